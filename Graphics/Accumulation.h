@@ -0,0 +1,165 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds the HDR accumulation behind the image PT.hlsl renders. Core owns a buffer with an entry per pixel
+// holding the running mean of the pixel's samples in linear radiance, in float4, and the low order bits the additions
+// to the mean have rounded away. The passes shading the pixel add its n'th sample, counting the samples in its mean,
+// which the fourth channel holds and temporal reprojection carries over from the last view (see
+// TemporalReprojection.h), as mean += (sample - mean) / n with Kahan's compensated summation; without the
+// compensation every addition rounds the mean to float, and once the increments are a few ulps of the mean the
+// rounding errors dominate them, which leaves the image visibly biased after some millions of samples. The first
+// sample replaces the mean, so accumulation restarts without clearing the buffer. The Tonemap pass then scales the
+// mean by the exposure and encodes it into the R8G8B8A8 render target, so changing the exposure does not restart
+// accumulation. accumulate and Tonemap in PT.hlsl mirror AccumulationPixel::add and tonemap. verify() checks the mean
+// against double precision over millions of samples.
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Stops the exposure changes by per key press
+static const float ACCUMULATION_EXPOSURE_STEP = 0.5f;
+
+// One pixel's running mean and its compensation, laid out as AccumulationPixel in PT.hlsl (32 bytes). The fourth
+// channel of the mean is the number of samples in it
+struct AccumulationPixel
+{
+	float mean[4] = {};
+	float compensation[4] = {};
+
+	// Adds the n'th sample of the pixel, counting from 1. Samples that are not finite are added as black rather than
+	// turning the mean into NaN for good
+	void add(const float* colour, unsigned int n)
+	{
+		float sample[3] = { colour[0], colour[1], colour[2] };
+		if (std::isfinite(sample[0] + sample[1] + sample[2]) == false)
+		{
+			sample[0] = sample[1] = sample[2] = 0;
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			if (n <= 1)
+			{
+				mean[c] = sample[c];
+				compensation[c] = 0;
+				continue;
+			}
+			float y = ((sample[c] - mean[c]) / (float)n) - compensation[c];
+			float t = mean[c] + y;
+			compensation[c] = (t - mean[c]) - y;
+			mean[c] = t;
+		}
+		mean[3] = (float)n;
+		compensation[3] = 0;
+	}
+};
+
+// Encodes a linear colour scaled by 2^exposure as the gamma 2.2 value the render target holds, as tmo does
+static void tonemap(const float* colour, float exposure, float* out)
+{
+	float scale = exp2f(exposure);
+	for (int c = 0; c < 3; c++)
+	{
+		out[c] = std::min(powf(std::max(colour[c] * scale, 0.0f), 1.0f / 2.2f), 1.0f);
+	}
+}
+
+// Checks restarting, carrying on from the count a reprojected pixel holds, the compensated mean against double
+// precision over 2^24 samples of noisy and of constant pixels, that the mean without compensation drifts on the same
+// samples, non-finite samples and the exposure. Returns the number of failed checks
+static int verifyAccumulation()
+{
+	int failures = 0;
+	unsigned int state = 0x2F6B1A93u;
+	auto next = [&]()
+		{
+			state = (state * 1664525u) + 1013904223u;
+			return (float)(state >> 8) / 16777216.0f;
+		};
+
+	// The first sample replaces whatever the pixel held before
+	AccumulationPixel pixel;
+	pixel.mean[0] = 5.0f;
+	pixel.compensation[0] = 1.0f;
+	float first[3] = { 0.25f, 0.5f, 0.75f };
+	pixel.add(first, 1);
+	failures += (pixel.mean[0] == 0.25f && pixel.mean[2] == 0.75f && pixel.mean[3] == 1.0f && pixel.compensation[0] == 0) ? 0 : 1;
+
+	// Noisy samples with the occasional firefly, as a path traced pixel sees, and a constant pixel, which the
+	// increments of a float mean would make wander
+	const unsigned int samples = 1u << 24;
+	for (int test = 0; test < 2; test++)
+	{
+		AccumulationPixel compensated;
+		float plain = 0;
+		double exact = 0;
+		for (unsigned int n = 1; n <= samples; n++)
+		{
+			float v = 0.3f;
+			if (test == 0)
+			{
+				v = next() * 0.6f;
+				v = next() < 0.001f ? v * 100.0f : v;
+			}
+			float c[3] = { v, v, v };
+			compensated.add(c, n);
+			plain = n == 1 ? v : plain + ((v - plain) / (float)n);
+			exact += ((double)v - exact) / (double)n;
+		}
+		double error = fabs((double)compensated.mean[0] - exact) / exact;
+		double plainError = fabs((double)plain - exact) / exact;
+		failures += (error < 1e-6 && compensated.mean[3] == (float)samples) ? 0 : 1;
+		// Without compensation the noisy pixel's mean is off by far more
+		failures += (test == 1 || plainError > 10.0 * std::max(error, 1e-7)) ? 0 : 1;
+	}
+
+	// A sample that is not finite adds black
+	AccumulationPixel bad;
+	float one[3] = { 1.0f, 1.0f, 1.0f };
+	float nan[3] = { NAN, 1.0f, 1.0f };
+	bad.add(one, 1);
+	bad.add(nan, 2);
+	failures += (bad.mean[0] == 0.5f && bad.mean[1] == 0.5f) ? 0 : 1;
+
+	// A pixel reprojected with the history of 32 samples adds the next as the 33rd
+	AccumulationPixel carried;
+	carried.mean[0] = 0.5f;
+	carried.mean[3] = 32.0f;
+	carried.add(one, (unsigned int)carried.mean[3] + 1);
+	failures += (fabsf(carried.mean[0] - (0.5f + (0.5f / 33.0f))) < 1e-6f && carried.mean[3] == 33.0f) ? 0 : 1;
+
+	// Each stop of exposure doubles the linear value, and the encoding clamps to 1
+	float grey[3] = { 0.18f, 0.18f, 0.18f };
+	float base[3];
+	float brighter[3];
+	tonemap(grey, 0, base);
+	tonemap(grey, 2.0f, brighter);
+	failures += (fabsf(powf(brighter[0], 2.2f) - (4.0f * powf(base[0], 2.2f))) < 1e-4f) ? 0 : 1;
+	tonemap(grey, 8.0f, brighter);
+	failures += brighter[1] == 1.0f ? 0 : 1;
+	return failures;
+}
@@ -0,0 +1,480 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds the adaptive sampling behind the adaptive mode of PT.hlsl. RayGeneration keeps running statistics
+// of every pixel's samples with Welford's update: the mean colour, which compare() measures images by, and the mean
+// and squared deviations of the luminance, which give its error. The pixel's count numbers the samples it adds to the
+// accumulation buffer. Every ADAPTIVE_SCHEDULE_INTERVAL frames the
+// statistics are read back and AdaptiveSampler estimates each pixel's error as the standard error of its mean
+// luminance relative to that mean, takes the largest in every tile of ADAPTIVE_TILE_SIZE pixels square as the tile's
+// error, and lists the pixels of the tiles over the threshold and of the tiles around them, so that noise at the edge
+// of a tile is not left behind. The frames after that dispatch one ray generation invocation per listed pixel, so the
+// dispatch shrinks as the image converges, and dispatch nothing once every tile is under the threshold. A pixel with
+// fewer than ADAPTIVE_MIN_SAMPLES samples never counts as converged, as a few samples of a path that rarely finds the
+// light can all miss it. adaptiveAccumulate in PT.hlsl mirrors AdaptivePixel::add. verify() checks the statistics,
+// the error and the scheduler, and compare() measures the time adaptive and uniform sampling take to reach an error
+// against a reference, with any per pixel sampling function, which Headless.cpp runs with BDPT's path tracer.
+
+#include "Math.h"
+#include "Parallel.h"
+#include "LightSampling.h"
+#include <cfloat>
+#include <climits>
+#include <chrono>
+#include <vector>
+
+// Pixels along each side of the tiles the error is estimated over
+static const int ADAPTIVE_TILE_SIZE = 8;
+// Samples a pixel takes before its error is trusted
+static const unsigned int ADAPTIVE_MIN_SAMPLES = 16;
+// Relative standard error of a pixel's mean luminance under which it is converged
+static const float ADAPTIVE_ERROR_THRESHOLD = 0.02f;
+// Added to the mean luminance the error is relative to, so that pixels near black converge on an absolute error
+static const float ADAPTIVE_LUMINANCE_FLOOR = 0.05f;
+// Frames between readbacks of the statistics and rescheduling
+static const int ADAPTIVE_SCHEDULE_INTERVAL = 8;
+
+// Running statistics of one pixel's samples, laid out as AdaptivePixel in PT.hlsl (32 bytes)
+struct AdaptivePixel
+{
+	float mean[3] = {};
+	unsigned int count = 0;
+	float luminanceMean = 0;
+	float luminanceM2 = 0;              // Sum of the squared deviations of the luminance from its mean
+	unsigned int pad[2] = {};
+
+	// Adds a sample with Welford's update. A sample that is not finite counts as black, so one bad path can't take
+	// over the pixel
+	void add(const float* colour)
+	{
+		float c[3] = { colour[0], colour[1], colour[2] };
+		if (std::isfinite(c[0] + c[1] + c[2]) == false)
+		{
+			c[0] = c[1] = c[2] = 0;
+		}
+		count++;
+		float weight = 1.0f / (float)count;
+		for (int i = 0; i < 3; i++)
+		{
+			mean[i] += (c[i] - mean[i]) * weight;
+		}
+		float l = luminance(c);
+		float delta = l - luminanceMean;
+		luminanceMean += delta * weight;
+		luminanceM2 += delta * (l - luminanceMean);
+	}
+
+	// Unbiased variance of the luminance
+	float variance() const
+	{
+		return count > 1 ? luminanceM2 / (float)(count - 1) : 0;
+	}
+
+	// Standard error of the mean luminance relative to it, or FLT_MAX before the pixel has ADAPTIVE_MIN_SAMPLES
+	float error() const
+	{
+		if (count < ADAPTIVE_MIN_SAMPLES)
+		{
+			return FLT_MAX;
+		}
+		return sqrtf(variance() / (float)count) / (luminanceMean + ADAPTIVE_LUMINANCE_FLOOR);
+	}
+};
+
+// Error of an image against the reference after some sampling time
+struct AdaptiveErrorPoint
+{
+	double seconds = 0;                 // Sampling and scheduling time, not counting the error measurements
+	double samples = 0;                 // Samples taken per pixel on average
+	double error = 0;                   // Root mean square error over the reference's mean
+};
+
+// Convergence of uniform and adaptive sampling measured by AdaptiveSampler::compare
+struct AdaptiveComparison
+{
+	std::vector<AdaptiveErrorPoint> uniform;
+	std::vector<AdaptiveErrorPoint> adaptive;
+
+	// Time the first measurement at or below an error took, or -1 if the sampling never got there
+	static double timeToError(const std::vector<AdaptiveErrorPoint>& points, double error)
+	{
+		for (unsigned int i = 0; i < points.size(); i++)
+		{
+			if (points[i].error <= error)
+			{
+				return points[i].seconds;
+			}
+		}
+		return -1.0;
+	}
+};
+
+class AdaptiveSampler
+{
+public:
+	int width = 0;
+	int height = 0;
+	int tilesX = 0;
+	int tilesY = 0;
+	float threshold = ADAPTIVE_ERROR_THRESHOLD;
+	std::vector<float> tileErrors;      // Largest error of a pixel in each tile
+	std::vector<unsigned char> activeTiles;
+	std::vector<unsigned int> workList; // Pixels still sampled, packed by packPixel, tile by tile
+
+	void init(int _width, int _height)
+	{
+		width = _width;
+		height = _height;
+		tilesX = (width + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+		tilesY = (height + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+		reset();
+	}
+
+	// Lists every pixel, for the statistics starting again
+	void reset()
+	{
+		tileErrors.assign(tilesX * tilesY, FLT_MAX);
+		activeTiles.assign(tilesX * tilesY, 1);
+		buildWorkList();
+	}
+
+	// A pixel as the work list holds it, with x in the low 16 bits
+	static unsigned int packPixel(int x, int y)
+	{
+		return (unsigned int)x | ((unsigned int)y << 16);
+	}
+
+	static void unpackPixel(unsigned int packed, int& x, int& y)
+	{
+		x = (int)(packed & 0xFFFFu);
+		y = (int)(packed >> 16);
+	}
+
+	// Estimates the tiles' errors from the statistics of every pixel and lists the pixels of the tiles over the
+	// threshold and of their neighbours. Returns the number of pixels listed
+	int schedule(const AdaptivePixel* pixels)
+	{
+		parallelFor(tilesX * tilesY, [&](int tile)
+			{
+				int x0 = (tile % tilesX) * ADAPTIVE_TILE_SIZE;
+				int y0 = (tile / tilesX) * ADAPTIVE_TILE_SIZE;
+				float e = 0;
+				for (int y = y0; y < std::min(y0 + ADAPTIVE_TILE_SIZE, height); y++)
+				{
+					for (int x = x0; x < std::min(x0 + ADAPTIVE_TILE_SIZE, width); x++)
+					{
+						e = std::max(e, pixels[(y * width) + x].error());
+					}
+				}
+				tileErrors[tile] = e;
+			}, 64);
+		for (int ty = 0; ty < tilesY; ty++)
+		{
+			for (int tx = 0; tx < tilesX; tx++)
+			{
+				bool active = false;
+				for (int y = std::max(ty - 1, 0); y <= std::min(ty + 1, tilesY - 1); y++)
+				{
+					for (int x = std::max(tx - 1, 0); x <= std::min(tx + 1, tilesX - 1); x++)
+					{
+						active = active || tileErrors[(y * tilesX) + x] > threshold;
+					}
+				}
+				activeTiles[(ty * tilesX) + tx] = active ? 1 : 0;
+			}
+		}
+		buildWorkList();
+		return (int)workList.size();
+	}
+
+	bool converged() const
+	{
+		return workList.empty();
+	}
+
+	// Samples an image with samplePixel(x, y, sampleIndex), which returns a pixel's radiance as a Vec3, for the given
+	// time or number of frames each, first one sample per pixel per frame and then adaptively, measuring the error
+	// against the reference after every frame. Adaptive sampling stops early once it has converged
+	template<typename SamplePixel>
+	AdaptiveComparison compare(SamplePixel samplePixel, const std::vector<float>& reference, double seconds, int maxFrames = INT_MAX)
+	{
+		AdaptiveComparison result;
+		std::vector<AdaptivePixel> pixels;
+		for (int adaptive = 0; adaptive < 2; adaptive++)
+		{
+			std::vector<AdaptiveErrorPoint>& points = adaptive == 1 ? result.adaptive : result.uniform;
+			pixels.assign(width * height, AdaptivePixel());
+			reset();
+			double elapsed = 0;
+			double samples = 0;
+			for (int frame = 0; frame < maxFrames && elapsed < seconds && converged() == false; frame++)
+			{
+				auto start = std::chrono::high_resolution_clock::now();
+				parallelForChunks((int)workList.size(), [&](int begin, int end, int)
+					{
+						for (int i = begin; i < end; i++)
+						{
+							int x;
+							int y;
+							unpackPixel(workList[i], x, y);
+							AdaptivePixel& pixel = pixels[(y * width) + x];
+							Vec3 L = samplePixel(x, y, pixel.count);
+							float c[3] = { L.x, L.y, L.z };
+							pixel.add(c);
+						}
+					}, 16);
+				samples += (double)workList.size() / (double)(width * height);
+				if (adaptive == 1 && (frame + 1) % ADAPTIVE_SCHEDULE_INTERVAL == 0)
+				{
+					schedule(pixels.data());
+				}
+				elapsed += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+				AdaptiveErrorPoint point;
+				point.seconds = elapsed;
+				point.samples = samples;
+				point.error = error(pixels, reference);
+				points.push_back(point);
+			}
+		}
+		reset();
+		return result;
+	}
+
+	// Root mean square error of the statistics' mean image against a reference of RGB triples, over its mean
+	static double error(const std::vector<AdaptivePixel>& pixels, const std::vector<float>& reference)
+	{
+		double squared = 0;
+		double mean = 0;
+		for (unsigned int i = 0; i < reference.size(); i++)
+		{
+			double e = (double)pixels[i / 3].mean[i % 3] - (double)reference[i];
+			squared += e * e;
+			mean += reference[i];
+		}
+		mean /= (double)reference.size();
+		return mean > 0 ? sqrt(squared / (double)reference.size()) / mean : 0;
+	}
+
+	// Checks the statistics against two pass sums, the error, the scheduler on images with known noise, and that
+	// adaptive sampling reaches an error with fewer samples than uniform sampling on an image that is mostly smooth.
+	// Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x1B56C4E9u;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+
+		// Welford's update matches the mean and variance summed in two passes, including far from zero where summing
+		// squares in float would cancel, and samples that are not finite count as black
+		for (int test = 0; test < 2; test++)
+		{
+			float offset = test == 0 ? 0 : 1000.0f;
+			std::vector<double> values(4000);
+			AdaptivePixel pixel;
+			for (unsigned int i = 0; i < values.size(); i++)
+			{
+				float v = offset + next();
+				float c[3] = { v, v, v };
+				pixel.add(c);
+				values[i] = luminance(c);
+			}
+			double mean = 0;
+			for (double v : values)
+			{
+				mean += v;
+			}
+			mean /= (double)values.size();
+			double variance = 0;
+			for (double v : values)
+			{
+				variance += (v - mean) * (v - mean);
+			}
+			variance /= (double)(values.size() - 1);
+			bool match = pixel.count == values.size() && fabs(pixel.luminanceMean - mean) < 1e-4 * (mean + 1.0);
+			match = match && fabs(pixel.variance() - variance) < 0.01 * variance && fabsf(pixel.mean[0] - (float)mean) < 1e-3f * (float)(mean + 1.0);
+			failures += match ? 0 : 1;
+		}
+		AdaptivePixel bad;
+		float nan[3] = { NAN, 1.0f, 1.0f };
+		bad.add(nan);
+		failures += (bad.count == 1 && bad.mean[1] == 0 && bad.luminanceMean == 0) ? 0 : 1;
+
+		// A constant pixel has no error once it has enough samples, and a pixel alternating between 0 and 2 has the
+		// standard error of its mean of 1 relative to 1 plus the floor
+		AdaptivePixel constant;
+		AdaptivePixel alternating;
+		bool early = true;
+		for (unsigned int i = 0; i < 100; i++)
+		{
+			early = early && (i >= ADAPTIVE_MIN_SAMPLES || (constant.error() == FLT_MAX && alternating.error() == FLT_MAX));
+			float c[3] = { 0.3f, 0.3f, 0.3f };
+			constant.add(c);
+			float a = i % 2 == 0 ? 0 : 2.0f;
+			float d[3] = { a, a, a };
+			alternating.add(d);
+		}
+		float expected = sqrtf((100.0f / 99.0f) / 100.0f) / (1.0f + ADAPTIVE_LUMINANCE_FLOOR);
+		failures += (early && constant.error() == 0 && fabsf(alternating.error() - expected) < 1e-3f * expected) ? 0 : 1;
+
+		// On an image whose size is not a multiple of the tiles, every pixel is listed once at first, a single noisy
+		// pixel lists its tile and the tiles around it and nothing else, and converged statistics list nothing
+		int w = (ADAPTIVE_TILE_SIZE * 7) + 3;
+		int h = (ADAPTIVE_TILE_SIZE * 5) + 5;
+		init(w, h);
+		std::vector<int> listed(w * h, 0);
+		for (unsigned int packed : workList)
+		{
+			int x;
+			int y;
+			unpackPixel(packed, x, y);
+			if (x < w && y < h)
+			{
+				listed[(y * w) + x]++;
+			}
+		}
+		bool once = workList.size() == (unsigned int)(w * h);
+		for (int count : listed)
+		{
+			once = once && count == 1;
+		}
+		failures += once ? 0 : 1;
+		std::vector<AdaptivePixel> image(w * h);
+		for (AdaptivePixel& pixel : image)
+		{
+			for (unsigned int i = 0; i < ADAPTIVE_MIN_SAMPLES; i++)
+			{
+				float c[3] = { 0.5f, 0.4f, 0.3f };
+				pixel.add(c);
+			}
+		}
+		failures += schedule(image.data()) == 0 && converged() ? 0 : 1;
+		int noisyX = (ADAPTIVE_TILE_SIZE * 7) + 1;
+		int noisyY = (ADAPTIVE_TILE_SIZE * 2) + 3;
+		image[(noisyY * w) + noisyX].luminanceM2 = 100.0f;
+		schedule(image.data());
+		bool dilated = true;
+		listed.assign(w * h, 0);
+		for (unsigned int packed : workList)
+		{
+			int x;
+			int y;
+			unpackPixel(packed, x, y);
+			listed[(y * w) + x]++;
+		}
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				int dx = (x / ADAPTIVE_TILE_SIZE) - (noisyX / ADAPTIVE_TILE_SIZE);
+				int dy = (y / ADAPTIVE_TILE_SIZE) - (noisyY / ADAPTIVE_TILE_SIZE);
+				dilated = dilated && listed[(y * w) + x] == ((abs(dx) <= 1 && abs(dy) <= 1) ? 1 : 0);
+			}
+		}
+		failures += dilated ? 0 : 1;
+		// Packing round trips at the largest coordinates it holds
+		int px;
+		int py;
+		unpackPixel(packPixel(65535, 65535), px, py);
+		failures += (px == 65535 && py == 65535) ? 0 : 1;
+
+		// An image that is smooth but for a noisy patch reaches a tenth of its first frame's error in fewer samples
+		// per pixel when sampled adaptively
+		w = 64;
+		h = 64;
+		init(w, h);
+		std::vector<float> reference(w * h * 3, 0.5f);
+		auto noisy = [&](int x, int y)
+			{
+				return x >= 16 && x < 32 && y >= 8 && y < 24;
+			};
+		unsigned int noiseState = 0;
+		auto samplePixel = [&](int x, int y, unsigned int index)
+			{
+				unsigned int s = hashSeed(((unsigned int)((y * w) + x) * 9781u) ^ (index * 6271u) ^ noiseState);
+				float u = (float)(s >> 8) / 16777216.0f;
+				float v = noisy(x, y) ? (u < 0.25f ? 2.0f : 0.0f) : 0.45f + (0.1f * u);
+				return Vec3(v, v, v);
+			};
+		AdaptiveComparison comparison = compare(samplePixel, reference, 60.0, 400);
+		double target = comparison.uniform.size() > 0 ? comparison.uniform[0].error * 0.1 : 0;
+		double uniformSamples = -1.0;
+		double adaptiveSamples = -1.0;
+		for (const AdaptiveErrorPoint& point : comparison.uniform)
+		{
+			if (point.error <= target && uniformSamples < 0)
+			{
+				uniformSamples = point.samples;
+			}
+		}
+		for (const AdaptiveErrorPoint& point : comparison.adaptive)
+		{
+			if (point.error <= target && adaptiveSamples < 0)
+			{
+				adaptiveSamples = point.samples;
+			}
+		}
+		failures += (uniformSamples > 0 && adaptiveSamples > 0 && adaptiveSamples < 0.6 * uniformSamples) ? 0 : 1;
+		return failures;
+	}
+
+private:
+	// Lists the pixels of the active tiles, a tile at a time so that neighbouring invocations shade nearby pixels
+	void buildWorkList()
+	{
+		workList.clear();
+		for (int tile = 0; tile < tilesX * tilesY; tile++)
+		{
+			if (activeTiles[tile] == 0)
+			{
+				continue;
+			}
+			int x0 = (tile % tilesX) * ADAPTIVE_TILE_SIZE;
+			int y0 = (tile / tilesX) * ADAPTIVE_TILE_SIZE;
+			for (int y = y0; y < std::min(y0 + ADAPTIVE_TILE_SIZE, height); y++)
+			{
+				for (int x = x0; x < std::min(x0 + ADAPTIVE_TILE_SIZE, width); x++)
+				{
+					workList.push_back(packPixel(x, y));
+				}
+			}
+		}
+	}
+
+	static unsigned int hashSeed(unsigned int v)
+	{
+		v ^= v >> 16;
+		v *= 0x7FEB352Du;
+		v ^= v >> 15;
+		v *= 0x846CA68Bu;
+		v ^= v >> 16;
+		return v;
+	}
+};
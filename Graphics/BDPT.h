@@ -0,0 +1,1637 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file holds a bidirectional path tracer that runs on the CPU worker threads, without a window or a GPU, after
+// Veach's thesis and the formulation in PBRT. The GPU path tracer extends a single camera path a bounce at a time in
+// tracePath, which makes a poor fit for paths built from both ends, so BDPT is a headless integrator of its own.
+// BDPTScene loads a scene's scene.json and models into flat triangles under a binned SAH BVH, with a pinhole camera
+// matching the GPU's. BDPT traces a camera subpath and a light subpath for every sample and joins them with every
+// connection strategy, including light tracing to the camera, weighting each with the power heuristic over all
+// strategies that could have built the same path. Alongside it runs a CPU port of the GPU's path tracer with next event
+// estimation, so that compare() can measure the time both take to reach a given error against a converged reference.
+// Both integrators shade every surface as two sided and Lambertian apart from mirrors and lights, using geometric
+// normals, which is how the GPU shades the BSDFs it implements, with the glass placeholder as Lambertian. They take
+// their random numbers from the samplers in Sampler.h, which samplerConvergence() compares on the path tracer. verify()
+// checks the BVH and both integrators against an analytic answer and each other.
+
+#include "Math.h"
+#include "Parallel.h"
+#include "LightSampling.h"
+#include "SphericalTriangle.h"
+#include "Sampler.h"
+#include "Denoiser.h"
+#include "GEMLoader.h"
+#include "stb_image.h"
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <vector>
+
+static const float BDPT_PI = 3.14159265358979f;
+// Scattering vertices a path has at most, as in shadeHit, which lights the vertices at depths 0 to 6
+static const int BDPT_MAX_BOUNCES = 7;
+// Triangles a BVH leaf holds at most, and the bins the SAH build evaluates along each axis
+static const int BDPT_LEAF_TRIANGLES = 4;
+static const int BDPT_SAH_BINS = 12;
+// Offset of ray origins from the surfaces they leave
+static const float BDPT_RAY_EPSILON = 1e-4f;
+// BSDFs of BDPTMaterial. Lights only emit
+static const int BDPT_LAMBERTIAN = 0;
+static const int BDPT_MIRROR = 1;
+static const int BDPT_EMITTER = 2;
+// Types of BDPTVertex
+static const int BDPT_CAMERA_VERTEX = 0;
+static const int BDPT_LIGHT_VERTEX = 1;
+static const int BDPT_SURFACE_VERTEX = 2;
+
+// An albedo texture, looked up at the nearest texel with wrapping
+class BDPTTexture
+{
+public:
+	int width = 1;
+	int height = 1;
+	std::vector<Vec3> texels;
+
+	Vec3 lookup(float u, float v) const
+	{
+		u = u - floorf(u);
+		v = v - floorf(v);
+		int x = std::min((int)(u * (float)width), width - 1);
+		int y = std::min((int)(v * (float)height), height - 1);
+		return texels[(y * width) + x];
+	}
+};
+
+struct BDPTMaterial
+{
+	int bsdf = BDPT_LAMBERTIAN;
+	int texture = 0;
+	Vec3 emission;                      // Radiance leaving the side the geometric normal faces
+};
+
+struct BDPTTriangle
+{
+	Vec3 v[3];
+	float uv[3][2] = {};
+	Vec3 normal;                        // Geometric normal, facing the way the model's normals do
+	float area = 0;
+	int material = 0;
+};
+
+// Closest intersection along a ray, with the barycentrics of the second and third vertices
+struct BDPTHit
+{
+	float t = FLT_MAX;
+	int triangle = -1;
+	float b1 = 0;
+	float b2 = 0;
+};
+
+// A node of the BVH. Leaves hold count triangles from first in the triangle order, interior nodes have no triangles
+// and their children at first and first + 1
+struct BDPTNode
+{
+	AABB bounds;
+	int first = 0;
+	int count = 0;
+};
+
+class BDPTScene
+{
+public:
+	std::vector<BDPTTriangle> triangles;
+	std::vector<BDPTMaterial> materials;
+	std::vector<BDPTTexture> textures;
+	std::vector<int> lights;            // Triangles that emit
+	std::vector<int> lightIndex;        // Index of each triangle in lights, or -1
+	AliasTable lightTable;              // Lights by power, as Scene builds for PT.hlsl
+	std::vector<BDPTNode> nodes;
+	std::vector<int> order;
+
+	// Pinhole camera, set up as loadScene sets up Camera
+	Vec3 eye;
+	Vec3 right;
+	Vec3 up;
+	Vec3 forward;
+	float tanHalfFov = 1.0f;
+	bool flipX = false;
+	int width = 1;
+	int height = 1;
+
+	void setCamera(const Vec3& from, const Vec3& to, const Vec3& upHint, float fov, int _width, int _height, bool flip)
+	{
+		eye = from;
+		forward = (to - from).normalize();
+		right = Cross(upHint, -forward).normalize();
+		up = Cross(-forward, right);
+		tanHalfFov = tanf(fov * 0.5f * BDPT_PI / 180.0f);
+		width = _width;
+		height = _height;
+		flipX = flip;
+	}
+
+	float aspect() const
+	{
+		return (float)width / (float)height;
+	}
+
+	int addTexture(const Vec3& colour)
+	{
+		BDPTTexture texture;
+		texture.texels.push_back(colour);
+		textures.push_back(texture);
+		return (int)textures.size() - 1;
+	}
+
+	int addMaterial(int bsdf, int texture, const Vec3& emission = Vec3(0, 0, 0))
+	{
+		BDPTMaterial material;
+		material.bsdf = bsdf;
+		material.texture = texture;
+		material.emission = emission;
+		materials.push_back(material);
+		return (int)materials.size() - 1;
+	}
+
+	// Adds a triangle whose geometric normal is turned to the side of facing
+	void addTriangle(const Vec3& v0, const Vec3& v1, const Vec3& v2, const Vec3& facing, int material, const float* uvs = NULL)
+	{
+		BDPTTriangle triangle;
+		triangle.v[0] = v0;
+		triangle.v[1] = v1;
+		triangle.v[2] = v2;
+		Vec3 n = Cross(v1 - v0, v2 - v0);
+		triangle.area = n.length() * 0.5f;
+		if (triangle.area <= 0)
+		{
+			return;
+		}
+		triangle.normal = n.normalize();
+		triangle.normal = triangle.normal * (Dot(triangle.normal, facing) < 0 ? -1.0f : 1.0f);
+		if (uvs != NULL)
+		{
+			memcpy(triangle.uv, uvs, sizeof(triangle.uv));
+		}
+		triangle.material = material;
+		triangles.push_back(triangle);
+	}
+
+	// Builds the BVH and the light selection table once every triangle is added
+	void build()
+	{
+		lights.clear();
+		lightIndex.assign(triangles.size(), -1);
+		std::vector<float> powers;
+		for (unsigned int i = 0; i < triangles.size(); i++)
+		{
+			const BDPTMaterial& material = materials[triangles[i].material];
+			if (luminance(material.emission.coords) > 0)
+			{
+				lightIndex[i] = (int)lights.size();
+				lights.push_back((int)i);
+				powers.push_back(luminance(material.emission.coords) * triangles[i].area * BDPT_PI);
+			}
+		}
+		lightTable.build(powers);
+		order.resize(triangles.size());
+		for (unsigned int i = 0; i < triangles.size(); i++)
+		{
+			order[i] = (int)i;
+		}
+		std::vector<Vec3> centroids(triangles.size());
+		parallelFor((int)triangles.size(), [&](int i)
+			{
+				centroids[i] = (triangles[i].v[0] + triangles[i].v[1] + triangles[i].v[2]) / 3.0f;
+			});
+		nodes.assign(1, BDPTNode());
+		nodes.reserve(triangles.size() * 2);
+		buildNode(0, 0, (int)triangles.size(), centroids);
+	}
+
+	// Finds the closest triangle along a ray up to tMax
+	bool intersect(const Vec3& o, const Vec3& d, float tMax, BDPTHit& hit) const
+	{
+		hit = BDPTHit();
+		hit.t = tMax;
+		if (nodes.size() == 0 || triangles.size() == 0)
+		{
+			return false;
+		}
+		Vec3 invD(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+		int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const BDPTNode& node = nodes[stack[--top]];
+			if (slab(node.bounds, o, invD, hit.t) == false)
+			{
+				continue;
+			}
+			if (node.count > 0)
+			{
+				for (int i = node.first; i < node.first + node.count; i++)
+				{
+					intersectTriangle(order[i], o, d, hit);
+				}
+				continue;
+			}
+			// Visit the child on the side the ray comes from first
+			const BDPTNode& left = nodes[node.first];
+			Vec3 toLeft = left.bounds.centre() - nodes[node.first + 1].bounds.centre();
+			bool leftFirst = Dot(toLeft, d) < 0;
+			stack[top++] = leftFirst ? node.first + 1 : node.first;
+			stack[top++] = leftFirst ? node.first : node.first + 1;
+		}
+		return hit.triangle >= 0;
+	}
+
+	// Returns true if nothing lies between two points
+	bool visible(const Vec3& a, const Vec3& b) const
+	{
+		Vec3 d = b - a;
+		float distance = d.length();
+		if (distance <= 2.0f * BDPT_RAY_EPSILON)
+		{
+			return true;
+		}
+		d = d / distance;
+		BDPTHit hit;
+		return intersect(a + (d * BDPT_RAY_EPSILON), d, distance - (2.0f * BDPT_RAY_EPSILON), hit) == false;
+	}
+
+	// Loads a scene's camera, models and materials as loadScene does, mapping the BSDFs as described at the top of
+	// this file. Returns false if the scene has no triangles
+	bool load(std::string sceneName)
+	{
+		GEMLoader::GEMScene gemscene;
+		gemscene.load(sceneName + "/scene.json");
+		int sceneWidth = gemscene.findProperty("width").getValue(1920);
+		int sceneHeight = gemscene.findProperty("height").getValue(1080);
+		float fov = gemscene.findProperty("fov").getValue(45.0f);
+		Vec3 from;
+		Vec3 to;
+		Vec3 upHint;
+		gemscene.findProperty("from").getValuesAsVector3(from.x, from.y, from.z);
+		gemscene.findProperty("to").getValuesAsVector3(to.x, to.y, to.z);
+		gemscene.findProperty("up").getValuesAsVector3(upHint.x, upHint.y, upHint.z);
+		setCamera(from, to, upHint, fov, sceneWidth, sceneHeight, gemscene.findProperty("flipX").getValue(0) == 1);
+		std::map<std::string, int> textureIDs;
+		std::map<std::string, std::vector<GEMLoader::GEMMesh>> models;
+		for (unsigned int i = 0; i < gemscene.instances.size(); i++)
+		{
+			GEMLoader::GEMInstance& instance = gemscene.instances[i];
+			std::string textureFilename = sceneName + "/" + instance.material.find("reflectance").getValue("");
+			if (textureIDs.find(textureFilename) == textureIDs.end())
+			{
+				textureIDs[textureFilename] = loadTexture(textureFilename);
+			}
+			std::string bsdf = instance.material.find("bsdf").getValue("");
+			int material = addMaterial(bsdf == "mirror" ? BDPT_MIRROR : BDPT_LAMBERTIAN, textureIDs[textureFilename]);
+			if (instance.material.find("emission").getValue("") != "")
+			{
+				materials[material].bsdf = BDPT_EMITTER;
+				instance.material.find("emission").getValuesAsVector3(materials[material].emission.x, materials[material].emission.y, materials[material].emission.z);
+			}
+			std::string modelFilename = sceneName + "/" + instance.meshFilename;
+			if (models.find(modelFilename) == models.end())
+			{
+				GEMLoader::GEMModelLoader loader;
+				loader.load(modelFilename, models[modelFilename]);
+			}
+			Matrix w;
+			memcpy(w.m, instance.w.m, 16 * sizeof(float));
+			Matrix normalMatrix = w.invert().transpose();
+			const std::vector<GEMLoader::GEMMesh>& meshes = models[modelFilename];
+			for (unsigned int m = 0; m < meshes.size(); m++)
+			{
+				const GEMLoader::GEMMesh& mesh = meshes[m];
+				for (unsigned int n = 0; n + 2 < mesh.indices.size(); n += 3)
+				{
+					Vec3 v[3];
+					float uvs[3][2];
+					for (int k = 0; k < 3; k++)
+					{
+						const GEMLoader::GEMStaticVertex& vertex = mesh.verticesStatic[mesh.indices[n + k]];
+						v[k] = w.mulPoint(Vec3(vertex.position.x, vertex.position.y, vertex.position.z));
+						uvs[k][0] = vertex.u;
+						uvs[k][1] = vertex.v;
+					}
+					const GEMLoader::GEMStaticVertex& first = mesh.verticesStatic[mesh.indices[n]];
+					Vec3 facing = normalMatrix.mulVec(Vec3(first.normal.x, first.normal.y, first.normal.z));
+					addTriangle(v[0], v[1], v[2], facing, material, &uvs[0][0]);
+				}
+			}
+		}
+		build();
+		return triangles.size() > 0;
+	}
+
+private:
+	// Reads an albedo texture as the GPU does, with the bytes as linear values, or mid grey if it cannot be read
+	int loadTexture(std::string filename)
+	{
+		BDPTTexture texture;
+		int channels = 0;
+		unsigned char* data = stbi_load(filename.c_str(), &texture.width, &texture.height, &channels, 4);
+		if (data == NULL)
+		{
+			return addTexture(Vec3(0.5f, 0.5f, 0.5f));
+		}
+		texture.texels.resize(texture.width * texture.height);
+		for (int i = 0; i < texture.width * texture.height; i++)
+		{
+			texture.texels[i] = Vec3((float)data[i * 4] / 255.0f, (float)data[(i * 4) + 1] / 255.0f, (float)data[(i * 4) + 2] / 255.0f);
+		}
+		stbi_image_free(data);
+		textures.push_back(texture);
+		return (int)textures.size() - 1;
+	}
+
+	// Splits the triangles of a node at the cheapest of the bin boundaries along each axis by the surface area
+	// heuristic, or makes it a leaf if no split beats intersecting them all
+	void buildNode(int node, int first, int count, const std::vector<Vec3>& centroids)
+	{
+		AABB bounds;
+		AABB centroidBounds;
+		for (int i = first; i < first + count; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				bounds.extend(triangles[order[i]].v[k]);
+			}
+			centroidBounds.extend(centroids[order[i]]);
+		}
+		nodes[node].bounds = bounds;
+		nodes[node].first = first;
+		nodes[node].count = count;
+		if (count <= BDPT_LEAF_TRIANGLES)
+		{
+			return;
+		}
+		int bestAxis = -1;
+		int bestSplit = 0;
+		float bestCost = (float)count * bounds.area();
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float lo = centroidBounds.min.coords[axis];
+			float extent = centroidBounds.max.coords[axis] - lo;
+			if (extent <= 0)
+			{
+				continue;
+			}
+			AABB binBounds[BDPT_SAH_BINS];
+			int binCounts[BDPT_SAH_BINS] = {};
+			for (int i = first; i < first + count; i++)
+			{
+				int b = std::min((int)(((centroids[order[i]].coords[axis] - lo) / extent) * BDPT_SAH_BINS), BDPT_SAH_BINS - 1);
+				binCounts[b]++;
+				for (int k = 0; k < 3; k++)
+				{
+					binBounds[b].extend(triangles[order[i]].v[k]);
+				}
+			}
+			float rightAreas[BDPT_SAH_BINS] = {};
+			int rightCounts[BDPT_SAH_BINS] = {};
+			AABB rightBounds;
+			int rightCount = 0;
+			for (int b = BDPT_SAH_BINS - 1; b > 0; b--)
+			{
+				rightBounds.extend(binBounds[b]);
+				rightCount += binCounts[b];
+				rightAreas[b] = rightBounds.area();
+				rightCounts[b] = rightCount;
+			}
+			AABB leftBounds;
+			int leftCount = 0;
+			for (int b = 1; b < BDPT_SAH_BINS; b++)
+			{
+				leftBounds.extend(binBounds[b - 1]);
+				leftCount += binCounts[b - 1];
+				if (leftCount == 0 || rightCounts[b] == 0)
+				{
+					continue;
+				}
+				float cost = ((float)leftCount * leftBounds.area()) + ((float)rightCounts[b] * rightAreas[b]);
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+		int mid;
+		if (bestAxis >= 0)
+		{
+			float lo = centroidBounds.min.coords[bestAxis];
+			float extent = centroidBounds.max.coords[bestAxis] - lo;
+			int* split = std::partition(order.data() + first, order.data() + first + count, [&](int t)
+				{
+					return std::min((int)(((centroids[t].coords[bestAxis] - lo) / extent) * BDPT_SAH_BINS), BDPT_SAH_BINS - 1) < bestSplit;
+				});
+			mid = (int)(split - order.data());
+		} else if (count > 4 * BDPT_LEAF_TRIANGLES)
+		{
+			// Triangles sharing a centroid are split in half to keep leaves small
+			mid = first + (count / 2);
+		} else
+		{
+			return;
+		}
+		int children = (int)nodes.size();
+		nodes.push_back(BDPTNode());
+		nodes.push_back(BDPTNode());
+		nodes[node].first = children;
+		nodes[node].count = 0;
+		buildNode(children, first, mid - first, centroids);
+		buildNode(children + 1, mid, first + count - mid, centroids);
+	}
+
+	static bool slab(const AABB& box, const Vec3& o, const Vec3& invD, float tMax)
+	{
+		float t0 = 0;
+		float t1 = tMax;
+		for (int a = 0; a < 3; a++)
+		{
+			float tNear = (box.min.coords[a] - o.coords[a]) * invD.coords[a];
+			float tFar = (box.max.coords[a] - o.coords[a]) * invD.coords[a];
+			if (tNear > tFar)
+			{
+				std::swap(tNear, tFar);
+			}
+			t0 = std::max(t0, tNear);
+			t1 = std::min(t1, tFar * 1.0000004f);
+			if (t0 > t1)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Moller-Trumbore intersection, keeping the hit if it is closer than the current one
+	void intersectTriangle(int index, const Vec3& o, const Vec3& d, BDPTHit& hit) const
+	{
+		const BDPTTriangle& triangle = triangles[index];
+		Vec3 e1 = triangle.v[1] - triangle.v[0];
+		Vec3 e2 = triangle.v[2] - triangle.v[0];
+		Vec3 h = Cross(d, e2);
+		float det = Dot(e1, h);
+		if (fabsf(det) < 1e-12f)
+		{
+			return;
+		}
+		float invDet = 1.0f / det;
+		Vec3 s = o - triangle.v[0];
+		float u = Dot(s, h) * invDet;
+		if (u < 0 || u > 1.0f)
+		{
+			return;
+		}
+		Vec3 q = Cross(s, e1);
+		float v = Dot(d, q) * invDet;
+		if (v < 0 || (u + v) > 1.0f)
+		{
+			return;
+		}
+		float t = Dot(e2, q) * invDet;
+		if (t > 0 && t < hit.t)
+		{
+			hit.t = t;
+			hit.triangle = index;
+			hit.b1 = u;
+			hit.b2 = v;
+		}
+	}
+};
+
+// A vertex of a camera or light subpath. pdfFwd is the density, per unit area, of sampling the vertex from the
+// previous vertex of its subpath, and pdfRev that of sampling it from the next, coming from the other end
+struct BDPTVertex
+{
+	int type = BDPT_SURFACE_VERTEX;
+	Vec3 p;
+	Vec3 n;                             // Geometric normal; the viewing direction at the camera
+	Vec3 beta;                          // Throughput of the subpath up to the vertex
+	Vec3 albedo;
+	Vec3 emission;
+	float pdfFwd = 0;
+	float pdfRev = 0;
+	bool delta = false;                 // Left by a mirror reflection
+	int bsdf = BDPT_LAMBERTIAN;
+	int triangle = -1;
+};
+
+// Error of an integrator's image against the reference after a number of passes
+struct BDPTErrorPoint
+{
+	double seconds = 0;                 // Rendering time, not counting the error measurements
+	int passes = 0;
+	double error = 0;                   // Root mean square error over the reference's mean
+};
+
+// Convergence of the path tracer with each sampler measured by BDPT::samplerConvergence. The reference's own noise
+// puts a floor under the errors, so it needs many more passes than are measured
+struct BDPTSamplerConvergence
+{
+	int referencePasses = 0;
+	std::vector<double> passes;         // Powers of two the errors are measured after
+	std::vector<double> errors[SAMPLER_TYPES];
+	double slope[SAMPLER_TYPES] = {};
+};
+
+// Convergence of the path tracer and BDPT measured by BDPT::compare
+struct BDPTComparison
+{
+	int referencePasses = 0;
+	double referenceSeconds = 0;
+	std::vector<BDPTErrorPoint> pathTracer;
+	std::vector<BDPTErrorPoint> bidirectional;
+
+	// Time the first measurement at or below an error took, or -1 if the integrator never got there
+	static double timeToError(const std::vector<BDPTErrorPoint>& points, double error)
+	{
+		for (unsigned int i = 0; i < points.size(); i++)
+		{
+			if (points[i].error <= error)
+			{
+				return points[i].seconds;
+			}
+		}
+		return -1.0;
+	}
+};
+
+class BDPT
+{
+public:
+	const BDPTScene* scene = NULL;
+	int maxBounces = BDPT_MAX_BOUNCES;
+	// Random numbers of the camera paths, and of the light subpaths which continue them
+	Sampler sampling;
+	// Sum of each pixel's samples, the light tracing splats of every pass, and the passes rendered
+	std::vector<double> sums;
+	std::vector<double> splats;
+	int passes = 0;
+
+	void init(const BDPTScene* _scene)
+	{
+		scene = _scene;
+		reset();
+	}
+
+	void reset()
+	{
+		sums.assign(scene->width * scene->height * 3, 0.0);
+		splats.assign(scene->width * scene->height * 3, 0.0);
+		passes = 0;
+	}
+
+	// Renders one sample per pixel with BDPT or the path tracer and adds it to the image
+	void renderPass(bool bidirectional)
+	{
+		int width = scene->width;
+		int height = scene->height;
+		int threads = workerThreadCount();
+		std::vector<std::vector<float>> threadSplats(bidirectional ? threads : 0);
+		unsigned int passSeed = hash((unsigned int)passes + (bidirectional ? 0x68E31DA4u : 0));
+		parallelForChunks(height, [&](int start, int end, int thread)
+			{
+				std::vector<float>* splat = NULL;
+				if (bidirectional)
+				{
+					threadSplats[thread].assign(width * height * 3, 0.0f);
+					splat = &threadSplats[thread];
+				}
+				for (int y = start; y < end; y++)
+				{
+					for (int x = 0; x < width; x++)
+					{
+						int pixel = (y * width) + x;
+						PixelSampler sampler = sampling.pixel(x, y, (unsigned int)passes, hash((unsigned int)pixel ^ passSeed));
+						Vec3 L = bidirectional ? bidirectionalSample(x, y, sampler, *splat) : pathTraceSample(x, y, sampler);
+						if (std::isfinite(L.x + L.y + L.z))
+						{
+							sums[pixel * 3] += L.x;
+							sums[(pixel * 3) + 1] += L.y;
+							sums[(pixel * 3) + 2] += L.z;
+						}
+					}
+				}
+			}, 1);
+		for (unsigned int t = 0; t < threadSplats.size(); t++)
+		{
+			if (threadSplats[t].size() == 0)
+			{
+				continue;
+			}
+			parallelFor((int)splats.size(), [&](int i)
+				{
+					splats[i] += threadSplats[t][i];
+				});
+		}
+		passes++;
+	}
+
+	// The image so far, as RGB triples
+	void image(std::vector<float>& out) const
+	{
+		out.resize(sums.size());
+		float scale = passes > 0 ? 1.0f / (float)passes : 0;
+		for (unsigned int i = 0; i < sums.size(); i++)
+		{
+			out[i] = (float)(sums[i] + splats[i]) * scale;
+		}
+	}
+
+	// The denoiser's AOVs, as shadeHit and shadeMiss write them for the first hit of the camera rays of the path tracer's
+	// first passes: the albedo and the normal facing the camera, both zero for lights, which reflect nothing, and for
+	// rays leaving the scene, the distance along the ray and the emission seen, of which there is none for rays leaving
+	// the scene as it has no environment here. Albedo, normals and emission are RGB and XYZ triples
+	void firstHitAOVs(int samples, std::vector<float>& albedo, std::vector<float>& normal, std::vector<float>& depth, std::vector<float>& emission) const
+	{
+		int width = scene->width;
+		int height = scene->height;
+		albedo.assign(width * height * 3, 0.0f);
+		normal.assign(width * height * 3, 0.0f);
+		depth.assign(width * height, 0.0f);
+		emission.assign(width * height * 3, 0.0f);
+		parallelFor(width * height, [&](int pixel)
+			{
+				int x = pixel % width;
+				int y = pixel / width;
+				Vec3 albedoSum;
+				Vec3 normalSum;
+				Vec3 emissionSum;
+				float depthSum = 0;
+				for (int i = 0; i < samples; i++)
+				{
+					// The jitter renderPass takes the pass's camera ray through
+					PixelSampler sampler = sampling.pixel(x, y, (unsigned int)i, hash((unsigned int)pixel ^ hash((unsigned int)i)));
+					Vec3 d = cameraDirection((float)x + sampler.next(), (float)y + sampler.next());
+					BDPTHit hit;
+					if (scene->intersect(scene->eye, d, FLT_MAX, hit) == false)
+					{
+						depthSum += DENOISER_MISS_DEPTH;
+						continue;
+					}
+					BDPTVertex vertex = surfaceVertex(hit, scene->eye, d, Vec3(1.0f, 1.0f, 1.0f));
+					if (luminance(vertex.emission.coords) > 0)
+					{
+						emissionSum = emissionSum + (Dot(vertex.n, -d) > 0 ? vertex.emission : Vec3(0, 0, 0));
+					} else
+					{
+						albedoSum = albedoSum + vertex.albedo;
+						normalSum = normalSum + (Dot(vertex.n, d) > 0 ? -vertex.n : vertex.n);
+					}
+					depthSum += hit.t;
+				}
+				float scale = 1.0f / (float)samples;
+				for (int c = 0; c < 3; c++)
+				{
+					albedo[(pixel * 3) + c] = albedoSum.coords[c] * scale;
+					normal[(pixel * 3) + c] = normalSum.coords[c] * scale;
+					emission[(pixel * 3) + c] = emissionSum.coords[c] * scale;
+				}
+				depth[pixel] = depthSum * scale;
+			}, 64);
+	}
+
+	// One path traced sample of a pixel; a port of RayGeneration and shadeHit. Direct lighting samples a light by
+	// power and a point on it as calculateDirect does, and is weighted against BSDF sampling with the power heuristic
+	Vec3 pathTraceSample(int x, int y, PixelSampler& sampler) const
+	{
+		Vec3 L;
+		Vec3 beta(1.0f, 1.0f, 1.0f);
+		Vec3 o = scene->eye;
+		Vec3 d = cameraDirection((float)x + sampler.next(), (float)y + sampler.next());
+		bool unweighted = true;
+		float lastPdf = 0;
+		Vec3 lastP;
+		for (int depth = 0; depth <= maxBounces; depth++)
+		{
+			BDPTHit hit;
+			if (scene->intersect(o, d, FLT_MAX, hit) == false)
+			{
+				break;
+			}
+			BDPTVertex vertex = surfaceVertex(hit, o, d, beta);
+			// Emission, weighted against light sampling at the previous vertex unless it could not sample lights
+			if (luminance(vertex.emission.coords) > 0 && Dot(vertex.n, -d) > 0)
+			{
+				float weight = 1.0f;
+				if (unweighted == false)
+				{
+					weight = powerHeuristic(lastPdf, lightSolidAnglePdf(hit.triangle, lastP, d, vertex.p));
+				}
+				L = L + (beta * vertex.emission * weight);
+			}
+			// The vertex at maxBounces is only there for the emission BSDF sampling finds from the one before
+			if (depth == maxBounces || vertex.bsdf == BDPT_EMITTER)
+			{
+				break;
+			}
+			Vec3 wo = -d;
+			if (vertex.bsdf == BDPT_LAMBERTIAN && scene->lights.size() > 0)
+			{
+				float pmf;
+				int light = scene->lightTable.sample(sampler.next(), sampler.next(), pmf);
+				const BDPTTriangle& triangle = scene->triangles[scene->lights[light]];
+				Vec3 wi;
+				Vec3 lightPoint;
+				float pdf;
+				float r1 = sampler.next();
+				float r2 = sampler.next();
+				if (sampleTriangleLight(triangle.v[0], triangle.v[1], triangle.v[2], triangle.normal, triangle.area, vertex.p, r1, r2, wi, lightPoint, pdf) && pdf > 0)
+				{
+					Vec3 f = bsdfF(vertex, wo, wi);
+					float lightPdf = pdf * pmf;
+					if (f.x + f.y + f.z > 0 && scene->visible(offset(vertex, wi), lightPoint))
+					{
+						float weight = powerHeuristic(lightPdf, bsdfPdf(vertex, wo, wi));
+						Vec3 emission = scene->materials[triangle.material].emission;
+						L = L + (beta * f * emission * (fabsf(Dot(wi, vertex.n)) * weight / lightPdf));
+					}
+				}
+			}
+			if (depth == maxBounces - 1)
+			{
+				// No more vertices to light; the next hit only adds emission
+			} else if (depth > 3)
+			{
+				// Russian roulette as in shadeHit
+				float q = std::min(luminance(beta.coords), 0.7f);
+				if (sampler.next() < q)
+				{
+					break;
+				}
+				beta = beta / (1.0f - q);
+			}
+			Vec3 wi;
+			Vec3 f;
+			float pdf;
+			bool delta;
+			if (sampleBSDF(vertex, wo, sampler, wi, f, pdf, delta) == false || pdf <= 0)
+			{
+				break;
+			}
+			beta = beta * f * (fabsf(Dot(wi, vertex.n)) / pdf);
+			unweighted = delta;
+			lastPdf = pdf;
+			lastP = vertex.p;
+			o = offset(vertex, wi);
+			d = wi;
+		}
+		return L;
+	}
+
+	// One BDPT sample of a pixel: every connection of its camera subpath with a light subpath. The radiance reaching
+	// the pixel is returned, and light tracing paths reaching the camera are splatted where they land
+	Vec3 bidirectionalSample(int x, int y, PixelSampler& sampler, std::vector<float>& splat) const
+	{
+		BDPTVertex cameraPath[BDPT_MAX_BOUNCES + 2];
+		BDPTVertex lightPath[BDPT_MAX_BOUNCES + 1];
+		int cameraCount = cameraSubpath((float)x + sampler.next(), (float)y + sampler.next(), sampler, cameraPath);
+		int lightCount = lightSubpath(sampler, lightPath);
+		Vec3 L;
+		for (int t = 1; t <= cameraCount; t++)
+		{
+			for (int s = 0; s <= lightCount; s++)
+			{
+				int depth = t + s - 2;
+				if ((s == 1 && t == 1) || depth < 0 || depth > maxBounces)
+				{
+					continue;
+				}
+				float rasterX = 0;
+				float rasterY = 0;
+				Vec3 contribution = connect(lightPath, cameraPath, s, t, sampler, rasterX, rasterY);
+				if (t != 1)
+				{
+					L = L + contribution;
+				} else if (contribution.x + contribution.y + contribution.z > 0 && std::isfinite(contribution.x + contribution.y + contribution.z))
+				{
+					int px = std::min((int)rasterX, scene->width - 1);
+					int py = std::min((int)rasterY, scene->height - 1);
+					int pixel = (py * scene->width) + px;
+					splat[pixel * 3] += contribution.x;
+					splat[(pixel * 3) + 1] += contribution.y;
+					splat[(pixel * 3) + 2] += contribution.z;
+				}
+			}
+		}
+		return L;
+	}
+
+	// Renders both integrators for the same time and measures their error after every pass against a reference
+	// rendered with BDPT and independent samples for referenceSeconds
+	BDPTComparison compare(double seconds, double referenceSeconds)
+	{
+		BDPTComparison result;
+		reset();
+		int samplerType = sampling.type;
+		sampling.type = SAMPLER_PCG;
+		auto start = std::chrono::high_resolution_clock::now();
+		while (secondsSince(start) < referenceSeconds || passes == 0)
+		{
+			renderPass(true);
+		}
+		sampling.type = samplerType;
+		result.referenceSeconds = secondsSince(start);
+		result.referencePasses = passes;
+		std::vector<float> reference;
+		image(reference);
+		for (int integrator = 0; integrator < 2; integrator++)
+		{
+			std::vector<BDPTErrorPoint>& points = integrator == 0 ? result.pathTracer : result.bidirectional;
+			reset();
+			double elapsed = 0;
+			while (elapsed < seconds)
+			{
+				start = std::chrono::high_resolution_clock::now();
+				renderPass(integrator == 1);
+				elapsed += secondsSince(start);
+				BDPTErrorPoint point;
+				point.seconds = elapsed;
+				point.passes = passes;
+				point.error = error(reference);
+				points.push_back(point);
+			}
+		}
+		return result;
+	}
+
+	// Renders the path tracer with each sampler, measuring its error after every power of two passes up to maxPasses
+	// against a reference of referencePasses path traced with independent samples
+	BDPTSamplerConvergence samplerConvergence(int maxPasses, int referencePasses)
+	{
+		BDPTSamplerConvergence result;
+		if (sampling.mask.values.size() == 0)
+		{
+			sampling.mask.generate();
+		}
+		int samplerType = sampling.type;
+		sampling.type = SAMPLER_PCG;
+		reset();
+		while (passes < referencePasses)
+		{
+			renderPass(false);
+		}
+		result.referencePasses = passes;
+		std::vector<float> reference;
+		image(reference);
+		for (int p = 1; p <= maxPasses; p *= 2)
+		{
+			result.passes.push_back((double)p);
+		}
+		for (int type = 0; type < SAMPLER_TYPES; type++)
+		{
+			sampling.type = type;
+			reset();
+			while (passes < maxPasses)
+			{
+				renderPass(false);
+				if ((passes & (passes - 1)) == 0)
+				{
+					result.errors[type].push_back(error(reference));
+				}
+			}
+			// The first few passes are dominated by the pixels' first samples rather than the rate
+			result.slope[type] = convergenceSlope(result.passes, result.errors[type], 2);
+		}
+		sampling.type = samplerType;
+		return result;
+	}
+
+	// Root mean square error of the image against a reference, over the reference's mean
+	double error(const std::vector<float>& reference) const
+	{
+		std::vector<float> current;
+		image(current);
+		double squared = 0;
+		double mean = 0;
+		for (unsigned int i = 0; i < reference.size(); i++)
+		{
+			double e = (double)current[i] - (double)reference[i];
+			squared += e * e;
+			mean += reference[i];
+		}
+		mean /= (double)reference.size();
+		return mean > 0 ? sqrt(squared / (double)reference.size()) / mean : 0;
+	}
+
+	// Checks the BVH against brute force, both integrators against the analytic radiance inside a glowing box, and
+	// the two integrators against each other in a box lit by a small light through a mirror. Returns the number of
+	// failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x3C6EF372u;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+
+		// Closest hits and visibility through the BVH match testing every triangle
+		BDPTScene soup;
+		int material = soup.addMaterial(BDPT_LAMBERTIAN, soup.addTexture(Vec3(0.5f, 0.5f, 0.5f)));
+		for (int i = 0; i < 3000; i++)
+		{
+			Vec3 c(next() * 10.0f, next() * 10.0f, next() * 10.0f);
+			Vec3 a(next() - 0.5f, next() - 0.5f, next() - 0.5f);
+			Vec3 b(next() - 0.5f, next() - 0.5f, next() - 0.5f);
+			soup.addTriangle(c, c + a, c + b, Vec3(0, 1.0f, 0), material);
+		}
+		soup.build();
+		int wrongHits = 0;
+		for (int i = 0; i < 2000; i++)
+		{
+			Vec3 o(next() * 10.0f, next() * 10.0f, next() * 10.0f);
+			Vec3 d = Vec3(next() - 0.5f, next() - 0.5f, next() - 0.5f).normalize();
+			BDPTHit hit;
+			soup.intersect(o, d, FLT_MAX, hit);
+			float closest = FLT_MAX;
+			int closestTriangle = -1;
+			for (unsigned int t = 0; t < soup.triangles.size(); t++)
+			{
+				const BDPTTriangle& triangle = soup.triangles[t];
+				float distance = intersectTriangle(o, d, triangle.v[0], triangle.v[1], triangle.v[2]);
+				if (distance > 0 && distance < closest)
+				{
+					closest = distance;
+					closestTriangle = (int)t;
+				}
+			}
+			wrongHits += (hit.triangle == closestTriangle && (closestTriangle < 0 || fabsf(hit.t - closest) < 1e-4f)) ? 0 : 1;
+			Vec3 target = o + (d * 3.0f);
+			wrongHits += soup.visible(o, target) == (closest > 3.0f) ? 0 : 1;
+		}
+		failures += wrongHits == 0 ? 0 : 1;
+
+		// Inside a closed box whose walls all emit 1 and reflect half, paths of up to B bounces see 1 + 1/2 + ... + 1/2^B
+		BDPTScene furnace;
+		int glowing = furnace.addMaterial(BDPT_LAMBERTIAN, furnace.addTexture(Vec3(0.5f, 0.5f, 0.5f)), Vec3(1.0f, 1.0f, 1.0f));
+		addBox(furnace, Vec3(-1.0f, -1.0f, -1.0f), Vec3(1.0f, 1.0f, 1.0f), glowing, true);
+		furnace.setCamera(Vec3(0, 0, 0.3f), Vec3(0.2f, 0.1f, -1.0f), Vec3(0, 1.0f, 0), 70.0f, 16, 12, false);
+		furnace.build();
+		const int furnaceBounces = 3;
+		double expected = 0;
+		for (int k = 0; k <= furnaceBounces; k++)
+		{
+			expected += pow(0.5, k);
+		}
+		for (int bidirectional = 0; bidirectional < 2; bidirectional++)
+		{
+			init(&furnace);
+			maxBounces = furnaceBounces;
+			for (int pass = 0; pass < 128; pass++)
+			{
+				renderPass(bidirectional == 1);
+			}
+			std::vector<float> result;
+			image(result);
+			double mean = 0;
+			for (unsigned int i = 0; i < result.size(); i++)
+			{
+				mean += result[i];
+			}
+			mean /= (double)result.size();
+			failures += fabs(mean - expected) < 0.01 * expected ? 0 : 1;
+		}
+
+		// A box with a small light under the ceiling, one mirror wall and a block: both integrators render the same
+		// image, over the whole and in each quarter
+		BDPTScene box;
+		int white = box.addMaterial(BDPT_LAMBERTIAN, box.addTexture(Vec3(0.7f, 0.7f, 0.7f)));
+		int red = box.addMaterial(BDPT_LAMBERTIAN, box.addTexture(Vec3(0.7f, 0.1f, 0.1f)));
+		int mirror = box.addMaterial(BDPT_MIRROR, box.addTexture(Vec3(0.9f, 0.9f, 0.9f)));
+		int light = box.addMaterial(BDPT_EMITTER, box.addTexture(Vec3(0, 0, 0)), Vec3(40.0f, 36.0f, 30.0f));
+		addBox(box, Vec3(-1.0f, 0, -1.0f), Vec3(1.0f, 2.0f, 1.0f), white, true);
+		box.addTriangle(Vec3(-0.999f, 0.2f, -0.6f), Vec3(-0.999f, 1.6f, -0.6f), Vec3(-0.999f, 1.6f, 0.6f), Vec3(1.0f, 0, 0), mirror);
+		box.addTriangle(Vec3(-0.999f, 0.2f, -0.6f), Vec3(-0.999f, 1.6f, 0.6f), Vec3(-0.999f, 0.2f, 0.6f), Vec3(1.0f, 0, 0), mirror);
+		addBox(box, Vec3(0.1f, 0, -0.5f), Vec3(0.6f, 0.7f, 0.0f), red, false);
+		box.addTriangle(Vec3(-0.15f, 1.99f, -0.15f), Vec3(0.15f, 1.99f, -0.15f), Vec3(0.15f, 1.99f, 0.15f), Vec3(0, -1.0f, 0), light);
+		box.addTriangle(Vec3(-0.15f, 1.99f, -0.15f), Vec3(0.15f, 1.99f, 0.15f), Vec3(-0.15f, 1.99f, 0.15f), Vec3(0, -1.0f, 0), light);
+		box.setCamera(Vec3(0, 1.0f, 0.95f), Vec3(0, 0.9f, 0), Vec3(0, 1.0f, 0), 75.0f, 24, 24, false);
+		box.build();
+		double quarters[2][4] = {};
+		for (int bidirectional = 0; bidirectional < 2; bidirectional++)
+		{
+			init(&box);
+			for (int pass = 0; pass < 512; pass++)
+			{
+				renderPass(bidirectional == 1);
+			}
+			std::vector<float> result;
+			image(result);
+			for (int y = 0; y < box.height; y++)
+			{
+				for (int x = 0; x < box.width; x++)
+				{
+					int pixel = (y * box.width) + x;
+					int quarter = (x * 2 / box.width) + (2 * (y * 2 / box.height));
+					quarters[bidirectional][quarter] += result[pixel * 3] + result[(pixel * 3) + 1] + result[(pixel * 3) + 2];
+				}
+			}
+		}
+		double total[2] = {};
+		bool quartersAgree = true;
+		for (int q = 0; q < 4; q++)
+		{
+			total[0] += quarters[0][q];
+			total[1] += quarters[1][q];
+			quartersAgree = quartersAgree && fabs(quarters[0][q] - quarters[1][q]) < 0.05 * quarters[0][q];
+		}
+		failures += (total[0] > 0 && fabs(total[0] - total[1]) < 0.02 * total[0] && quartersAgree) ? 0 : 1;
+		maxBounces = BDPT_MAX_BOUNCES;
+		return failures;
+	}
+
+private:
+	static unsigned int hash(unsigned int a)
+	{
+		a = (a + 0x7ed55d16u) + (a << 12);
+		a = (a ^ 0xc761c23cu) ^ (a >> 19);
+		a = (a + 0x165667b1u) + (a << 5);
+		a = (a + 0xd3a2646cu) ^ (a << 9);
+		a = (a + 0xfd7046c5u) + (a << 3);
+		a = (a ^ 0xb55a4f09u) ^ (a >> 16);
+		return a;
+	}
+
+	static double secondsSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::max(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count(), 1e-9);
+	}
+
+	static float powerHeuristic(float a, float b)
+	{
+		float a2 = a * a;
+		float b2 = b * b;
+		return (a2 + b2) > 0 ? a2 / (a2 + b2) : 0;
+	}
+
+	// Distance along a ray to a triangle, or a negative value if it is missed
+	static float intersectTriangle(const Vec3& o, const Vec3& d, const Vec3& v1, const Vec3& v2, const Vec3& v3)
+	{
+		Vec3 e1 = v2 - v1;
+		Vec3 e2 = v3 - v1;
+		Vec3 h = Cross(d, e2);
+		float det = Dot(e1, h);
+		if (fabsf(det) < 1e-12f)
+		{
+			return -1.0f;
+		}
+		float invDet = 1.0f / det;
+		Vec3 s = o - v1;
+		float u = Dot(s, h) * invDet;
+		Vec3 q = Cross(s, e1);
+		float v = Dot(d, q) * invDet;
+		if (u < 0 || v < 0 || (u + v) > 1.0f)
+		{
+			return -1.0f;
+		}
+		return Dot(e2, q) * invDet;
+	}
+
+	// Adds the six faces of a box, facing inwards or outwards
+	static void addBox(BDPTScene& target, const Vec3& lo, const Vec3& hi, int material, bool inwards)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			for (int side = 0; side < 2; side++)
+			{
+				int a = (axis + 1) % 3;
+				int b = (axis + 2) % 3;
+				Vec3 corners[4];
+				for (int k = 0; k < 4; k++)
+				{
+					corners[k].coords[axis] = side == 0 ? lo.coords[axis] : hi.coords[axis];
+					corners[k].coords[a] = (k == 1 || k == 2) ? hi.coords[a] : lo.coords[a];
+					corners[k].coords[b] = k >= 2 ? hi.coords[b] : lo.coords[b];
+				}
+				Vec3 outwards;
+				outwards.coords[axis] = side == 0 ? -1.0f : 1.0f;
+				Vec3 facing = inwards ? -outwards : outwards;
+				target.addTriangle(corners[0], corners[1], corners[2], facing, material);
+				target.addTriangle(corners[0], corners[2], corners[3], facing, material);
+			}
+		}
+	}
+
+	// Area of the image plane at unit distance from the camera
+	float filmArea() const
+	{
+		return 4.0f * scene->tanHalfFov * scene->tanHalfFov * scene->aspect();
+	}
+
+	// Direction through a point of the image in pixels, as RayGeneration computes it
+	Vec3 cameraDirection(float fx, float fy) const
+	{
+		float x = ((2.0f * fx / (float)scene->width) - 1.0f) * scene->aspect() * scene->tanHalfFov;
+		float y = (1.0f - (2.0f * fy / (float)scene->height)) * scene->tanHalfFov;
+		x = scene->flipX ? -x : x;
+		return ((scene->right * x) + (scene->up * y) + scene->forward).normalize();
+	}
+
+	// Finds where a point appears in the image, returning false if it is behind the camera or outside the image
+	bool project(const Vec3& p, float& fx, float& fy) const
+	{
+		Vec3 w = p - scene->eye;
+		float z = Dot(w, scene->forward);
+		if (z <= 0)
+		{
+			return false;
+		}
+		float x = Dot(w, scene->right) / (z * scene->aspect() * scene->tanHalfFov);
+		float y = Dot(w, scene->up) / (z * scene->tanHalfFov);
+		x = scene->flipX ? -x : x;
+		if (x < -1.0f || x >= 1.0f || y <= -1.0f || y > 1.0f)
+		{
+			return false;
+		}
+		fx = (x + 1.0f) * 0.5f * (float)scene->width;
+		fy = (1.0f - y) * 0.5f * (float)scene->height;
+		return true;
+	}
+
+	// Density over solid angle of the camera's ray directions, and its importance, for a direction at cosTheta to the
+	// viewing direction; the pixel filter is a box and the whole image integrates to one
+	float cameraPdfDir(float cosTheta) const
+	{
+		return cosTheta > 0 ? 1.0f / (filmArea() * cosTheta * cosTheta * cosTheta) : 0;
+	}
+
+	float cameraImportance(float cosTheta) const
+	{
+		return cosTheta > 0 ? 1.0f / (filmArea() * cosTheta * cosTheta * cosTheta * cosTheta) : 0;
+	}
+
+	BDPTVertex surfaceVertex(const BDPTHit& hit, const Vec3& o, const Vec3& d, const Vec3& beta) const
+	{
+		const BDPTTriangle& triangle = scene->triangles[hit.triangle];
+		const BDPTMaterial& material = scene->materials[triangle.material];
+		BDPTVertex vertex;
+		vertex.type = BDPT_SURFACE_VERTEX;
+		vertex.p = o + (d * hit.t);
+		vertex.n = triangle.normal;
+		vertex.beta = beta;
+		float b0 = 1.0f - hit.b1 - hit.b2;
+		float u = (b0 * triangle.uv[0][0]) + (hit.b1 * triangle.uv[1][0]) + (hit.b2 * triangle.uv[2][0]);
+		float v = (b0 * triangle.uv[0][1]) + (hit.b1 * triangle.uv[1][1]) + (hit.b2 * triangle.uv[2][1]);
+		vertex.albedo = scene->textures[material.texture].lookup(u, v);
+		vertex.emission = material.emission;
+		vertex.bsdf = material.bsdf;
+		vertex.triangle = hit.triangle;
+		return vertex;
+	}
+
+	// Origin of a ray leaving a vertex in direction wi
+	static Vec3 offset(const BDPTVertex& vertex, const Vec3& wi)
+	{
+		return vertex.p + (vertex.n * (Dot(wi, vertex.n) > 0 ? BDPT_RAY_EPSILON : -BDPT_RAY_EPSILON));
+	}
+
+	// Two sided Lambertian reflection, between directions on the same side of the surface
+	static Vec3 bsdfF(const BDPTVertex& vertex, const Vec3& wo, const Vec3& wi)
+	{
+		if (vertex.bsdf != BDPT_LAMBERTIAN || Dot(vertex.n, wo) * Dot(vertex.n, wi) <= 0)
+		{
+			return Vec3(0, 0, 0);
+		}
+		return vertex.albedo / BDPT_PI;
+	}
+
+	static float bsdfPdf(const BDPTVertex& vertex, const Vec3& wo, const Vec3& wi)
+	{
+		if (vertex.bsdf != BDPT_LAMBERTIAN || Dot(vertex.n, wo) * Dot(vertex.n, wi) <= 0)
+		{
+			return 0;
+		}
+		return fabsf(Dot(vertex.n, wi)) / BDPT_PI;
+	}
+
+	// Samples a direction to leave a vertex in, as sampleBSDF does for the diffuse BSDFs and the mirror
+	static bool sampleBSDF(const BDPTVertex& vertex, const Vec3& wo, PixelSampler& sampler, Vec3& wi, Vec3& f, float& pdf, bool& delta)
+	{
+		Vec3 n = Dot(vertex.n, wo) > 0 ? vertex.n : -vertex.n;
+		delta = false;
+		if (vertex.bsdf == BDPT_LAMBERTIAN)
+		{
+			float r = sqrtf(sampler.next());
+			float phi = 2.0f * BDPT_PI * sampler.next();
+			Vec3 local(r * cosf(phi), r * sinf(phi), sqrtf(std::max(1.0f - (r * r), 0.0f)));
+			Frame frame;
+			frame.fromVector(n);
+			wi = frame.toWorld(local);
+			f = vertex.albedo / BDPT_PI;
+			pdf = local.z / BDPT_PI;
+			return pdf > 0;
+		}
+		if (vertex.bsdf == BDPT_MIRROR)
+		{
+			float cosTheta = Dot(wo, n);
+			wi = (n * (2.0f * cosTheta)) - wo;
+			f = vertex.albedo / cosTheta;
+			pdf = 1.0f;
+			delta = true;
+			return cosTheta > 0;
+		}
+		return false;
+	}
+
+	// Radiance a vertex on a light emits towards a point
+	static Vec3 emitted(const BDPTVertex& vertex, const Vec3& towards)
+	{
+		return Dot(vertex.n, towards - vertex.p) > 0 ? vertex.emission : Vec3(0, 0, 0);
+	}
+
+	// Solid angle density of the direct lighting in pathTraceSample choosing a point of a light seen from p
+	float lightSolidAnglePdf(int triangleIndex, const Vec3& p, const Vec3& wi, const Vec3& lightPoint) const
+	{
+		int light = scene->lightIndex[triangleIndex];
+		if (light < 0)
+		{
+			return 0;
+		}
+		const BDPTTriangle& triangle = scene->triangles[triangleIndex];
+		return scene->lightTable.pmfs[light] * triangleLightPdf(triangle.v[0], triangle.v[1], triangle.v[2], triangle.normal, triangle.area, p, wi, lightPoint);
+	}
+
+	// Converts a density over solid angle at one vertex to a density over area at another
+	static float convertDensity(float pdf, const BDPTVertex& from, const BDPTVertex& to)
+	{
+		Vec3 w = to.p - from.p;
+		float distanceSq = w.lengthSq();
+		if (distanceSq <= 0)
+		{
+			return 0;
+		}
+		pdf = pdf / distanceSq;
+		if (to.type != BDPT_CAMERA_VERTEX)
+		{
+			pdf = pdf * fabsf(Dot(to.n, w / sqrtf(distanceSq)));
+		}
+		return pdf;
+	}
+
+	// Density over area of a light vertex emitting towards another vertex, with cosine distributed directions
+	static float pdfLight(const BDPTVertex& light, const BDPTVertex& to)
+	{
+		Vec3 w = (to.p - light.p).normalize();
+		float cosTheta = Dot(light.n, w);
+		return cosTheta > 0 ? convertDensity(cosTheta / BDPT_PI, light, to) : 0;
+	}
+
+	// Density over area of choosing a point on a light as the start of a light subpath
+	float pdfLightOrigin(const BDPTVertex& vertex) const
+	{
+		int light = vertex.triangle >= 0 ? scene->lightIndex[vertex.triangle] : -1;
+		if (light < 0)
+		{
+			return 0;
+		}
+		return scene->lightTable.pmfs[light] / scene->triangles[vertex.triangle].area;
+	}
+
+	// Density over area of a vertex sampling next, having been reached from prev
+	float vertexPdf(const BDPTVertex& vertex, const BDPTVertex* prev, const BDPTVertex& next) const
+	{
+		if (vertex.type == BDPT_LIGHT_VERTEX)
+		{
+			return pdfLight(vertex, next);
+		}
+		Vec3 wn = next.p - vertex.p;
+		if (wn.lengthSq() <= 0)
+		{
+			return 0;
+		}
+		wn = wn.normalize();
+		float pdf;
+		if (vertex.type == BDPT_CAMERA_VERTEX)
+		{
+			float fx;
+			float fy;
+			pdf = project(next.p, fx, fy) ? cameraPdfDir(Dot(wn, scene->forward)) : 0;
+		} else
+		{
+			pdf = bsdfPdf(vertex, (prev->p - vertex.p).normalize(), wn);
+		}
+		return convertDensity(pdf, vertex, next);
+	}
+
+	// Extends a subpath from the vertex before path[0], filling path with up to maxVertices vertices. pdf is the
+	// solid angle density of the first direction
+	int randomWalk(PixelSampler& sampler, Vec3 o, Vec3 d, Vec3 beta, float pdf, int maxVertices, BDPTVertex* path) const
+	{
+		int count = 0;
+		float pdfFwd = pdf;
+		while (count < maxVertices)
+		{
+			BDPTHit hit;
+			if (scene->intersect(o, d, FLT_MAX, hit) == false)
+			{
+				break;
+			}
+			BDPTVertex& vertex = path[count];
+			BDPTVertex& prev = path[count - 1];
+			vertex = surfaceVertex(hit, o, d, beta);
+			vertex.pdfFwd = convertDensity(pdfFwd, prev, vertex);
+			count++;
+			if (count >= maxVertices)
+			{
+				break;
+			}
+			Vec3 wo = -d;
+			Vec3 wi;
+			Vec3 f;
+			bool delta;
+			if (sampleBSDF(vertex, wo, sampler, wi, f, pdf, delta) == false || pdf <= 0)
+			{
+				break;
+			}
+			beta = beta * f * (fabsf(Dot(wi, vertex.n)) / pdf);
+			if (beta.x + beta.y + beta.z <= 0)
+			{
+				break;
+			}
+			float pdfRev = bsdfPdf(vertex, wi, wo);
+			if (delta)
+			{
+				vertex.delta = true;
+				pdf = 0;
+				pdfRev = 0;
+			}
+			pdfFwd = pdf;
+			prev.pdfRev = convertDensity(pdfRev, vertex, prev);
+			o = offset(vertex, wi);
+			d = wi;
+		}
+		return count;
+	}
+
+	int cameraSubpath(float fx, float fy, PixelSampler& sampler, BDPTVertex* path) const
+	{
+		Vec3 d = cameraDirection(fx, fy);
+		path[0] = BDPTVertex();
+		path[0].type = BDPT_CAMERA_VERTEX;
+		path[0].p = scene->eye;
+		path[0].n = scene->forward;
+		path[0].beta = Vec3(1.0f, 1.0f, 1.0f);
+		return 1 + randomWalk(sampler, scene->eye, d, path[0].beta, cameraPdfDir(Dot(d, scene->forward)), maxBounces + 1, path + 1);
+	}
+
+	// Starts a subpath at a light chosen by power, at a uniform point and in a cosine distributed direction
+	int lightSubpath(PixelSampler& sampler, BDPTVertex* path) const
+	{
+		if (scene->lights.size() == 0)
+		{
+			return 0;
+		}
+		float pmf;
+		int light = scene->lightTable.sample(sampler.next(), sampler.next(), pmf);
+		int triangleIndex = scene->lights[light];
+		const BDPTTriangle& triangle = scene->triangles[triangleIndex];
+		float su = sqrtf(sampler.next());
+		float r = sampler.next();
+		Vec3 p = (triangle.v[0] * (1.0f - su)) + (triangle.v[1] * (su * r)) + (triangle.v[2] * (su * (1.0f - r)));
+		float rr = sqrtf(sampler.next());
+		float phi = 2.0f * BDPT_PI * sampler.next();
+		Vec3 local(rr * cosf(phi), rr * sinf(phi), sqrtf(std::max(1.0f - (rr * rr), 0.0f)));
+		if (local.z <= 0 || pmf <= 0)
+		{
+			return 0;
+		}
+		Frame frame;
+		frame.fromVector(triangle.normal);
+		Vec3 wi = frame.toWorld(local);
+		float pdfPos = 1.0f / triangle.area;
+		float pdfDir = local.z / BDPT_PI;
+		path[0] = BDPTVertex();
+		path[0].type = BDPT_LIGHT_VERTEX;
+		path[0].p = p;
+		path[0].n = triangle.normal;
+		path[0].emission = scene->materials[triangle.material].emission;
+		path[0].beta = path[0].emission;
+		path[0].pdfFwd = pmf * pdfPos;
+		path[0].triangle = triangleIndex;
+		Vec3 beta = path[0].emission * (local.z / (pmf * pdfPos * pdfDir));
+		return 1 + randomWalk(sampler, p + (triangle.normal * BDPT_RAY_EPSILON), wi, beta, pdfDir, maxBounces, path + 1);
+	}
+
+	// The contribution of the path joining the first s vertices of the light subpath with the first t of the camera
+	// subpath, weighted by MIS. Light tracing paths (t = 1) return where they land in the image
+	Vec3 connect(const BDPTVertex* lightPath, const BDPTVertex* cameraPath, int s, int t, PixelSampler& sampler, float& rasterX, float& rasterY) const
+	{
+		Vec3 L;
+		BDPTVertex sampled;
+		if (s == 0)
+		{
+			// The camera subpath found a light by itself
+			const BDPTVertex& pt = cameraPath[t - 1];
+			L = pt.beta * emitted(pt, cameraPath[t - 2].p);
+		} else if (t == 1)
+		{
+			// Light tracing: the light subpath's last vertex is joined to the camera
+			const BDPTVertex& qs = lightPath[s - 1];
+			if (qs.delta || qs.type != BDPT_SURFACE_VERTEX || project(qs.p, rasterX, rasterY) == false)
+			{
+				return Vec3(0, 0, 0);
+			}
+			Vec3 w = scene->eye - qs.p;
+			float distanceSq = w.lengthSq();
+			w = w.normalize();
+			float cosCamera = Dot(-w, scene->forward);
+			sampled.type = BDPT_CAMERA_VERTEX;
+			sampled.p = scene->eye;
+			sampled.n = scene->forward;
+			sampled.beta = Vec3(1.0f, 1.0f, 1.0f) * (cameraImportance(cosCamera) * cosCamera / distanceSq);
+			L = qs.beta * bsdfF(qs, lightPath[s - 2].p - qs.p, w) * sampled.beta * fabsf(Dot(w, qs.n));
+			if (L.x + L.y + L.z > 0 && scene->visible(offset(qs, w), scene->eye) == false)
+			{
+				return Vec3(0, 0, 0);
+			}
+		} else if (s == 1)
+		{
+			// Next event estimation: a new point on a light is joined to the camera subpath's last vertex
+			const BDPTVertex& pt = cameraPath[t - 1];
+			if (pt.delta || scene->lights.size() == 0)
+			{
+				return Vec3(0, 0, 0);
+			}
+			float pmf;
+			int light = scene->lightTable.sample(sampler.next(), sampler.next(), pmf);
+			int triangleIndex = scene->lights[light];
+			const BDPTTriangle& triangle = scene->triangles[triangleIndex];
+			float su = sqrtf(sampler.next());
+			float r = sampler.next();
+			Vec3 p = (triangle.v[0] * (1.0f - su)) + (triangle.v[1] * (su * r)) + (triangle.v[2] * (su * (1.0f - r)));
+			Vec3 w = pt.p - p;
+			float distanceSq = w.lengthSq();
+			w = w.normalize();
+			float cosLight = Dot(triangle.normal, w);
+			if (cosLight <= 0 || distanceSq <= 0 || pmf <= 0)
+			{
+				return Vec3(0, 0, 0);
+			}
+			sampled.type = BDPT_LIGHT_VERTEX;
+			sampled.p = p;
+			sampled.n = triangle.normal;
+			sampled.emission = scene->materials[triangle.material].emission;
+			sampled.beta = sampled.emission * (triangle.area * cosLight / (pmf * distanceSq));
+			sampled.pdfFwd = pmf / triangle.area;
+			sampled.triangle = triangleIndex;
+			L = pt.beta * bsdfF(pt, cameraPath[t - 2].p - pt.p, -w) * sampled.beta * fabsf(Dot(w, pt.n));
+			if (L.x + L.y + L.z > 0 && scene->visible(offset(pt, -w), p) == false)
+			{
+				return Vec3(0, 0, 0);
+			}
+		} else
+		{
+			// Both subpaths' last vertices are joined
+			const BDPTVertex& qs = lightPath[s - 1];
+			const BDPTVertex& pt = cameraPath[t - 1];
+			if (qs.delta || pt.delta)
+			{
+				return Vec3(0, 0, 0);
+			}
+			Vec3 w = pt.p - qs.p;
+			float distanceSq = w.lengthSq();
+			if (distanceSq <= 0)
+			{
+				return Vec3(0, 0, 0);
+			}
+			w = w / sqrtf(distanceSq);
+			L = qs.beta * bsdfF(qs, lightPath[s - 2].p - qs.p, w) * bsdfF(pt, cameraPath[t - 2].p - pt.p, -w) * pt.beta;
+			L = L * (fabsf(Dot(w, qs.n)) * fabsf(Dot(w, pt.n)) / distanceSq);
+			if (L.x + L.y + L.z > 0 && scene->visible(offset(qs, w), offset(pt, -w)) == false)
+			{
+				return Vec3(0, 0, 0);
+			}
+		}
+		if (L.x + L.y + L.z <= 0)
+		{
+			return Vec3(0, 0, 0);
+		}
+		return L * misWeight(lightPath, cameraPath, sampled, s, t);
+	}
+
+	// Power heuristic weight of the strategy joining s light and t camera vertices, against every other strategy that
+	// builds the same path. The densities of each vertex from either end give the ratio of each strategy's pdf to the
+	// next one's, with the densities at the joined vertices recomputed for the connection
+	float misWeight(const BDPTVertex* lightPath, const BDPTVertex* cameraPath, const BDPTVertex& sampled, int s, int t) const
+	{
+		if (s + t == 2)
+		{
+			return 1.0f;
+		}
+		BDPTVertex l[BDPT_MAX_BOUNCES + 1];
+		BDPTVertex c[BDPT_MAX_BOUNCES + 2];
+		for (int i = 0; i < s; i++)
+		{
+			l[i] = lightPath[i];
+		}
+		for (int i = 0; i < t; i++)
+		{
+			c[i] = cameraPath[i];
+		}
+		if (s == 1)
+		{
+			l[0] = sampled;
+		} else if (t == 1)
+		{
+			c[0] = sampled;
+		}
+		BDPTVertex* qs = s > 0 ? &l[s - 1] : NULL;
+		BDPTVertex* pt = t > 0 ? &c[t - 1] : NULL;
+		BDPTVertex* qsMinus = s > 1 ? &l[s - 2] : NULL;
+		BDPTVertex* ptMinus = t > 1 ? &c[t - 2] : NULL;
+		// The joined vertices were reached by a connection, which no mirror took
+		if (pt != NULL)
+		{
+			pt->delta = false;
+			pt->pdfRev = s > 0 ? vertexPdf(*qs, qsMinus, *pt) : pdfLightOrigin(*pt);
+		}
+		if (qs != NULL)
+		{
+			qs->delta = false;
+			qs->pdfRev = vertexPdf(*pt, ptMinus, *qs);
+		}
+		if (ptMinus != NULL)
+		{
+			ptMinus->pdfRev = s > 0 ? vertexPdf(*pt, qs, *ptMinus) : pdfLight(*pt, *ptMinus);
+		}
+		if (qsMinus != NULL)
+		{
+			qsMinus->pdfRev = vertexPdf(*qs, pt, *qsMinus);
+		}
+		// Densities of zero belong to mirrors, which divide out of the ratios
+		auto remap = [](float pdf)
+			{
+				return pdf != 0 ? pdf * pdf : 1.0f;
+			};
+		float sumRi = 0;
+		float ri = 1.0f;
+		for (int i = t - 1; i > 0; i--)
+		{
+			ri *= remap(c[i].pdfRev) / remap(c[i].pdfFwd);
+			if (c[i].delta == false && c[i - 1].delta == false)
+			{
+				sumRi += ri;
+			}
+		}
+		ri = 1.0f;
+		for (int i = s - 1; i >= 0; i--)
+		{
+			ri *= remap(l[i].pdfRev) / remap(l[i].pdfFwd);
+			bool deltaBefore = i > 0 ? l[i - 1].delta : false;
+			if (l[i].delta == false && deltaBefore == false)
+			{
+				sumRi += ri;
+			}
+		}
+		return 1.0f / (1.0f + sumRi);
+	}
+};
+
+// Writes an RGB image as a PFM, which keeps the radiance unclamped
+static bool writePFM(std::string filename, const std::vector<float>& rgb, int width, int height)
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (file.is_open() == false)
+	{
+		return false;
+	}
+	file << "PF\n" << width << " " << height << "\n-1.0\n";
+	// PFM rows run from the bottom of the image up
+	for (int y = height - 1; y >= 0; y--)
+	{
+		file.write(reinterpret_cast<const char*>(&rgb[y * width * 3]), width * 3 * sizeof(float));
+	}
+	return true;
+}
@@ -115,6 +115,12 @@ public:
 		return forward;
 	}
 
+	// Returns the combined view projection matrix (projection * view), used to reproject points into the previous frame
+	Matrix viewProjection()
+	{
+		return view.mul(projection);
+	}
+
 	// Updates the view matrix and its inverse
 	void updateViewMatrix()
 	{
@@ -27,6 +27,8 @@ SOFTWARE.
 #include <d3d12.h>
 #include <dxgi1_4.h>
 #include <vector>
+#include "Accumulation.h"
+#include "Timer.h"
 
 // Link necessary libraries
 #pragma comment(lib, "d3d12")
@@ -103,6 +105,14 @@ public:
         used++;
         return cpuHandle;
     }
+
+    // Returns the CPU descriptor handle at 'index', for rewriting a descriptor already in use
+    D3D12_CPU_DESCRIPTOR_HANDLE getCPUHandle(int index)
+    {
+        D3D12_CPU_DESCRIPTOR_HANDLE handle = heap->GetCPUDescriptorHandleForHeapStart();
+        handle.ptr += (SIZE_T)index * size;
+        return handle;
+    }
 };
 
 // Barrier: Provides a static helper to add resource transition barriers
@@ -132,6 +142,7 @@ public:
     IDXGISwapChain3* swapchain;
     DescriptorHeap uavsrvHeap;
     ID3D12Resource* rendertarget;
+    ID3D12Resource* accumulation;       // Running mean of every pixel's samples, an AccumulationPixel per pixel
     ID3D12CommandAllocator* graphicsCommandAllocator;
     ID3D12GraphicsCommandList4* graphicsCommandList;
     ID3D12RootSignature* rootSignature;
@@ -139,6 +150,7 @@ public:
     int width;
     int height;
     HWND windowHandle;
+    float frameMilliseconds = 0;        // Time the last frame's command list took to run, measured while waiting for it
 
     // Initializes the Direct3D device, command queues, swap chain, and related resources
     void init(HWND hwnd, int _width, int _height)
@@ -215,6 +227,7 @@ public:
         uavsrvHeap.init(device, 16384);
 
         rendertarget = nullptr;
+        accumulation = nullptr;
 
         // Update screen resources based on the given width and height
         updateScreenResources(_width, _height);
@@ -267,6 +280,25 @@ public:
         uavDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
         uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
         device->CreateUnorderedAccessView(rendertarget, nullptr, &uavDesc, uavsrvHeap.getNextCPUHandle());
+
+        // Create the HDR accumulation buffer the path tracing passes average their samples into, which the tonemap
+        // pass encodes into the render target. It is bound as a root UAV, so it needs no descriptor
+        if (accumulation != nullptr)
+        {
+            accumulation->Release();
+        }
+        D3D12_RESOURCE_DESC accumulationDesc = {};
+        accumulationDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        accumulationDesc.Width = (UINT64)sizeof(AccumulationPixel) * width * height;
+        accumulationDesc.Height = 1;
+        accumulationDesc.DepthOrArraySize = 1;
+        accumulationDesc.MipLevels = 1;
+        accumulationDesc.Format = DXGI_FORMAT_UNKNOWN;
+        accumulationDesc.SampleDesc.Count = 1;
+        accumulationDesc.SampleDesc.Quality = 0;
+        accumulationDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        accumulationDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+        device->CreateCommittedResource(&heapDesc, D3D12_HEAP_FLAG_NONE, &accumulationDesc, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&accumulation));
     }
 
     // Creates the root signature for the pipeline
@@ -360,6 +392,101 @@ public:
         instanceBufferParam.Descriptor.RegisterSpace = 0;
         instanceBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
 
+        D3D12_ROOT_PARAMETER instanceNormalBufferParam = {};
+        instanceNormalBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+        instanceNormalBufferParam.Descriptor.ShaderRegister = 6; // Corresponds to register t6
+        instanceNormalBufferParam.Descriptor.RegisterSpace = 0;
+        instanceNormalBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER shadingRecordBufferParam = {};
+        shadingRecordBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+        shadingRecordBufferParam.Descriptor.ShaderRegister = 7; // Corresponds to register t7
+        shadingRecordBufferParam.Descriptor.RegisterSpace = 0;
+        shadingRecordBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER lightAliasBufferParam = {};
+        lightAliasBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+        lightAliasBufferParam.Descriptor.ShaderRegister = 8; // Corresponds to register t8
+        lightAliasBufferParam.Descriptor.RegisterSpace = 0;
+        lightAliasBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER lightBVHNodeBufferParam = {};
+        lightBVHNodeBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+        lightBVHNodeBufferParam.Descriptor.ShaderRegister = 9; // Corresponds to register t9
+        lightBVHNodeBufferParam.Descriptor.RegisterSpace = 0;
+        lightBVHNodeBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER lightBVHTrailBufferParam = {};
+        lightBVHTrailBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+        lightBVHTrailBufferParam.Descriptor.ShaderRegister = 10; // Corresponds to register t10
+        lightBVHTrailBufferParam.Descriptor.RegisterSpace = 0;
+        lightBVHTrailBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER environmentDistributionBufferParam = {};
+        environmentDistributionBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+        environmentDistributionBufferParam.Descriptor.ShaderRegister = 11; // Corresponds to register t11
+        environmentDistributionBufferParam.Descriptor.RegisterSpace = 0;
+        environmentDistributionBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        // The buffers of ReSTIR, the radiance cache, the probe volume, the light cache, path guiding and the photon map
+        // are reached through a descriptor table, as root views of them all would take the root signature past its 64 DWORDs
+        D3D12_DESCRIPTOR_RANGE featureRange = {};
+        featureRange.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+        featureRange.NumDescriptors = 13;
+        featureRange.BaseShaderRegister = 1; // Corresponds to registers u1 to u13
+        featureRange.RegisterSpace = 0;
+        featureRange.OffsetInDescriptorsFromTableStart = D3D12_DESCRIPTOR_RANGE_OFFSET_APPEND;
+
+        D3D12_ROOT_PARAMETER featureParam = {};
+        featureParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
+        featureParam.DescriptorTable.NumDescriptorRanges = 1;
+        featureParam.DescriptorTable.pDescriptorRanges = &featureRange;
+        featureParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER blueNoiseBufferParam = {};
+        blueNoiseBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+        blueNoiseBufferParam.Descriptor.ShaderRegister = 12; // Corresponds to register t12
+        blueNoiseBufferParam.Descriptor.RegisterSpace = 0;
+        blueNoiseBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER adaptivePixelBufferParam = {};
+        adaptivePixelBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_UAV;
+        adaptivePixelBufferParam.Descriptor.ShaderRegister = 14; // Corresponds to register u14
+        adaptivePixelBufferParam.Descriptor.RegisterSpace = 0;
+        adaptivePixelBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER adaptiveWorkListBufferParam = {};
+        adaptiveWorkListBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_UAV;
+        adaptiveWorkListBufferParam.Descriptor.ShaderRegister = 15; // Corresponds to register u15
+        adaptiveWorkListBufferParam.Descriptor.RegisterSpace = 0;
+        adaptiveWorkListBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER accumulationParam = {};
+        accumulationParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_UAV;
+        accumulationParam.Descriptor.ShaderRegister = 16; // Corresponds to register u16
+        accumulationParam.Descriptor.RegisterSpace = 0;
+        accumulationParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        D3D12_ROOT_PARAMETER aovBufferParam = {};
+        aovBufferParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_UAV;
+        aovBufferParam.Descriptor.ShaderRegister = 17; // Corresponds to register u17
+        aovBufferParam.Descriptor.RegisterSpace = 0;
+        aovBufferParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
+        // The wavefront queues are reached through a descriptor table too
+        D3D12_DESCRIPTOR_RANGE wavefrontRange = {};
+        wavefrontRange.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+        wavefrontRange.NumDescriptors = 6;
+        wavefrontRange.BaseShaderRegister = 18; // Corresponds to registers u18 to u23
+        wavefrontRange.RegisterSpace = 0;
+        wavefrontRange.OffsetInDescriptorsFromTableStart = D3D12_DESCRIPTOR_RANGE_OFFSET_APPEND;
+
+        D3D12_ROOT_PARAMETER wavefrontParam = {};
+        wavefrontParam.ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
+        wavefrontParam.DescriptorTable.NumDescriptorRanges = 1;
+        wavefrontParam.DescriptorTable.pDescriptorRanges = &wavefrontRange;
+        wavefrontParam.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+
         D3D12_DESCRIPTOR_RANGE envTextureRange = {};
         envTextureRange.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_SRV;
         envTextureRange.NumDescriptors = 1;
@@ -384,7 +511,20 @@ public:
             indexBufferParam,
             instanceBufferParam,
             lightBufferParam,
-            envTextureParam
+            envTextureParam,
+            instanceNormalBufferParam,
+            shadingRecordBufferParam,
+            lightAliasBufferParam,
+            lightBVHNodeBufferParam,
+            lightBVHTrailBufferParam,
+            environmentDistributionBufferParam,
+            featureParam,
+            blueNoiseBufferParam,
+            adaptivePixelBufferParam,
+            adaptiveWorkListBufferParam,
+            accumulationParam,
+            aovBufferParam,
+            wavefrontParam
         };
 
         D3D12_ROOT_SIGNATURE_DESC desc = {};
@@ -426,7 +566,7 @@ public:
         graphicsCommandList->Reset(graphicsCommandAllocator, nullptr);
     }
 
-    // Binds the render target UAV and texture descriptor tables
+    // Binds the render target UAV and texture descriptor tables, and the accumulation buffer
     void bindRTUAV()
     {
         graphicsCommandList->SetDescriptorHeaps(1, &uavsrvHeap.heap);
@@ -436,6 +576,7 @@ public:
         D3D12_GPU_DESCRIPTOR_HANDLE textureGpuHandle = gpuHandle;
         textureGpuHandle.ptr += descriptorSize * 2;
         graphicsCommandList->SetComputeRootDescriptorTable(3, textureGpuHandle);
+        graphicsCommandList->SetComputeRootUnorderedAccessView(19, accumulation->GetGPUVirtualAddress());
     }
 
     // Completes the frame by copying the render target to the swap chain backbuffer and presenting
@@ -458,9 +599,11 @@ public:
         backbuffer->Release();
 
         graphicsCommandList->Close();
+        Timer frameTimer;
         graphicsQueue->ExecuteCommandLists(1, (ID3D12CommandList**)&graphicsCommandList);
 
         flushGraphicsQueue();
+        frameMilliseconds = frameTimer.dt() * 1000.0f;
         swapchain->Present(1, 0);
     }
 
@@ -489,6 +632,10 @@ public:
         {
             rendertarget->Release();
         }
+        if (accumulation)
+        {
+            accumulation->Release();
+        }
         if (swapchain)
         {
             swapchain->Release();
@@ -590,6 +737,163 @@ public:
     }
 };
 
+// RWStructuredBuffer: Manages a GPU buffer for structured data that shaders both read and write
+// The buffer stays in the unordered access state and is bound as a root UAV, or through a view made by createUAV
+// when it is reached through a descriptor table
+class RWStructuredBuffer
+{
+public:
+    ID3D12Resource* buffer = nullptr;
+    int elementSizeInBytes = 0;
+    int size = 0;
+
+    // Creates a zero filled buffer of 'size' elements
+    void init(Core* core, int _elementSizeInBytes, int _size)
+    {
+        elementSizeInBytes = _elementSizeInBytes;
+        size = _size;
+        D3D12_HEAP_PROPERTIES heapDesc = {};
+        heapDesc.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+        D3D12_RESOURCE_DESC bd = {};
+        bd.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        bd.Width = (UINT64)elementSizeInBytes * size;
+        bd.Height = 1;
+        bd.DepthOrArraySize = 1;
+        bd.MipLevels = 1;
+        bd.Format = DXGI_FORMAT_UNKNOWN;
+        bd.SampleDesc.Count = 1;
+        bd.SampleDesc.Quality = 0;
+        bd.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        bd.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+
+        // Committed resources in the default heap are zero filled
+        core->device->CreateCommittedResource(&heapDesc, D3D12_HEAP_FLAG_NONE, &bd, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&buffer));
+    }
+
+    // Copies 'count' elements to the start of the buffer through an intermediate upload buffer, waiting for the copy
+    void upload(Core* core, void* data, int count)
+    {
+        ID3D12Resource* uploadBuffer;
+        UINT64 sizeInBytes = (UINT64)elementSizeInBytes * count;
+
+        D3D12_HEAP_PROPERTIES heapDesc = {};
+        heapDesc.Type = D3D12_HEAP_TYPE_UPLOAD;
+
+        D3D12_RESOURCE_DESC bd = {};
+        bd.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        bd.Width = sizeInBytes;
+        bd.Height = 1;
+        bd.DepthOrArraySize = 1;
+        bd.MipLevels = 1;
+        bd.Format = DXGI_FORMAT_UNKNOWN;
+        bd.SampleDesc.Count = 1;
+        bd.SampleDesc.Quality = 0;
+        bd.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        bd.Flags = D3D12_RESOURCE_FLAG_NONE;
+        core->device->CreateCommittedResource(&heapDesc, D3D12_HEAP_FLAG_NONE, &bd, D3D12_RESOURCE_STATE_GENERIC_READ, nullptr, IID_PPV_ARGS(&uploadBuffer));
+
+        void* mappedData;
+        uploadBuffer->Map(0, nullptr, &mappedData);
+        memcpy(mappedData, data, sizeInBytes);
+        uploadBuffer->Unmap(0, nullptr);
+
+        core->resetCommandList();
+        Barrier::add(buffer, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_DEST, core->graphicsCommandList);
+        core->graphicsCommandList->CopyBufferRegion(buffer, 0, uploadBuffer, 0, sizeInBytes);
+        Barrier::add(buffer, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, core->graphicsCommandList);
+        core->finishCommandList();
+        core->flushGraphicsQueue();
+
+        uploadBuffer->Release();
+    }
+
+    // Copies the first 'count' elements of the buffer to the CPU through an intermediate readback buffer, waiting for
+    // the GPU to finish the work already submitted
+    void readback(Core* core, void* data, int count)
+    {
+        ID3D12Resource* readbackBuffer;
+        UINT64 sizeInBytes = (UINT64)elementSizeInBytes * count;
+
+        D3D12_HEAP_PROPERTIES heapDesc = {};
+        heapDesc.Type = D3D12_HEAP_TYPE_READBACK;
+
+        D3D12_RESOURCE_DESC bd = {};
+        bd.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        bd.Width = sizeInBytes;
+        bd.Height = 1;
+        bd.DepthOrArraySize = 1;
+        bd.MipLevels = 1;
+        bd.Format = DXGI_FORMAT_UNKNOWN;
+        bd.SampleDesc.Count = 1;
+        bd.SampleDesc.Quality = 0;
+        bd.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        bd.Flags = D3D12_RESOURCE_FLAG_NONE;
+        core->device->CreateCommittedResource(&heapDesc, D3D12_HEAP_FLAG_NONE, &bd, D3D12_RESOURCE_STATE_COPY_DEST, nullptr, IID_PPV_ARGS(&readbackBuffer));
+
+        core->resetCommandList();
+        Barrier::add(buffer, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE, core->graphicsCommandList);
+        core->graphicsCommandList->CopyBufferRegion(readbackBuffer, 0, buffer, 0, sizeInBytes);
+        Barrier::add(buffer, D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, core->graphicsCommandList);
+        core->finishCommandList();
+        core->flushGraphicsQueue();
+
+        D3D12_RANGE readRange = { 0, (SIZE_T)sizeInBytes };
+        D3D12_RANGE writtenRange = { 0, 0 };
+        void* mappedData;
+        readbackBuffer->Map(0, &readRange, &mappedData);
+        memcpy(data, mappedData, sizeInBytes);
+        readbackBuffer->Unmap(0, &writtenRange);
+
+        readbackBuffer->Release();
+    }
+
+    // Creates a UAV of the buffer at the next descriptor of the heap, for buffers reached through a descriptor table,
+    // and returns its index in the heap
+    int createUAV(Core* core, DescriptorHeap* heap)
+    {
+        writeUAV(core, heap->getNextCPUHandle());
+        return heap->used - 1;
+    }
+
+    // Rewrites the UAV at 'index' of the heap, once the buffer has been reallocated, keeping its place in a table
+    void createUAV(Core* core, DescriptorHeap* heap, int index)
+    {
+        writeUAV(core, heap->getCPUHandle(index));
+    }
+
+    // Writes a UAV of the whole buffer to the given descriptor
+    void writeUAV(Core* core, D3D12_CPU_DESCRIPTOR_HANDLE handle)
+    {
+        D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+        uavDesc.Format = DXGI_FORMAT_UNKNOWN;
+        uavDesc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+        uavDesc.Buffer.FirstElement = 0;
+        uavDesc.Buffer.NumElements = size;
+        uavDesc.Buffer.StructureByteStride = elementSizeInBytes;
+        core->device->CreateUnorderedAccessView(buffer, nullptr, &uavDesc, handle);
+    }
+
+    // Makes writes from previous dispatches visible to the next one
+    void barrier(Core* core)
+    {
+        D3D12_RESOURCE_BARRIER barrier = {};
+        barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+        barrier.UAV.pResource = buffer;
+        core->graphicsCommandList->ResourceBarrier(1, &barrier);
+    }
+
+    // Releases the buffer
+    void free()
+    {
+        if (buffer != nullptr)
+        {
+            buffer->Release();
+            buffer = nullptr;
+        }
+    }
+};
+
 // Template function 'use': Returns a static instance of type T
 template<typename T>
 T &use()
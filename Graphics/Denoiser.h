@@ -0,0 +1,625 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds the edge-aware denoiser, after the edge-avoiding a-trous wavelet filter of Dammertz et al. with the
+// edge-stopping functions of SVGF (Schied et al.). The path tracer writes four AOVs at the first hit of every camera
+// path, averaged over the pixel's samples like its colour: the albedo, the normal facing the camera, the distance along
+// the ray and the light emitted towards the camera. Lights and the environment seen directly have no albedo or normal,
+// so their emission is kept out of the filter. The emission is taken away from the image and what is left divided by
+// the albedo, so that texture detail is not blurred away, and each pixel's variance is estimated over the 3x3 pixels
+// around it. DENOISER_ITERATIONS passes of a 5x5 B3 spline kernel then
+// filter the irradiance with the taps spread 1, 2, 4, ... pixels apart, each tap weighted down by how far its normal,
+// its depth relative to the pixel's and its luminance relative to the pixel's standard deviation are from the
+// pixel's, and the variance is filtered along with it. The result is multiplied by the albedo again and the emission
+// added back. On the GPU the
+// passes are DenoisePrepare and DenoiseStep0 to DenoiseStep4 in PT.hlsl, ray generation shaders as every other pass of
+// the renderer is, and Denoiser is the CPU implementation they mirror, which is the reference for them and denoises
+// the headless renderer's images. It filters four pixels at a time with SSE2 where that is compiled in, on the worker
+// threads. verify() checks the SSE2 path against the scalar one and the filter on images with known answers, and
+// benchmark() measures megapixels per second.
+
+#include "Parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DENOISER_SSE2
+#include <emmintrin.h>
+#endif
+
+// Filter passes, the last spreading its taps 2^(DENOISER_ITERATIONS - 1) pixels apart
+static const int DENOISER_ITERATIONS = 5;
+// Edge-stopping: luminance differences in standard deviations, the exponent of the normals' cosine and relative depth
+// differences per pixel of distance
+static const float DENOISER_SIGMA_LUMINANCE = 4.0f;
+static const float DENOISER_SIGMA_NORMAL = 128.0f;
+static const float DENOISER_SIGMA_DEPTH = 0.05f;
+// Albedo the image is divided by at least, and the floor under the luminance's standard deviation
+static const float DENOISER_ALBEDO_EPSILON = 0.01f;
+static const float DENOISER_EPSILON = 1e-4f;
+// Depth written for camera rays leaving the scene, the ray length of RayGeneration
+static const float DENOISER_MISS_DEPTH = 1000.0f;
+
+// Throughput of the denoiser measured by Denoiser::benchmark
+struct DenoiserBenchmark
+{
+	int width = 0;
+	int height = 0;
+	double scalarMegapixelsPerSecond = 0;
+	double simdMegapixelsPerSecond = 0;  // The same as scalar where SSE2 is not compiled in
+	int threads = 0;
+};
+
+// e^x for x <= 0, to about 3e-6 relative: 2^(x log2 e) split at the nearest integer, with a polynomial for the
+// fraction. The SSE2 path computes the same
+static inline float denoiserExp(float x)
+{
+	float t = std::max(x, -80.0f) * 1.44269504f;
+	float i = nearbyintf(t);
+	float f = t - i;
+	float p = 1.0f + (f * (0.693147181f + (f * (0.240226507f + (f * (0.0555041087f + (f * (0.00961812911f + (f * 0.00133335581f)))))))));
+	int bits = ((int)i + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(float));
+	return p * scale;
+}
+
+#ifdef DENOISER_SSE2
+static inline __m128 denoiserExp(__m128 x)
+{
+	__m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.0f)), _mm_set1_ps(1.44269504f));
+	__m128i i = _mm_cvtps_epi32(t);
+	__m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(i));
+	__m128 p = _mm_add_ps(_mm_set1_ps(0.00961812911f), _mm_mul_ps(f, _mm_set1_ps(0.00133335581f)));
+	p = _mm_add_ps(_mm_set1_ps(0.0555041087f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(0.240226507f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(0.693147181f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(f, p));
+	return _mm_mul_ps(p, _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23)));
+}
+#endif
+
+class Denoiser
+{
+public:
+	int width = 0;
+	int height = 0;
+	bool simd = true;                   // Filters four pixels at a time where SSE2 is compiled in
+	// The AOVs as planes of a float per pixel, the normals made unit length
+	std::vector<float> albedo[3];
+	std::vector<float> normal[3];
+	std::vector<float> depth;
+	std::vector<float> emission[3];
+	// The irradiance and its variance, ping-ponged between the passes
+	std::vector<float> irradiance[2][3];
+	std::vector<float> variance[2];
+
+	// Denoises an image of RGB triples given its AOVs: albedo RGB and normal XYZ triples, a depth per pixel and
+	// emission RGB triples. Writes RGB triples
+	void denoise(const float* colour, const float* albedoIn, const float* normalIn, const float* depthIn, const float* emissionIn, int _width, int _height, std::vector<float>& out)
+	{
+		resize(_width, _height);
+		prepare(colour, albedoIn, normalIn, depthIn, emissionIn);
+		for (int iteration = 0; iteration < DENOISER_ITERATIONS; iteration++)
+		{
+			filter(iteration);
+		}
+		int last = DENOISER_ITERATIONS & 1;
+		out.resize(width * height * 3);
+		parallelFor(width * height, [&](int p)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					out[(p * 3) + c] = (irradiance[last][c][p] * std::max(albedo[c][p], DENOISER_ALBEDO_EPSILON)) + emission[c][p];
+				}
+			});
+	}
+
+	// Checks the SSE2 path against the scalar one, that an image's noise is removed without blurring across edges of
+	// the normals and depth or across the albedo's texture, that a light seen directly neither blurs nor darkens the
+	// surface around it, that a noise free linear gradient comes through unchanged, and the exponential. Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x6A09E667u;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+		std::vector<float> colour;
+		std::vector<float> albedoIn;
+		std::vector<float> normalIn;
+		std::vector<float> depthIn;
+		std::vector<float> emissionIn;
+		std::vector<float> truth;
+		auto allocate = [&](int w, int h)
+			{
+				colour.assign(w * h * 3, 0);
+				albedoIn.assign(w * h * 3, 0);
+				normalIn.assign(w * h * 3, 0);
+				depthIn.assign(w * h, 0);
+				emissionIn.assign(w * h * 3, 0);
+				truth.assign(w * h * 3, 0);
+			};
+		auto rmse = [&](const std::vector<float>& image, int x0, int x1, int y0, int y1, int w)
+			{
+				double sum = 0;
+				int count = 0;
+				for (int y = y0; y < y1; y++)
+				{
+					for (int x = x0; x < x1; x++)
+					{
+						for (int c = 0; c < 3; c++)
+						{
+							double e = image[(((y * w) + x) * 3) + c] - truth[(((y * w) + x) * 3) + c];
+							sum += e * e;
+							count++;
+						}
+					}
+				}
+				return sqrt(sum / count);
+			};
+
+		// Random AOVs and colours, on an image whose width leaves pixels over from the groups of four, come out of
+		// both paths the same
+		int w = 67;
+		int h = 45;
+		allocate(w, h);
+		for (int i = 0; i < w * h; i++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				colour[(i * 3) + c] = next() * (next() < 0.05f ? 20.0f : 1.0f);
+				albedoIn[(i * 3) + c] = next();
+				normalIn[(i * 3) + c] = next() - 0.5f;
+				emissionIn[(i * 3) + c] = next() < 0.1f ? colour[(i * 3) + c] * next() : 0;
+			}
+			depthIn[i] = 1.0f + next();
+		}
+		std::vector<float> scalarOut;
+		std::vector<float> simdOut;
+		simd = false;
+		denoise(colour.data(), albedoIn.data(), normalIn.data(), depthIn.data(), emissionIn.data(), w, h, scalarOut);
+		simd = true;
+		denoise(colour.data(), albedoIn.data(), normalIn.data(), depthIn.data(), emissionIn.data(), w, h, simdOut);
+		bool match = true;
+		for (unsigned int i = 0; i < scalarOut.size(); i++)
+		{
+			match = match && fabsf(scalarOut[i] - simdOut[i]) <= 1e-4f * (fabsf(scalarOut[i]) + 1e-3f);
+		}
+		failures += match ? 0 : 1;
+
+		// Two planes meeting down the middle, at different depths and facing different ways, lit differently and
+		// noisy. The noise goes, and neither plane's light bleeds into the columns beside the edge
+		w = 64;
+		h = 64;
+		allocate(w, h);
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				int p = (y * w) + x;
+				bool left = x < w / 2;
+				float value = 0.5f * (left ? 0.2f : 1.0f);
+				for (int c = 0; c < 3; c++)
+				{
+					truth[(p * 3) + c] = value;
+					colour[(p * 3) + c] = value * (1.0f + (1.6f * (next() - 0.5f)));
+					albedoIn[(p * 3) + c] = 0.5f;
+				}
+				normalIn[p * 3] = left ? 0 : 0.6f;
+				normalIn[(p * 3) + 2] = left ? 1.0f : 0.8f;
+				depthIn[p] = left ? 2.0f : 4.0f;
+			}
+		}
+		std::vector<float> denoised;
+		denoise(colour.data(), albedoIn.data(), normalIn.data(), depthIn.data(), emissionIn.data(), w, h, denoised);
+		bool edge = rmse(denoised, 0, w, 0, h, w) < 0.25 * rmse(colour, 0, w, 0, h, w);
+		for (int x = (w / 2) - 1; x <= w / 2; x++)
+		{
+			double sum = 0;
+			for (int y = 0; y < h; y++)
+			{
+				sum += denoised[((y * w) + x) * 3];
+			}
+			edge = edge && fabs((sum / h) - truth[x * 3]) < 0.05 * truth[x * 3];
+		}
+		failures += edge ? 0 : 1;
+
+		// A checkered albedo under even, noisy light keeps its checks
+		allocate(w, h);
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				int p = (y * w) + x;
+				float a = ((x / 4) + (y / 4)) % 2 == 0 ? 0.2f : 0.8f;
+				for (int c = 0; c < 3; c++)
+				{
+					truth[(p * 3) + c] = a * 0.5f;
+					colour[(p * 3) + c] = a * 0.5f * (1.0f + (1.6f * (next() - 0.5f)));
+					albedoIn[(p * 3) + c] = a;
+				}
+				normalIn[(p * 3) + 2] = 1.0f;
+				depthIn[p] = 3.0f;
+			}
+		}
+		denoise(colour.data(), albedoIn.data(), normalIn.data(), depthIn.data(), emissionIn.data(), w, h, denoised);
+		failures += rmse(denoised, 0, w, 0, h, w) < 0.25 * rmse(colour, 0, w, 0, h, w) ? 0 : 1;
+
+		// A bright light in the middle of a noisy ceiling, on the same plane, comes through exactly, and the ceiling
+		// beside it is not darkened by the light's pixels, which reflect nothing
+		allocate(w, h);
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				int p = (y * w) + x;
+				bool light = x >= 24 && x < 40 && y >= 24 && y < 40;
+				for (int c = 0; c < 3; c++)
+				{
+					truth[(p * 3) + c] = light ? 17.0f : 0.25f;
+					colour[(p * 3) + c] = light ? 17.0f : 0.25f * (1.0f + (1.6f * (next() - 0.5f)));
+					albedoIn[(p * 3) + c] = light ? 0 : 0.5f;
+					emissionIn[(p * 3) + c] = light ? 17.0f : 0;
+				}
+				normalIn[(p * 3) + 2] = light ? 0 : 1.0f;
+				depthIn[p] = 3.0f;
+			}
+		}
+		denoise(colour.data(), albedoIn.data(), normalIn.data(), depthIn.data(), emissionIn.data(), w, h, denoised);
+		bool lit = rmse(denoised, 24, 40, 24, 40, w) < 1e-4 && rmse(denoised, 0, w, 0, h, w) < 0.25 * rmse(colour, 0, w, 0, h, w);
+		double ring = 0;
+		for (int y = 22; y < 42; y++)
+		{
+			ring += denoised[((y * w) + 22) * 3] + denoised[((y * w) + 41) * 3];
+		}
+		failures += lit && fabs((ring / 40.0) - 0.25) < 0.0125 ? 0 : 1;
+
+		// A noise free gradient is symmetric about every pixel, so away from the borders the filter leaves it be
+		w = 160;
+		h = 160;
+		allocate(w, h);
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				int p = (y * w) + x;
+				for (int c = 0; c < 3; c++)
+				{
+					truth[(p * 3) + c] = 0.1f + (0.004f * (float)x) + (0.002f * (float)y);
+					colour[(p * 3) + c] = truth[(p * 3) + c];
+					albedoIn[(p * 3) + c] = 1.0f;
+				}
+				normalIn[(p * 3) + 2] = 1.0f;
+				depthIn[p] = 3.0f;
+			}
+		}
+		denoise(colour.data(), albedoIn.data(), normalIn.data(), depthIn.data(), emissionIn.data(), w, h, denoised);
+		failures += rmse(denoised, 64, 96, 64, 96, w) < 1e-4 ? 0 : 1;
+
+		// The exponential matches the library's, in both paths
+		bool exponential = true;
+		for (int i = 0; i <= 1000; i++)
+		{
+			float x = -80.0f * (float)i / 1000.0f;
+			float e = expf(x);
+			exponential = exponential && fabsf(denoiserExp(x) - e) <= 5e-6f * e;
+#ifdef DENOISER_SSE2
+			float lanes[4];
+			_mm_storeu_ps(lanes, denoiserExp(_mm_set1_ps(x)));
+			exponential = exponential && lanes[0] == denoiserExp(x);
+#endif
+		}
+		failures += exponential ? 0 : 1;
+		return failures;
+	}
+
+	// Measures the scalar and SSE2 paths on the worker threads denoising a noisy image of planes at the given size
+	DenoiserBenchmark benchmark(int benchmarkWidth = 1920, int benchmarkHeight = 1080, int repeats = 4)
+	{
+		DenoiserBenchmark result;
+		result.width = benchmarkWidth;
+		result.height = benchmarkHeight;
+		result.threads = workerThreadCount();
+		int pixels = benchmarkWidth * benchmarkHeight;
+		std::vector<float> colour(pixels * 3);
+		std::vector<float> albedoIn(pixels * 3);
+		std::vector<float> normalIn(pixels * 3, 0);
+		std::vector<float> depthIn(pixels);
+		std::vector<float> emissionIn(pixels * 3, 0);
+		unsigned int state = 0xBB67AE85u;
+		for (int p = 0; p < pixels; p++)
+		{
+			int band = ((p % benchmarkWidth) / 97) + ((p / benchmarkWidth) / 61);
+			for (int c = 0; c < 3; c++)
+			{
+				state = (state * 1664525u) + 1013904223u;
+				albedoIn[(p * 3) + c] = 0.2f + (0.1f * (float)(band % 7));
+				colour[(p * 3) + c] = albedoIn[(p * 3) + c] * (float)(state >> 8) / 16777216.0f;
+			}
+			normalIn[(p * 3) + (band % 3)] = 1.0f;
+			depthIn[p] = 1.0f + (float)(band % 5);
+		}
+		std::vector<float> out;
+		bool wasSimd = simd;
+		for (int path = 0; path < 2; path++)
+		{
+			simd = path == 1;
+			denoise(colour.data(), albedoIn.data(), normalIn.data(), depthIn.data(), emissionIn.data(), benchmarkWidth, benchmarkHeight, out);
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int r = 0; r < repeats; r++)
+			{
+				denoise(colour.data(), albedoIn.data(), normalIn.data(), depthIn.data(), emissionIn.data(), benchmarkWidth, benchmarkHeight, out);
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			double rate = ((double)pixels * repeats) / (seconds * 1e6);
+			if (path == 0)
+			{
+				result.scalarMegapixelsPerSecond = rate;
+			} else
+			{
+				result.simdMegapixelsPerSecond = rate;
+			}
+		}
+		simd = wasSimd;
+		return result;
+	}
+
+private:
+	// The 5x5 kernel's weights along each axis
+	static float kernel(int i)
+	{
+		static const float weights[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+		return weights[i + 2];
+	}
+
+	void resize(int _width, int _height)
+	{
+		width = _width;
+		height = _height;
+		int pixels = width * height;
+		for (int c = 0; c < 3; c++)
+		{
+			albedo[c].resize(pixels);
+			normal[c].resize(pixels);
+			emission[c].resize(pixels);
+			irradiance[0][c].resize(pixels);
+			irradiance[1][c].resize(pixels);
+		}
+		depth.resize(pixels);
+		variance[0].resize(pixels);
+		variance[1].resize(pixels);
+	}
+
+	float luminanceAt(int buffer, int p) const
+	{
+		return (0.2126f * irradiance[buffer][0][p]) + (0.7152f * irradiance[buffer][1][p]) + (0.0722f * irradiance[buffer][2][p]);
+	}
+
+	// Splits the inputs into planes, takes the emission away from the colour and divides what is left by the albedo,
+	// and estimates each pixel's variance from the luminance of the 3x3 pixels around it; mirrors DenoisePrepare
+	void prepare(const float* colour, const float* albedoIn, const float* normalIn, const float* depthIn, const float* emissionIn)
+	{
+		parallelFor(width * height, [&](int p)
+			{
+				float length = sqrtf((normalIn[p * 3] * normalIn[p * 3]) + (normalIn[(p * 3) + 1] * normalIn[(p * 3) + 1]) + (normalIn[(p * 3) + 2] * normalIn[(p * 3) + 2]));
+				float scale = length > 0 ? 1.0f / length : 0;
+				for (int c = 0; c < 3; c++)
+				{
+					albedo[c][p] = albedoIn[(p * 3) + c];
+					normal[c][p] = normalIn[(p * 3) + c] * scale;
+					emission[c][p] = emissionIn[(p * 3) + c];
+					irradiance[0][c][p] = (colour[(p * 3) + c] - emission[c][p]) / std::max(albedo[c][p], DENOISER_ALBEDO_EPSILON);
+				}
+				depth[p] = depthIn[p];
+			}, 4096);
+		parallelFor(width * height, [&](int p)
+			{
+				int x = p % width;
+				int y = p / width;
+				float sum = 0;
+				float sumSq = 0;
+				int count = 0;
+				for (int qy = std::max(y - 1, 0); qy <= std::min(y + 1, height - 1); qy++)
+				{
+					for (int qx = std::max(x - 1, 0); qx <= std::min(x + 1, width - 1); qx++)
+					{
+						float l = luminanceAt(0, (qy * width) + qx);
+						sum += l;
+						sumSq += l * l;
+						count++;
+					}
+				}
+				float mean = sum / (float)count;
+				variance[0][p] = std::max((sumSq / (float)count) - (mean * mean), 0.0f);
+			}, 4096);
+	}
+
+	// One a-trous pass from one ping-pong buffer to the other, over rows on the worker threads
+	void filter(int iteration)
+	{
+		int step = 1 << iteration;
+		parallelForChunks(height, [&](int start, int end, int)
+			{
+				for (int y = start; y < end; y++)
+				{
+					int x = 0;
+#ifdef DENOISER_SSE2
+					if (simd)
+					{
+						// Groups of four whose taps all lie inside the row; the pixels nearer the sides take the scalar path
+						int first = std::min(2 * step, width);
+						for (; x < first; x++)
+						{
+							filterPixel(iteration, x, y);
+						}
+						for (; x + 3 + (2 * step) < width; x += 4)
+						{
+							filterFour(iteration, x, y);
+						}
+					}
+#endif
+					for (; x < width; x++)
+					{
+						filterPixel(iteration, x, y);
+					}
+				}
+			}, 1);
+	}
+
+	// Filters a pixel; mirrors denoiseAtrous in PT.hlsl
+	void filterPixel(int iteration, int x, int y)
+	{
+		int step = 1 << iteration;
+		int src = iteration & 1;
+		int dst = src ^ 1;
+		int p = (y * width) + x;
+		float lp = luminanceAt(src, p);
+		float luminanceScale = -1.0f / ((DENOISER_SIGMA_LUMINANCE * sqrtf(variance[src][p])) + DENOISER_EPSILON);
+		float depthScale = -1.0f / (DENOISER_SIGMA_DEPTH * std::max(depth[p], DENOISER_EPSILON) * (float)step);
+		float sum[3] = { 0, 0, 0 };
+		float sumVariance = 0;
+		float sumWeight = 0;
+		for (int j = -2; j <= 2; j++)
+		{
+			int qy = y + (j * step);
+			if (qy < 0 || qy >= height)
+			{
+				continue;
+			}
+			for (int i = -2; i <= 2; i++)
+			{
+				int qx = x + (i * step);
+				if (qx < 0 || qx >= width)
+				{
+					continue;
+				}
+				int q = (qy * width) + qx;
+				float w = kernel(i) * kernel(j);
+				if (i != 0 || j != 0)
+				{
+					float cosine = std::max((normal[0][p] * normal[0][q]) + (normal[1][p] * normal[1][q]) + (normal[2][p] * normal[2][q]), 0.0f);
+					float normalWeight = cosine;
+					for (int k = 0; k < 7; k++)
+					{
+						normalWeight *= normalWeight;
+					}
+					float distance = sqrtf((float)((i * i) + (j * j)));
+					float exponent = (fabsf(luminanceAt(src, q) - lp) * luminanceScale) + (fabsf(depth[q] - depth[p]) * depthScale / distance);
+					w *= normalWeight * denoiserExp(exponent);
+				}
+				for (int c = 0; c < 3; c++)
+				{
+					sum[c] += w * irradiance[src][c][q];
+				}
+				sumVariance += w * w * variance[src][q];
+				sumWeight += w;
+			}
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			irradiance[dst][c][p] = sum[c] / sumWeight;
+		}
+		variance[dst][p] = sumVariance / (sumWeight * sumWeight);
+	}
+
+#ifdef DENOISER_SSE2
+	// Filters pixels x to x + 3 of a row, all of whose taps lie inside the row, as filterPixel does each
+	void filterFour(int iteration, int x, int y)
+	{
+		int step = 1 << iteration;
+		int src = iteration & 1;
+		int dst = src ^ 1;
+		int p = (y * width) + x;
+		const __m128 lr = _mm_set1_ps(0.2126f);
+		const __m128 lg = _mm_set1_ps(0.7152f);
+		const __m128 lb = _mm_set1_ps(0.0722f);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+		__m128 ir[3];
+		__m128 n[3];
+		for (int c = 0; c < 3; c++)
+		{
+			ir[c] = _mm_loadu_ps(&irradiance[src][c][p]);
+			n[c] = _mm_loadu_ps(&normal[c][p]);
+		}
+		__m128 lp = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lr, ir[0]), _mm_mul_ps(lg, ir[1])), _mm_mul_ps(lb, ir[2]));
+		__m128 zp = _mm_loadu_ps(&depth[p]);
+		__m128 luminanceScale = _mm_div_ps(_mm_set1_ps(-1.0f), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(DENOISER_SIGMA_LUMINANCE), _mm_sqrt_ps(_mm_loadu_ps(&variance[src][p]))), _mm_set1_ps(DENOISER_EPSILON)));
+		__m128 depthScale = _mm_div_ps(_mm_set1_ps(-1.0f), _mm_mul_ps(_mm_set1_ps(DENOISER_SIGMA_DEPTH * (float)step), _mm_max_ps(zp, _mm_set1_ps(DENOISER_EPSILON))));
+		__m128 sum[3] = { zero, zero, zero };
+		__m128 sumVariance = zero;
+		__m128 sumWeight = zero;
+		for (int j = -2; j <= 2; j++)
+		{
+			int qy = y + (j * step);
+			if (qy < 0 || qy >= height)
+			{
+				continue;
+			}
+			for (int i = -2; i <= 2; i++)
+			{
+				int q = (qy * width) + x + (i * step);
+				__m128 w = _mm_set1_ps(kernel(i) * kernel(j));
+				__m128 iq[3];
+				for (int c = 0; c < 3; c++)
+				{
+					iq[c] = _mm_loadu_ps(&irradiance[src][c][q]);
+				}
+				if (i != 0 || j != 0)
+				{
+					__m128 cosine = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], _mm_loadu_ps(&normal[0][q])), _mm_mul_ps(n[1], _mm_loadu_ps(&normal[1][q]))), _mm_mul_ps(n[2], _mm_loadu_ps(&normal[2][q])));
+					__m128 normalWeight = _mm_max_ps(cosine, zero);
+					for (int k = 0; k < 7; k++)
+					{
+						normalWeight = _mm_mul_ps(normalWeight, normalWeight);
+					}
+					__m128 lq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lr, iq[0]), _mm_mul_ps(lg, iq[1])), _mm_mul_ps(lb, iq[2]));
+					__m128 luminanceTerm = _mm_mul_ps(_mm_and_ps(_mm_sub_ps(lq, lp), signMask), luminanceScale);
+					__m128 depthTerm = _mm_div_ps(_mm_mul_ps(_mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&depth[q]), zp), signMask), depthScale), _mm_set1_ps(sqrtf((float)((i * i) + (j * j)))));
+					w = _mm_mul_ps(w, _mm_mul_ps(normalWeight, denoiserExp(_mm_add_ps(luminanceTerm, depthTerm))));
+				}
+				for (int c = 0; c < 3; c++)
+				{
+					sum[c] = _mm_add_ps(sum[c], _mm_mul_ps(w, iq[c]));
+				}
+				sumVariance = _mm_add_ps(sumVariance, _mm_mul_ps(_mm_mul_ps(w, w), _mm_loadu_ps(&variance[src][q])));
+				sumWeight = _mm_add_ps(sumWeight, w);
+			}
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			_mm_storeu_ps(&irradiance[dst][c][p], _mm_div_ps(sum[c], sumWeight));
+		}
+		_mm_storeu_ps(&variance[dst][p], _mm_div_ps(sumVariance, _mm_mul_ps(sumWeight, sumWeight)));
+	}
+#endif
+};
@@ -0,0 +1,432 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds dynamic resolution, which renders the frames of a moving camera at a lower resolution. With it on,
+// while the camera moves each frame starts accumulation again and the path tracing pass samples only the top left
+// renderWidth x renderHeight pixels of the screen's buffers, one camera path each through the point of its pixel offset
+// by the frame's jitter, which steps along the Halton sequence in bases 2 and 3. The Upsample pass then fills the
+// screen from them in place of the tonemap pass: a screen pixel takes the four samples around its centre weighted
+// bilinearly by where they were taken, keeping only those that show the same surface as the nearest, by distance and
+// normal from the first-hit AOVs, so that edges stay sharp. Once the camera stops, the screen is rendered whole again
+// and accumulates. The resolution follows the measured time of the frames: the cost of a sample is estimated from
+// each frame's time over its samples, rising at once when a frame runs long and falling smoothly, and the next frame
+// takes the scale whose samples fit the budget, a multiple of RESOLUTION_SCALE_STEP that grows by at most
+// RESOLUTION_MAX_GROWTH a frame. Upsample in PT.hlsl mirrors upsample, and verify() checks the controller, the jitter
+// and the upsampler.
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Time the GPU work of a frame at a lower resolution aims for, leaving a 60 Hz frame room for the CPU and presenting
+static const float RESOLUTION_BUDGET_MILLISECONDS = 14.0f;
+// Smallest scale of the screen's sides, the step scales are taken in and the scale the first frame takes
+static const float RESOLUTION_MIN_SCALE = 0.25f;
+static const float RESOLUTION_SCALE_STEP = 0.05f;
+static const float RESOLUTION_START_SCALE = 0.5f;
+// Most a frame's scale grows over the last frame's
+static const float RESOLUTION_MAX_GROWTH = 1.25f;
+// Weight of a frame's sample cost in the estimate when it is lower than the estimate
+static const float RESOLUTION_COST_SMOOTHING = 0.25f;
+// Frames the jitter steps through before it repeats
+static const int RESOLUTION_JITTER_FRAMES = 16;
+// Distance from the nearest sample's, relative to it, within which a sample shows the same surface, and the cosine
+// its normal must be within of the nearest sample's
+static const float RESOLUTION_DEPTH_TOLERANCE = 0.05f;
+static const float RESOLUTION_NORMAL_THRESHOLD = 0.9f;
+
+// A sample of the path tracing pass at a lower resolution, as Upsample reads it from the accumulation and the AOVs:
+// its colour and the distance and normal of its first hit, no normal for lights and rays leaving the scene
+struct ResolutionSample
+{
+	float colour[3] = {};
+	float depth = 0;
+	float normal[3] = {};
+};
+
+// The controller run against a synthetic frame time by DynamicResolution::simulate: the scale and size of the last
+// frame and its time
+struct ResolutionSimulation
+{
+	float scale = 0;
+	int renderWidth = 0;
+	int renderHeight = 0;
+	float frameMilliseconds = 0;
+};
+
+class DynamicResolution
+{
+public:
+	int width = 0;
+	int height = 0;
+	float budgetMilliseconds = RESOLUTION_BUDGET_MILLISECONDS;
+	float scale = RESOLUTION_START_SCALE;
+	int renderWidth = 0;
+	int renderHeight = 0;
+	float sampleMilliseconds = 0;       // Estimated cost of a sample, 0 until a frame has been measured
+	int lastSamples = 0;                // Samples of the last frame if it was rendered at a lower resolution, otherwise 0
+
+	// Sets the screen size, starting at RESOLUTION_START_SCALE until the controller has measured a frame
+	void init(int _width, int _height)
+	{
+		width = _width;
+		height = _height;
+		scale = RESOLUTION_START_SCALE;
+		sampleMilliseconds = 0;
+		lastSamples = 0;
+		resize();
+	}
+
+	// Marks the last frame as rendered whole, so that its time is not taken for a lower resolution frame's. The scale
+	// is kept for when the camera moves again
+	void restart()
+	{
+		lastSamples = 0;
+	}
+
+	// Updates the sample cost estimate from the measured time of the last frame, if it was rendered at a lower
+	// resolution, and from it the scale of the next
+	void adapt(float frameMilliseconds)
+	{
+		if (lastSamples == 0 || frameMilliseconds <= 0)
+		{
+			return;
+		}
+		float cost = frameMilliseconds / (float)lastSamples;
+		if (sampleMilliseconds <= 0 || cost > sampleMilliseconds)
+		{
+			sampleMilliseconds = cost;
+		}
+		else
+		{
+			sampleMilliseconds = sampleMilliseconds + ((cost - sampleMilliseconds) * RESOLUTION_COST_SMOOTHING);
+		}
+		float fit = sqrtf(budgetMilliseconds / (sampleMilliseconds * (float)(width * height)));
+		fit = std::min(fit, std::min(scale * RESOLUTION_MAX_GROWTH, 1.0f));
+		scale = std::max(floorf((fit / RESOLUTION_SCALE_STEP) + 1e-4f) * RESOLUTION_SCALE_STEP, RESOLUTION_MIN_SCALE);
+		resize();
+	}
+
+	// Takes the next frame at a lower resolution, at renderWidth x renderHeight, so that its time is measured
+	void schedule()
+	{
+		lastSamples = renderWidth * renderHeight;
+	}
+
+	// Sub-pixel offset of the samples of a frame, in [0, 1) of a pixel: the Halton sequence in bases 2 and 3, from its
+	// second point, as its first sits on the pixel's corner
+	static void jitter(int frame, float& x, float& y)
+	{
+		x = radicalInverse((frame % RESOLUTION_JITTER_FRAMES) + 1, 2);
+		y = radicalInverse((frame % RESOLUTION_JITTER_FRAMES) + 1, 3);
+	}
+
+	// Fills a width x height screen of colours from samples taken at renderWidth x renderHeight, laid out in rows of
+	// stride samples, each through its pixel's point offset by the jitter. Each screen pixel weights the four samples
+	// around its centre bilinearly by where they were taken, and if edgeAware keeps only those showing the same surface
+	// as the nearest of them. Mirrors Upsample in PT.hlsl
+	void upsample(const ResolutionSample* samples, int stride, int sampleWidth, int sampleHeight, float jitterX, float jitterY,
+		float* out, bool edgeAware = true) const
+	{
+		float scaleX = (float)sampleWidth / (float)width;
+		float scaleY = (float)sampleHeight / (float)height;
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				float sx = ((((float)x + 0.5f) * scaleX) - jitterX);
+				float sy = ((((float)y + 0.5f) * scaleY) - jitterY);
+				int x0 = (int)floorf(sx);
+				int y0 = (int)floorf(sy);
+				float fx = sx - (float)x0;
+				float fy = sy - (float)y0;
+				const ResolutionSample& nearest = samples[index(x0 + (fx >= 0.5f ? 1 : 0), y0 + (fy >= 0.5f ? 1 : 0), stride, sampleWidth, sampleHeight)];
+				float colour[3] = {};
+				float total = 0;
+				for (int i = 0; i < 4; i++)
+				{
+					int dx = i & 1;
+					int dy = i >> 1;
+					const ResolutionSample& sample = samples[index(x0 + dx, y0 + dy, stride, sampleWidth, sampleHeight)];
+					float w = (dx == 1 ? fx : 1.0f - fx) * (dy == 1 ? fy : 1.0f - fy);
+					if (edgeAware && similar(sample, nearest) == false)
+					{
+						w = 0;
+					}
+					for (int c = 0; c < 3; c++)
+					{
+						colour[c] += sample.colour[c] * w;
+					}
+					total += w;
+				}
+				for (int c = 0; c < 3; c++)
+				{
+					out[(((y * width) + x) * 3) + c] = colour[c] / total;
+				}
+			}
+		}
+	}
+
+	// Runs the controller for a number of frames on a screen whose frames take a fixed time plus a time per megapixel
+	// sampled, with multiplicative noise of the given amplitude, and returns how it ends up
+	ResolutionSimulation simulate(int simulationWidth, int simulationHeight, float fixedMilliseconds, float megapixelMilliseconds,
+		float noise, int frames)
+	{
+		init(simulationWidth, simulationHeight);
+		ResolutionSimulation result;
+		unsigned int state = 0x9E3779B9u;
+		for (int i = 0; i < frames; i++)
+		{
+			schedule();
+			state = (state * 1664525u) + 1013904223u;
+			float jitterNoise = 1.0f + (noise * ((((float)(state >> 8) / 16777216.0f) * 2.0f) - 1.0f));
+			float megapixels = (float)(renderWidth * renderHeight) / 1e6f;
+			result.scale = scale;
+			result.renderWidth = renderWidth;
+			result.renderHeight = renderHeight;
+			result.frameMilliseconds = (fixedMilliseconds + (megapixels * megapixelMilliseconds)) * jitterNoise;
+			adapt(result.frameMilliseconds);
+		}
+		return result;
+	}
+
+	// Checks that the controller settles within the budget on a heavy screen, keeps to the smallest scale on one too
+	// heavy to fit, renders a light one whole, recovers the budget within two frames of the scene getting four times
+	// heavier and keeps its sizes within the screen; that the jitter stays within a pixel and covers it evenly; and that
+	// the upsampler keeps a flat image flat, returns the samples at full resolution with centred jitter, reconstructs a
+	// linear ramp exactly away from the borders, and keeps a depth edge sharp where plain bilinear filtering blurs it.
+	// Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+
+		// Controller
+		ResolutionSimulation heavy = simulate(3840, 2160, 2.0f, 12.0f, 0.05f, 120);
+		failures += heavy.frameMilliseconds <= budgetMilliseconds * 1.1f && heavy.frameMilliseconds >= budgetMilliseconds * 0.5f ? 0 : 1;
+		failures += heavy.scale < 1.0f && heavy.renderWidth == (int)lroundf(3840 * heavy.scale) ? 0 : 1;
+		ResolutionSimulation heaviest = simulate(3840, 2160, 2.0f, 48.0f, 0.05f, 120);
+		failures += heaviest.scale == RESOLUTION_MIN_SCALE && heaviest.renderWidth == 960 ? 0 : 1;
+		ResolutionSimulation light = simulate(1280, 720, 1.0f, 2.0f, 0.05f, 60);
+		failures += light.scale == 1.0f && light.renderWidth == 1280 && light.renderHeight == 720 ? 0 : 1;
+		simulate(1920, 1080, 2.0f, 20.0f, 0.0f, 100);
+		bool recovered = true;
+		for (int i = 0; i < 20; i++)
+		{
+			schedule();
+			float frameMilliseconds = 2.0f + ((float)(renderWidth * renderHeight) / 1e6f * 80.0f);
+			adapt(frameMilliseconds);
+			recovered = recovered && (i < 2 || frameMilliseconds <= budgetMilliseconds * 1.05f);
+			recovered = recovered && scale >= RESOLUTION_MIN_SCALE && renderWidth >= 1 && renderWidth <= width && renderHeight >= 1 && renderHeight <= height;
+		}
+		failures += recovered ? 0 : 1;
+		init(1920, 1080);
+		schedule();
+		adapt(0.01f);
+		failures += scale <= RESOLUTION_START_SCALE * RESOLUTION_MAX_GROWTH ? 0 : 1;
+		init(1, 1);
+		failures += renderWidth == 1 && renderHeight == 1 ? 0 : 1;
+
+		// Jitter: within the pixel, every frame of a cycle different, the cycle's mean at the pixel's centre and each of
+		// the pixel's quarters taking at least three of its sixteen offsets
+		float meanX = 0;
+		float meanY = 0;
+		int quarters[4] = {};
+		bool jitterCorrect = true;
+		for (int i = 0; i < RESOLUTION_JITTER_FRAMES; i++)
+		{
+			float x;
+			float y;
+			jitter(i, x, y);
+			jitterCorrect = jitterCorrect && x > 0 && x < 1 && y > 0 && y < 1;
+			for (int j = 0; j < i; j++)
+			{
+				float px;
+				float py;
+				jitter(j, px, py);
+				jitterCorrect = jitterCorrect && (px != x || py != y);
+			}
+			quarters[(x >= 0.5f ? 1 : 0) + (y >= 0.5f ? 2 : 0)]++;
+			meanX += x / (float)RESOLUTION_JITTER_FRAMES;
+			meanY += y / (float)RESOLUTION_JITTER_FRAMES;
+		}
+		for (int q : quarters)
+		{
+			jitterCorrect = jitterCorrect && q >= 3;
+		}
+		failures += jitterCorrect && fabsf(meanX - 0.5f) < 0.05f && fabsf(meanY - 0.5f) < 0.05f ? 0 : 1;
+
+		// Upsampler, from 40 x 24 samples laid out in rows of 64 up to 100 x 60
+		const int sampleWidth = 40;
+		const int sampleHeight = 24;
+		const int stride = 64;
+		width = 100;
+		height = 60;
+		std::vector<ResolutionSample> samples(stride * sampleHeight);
+		std::vector<float> out(width * height * 3);
+		float jx;
+		float jy;
+		jitter(5, jx, jy);
+		for (int y = 0; y < sampleHeight; y++)
+		{
+			for (int x = 0; x < sampleWidth; x++)
+			{
+				ResolutionSample& s = samples[(y * stride) + x];
+				s.colour[0] = 0.25f;
+				s.colour[1] = 0.5f;
+				s.colour[2] = 1.0f;
+				s.depth = 3.0f + ((float)x * 0.01f);
+				s.normal[2] = 1.0f;
+			}
+		}
+		upsample(samples.data(), stride, sampleWidth, sampleHeight, jx, jy, out.data());
+		bool flat = true;
+		for (int i = 0; i < width * height; i++)
+		{
+			flat = flat && fabsf(out[i * 3] - 0.25f) < 1e-6f && fabsf(out[(i * 3) + 1] - 0.5f) < 1e-6f && fabsf(out[(i * 3) + 2] - 1.0f) < 1e-6f;
+		}
+		failures += flat ? 0 : 1;
+
+		// At full resolution with the jitter at the pixel's centre each pixel is its own sample
+		std::vector<ResolutionSample> full(width * height);
+		for (int i = 0; i < width * height; i++)
+		{
+			full[i].colour[0] = (float)(i % 7);
+			full[i].colour[1] = (float)(i % 11);
+			full[i].colour[2] = (float)(i % 13);
+			full[i].depth = 1.0f + (float)(i % 5);
+			full[i].normal[1] = 1.0f;
+		}
+		upsample(full.data(), width, width, height, 0.5f, 0.5f, out.data());
+		bool identity = true;
+		for (int i = 0; i < width * height; i++)
+		{
+			identity = identity && out[i * 3] == full[i].colour[0] && out[(i * 3) + 1] == full[i].colour[1] && out[(i * 3) + 2] == full[i].colour[2];
+		}
+		failures += identity ? 0 : 1;
+
+		// A ramp in x comes back exactly where all four samples are inside the image
+		for (int y = 0; y < sampleHeight; y++)
+		{
+			for (int x = 0; x < sampleWidth; x++)
+			{
+				samples[(y * stride) + x].colour[0] = ((float)x + jx) / (float)sampleWidth;
+			}
+		}
+		upsample(samples.data(), stride, sampleWidth, sampleHeight, jx, jy, out.data());
+		bool ramp = true;
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 4; x < width - 4; x++)
+			{
+				ramp = ramp && fabsf(out[((y * width) + x) * 3] - (((float)x + 0.5f) / (float)width)) < 1e-4f;
+			}
+		}
+		failures += ramp ? 0 : 1;
+
+		// A near white surface on the left and a far black one on the right: edge-aware upsampling gives every screen
+		// pixel the colour of the surface of the sample nearest its centre, bilinear filtering greys the pixels along
+		// the edge
+		const int edge = 17;
+		for (int y = 0; y < sampleHeight; y++)
+		{
+			for (int x = 0; x < sampleWidth; x++)
+			{
+				ResolutionSample& s = samples[(y * stride) + x];
+				float c = x < edge ? 1.0f : 0.0f;
+				s.colour[0] = c;
+				s.colour[1] = c;
+				s.colour[2] = c;
+				s.depth = x < edge ? 1.0f : 10.0f;
+			}
+		}
+		upsample(samples.data(), stride, sampleWidth, sampleHeight, jx, jy, out.data());
+		bool sharp = true;
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				int nearest = (int)floorf((((float)x + 0.5f) * (float)sampleWidth / (float)width) - jx + 0.5f);
+				sharp = sharp && out[((y * width) + x) * 3] == (nearest < edge ? 1.0f : 0.0f);
+			}
+		}
+		upsample(samples.data(), stride, sampleWidth, sampleHeight, jx, jy, out.data(), false);
+		bool blurred = false;
+		for (int i = 0; i < width * height; i++)
+		{
+			blurred = blurred || (out[i * 3] > 0.0f && out[i * 3] < 1.0f);
+		}
+		failures += sharp && blurred ? 0 : 1;
+		return failures;
+	}
+
+private:
+	// Sets the size frames are rendered at from the scale
+	void resize()
+	{
+		renderWidth = std::min(std::max((int)lroundf((float)width * scale), 1), std::max(width, 1));
+		renderHeight = std::min(std::max((int)lroundf((float)height * scale), 1), std::max(height, 1));
+	}
+
+	// Index of a sample, clamped to the samples taken
+	static int index(int x, int y, int stride, int sampleWidth, int sampleHeight)
+	{
+		return (std::min(std::max(y, 0), sampleHeight - 1) * stride) + std::min(std::max(x, 0), sampleWidth - 1);
+	}
+
+	// Whether a sample shows the same surface as the nearest sample: a distance within RESOLUTION_DEPTH_TOLERANCE of it
+	// and, where both have normals, a normal within RESOLUTION_NORMAL_THRESHOLD, or neither having one
+	static bool similar(const ResolutionSample& sample, const ResolutionSample& nearest)
+	{
+		if (fabsf(sample.depth - nearest.depth) > RESOLUTION_DEPTH_TOLERANCE * nearest.depth)
+		{
+			return false;
+		}
+		float cosine = (sample.normal[0] * nearest.normal[0]) + (sample.normal[1] * nearest.normal[1]) + (sample.normal[2] * nearest.normal[2]);
+		float sampleLength = (sample.normal[0] * sample.normal[0]) + (sample.normal[1] * sample.normal[1]) + (sample.normal[2] * sample.normal[2]);
+		float nearestLength = (nearest.normal[0] * nearest.normal[0]) + (nearest.normal[1] * nearest.normal[1]) + (nearest.normal[2] * nearest.normal[2]);
+		if (sampleLength <= 0 || nearestLength <= 0)
+		{
+			return sampleLength <= 0 && nearestLength <= 0;
+		}
+		return cosine >= RESOLUTION_NORMAL_THRESHOLD * sqrtf(sampleLength * nearestLength);
+	}
+
+	// The digits of i in the given base mirrored about the radix point
+	static float radicalInverse(int i, int base)
+	{
+		float inverse = 1.0f / (float)base;
+		float digit = inverse;
+		float result = 0;
+		while (i > 0)
+		{
+			result += (float)(i % base) * digit;
+			i /= base;
+			digit *= inverse;
+		}
+		return result;
+	}
+};
@@ -0,0 +1,255 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file implements importance sampling of the equirectangular environment map. A piecewise
+// constant 2D distribution is built over the pixels, weighted by luminance and sin(theta), and
+// stored as one conditional CDF per row followed by the marginal CDF over rows. PT.hlsl samples
+// it by inverting the CDFs and evaluates the matching solid angle pdf.
+
+#include "Math.h"
+#include "Parallel.h"
+#include <vector>
+
+#define ENVIRONMENT_PI 3.14159265358979f
+
+class EnvironmentDistribution
+{
+public:
+	int width = 0;
+	int height = 0;
+	// height rows of (width + 1) conditional CDF values, followed by (height + 1) marginal CDF values
+	std::vector<float> cdfs;
+
+	// Builds the distribution from linear RGB(A) pixels stored as floats, rows from top (theta = 0) to bottom
+	// Each pixel's weight is the largest luminance in its 3x3 neighbourhood so that bilinear filtering in
+	// the shader never returns radiance from a pixel that cannot be sampled
+	void build(const float* pixels, int _width, int _height, int channels)
+	{
+		width = _width;
+		height = _height;
+		cdfs.assign((height * (width + 1)) + height + 1, 0);
+		std::vector<float> lum(width * height);
+		parallelFor(width * height, [&](int i)
+			{
+				const float* c = &pixels[i * channels];
+				lum[i] = channels >= 3 ? (0.2126f * c[0]) + (0.7152f * c[1]) + (0.0722f * c[2]) : c[0];
+			});
+		std::vector<double> rowSums(height);
+		parallelFor(height, [&](int y)
+			{
+				float sinTheta = sinf(ENVIRONMENT_PI * ((float)y + 0.5f) / (float)height);
+				float* row = &cdfs[y * (width + 1)];
+				double sum = 0;
+				row[0] = 0;
+				for (int x = 0; x < width; x++)
+				{
+					float w = 0;
+					for (int dy = -1; dy <= 1; dy++)
+					{
+						int yy = clamp(y + dy, 0, height - 1);
+						for (int dx = -1; dx <= 1; dx++)
+						{
+							int xx = (x + dx + width) % width;
+							w = std::max(w, lum[(yy * width) + xx]);
+						}
+					}
+					sum += (double)std::max(w, 0.0f) * (double)sinTheta;
+					row[x + 1] = (float)sum;
+				}
+				rowSums[y] = sum;
+				// Normalise the row, falling back to uniform if it is black
+				for (int x = 1; x <= width; x++)
+				{
+					row[x] = sum > 0 ? (float)((double)row[x] / sum) : (float)x / (float)width;
+				}
+				row[width] = 1.0f;
+			}, 1);
+		float* marginal = &cdfs[height * (width + 1)];
+		double total = 0;
+		marginal[0] = 0;
+		for (int y = 0; y < height; y++)
+		{
+			total += rowSums[y];
+			marginal[y + 1] = (float)total;
+		}
+		for (int y = 1; y <= height; y++)
+		{
+			marginal[y] = total > 0 ? (float)((double)marginal[y] / total) : (float)y / (float)height;
+		}
+		marginal[height] = 1.0f;
+	}
+
+	// Returns 8 bit pixels as the values the shader reads from them in an R8G8B8A8_UNORM texture, for build
+	static std::vector<float> unorm(const unsigned char* pixels, int count)
+	{
+		std::vector<float> values(count);
+		for (int i = 0; i < count; i++)
+		{
+			values[i] = (float)pixels[i] / 255.0f;
+		}
+		return values;
+	}
+
+	// Returns the index i with cdf[i] <= u < cdf[i + 1] in a CDF of n + 1 values
+	static int findInterval(const float* cdf, int n, float u)
+	{
+		int first = 0;
+		int last = n;
+		while (last - first > 1)
+		{
+			int mid = (first + last) / 2;
+			if (cdf[mid] <= u)
+			{
+				first = mid;
+			} else
+			{
+				last = mid;
+			}
+		}
+		return first;
+	}
+
+	// Returns the coordinate at offset t into cell i of n cells, nudged by a few ulps where rounding would otherwise put
+	// it in a neighbouring cell, so pdfUV finds the cell that was sampled; mirrors environmentCellCoordinate in PT.hlsl
+	static float cellCoordinate(int i, float t, int n)
+	{
+		float c = ((float)i + t) / (float)n;
+		while ((int)(c * (float)n) > i)
+		{
+			c = nextafterf(c, 0.0f);
+		}
+		while ((int)(c * (float)n) < i)
+		{
+			c = nextafterf(c, 1.0f);
+		}
+		return c;
+	}
+
+	// Maps two uniform random numbers to texture coordinates (u, v) and returns the pdf with respect to (u, v); mirrors sampleEnvironmentUV in PT.hlsl
+	float sampleUV(float r1, float r2, float& u, float& v) const
+	{
+		const float* marginal = &cdfs[height * (width + 1)];
+		int y = findInterval(marginal, height, r1);
+		float dv = marginal[y + 1] - marginal[y];
+		const float* row = &cdfs[y * (width + 1)];
+		int x = findInterval(row, width, r2);
+		float du = row[x + 1] - row[x];
+		v = cellCoordinate(y, dv > 0 ? (r1 - marginal[y]) / dv : 0.5f, height);
+		u = cellCoordinate(x, du > 0 ? (r2 - row[x]) / du : 0.5f, width);
+		return dv * du * (float)width * (float)height;
+	}
+
+	// Returns the pdf with respect to (u, v) of the pixel containing the given texture coordinates; mirrors environmentPdfUV in PT.hlsl
+	float pdfUV(float u, float v) const
+	{
+		int x = clamp((int)(u * (float)width), 0, width - 1);
+		int y = clamp((int)(v * (float)height), 0, height - 1);
+		const float* marginal = &cdfs[height * (width + 1)];
+		const float* row = &cdfs[y * (width + 1)];
+		return (marginal[y + 1] - marginal[y]) * (row[x + 1] - row[x]) * (float)width * (float)height;
+	}
+
+	// Converts texture coordinates to a direction using the same mapping as evaluateEnvironmentMap in PT.hlsl
+	static Vec3 uvToDirection(float u, float v)
+	{
+		float phi = u * 2.0f * ENVIRONMENT_PI;
+		float theta = v * ENVIRONMENT_PI;
+		return Vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+	}
+
+	// Converts a (u, v) pdf to a solid angle pdf
+	static float toSolidAngle(float pdf, float v)
+	{
+		float sinTheta = sinf(v * ENVIRONMENT_PI);
+		return sinTheta > 0 ? pdf / (2.0f * ENVIRONMENT_PI * ENVIRONMENT_PI * sinTheta) : 0;
+	}
+
+	// Checks the distribution. The solid angle pdf is integrated over the sphere with a fine midpoint rule and must
+	// give one, and a histogram of samples over the pixels must match each pixel's probability.
+	// The pdf returned by sampleUV must also match pdfUV at the sampled point.
+	// Returns the largest of the integration error, the relative pdf mismatch and the per pixel probability difference beyond the expected noise
+	float verify(int samples = 1 << 20) const
+	{
+		if (width == 0 || height == 0)
+		{
+			return 0;
+		}
+		// The integration cells subdivide the pixels exactly, as the pdf is constant over each pixel and a cell that
+		// straddled two would be counted wholly in one of them
+		int resX = width * std::max(4, (256 + width - 1) / width);
+		int resY = height * std::max(4, (256 + height - 1) / height);
+		std::vector<double> rowIntegrals(resY, 0);
+		parallelFor(resY, [&](int y)
+			{
+				float theta0 = ENVIRONMENT_PI * (float)y / (float)resY;
+				float theta1 = ENVIRONMENT_PI * (float)(y + 1) / (float)resY;
+				double solidAngle = (2.0 * ENVIRONMENT_PI / (double)resX) * ((double)cosf(theta0) - (double)cosf(theta1));
+				double sum = 0;
+				for (int x = 0; x < resX; x++)
+				{
+					float u = ((float)x + 0.5f) / (float)resX;
+					float v = ((float)y + 0.5f) / (float)resY;
+					sum += (double)toSolidAngle(pdfUV(u, v), v) * solidAngle;
+				}
+				rowIntegrals[y] = sum;
+			}, 1);
+		double integral = 0;
+		for (int y = 0; y < resY; y++)
+		{
+			integral += rowIntegrals[y];
+		}
+		float error = (float)fabs(integral - 1.0);
+
+		std::vector<double> histogram(width * height, 0);
+		unsigned int state = 12345u;
+		for (int i = 0; i < samples; i++)
+		{
+			state = (state * 1664525u) + 1013904223u;
+			float r1 = (float)(state >> 8) / 16777216.0f;
+			state = (state * 1664525u) + 1013904223u;
+			float r2 = (float)(state >> 8) / 16777216.0f;
+			float u;
+			float v;
+			float pdf = sampleUV(r1, r2, u, v);
+			int x = clamp((int)(u * (float)width), 0, width - 1);
+			int y = clamp((int)(v * (float)height), 0, height - 1);
+			error = std::max(error, fabsf(pdf - pdfUV(u, v)) / std::max(pdf, 1e-6f));
+			histogram[(y * width) + x] += 1.0 / (double)samples;
+		}
+		// Allow for the Monte Carlo noise in the histogram, roughly four standard deviations
+		float maxDifference = 0;
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				double p = (double)pdfUV(((float)x + 0.5f) / (float)width, ((float)y + 0.5f) / (float)height) / ((double)width * (double)height);
+				double tolerance = 4.0 * sqrt(p / (double)samples);
+				maxDifference = std::max(maxDifference, (float)std::max(fabs(histogram[(y * width) + x] - p) - tolerance, 0.0));
+			}
+		}
+		return std::max(error, maxDifference);
+	}
+};
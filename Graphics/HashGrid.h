@@ -0,0 +1,453 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds the world space hash grid behind the radiance cache in PT.hlsl, in the spirit of SHaRC. Path
+// vertices are quantised into cells whose size grows with the distance from the camera, and each cell is found
+// through a 32 bit hash choosing a bucket of slots plus a second 32 bit hash (the checksum) identifying the cell
+// within it. The checksums are kept apart from the cell data so that probing a bucket reads one contiguous run of
+// memory. Collisions are resolved by linear probing inside the bucket, insertion claims an empty slot with an atomic
+// compare exchange, and cells that receive no radiance for a number of frames are evicted by the resolve pass.
+// The shader functions hashGridKey, hashGridFind, hashGridInsert, hashGridDeposit, hashGridLookup and HashGridResolve
+// are line for line copies of the methods below, with InterlockedCompareExchange and InterlockedAdd in place of the
+// plain operations used on the CPU. verify() checks the table and benchmark() measures its throughput.
+
+#include "Math.h"
+#include <chrono>
+#include <vector>
+
+// Slots in the table, a multiple of the bucket size
+static const unsigned int HASH_GRID_CAPACITY = 1u << 20;
+// Slots probed for a cell, starting from the first slot of the bucket its hash selects
+static const unsigned int HASH_GRID_BUCKET_SIZE = 8;
+// Returned when a cell is not in the table, or its bucket is full
+static const unsigned int HASH_GRID_INVALID = 0xFFFFFFFFu;
+// Cell size at level 0, and the cell size relative to the distance from the camera that the levels follow
+static const float HASH_GRID_MIN_CELL_SIZE = 1.0f / 256.0f;
+static const float HASH_GRID_CELL_SCALE = 0.02f;
+static const unsigned int HASH_GRID_MAX_LEVEL = 20;
+// Radiance is accumulated as fixed point so that it can be added atomically, clamped to avoid overflow
+static const float HASH_GRID_RADIANCE_SCALE = 1000.0f;
+static const float HASH_GRID_MAX_RADIANCE = 1000.0f;
+// Samples a cell's resolved radiance averages over at most, which sets how quickly it follows changes
+static const unsigned int HASH_GRID_MAX_SAMPLES = 256;
+// Samples a cell needs before lookups use it
+static const unsigned int HASH_GRID_MIN_SAMPLES = 4;
+// Resolves a cell may go without new samples before it is evicted
+static const unsigned int HASH_GRID_MAX_AGE = 32;
+
+// Data of one slot of the table, laid out as HashGridEntry in PT.hlsl (36 bytes)
+struct HashGridEntry
+{
+	unsigned int accumulated[3] = {};   // Fixed point radiance deposited since the last resolve
+	unsigned int accumulatedCount = 0;
+	float radiance[3] = {};             // Resolved mean radiance leaving the cell
+	unsigned int sampleCount = 0;       // Samples behind the resolved radiance
+	unsigned int age = 0;               // Resolves since the cell last received radiance
+};
+
+// Identifies a cell: hash selects its bucket and checksum tells it apart from other cells in the bucket (never zero)
+struct HashGridKey
+{
+	unsigned int hash = 0;
+	unsigned int checksum = 0;
+};
+
+// Bob Jenkins' 32 bit integer hash; mirrors hashJenkins in PT.hlsl
+static unsigned int hashJenkins(unsigned int a)
+{
+	a = (a + 0x7ed55d16u) + (a << 12);
+	a = (a ^ 0xc761c23cu) ^ (a >> 19);
+	a = (a + 0x165667b1u) + (a << 5);
+	a = (a + 0xd3a2646cu) ^ (a << 9);
+	a = (a + 0xfd7046c5u) + (a << 3);
+	a = (a ^ 0xb55a4f09u) ^ (a >> 16);
+	return a;
+}
+
+// PCG output permutation used as an independent second hash; mirrors hashPCG in PT.hlsl
+static unsigned int hashPCG(unsigned int v)
+{
+	unsigned int state = (v * 747796405u) + 2891336453u;
+	unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// Grid level for a point at the given distance from the camera. Cells double in size with every level, so that a cell
+// covers about the same number of pixels at every distance; mirrors hashGridLevel in PT.hlsl
+static unsigned int hashGridLevel(float distance)
+{
+	float cells = std::max(distance * HASH_GRID_CELL_SCALE / HASH_GRID_MIN_CELL_SIZE, 1.0f);
+	return std::min((unsigned int)floorf(log2f(cells)), HASH_GRID_MAX_LEVEL);
+}
+
+// Edge length of the cells at a level
+static float hashGridCellSize(unsigned int level)
+{
+	return HASH_GRID_MIN_CELL_SIZE * (float)(1u << level);
+}
+
+// Key of the cell holding a point, seen at the given distance from the camera. The signs of the normal are part of the
+// key so that the two sides of a thin wall never share a cell; mirrors hashGridKey in PT.hlsl
+static HashGridKey hashGridKey(const Vec3& pos, const Vec3& normal, float distance)
+{
+	unsigned int level = hashGridLevel(distance);
+	float cellSize = hashGridCellSize(level);
+	unsigned int x = (unsigned int)(int)floorf(pos.x / cellSize);
+	unsigned int y = (unsigned int)(int)floorf(pos.y / cellSize);
+	unsigned int z = (unsigned int)(int)floorf(pos.z / cellSize);
+	unsigned int normalBits = (normal.x >= 0 ? 1u : 0u) | (normal.y >= 0 ? 2u : 0u) | (normal.z >= 0 ? 4u : 0u);
+	unsigned int extra = level | (normalBits << 8);
+	HashGridKey key;
+	key.hash = hashJenkins(hashJenkins(hashJenkins(hashJenkins(x) ^ y) ^ z) ^ extra);
+	key.checksum = hashPCG(hashPCG(hashPCG(hashPCG(x) ^ y) ^ z) ^ extra);
+	key.checksum = key.checksum == 0 ? 1 : key.checksum;
+	return key;
+}
+
+// Throughput of the table measured by HashGrid::benchmark
+struct HashGridBenchmark
+{
+	int operations = 0;
+	double insertsPerSecond = 0;
+	double lookupsPerSecond = 0;      // Lookups of cells that are in the table
+	double missesPerSecond = 0;       // Lookups of cells that are not
+	double depositsPerSecond = 0;
+	float loadFactor = 0;             // Fraction of slots in use after the inserts
+	float failedInsertFraction = 0;   // Inserts that found their bucket full
+};
+
+class HashGrid
+{
+public:
+	unsigned int capacity = 0;
+	std::vector<unsigned int> checksums;   // Checksum of the cell in each slot, zero while the slot is empty
+	std::vector<HashGridEntry> entries;
+
+	void init(unsigned int _capacity = HASH_GRID_CAPACITY)
+	{
+		capacity = std::max(_capacity / HASH_GRID_BUCKET_SIZE, 1u) * HASH_GRID_BUCKET_SIZE;
+		checksums.assign(capacity, 0);
+		entries.assign(capacity, HashGridEntry());
+	}
+
+	// First slot of the bucket a key belongs to
+	unsigned int bucket(const HashGridKey& key) const
+	{
+		return (key.hash % (capacity / HASH_GRID_BUCKET_SIZE)) * HASH_GRID_BUCKET_SIZE;
+	}
+
+	// Returns the slot holding a cell, or HASH_GRID_INVALID. The whole bucket is probed as evicted slots leave holes; mirrors hashGridFind in PT.hlsl
+	unsigned int find(const HashGridKey& key) const
+	{
+		unsigned int base = bucket(key);
+		for (unsigned int i = 0; i < HASH_GRID_BUCKET_SIZE; i++)
+		{
+			if (checksums[base + i] == key.checksum)
+			{
+				return base + i;
+			}
+		}
+		return HASH_GRID_INVALID;
+	}
+
+	// Returns the slot holding a cell, claiming the first empty slot of its bucket if it is not in the table yet, or
+	// HASH_GRID_INVALID if the bucket is full. A slot claimed by another thread for the same cell is shared; mirrors hashGridInsert in PT.hlsl
+	unsigned int insert(const HashGridKey& key)
+	{
+		unsigned int slot = find(key);
+		if (slot != HASH_GRID_INVALID)
+		{
+			return slot;
+		}
+		unsigned int base = bucket(key);
+		for (unsigned int i = 0; i < HASH_GRID_BUCKET_SIZE; i++)
+		{
+			unsigned int previous = compareExchange(checksums[base + i], 0, key.checksum);
+			if (previous == 0 || previous == key.checksum)
+			{
+				return base + i;
+			}
+		}
+		return HASH_GRID_INVALID;
+	}
+
+	// Adds one radiance sample leaving a point to its cell; mirrors hashGridDeposit in PT.hlsl
+	void deposit(const Vec3& pos, const Vec3& normal, float distance, const Vec3& radiance)
+	{
+		unsigned int slot = insert(hashGridKey(pos, normal, distance));
+		if (slot == HASH_GRID_INVALID)
+		{
+			return;
+		}
+		HashGridEntry& entry = entries[slot];
+		entry.accumulated[0] += (unsigned int)((std::min(std::max(radiance.x, 0.0f), HASH_GRID_MAX_RADIANCE) * HASH_GRID_RADIANCE_SCALE) + 0.5f);
+		entry.accumulated[1] += (unsigned int)((std::min(std::max(radiance.y, 0.0f), HASH_GRID_MAX_RADIANCE) * HASH_GRID_RADIANCE_SCALE) + 0.5f);
+		entry.accumulated[2] += (unsigned int)((std::min(std::max(radiance.z, 0.0f), HASH_GRID_MAX_RADIANCE) * HASH_GRID_RADIANCE_SCALE) + 0.5f);
+		entry.accumulatedCount += 1;
+	}
+
+	// Returns true and the cached radiance leaving a point if its cell has enough samples; mirrors hashGridLookup in PT.hlsl
+	bool lookup(const Vec3& pos, const Vec3& normal, float distance, Vec3& radiance) const
+	{
+		unsigned int slot = find(hashGridKey(pos, normal, distance));
+		if (slot == HASH_GRID_INVALID || entries[slot].sampleCount < HASH_GRID_MIN_SAMPLES)
+		{
+			return false;
+		}
+		radiance = Vec3(entries[slot].radiance[0], entries[slot].radiance[1], entries[slot].radiance[2]);
+		return true;
+	}
+
+	// Folds the radiance deposited since the last resolve into a slot's mean, or ages the slot and evicts it once it
+	// has gone HASH_GRID_MAX_AGE resolves without radiance; mirrors HashGridResolve in PT.hlsl
+	void resolveSlot(unsigned int slot)
+	{
+		if (checksums[slot] == 0)
+		{
+			return;
+		}
+		HashGridEntry& entry = entries[slot];
+		if (entry.accumulatedCount == 0)
+		{
+			entry.age += 1;
+			if (entry.age > HASH_GRID_MAX_AGE)
+			{
+				checksums[slot] = 0;
+				entry = HashGridEntry();
+			}
+			return;
+		}
+		unsigned int history = entry.accumulatedCount >= HASH_GRID_MAX_SAMPLES ? 0 : std::min(entry.sampleCount, HASH_GRID_MAX_SAMPLES - entry.accumulatedCount);
+		float total = (float)(history + entry.accumulatedCount);
+		for (int c = 0; c < 3; c++)
+		{
+			entry.radiance[c] = ((entry.radiance[c] * (float)history) + ((float)entry.accumulated[c] / HASH_GRID_RADIANCE_SCALE)) / total;
+			entry.accumulated[c] = 0;
+		}
+		entry.sampleCount = history + entry.accumulatedCount;
+		entry.accumulatedCount = 0;
+		entry.age = 0;
+	}
+
+	// Resolves every slot, as the resolve pass does once per frame
+	void resolve()
+	{
+		for (unsigned int i = 0; i < capacity; i++)
+		{
+			resolveSlot(i);
+		}
+	}
+
+	// Number of slots in use
+	unsigned int occupied() const
+	{
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < capacity; i++)
+		{
+			count += checksums[i] != 0 ? 1 : 0;
+		}
+		return count;
+	}
+
+	// Checks keys, insertion, collision handling within a bucket, deposits and resolves, and aging and eviction on a
+	// small table of its own. Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x2545F491u;
+
+		// Points in the same cell share a key, the other side of a surface and the neighbouring cell do not, and the
+		// cells grow with distance
+		HashGridKey a = hashGridKey(Vec3(1.001f, 2.001f, 3.001f), Vec3(0, 1.0f, 0), 4.0f);
+		HashGridKey b = hashGridKey(Vec3(1.002f, 2.002f, 3.002f), Vec3(0.1f, 0.9f, 0.1f), 4.0f);
+		HashGridKey flipped = hashGridKey(Vec3(1.001f, 2.001f, 3.001f), Vec3(0, -1.0f, 0), 4.0f);
+		HashGridKey neighbour = hashGridKey(Vec3(1.001f + hashGridCellSize(hashGridLevel(4.0f)), 2.001f, 3.001f), Vec3(0, 1.0f, 0), 4.0f);
+		failures += (a.hash == b.hash && a.checksum == b.checksum) ? 0 : 1;
+		failures += (a.checksum != flipped.checksum && a.checksum != neighbour.checksum) ? 0 : 1;
+		failures += hashGridLevel(1.0f) < hashGridLevel(16.0f) ? 0 : 1;
+		failures += hashGridCellSize(hashGridLevel(16.0f)) <= 16.0f * HASH_GRID_CELL_SCALE ? 0 : 1;
+		failures += hashGridCellSize(hashGridLevel(16.0f)) > 8.0f * HASH_GRID_CELL_SCALE ? 0 : 1;
+
+		// Fill half the table with random cells. Inserting a cell again must return its slot, find must agree, and
+		// almost no bucket may overflow at this load
+		init(1u << 14);
+		unsigned int count = capacity / 2;
+		std::vector<HashGridKey> keys(count);
+		std::vector<unsigned int> slots(count);
+		unsigned int overflows = 0;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			keys[i] = hashGridKey(Vec3(nextFloat(state) * 100.0f, nextFloat(state) * 100.0f, nextFloat(state) * 100.0f), Vec3(0, 1.0f, 0), 10.0f);
+			slots[i] = insert(keys[i]);
+			overflows += slots[i] == HASH_GRID_INVALID ? 1 : 0;
+		}
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (slots[i] != HASH_GRID_INVALID)
+			{
+				failures += insert(keys[i]) == slots[i] ? 0 : 1;
+				failures += find(keys[i]) == slots[i] ? 0 : 1;
+				failures += checksums[slots[i]] == keys[i].checksum ? 0 : 1;
+			}
+		}
+		failures += overflows < (count / 100) ? 0 : 1;
+
+		// Cells colliding in one bucket take its slots in turn, and the bucket refuses a cell once it is full
+		init(1u << 10);
+		HashGridKey colliding;
+		colliding.hash = 12345u;
+		for (unsigned int i = 0; i < HASH_GRID_BUCKET_SIZE; i++)
+		{
+			colliding.checksum = 100u + i;
+			failures += insert(colliding) == bucket(colliding) + i ? 0 : 1;
+		}
+		colliding.checksum = 100u + HASH_GRID_BUCKET_SIZE;
+		failures += insert(colliding) == HASH_GRID_INVALID ? 0 : 1;
+		failures += find(colliding) == HASH_GRID_INVALID ? 0 : 1;
+		for (unsigned int i = 0; i < HASH_GRID_BUCKET_SIZE; i++)
+		{
+			colliding.checksum = 100u + i;
+			failures += find(colliding) == bucket(colliding) + i ? 0 : 1;
+		}
+
+		// A resolved cell returns the mean of its deposits, within the fixed point precision, and not before it has enough samples
+		init(1u << 10);
+		Vec3 pos(0.5f, 0.25f, -0.75f);
+		Vec3 normal(0, 0, 1.0f);
+		Vec3 radiance;
+		deposit(pos, normal, 2.0f, Vec3(1.0f, 2.0f, 3.0f));
+		resolve();
+		failures += lookup(pos, normal, 2.0f, radiance) == false ? 0 : 1;
+		for (unsigned int i = 0; i < HASH_GRID_MIN_SAMPLES; i++)
+		{
+			deposit(pos, normal, 2.0f, Vec3(1.0f + (float)i, 2.0f, 3.0f));
+		}
+		resolve();
+		float expected = ((1.0f * 1.0f) + (1.0f * (float)HASH_GRID_MIN_SAMPLES) + (float)((HASH_GRID_MIN_SAMPLES - 1) * HASH_GRID_MIN_SAMPLES / 2)) / (float)(HASH_GRID_MIN_SAMPLES + 1);
+		failures += lookup(pos, normal, 2.0f, radiance) ? 0 : 1;
+		failures += fabsf(radiance.x - expected) < 1e-3f && fabsf(radiance.y - 2.0f) < 1e-3f && fabsf(radiance.z - 3.0f) < 1e-3f ? 0 : 1;
+
+		// The history is capped, so a resolve with a full history's worth of new samples replaces the mean
+		for (unsigned int i = 0; i < HASH_GRID_MAX_SAMPLES; i++)
+		{
+			deposit(pos, normal, 2.0f, Vec3(5.0f, 5.0f, 5.0f));
+		}
+		resolve();
+		lookup(pos, normal, 2.0f, radiance);
+		failures += fabsf(radiance.x - 5.0f) < 1e-3f && entries[find(hashGridKey(pos, normal, 2.0f))].sampleCount == HASH_GRID_MAX_SAMPLES ? 0 : 1;
+
+		// A cell without deposits survives HASH_GRID_MAX_AGE resolves, is evicted on the next, and its slot can be claimed again
+		unsigned int slot = find(hashGridKey(pos, normal, 2.0f));
+		for (unsigned int f = 0; f < HASH_GRID_MAX_AGE; f++)
+		{
+			resolve();
+		}
+		failures += find(hashGridKey(pos, normal, 2.0f)) == slot ? 0 : 1;
+		resolve();
+		failures += find(hashGridKey(pos, normal, 2.0f)) == HASH_GRID_INVALID ? 0 : 1;
+		failures += occupied() == 0 ? 0 : 1;
+		failures += insert(hashGridKey(pos, normal, 2.0f)) == slot ? 0 : 1;
+		return failures;
+	}
+
+	// Measures single threaded insert, lookup and deposit throughput on a table of the size the GPU uses, filled to the given load
+	HashGridBenchmark benchmark(int operations = 1 << 20, float load = 0.5f)
+	{
+		HashGridBenchmark result;
+		init(HASH_GRID_CAPACITY);
+		int count = std::min(operations, (int)((float)capacity * load));
+		result.operations = count;
+		unsigned int state = 0x9E3779B9u;
+		std::vector<Vec3> points(count);
+		std::vector<HashGridKey> keys(count);
+		std::vector<HashGridKey> missing(count);
+		for (int i = 0; i < count; i++)
+		{
+			points[i] = Vec3(nextFloat(state) * 50.0f, nextFloat(state) * 10.0f, nextFloat(state) * 50.0f);
+			keys[i] = hashGridKey(points[i], Vec3(0, 1.0f, 0), 1.0f);
+			missing[i] = hashGridKey(points[i], Vec3(0, -1.0f, 0), 1.0f);
+		}
+
+		unsigned int failed = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; i++)
+		{
+			failed += insert(keys[i]) == HASH_GRID_INVALID ? 1 : 0;
+		}
+		result.insertsPerSecond = (double)count / secondsSince(start);
+		result.loadFactor = (float)occupied() / (float)capacity;
+		result.failedInsertFraction = (float)failed / (float)std::max(count, 1);
+
+		unsigned int found = 0;
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; i++)
+		{
+			found += find(keys[i]) != HASH_GRID_INVALID ? 1 : 0;
+		}
+		result.lookupsPerSecond = (double)count / secondsSince(start);
+
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; i++)
+		{
+			found += find(missing[i]) != HASH_GRID_INVALID ? 1 : 0;
+		}
+		result.missesPerSecond = (double)count / secondsSince(start);
+
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; i++)
+		{
+			deposit(points[i], Vec3(0, 1.0f, 0), 1.0f, Vec3(1.0f, 1.0f, 1.0f));
+		}
+		result.depositsPerSecond = (double)count / secondsSince(start);
+		// Keeps the lookups from being optimised away
+		result.operations += found > (unsigned int)(2 * count) ? 1 : 0;
+		return result;
+	}
+
+private:
+	// Stores value if dest equals compare and returns the previous value, as InterlockedCompareExchange does in PT.hlsl
+	static unsigned int compareExchange(unsigned int& dest, unsigned int compare, unsigned int value)
+	{
+		unsigned int previous = dest;
+		if (previous == compare)
+		{
+			dest = value;
+		}
+		return previous;
+	}
+
+	static float nextFloat(unsigned int& state)
+	{
+		state = (state * 1664525u) + 1013904223u;
+		return (float)(state >> 8) / 16777216.0f;
+	}
+
+	static double secondsSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::max(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count(), 1e-9);
+	}
+};
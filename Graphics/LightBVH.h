@@ -0,0 +1,568 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file implements a light BVH for scenes with many area lights. Each node stores the bounds,
+// a cone bounding the emitter normals and the total power of the lights below it. PT.hlsl walks
+// the tree from the root, choosing a child with probability proportional to an estimate of its
+// contribution to the shading point, so nearby lights facing the point are picked far more often
+// than distant or back facing ones. The CPU side mirrors the traversal to validate the pmf.
+
+#include "Math.h"
+#include "Parallel.h"
+#include <vector>
+#include <thread>
+
+#define LIGHT_BVH_PI 3.14159265358979f
+
+// One node of the light BVH, mirrored by LightBVHNode in PT.hlsl (48 bytes)
+// Nodes are stored depth first: an interior node's first child immediately follows it
+struct LightBVHNode
+{
+	Vec3 boundsMin;
+	float power;          // Sum of the power of the lights below this node
+	Vec3 boundsMax;
+	float cosThetaO;      // Cosine of the half angle of the cone bounding the emitter normals
+	Vec3 axis;            // Axis of the normal cone
+	unsigned int info;    // Leaf: LIGHT_BVH_LEAF | light index. Interior: index of the second child
+};
+
+static const unsigned int LIGHT_BVH_LEAF = 0x80000000u;
+
+// Input to the builder, one per area light
+struct LightBVHPrimitive
+{
+	AABB bounds;
+	Vec3 normal;
+	float power;
+};
+
+// Cone of directions stored as an axis and a half angle
+// Lights are one sided, so the emission spread around each normal is always a hemisphere and is not stored
+class LightCone
+{
+public:
+	Vec3 axis;
+	float theta = 0;
+	bool empty = true;
+
+	LightCone()
+	{
+	}
+	LightCone(const Vec3& _axis, float _theta)
+	{
+		axis = _axis;
+		theta = _theta;
+		empty = false;
+	}
+
+	// Returns the smallest cone (found by rotating the wider cone's axis) containing both cones
+	static LightCone merge(const LightCone& c0, const LightCone& c1)
+	{
+		if (c0.empty)
+		{
+			return c1;
+		}
+		if (c1.empty)
+		{
+			return c0;
+		}
+		const LightCone& a = c0.theta >= c1.theta ? c0 : c1;
+		const LightCone& b = c0.theta >= c1.theta ? c1 : c0;
+		float cosThetaD = clamp(Dot(a.axis, b.axis), -1.0f, 1.0f);
+		float thetaD = acosf(cosThetaD);
+		if (std::min(thetaD + b.theta, LIGHT_BVH_PI) <= a.theta)
+		{
+			return a;
+		}
+		float thetaO = (a.theta + thetaD + b.theta) * 0.5f;
+		if (thetaO >= LIGHT_BVH_PI)
+		{
+			return LightCone(a.axis, LIGHT_BVH_PI);
+		}
+		// Rotate the axis of a towards b by the extra angle needed
+		float thetaR = thetaO - a.theta;
+		Vec3 w = b.axis - (a.axis * cosThetaD);
+		if (w.lengthSq() < 1e-12f)
+		{
+			// Opposing axes, any perpendicular direction works
+			w = fabsf(a.axis.x) > 0.9f ? Cross(a.axis, Vec3(0, 1.0f, 0)) : Cross(a.axis, Vec3(1.0f, 0, 0));
+		}
+		w = w.normalize();
+		return LightCone(((a.axis * cosf(thetaR)) + (w * sinf(thetaR))).normalize(), thetaO);
+	}
+
+	// Orientation measure of the cone for the surface area orientation heuristic (Conty Estevez and Kulla 2018) with a hemispherical emission spread
+	float measure() const
+	{
+		if (empty)
+		{
+			return 0;
+		}
+		float thetaE = LIGHT_BVH_PI * 0.5f;
+		float thetaW = std::min(theta + thetaE, LIGHT_BVH_PI);
+		float sinThetaO = sinf(theta);
+		float cosThetaO = cosf(theta);
+		return (2.0f * LIGHT_BVH_PI * (1.0f - cosThetaO)) + ((LIGHT_BVH_PI * 0.5f) * ((2.0f * thetaW * sinThetaO) - cosf(theta - (2.0f * thetaW)) - (2.0f * theta * sinThetaO) + cosThetaO));
+	}
+};
+
+// Light BVH built with binned splits minimising the surface area orientation heuristic
+class LightBVH
+{
+public:
+	static const int binCount = 12;
+	static const int maxDepth = 32;       // Depth is limited so the path to every leaf fits in a 32 bit trail
+	int parallelDepth = 4;                // Subtrees are built on separate threads down to this depth
+	int parallelMinLights = 2048;         // Ranges smaller than this are always built on the calling thread
+
+	std::vector<LightBVHNode> nodes;
+	std::vector<unsigned int> trails;     // Per light, bit i is set if the path from the root takes the second child at depth i
+	std::vector<LightBVHPrimitive> primitives;
+	std::vector<Vec3> centroids;
+	std::vector<int> order;
+
+	// Builds the tree over the given lights
+	void build(const std::vector<LightBVHPrimitive>& lights)
+	{
+		primitives = lights;
+		int n = (int)primitives.size();
+		nodes.clear();
+		trails.assign(n, 0);
+		if (n == 0)
+		{
+			return;
+		}
+		centroids.resize(n);
+		order.resize(n);
+		parallelFor(n, [&](int i)
+			{
+				centroids[i] = primitives[i].bounds.centre();
+				order[i] = i;
+			});
+		nodes.reserve((2 * n) - 1);
+		buildNode(0, n, 0, 0, nodes);
+	}
+
+	// Returns the estimated contribution of everything below a node to a shading point with normal n; mirrors lightBVHImportance in PT.hlsl
+	static float importance(const LightBVHNode& node, const Vec3& p, const Vec3& n)
+	{
+		if (node.power <= 0)
+		{
+			return 0;
+		}
+		Vec3 centre = (node.boundsMin + node.boundsMax) * 0.5f;
+		float radiusSq = (node.boundsMax - centre).lengthSq();
+		Vec3 d = p - centre;
+		float distanceSq = d.lengthSq();
+		// Inside the bounding sphere every direction is possible
+		if (distanceSq <= radiusSq)
+		{
+			return node.power / std::max(radiusSq, 1e-8f);
+		}
+		Vec3 wi = d / sqrtf(distanceSq);
+		// Half angle subtended by the bounding sphere
+		float sinThetaBSq = radiusSq / distanceSq;
+		float sinThetaB = sqrtf(sinThetaBSq);
+		float cosThetaB = sqrtf(1.0f - sinThetaBSq);
+		// Smallest angle between the direction to the point and any emitter normal in the node
+		float cosThetaW = clamp(Dot(node.axis, wi), -1.0f, 1.0f);
+		float sinThetaW = sqrtf(std::max(1.0f - (cosThetaW * cosThetaW), 0.0f));
+		float sinThetaO = sqrtf(std::max(1.0f - (node.cosThetaO * node.cosThetaO), 0.0f));
+		float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+		float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+		float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+		if (cosThetaP <= 0)
+		{
+			return 0;
+		}
+		// Smallest angle between the shading normal and any direction towards the node
+		float cosThetaI = clamp(-Dot(n, wi), -1.0f, 1.0f);
+		float sinThetaI = sqrtf(std::max(1.0f - (cosThetaI * cosThetaI), 0.0f));
+		float cosThetaIP = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+		if (cosThetaIP <= 0)
+		{
+			return 0;
+		}
+		return node.power * cosThetaP * cosThetaIP / distanceSq;
+	}
+
+	// Picks a light for a shading point with a single uniform random number and returns its probability; mirrors sampleLightBVH in PT.hlsl
+	// Returns -1 with a pmf of zero if no light can contribute
+	int sample(const Vec3& p, const Vec3& n, float u, float& pmf) const
+	{
+		pmf = 0;
+		if (nodes.empty() || (isLeaf(nodes[0]) == false && importance(nodes[0], p, n) <= 0))
+		{
+			return -1;
+		}
+		float prob = 1.0f;
+		unsigned int node = 0;
+		while (isLeaf(nodes[node]) == false)
+		{
+			unsigned int first = node + 1;
+			unsigned int second = nodes[node].info;
+			float i0 = importance(nodes[first], p, n);
+			float i1 = importance(nodes[second], p, n);
+			if ((i0 + i1) <= 0)
+			{
+				return -1;
+			}
+			float p0 = i0 / (i0 + i1);
+			if (u < p0)
+			{
+				node = first;
+				prob = prob * p0;
+				u = std::min(u / p0, 0.99999994f);
+			} else
+			{
+				node = second;
+				prob = prob * (1.0f - p0);
+				u = std::min((u - p0) / (1.0f - p0), 0.99999994f);
+			}
+		}
+		pmf = prob;
+		return (int)(nodes[node].info & ~LIGHT_BVH_LEAF);
+	}
+
+	// Returns the probability that sample() picks the given light at a shading point by following the light's trail; mirrors lightBVHPmf in PT.hlsl
+	float pmf(const Vec3& p, const Vec3& n, int light) const
+	{
+		if (nodes.empty() || (isLeaf(nodes[0]) == false && importance(nodes[0], p, n) <= 0))
+		{
+			return 0;
+		}
+		float prob = 1.0f;
+		unsigned int node = 0;
+		unsigned int trail = trails[light];
+		int depth = 0;
+		while (isLeaf(nodes[node]) == false)
+		{
+			unsigned int first = node + 1;
+			unsigned int second = nodes[node].info;
+			float i0 = importance(nodes[first], p, n);
+			float i1 = importance(nodes[second], p, n);
+			if ((i0 + i1) <= 0)
+			{
+				return 0;
+			}
+			float p0 = i0 / (i0 + i1);
+			if ((trail & (1u << depth)) == 0)
+			{
+				node = first;
+				prob = prob * p0;
+			} else
+			{
+				node = second;
+				prob = prob * (1.0f - p0);
+			}
+			depth++;
+		}
+		return prob;
+	}
+
+	// Checks the traversal at random shading points inside the scene's light bounds
+	// For each point the probability of every leaf is found by pushing probability down the whole tree; together with the
+	// probability of stopping at nodes where nothing can contribute this must sum to one. Each leaf's probability must match
+	// pmf() for its light, and every light returned by sample() must report that same probability. Returns the largest error found.
+	float verify(int numPoints = 16, int samplesPerPoint = 64) const
+	{
+		if (nodes.empty())
+		{
+			return 0;
+		}
+		Vec3 boundsMin = nodes[0].boundsMin;
+		Vec3 extent = nodes[0].boundsMax - nodes[0].boundsMin;
+		std::vector<float> errors(numPoints, 0);
+		parallelFor(numPoints, [&](int i)
+			{
+				unsigned int state = 0x9E3779B9u * (unsigned int)(i + 1);
+				auto next = [&]()
+					{
+						state = (state * 1664525u) + 1013904223u;
+						return (float)(state >> 8) / 16777216.0f;
+					};
+				Vec3 p = boundsMin + (extent * Vec3((next() * 1.5f) - 0.25f, (next() * 1.5f) - 0.25f, (next() * 1.5f) - 0.25f));
+				float z = (next() * 2.0f) - 1.0f;
+				float r = sqrtf(std::max(1.0f - (z * z), 0.0f));
+				float phi = next() * 2.0f * LIGHT_BVH_PI;
+				Vec3 n(r * cosf(phi), r * sinf(phi), z);
+				std::vector<float> leafMass(trails.size(), 0);
+				double terminated = 0;
+				distribute(0, 1.0, p, n, leafMass, terminated);
+				double total = terminated;
+				float error = 0;
+				for (int l = 0; l < (int)leafMass.size(); l++)
+				{
+					total += leafMass[l];
+					error = std::max(error, fabsf(leafMass[l] - pmf(p, n, l)));
+				}
+				error = std::max(error, (float)fabs(total - 1.0));
+				for (int s = 0; s < samplesPerPoint; s++)
+				{
+					float samplePmf;
+					int light = sample(p, n, next(), samplePmf);
+					if (light >= 0)
+					{
+						error = std::max(error, fabsf(samplePmf - pmf(p, n, light)));
+					}
+				}
+				errors[i] = error;
+			}, 1);
+		float maxError = 0;
+		for (int i = 0; i < numPoints; i++)
+		{
+			maxError = std::max(maxError, errors[i]);
+		}
+		return maxError;
+	}
+
+private:
+	static bool isLeaf(const LightBVHNode& node)
+	{
+		return (node.info & LIGHT_BVH_LEAF) != 0;
+	}
+
+	// Pushes the probability of reaching a node down to its leaves, accumulating the probability lost where the traversal stops
+	void distribute(unsigned int node, double prob, const Vec3& p, const Vec3& n, std::vector<float>& leafMass, double& terminated) const
+	{
+		if (isLeaf(nodes[node]))
+		{
+			leafMass[nodes[node].info & ~LIGHT_BVH_LEAF] = (float)prob;
+			return;
+		}
+		if (node == 0 && importance(nodes[0], p, n) <= 0)
+		{
+			terminated += prob;
+			return;
+		}
+		float i0 = importance(nodes[node + 1], p, n);
+		float i1 = importance(nodes[nodes[node].info], p, n);
+		if ((i0 + i1) <= 0)
+		{
+			terminated += prob;
+			return;
+		}
+		float p0 = i0 / (i0 + i1);
+		distribute(node + 1, prob * p0, p, n, leafMass, terminated);
+		distribute(nodes[node].info, prob * (1.0f - p0), p, n, leafMass, terminated);
+	}
+
+	// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+	static float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		if (cosA > cosB)
+		{
+			return 1.0f;
+		}
+		return (cosA * cosB) + (sinA * sinB);
+	}
+	static float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		if (cosA > cosB)
+		{
+			return 0;
+		}
+		return (sinA * cosB) - (cosA * sinB);
+	}
+
+	static int ceilLog2(int n)
+	{
+		int l = 0;
+		while ((1 << l) < n && l < 31)
+		{
+			l++;
+		}
+		return l;
+	}
+
+	// Cost of a node for the surface area orientation heuristic
+	static float cost(float power, const AABB& bounds, const LightCone& cone)
+	{
+		return power * bounds.area() * cone.measure();
+	}
+
+	// Builds the subtree over order[start, end) and appends it to out
+	// Child indices are relative to the start of out, so subtrees built on other threads can be appended with an offset
+	void buildNode(int start, int end, int depth, unsigned int trail, std::vector<LightBVHNode>& out)
+	{
+		int n = end - start;
+		AABB bounds;
+		AABB centroidBounds;
+		LightCone cone;
+		float power = 0;
+		for (int i = start; i < end; i++)
+		{
+			const LightBVHPrimitive& prim = primitives[order[i]];
+			bounds.extend(prim.bounds);
+			centroidBounds.extend(centroids[order[i]]);
+			cone = LightCone::merge(cone, LightCone(prim.normal, 0));
+			power += prim.power;
+		}
+		int nodeIndex = (int)out.size();
+		LightBVHNode node;
+		node.boundsMin = bounds.min;
+		node.boundsMax = bounds.max;
+		node.power = power;
+		node.axis = cone.axis;
+		// Interior cones are widened slightly so rounding in the merge never makes them exclude a light
+		node.cosThetaO = n == 1 ? 1.0f : cosf(std::min(cone.theta + 1e-3f, LIGHT_BVH_PI));
+		node.info = 0;
+		out.push_back(node);
+		if (n == 1)
+		{
+			out[nodeIndex].info = LIGHT_BVH_LEAF | (unsigned int)order[start];
+			trails[order[start]] = trail;
+			return;
+		}
+
+		int mid = split(start, end, depth, bounds, centroidBounds);
+		unsigned int secondTrail = trail | (1u << depth);
+		if (depth < parallelDepth && n >= parallelMinLights)
+		{
+			// Build the second subtree on another thread into its own array, then append it
+			std::vector<LightBVHNode> second;
+			std::thread worker([&]()
+				{
+					buildNode(mid, end, depth + 1, secondTrail, second);
+				});
+			buildNode(start, mid, depth + 1, trail, out);
+			worker.join();
+			unsigned int offset = (unsigned int)out.size();
+			out[nodeIndex].info = offset;
+			for (unsigned int i = 0; i < second.size(); i++)
+			{
+				if (isLeaf(second[i]) == false)
+				{
+					second[i].info += offset;
+				}
+			}
+			out.insert(out.end(), second.begin(), second.end());
+			return;
+		}
+		buildNode(start, mid, depth + 1, trail, out);
+		out[nodeIndex].info = (unsigned int)out.size();
+		buildNode(mid, end, depth + 1, secondTrail, out);
+	}
+
+	// Partitions order[start, end) and returns the split position
+	int split(int start, int end, int depth, const AABB& bounds, const AABB& centroidBounds)
+	{
+		int n = end - start;
+		Vec3 extent = centroidBounds.size();
+		int longestAxis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		bool binned = extent.coords[longestAxis] > 0 && (depth + ceilLog2(n)) < maxDepth;
+
+		float bestCost = FLT_MAX;
+		int bestAxis = -1;
+		int bestBin = 0;
+		if (binned)
+		{
+			Vec3 boundsExtent = bounds.size();
+			float maxExtent = std::max(boundsExtent.x, std::max(boundsExtent.y, boundsExtent.z));
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (extent.coords[axis] <= 0)
+				{
+					continue;
+				}
+				AABB binBounds[binCount];
+				LightCone binCones[binCount];
+				float binPower[binCount] = {};
+				int binCounts[binCount] = {};
+				float scale = (float)binCount / extent.coords[axis];
+				for (int i = start; i < end; i++)
+				{
+					const LightBVHPrimitive& prim = primitives[order[i]];
+					int b = std::min((int)((centroids[order[i]].coords[axis] - centroidBounds.min.coords[axis]) * scale), binCount - 1);
+					binBounds[b].extend(prim.bounds);
+					binCones[b] = LightCone::merge(binCones[b], LightCone(prim.normal, 0));
+					binPower[b] += prim.power;
+					binCounts[b]++;
+				}
+				// Sweep from the right to accumulate the cost of the right hand side
+				float rightCosts[binCount];
+				int rightCounts[binCount];
+				AABB rightBounds;
+				LightCone rightCone;
+				float rightPower = 0;
+				int rightCount = 0;
+				for (int b = binCount - 1; b > 0; b--)
+				{
+					rightBounds.extend(binBounds[b]);
+					rightCone = LightCone::merge(rightCone, binCones[b]);
+					rightPower += binPower[b];
+					rightCount += binCounts[b];
+					rightCosts[b] = cost(rightPower, rightBounds, rightCone);
+					rightCounts[b] = rightCount;
+				}
+				// Thin axes are penalised so splits favour the longest dimension of the node
+				float regulariser = boundsExtent.coords[axis] > 0 ? maxExtent / boundsExtent.coords[axis] : 1.0f;
+				AABB leftBounds;
+				LightCone leftCone;
+				float leftPower = 0;
+				int leftCount = 0;
+				for (int b = 0; b < binCount - 1; b++)
+				{
+					leftBounds.extend(binBounds[b]);
+					leftCone = LightCone::merge(leftCone, binCones[b]);
+					leftPower += binPower[b];
+					leftCount += binCounts[b];
+					if (leftCount == 0 || rightCounts[b + 1] == 0)
+					{
+						continue;
+					}
+					float c = regulariser * (cost(leftPower, leftBounds, leftCone) + rightCosts[b + 1]);
+					if (c < bestCost)
+					{
+						bestCost = c;
+						bestAxis = axis;
+						bestBin = b;
+					}
+				}
+			}
+		}
+
+		if (bestAxis >= 0)
+		{
+			float scale = (float)binCount / extent.coords[bestAxis];
+			float minCoord = centroidBounds.min.coords[bestAxis];
+			int* mid = std::partition(&order[start], &order[start] + n, [&](int index)
+				{
+					int b = std::min((int)((centroids[index].coords[bestAxis] - minCoord) * scale), binCount - 1);
+					return b <= bestBin;
+				});
+			return (int)(mid - &order[0]);
+		}
+
+		// Coincident centroids or close to the depth limit: split at the median along the longest axis, which halves the range
+		int mid = start + (n / 2);
+		std::nth_element(&order[start], &order[mid], &order[start] + n, [&](int a, int b)
+			{
+				return centroids[a].coords[longestAxis] < centroids[b].coords[longestAxis];
+			});
+		return mid;
+	}
+};
@@ -0,0 +1,404 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file holds the light selection cache used by selectLight in PT.hlsl. World space cells, keyed like the radiance
+// cache's hash grid but larger, each learn which lights contribute unoccluded light to the points inside them. Every
+// light sample calculateDirect takes deposits its contribution (zero when occluded) into a slot for that light in the
+// cell, and a resolve pass once per frame folds the deposits into a decaying mean per light and evicts lights that
+// contribute nothing, or have not been sampled for a while. Lights are then selected from the cell's means, mixed with
+// the default selection (the light BVH or the alias table) so that every light keeps a chance of being picked and
+// the estimate stays unbiased. The shader functions lightCacheFind, lightCacheInsert, lightCacheDeposit,
+// lightCacheMix, lightCacheSample, lightCachePmf and LightCacheResolve are line for line copies of the methods below.
+// verify() checks them.
+
+#include "HashGrid.h"
+#include <vector>
+
+// Cells in the table, a multiple of the bucket size
+static const unsigned int LIGHT_CACHE_CAPACITY = 1u << 16;
+// Cells probed for a key, starting from the first cell of the bucket its hash selects
+static const unsigned int LIGHT_CACHE_BUCKET_SIZE = 4;
+// Lights a cell learns about at most
+static const unsigned int LIGHT_CACHE_SLOTS = 8;
+// Returned when a cell or a light is not in the table
+static const unsigned int LIGHT_CACHE_INVALID = 0xFFFFFFFFu;
+// Cells are this many times larger than the radiance cache's cells at the same distance from the camera
+static const float LIGHT_CACHE_CELL_FACTOR = 4.0f;
+// Contributions are accumulated as fixed point so that they can be added atomically, clamped to avoid overflow
+static const float LIGHT_CACHE_CONTRIBUTION_SCALE = 1000.0f;
+static const float LIGHT_CACHE_MAX_CONTRIBUTION = 100.0f;
+// Fraction of a slot's sample weight kept by each resolve, and the most weight a slot builds up
+static const float LIGHT_CACHE_DECAY = 0.9f;
+static const float LIGHT_CACHE_MAX_SAMPLES = 256.0f;
+// Slots whose weight decays below this are evicted as stale
+static const float LIGHT_CACHE_MIN_SAMPLES = 0.5f;
+// Slots with at least this weight whose mean is at most this fraction of the cell's total are evicted as useless
+static const float LIGHT_CACHE_EVICT_SAMPLES = 16.0f;
+static const float LIGHT_CACHE_EVICT_FRACTION = 0.01f;
+// Largest fraction of selections drawn from a cell's learned distribution, reached once the cell has this much weight
+static const float LIGHT_CACHE_MAX_MIX = 0.75f;
+static const float LIGHT_CACHE_CONFIDENT_SAMPLES = 64.0f;
+
+// What a cell has learned about one light, laid out as LightCacheSlot in PT.hlsl (20 bytes)
+struct LightCacheSlot
+{
+	unsigned int lightPlusOne = 0;      // Index of the light plus one, zero while the slot is empty
+	unsigned int accumulated = 0;       // Fixed point luminance of the contributions deposited since the last resolve
+	unsigned int accumulatedCount = 0;
+	float mean = 0;                     // Decaying mean luminance of the light's contribution to the cell
+	float samples = 0;                  // Decaying number of samples behind the mean
+};
+
+// A cell of the table, laid out as LightCacheCell in PT.hlsl (164 bytes)
+struct LightCacheCell
+{
+	unsigned int checksum = 0;          // Checksum of the cell's key, zero while the cell is empty
+	LightCacheSlot slots[LIGHT_CACHE_SLOTS];
+};
+
+// Key of the cell holding a shading point; mirrors lightCacheKey in PT.hlsl
+static HashGridKey lightCacheKey(const Vec3& pos, const Vec3& normal, float distance)
+{
+	return hashGridKey(pos, normal, distance * LIGHT_CACHE_CELL_FACTOR);
+}
+
+class LightCache
+{
+public:
+	unsigned int capacity = 0;
+	std::vector<LightCacheCell> cells;
+
+	void init(unsigned int _capacity = LIGHT_CACHE_CAPACITY)
+	{
+		capacity = std::max(_capacity / LIGHT_CACHE_BUCKET_SIZE, 1u) * LIGHT_CACHE_BUCKET_SIZE;
+		cells.assign(capacity, LightCacheCell());
+	}
+
+	// Returns the cell a key is stored in, or LIGHT_CACHE_INVALID; mirrors lightCacheFind in PT.hlsl
+	unsigned int find(const HashGridKey& key) const
+	{
+		unsigned int base = (key.hash % (capacity / LIGHT_CACHE_BUCKET_SIZE)) * LIGHT_CACHE_BUCKET_SIZE;
+		for (unsigned int i = 0; i < LIGHT_CACHE_BUCKET_SIZE; i++)
+		{
+			if (cells[base + i].checksum == key.checksum)
+			{
+				return base + i;
+			}
+		}
+		return LIGHT_CACHE_INVALID;
+	}
+
+	// Returns the cell a key is stored in, claiming an empty cell of its bucket if needed, or LIGHT_CACHE_INVALID if
+	// the bucket is full; mirrors lightCacheInsert in PT.hlsl
+	unsigned int insert(const HashGridKey& key)
+	{
+		unsigned int cell = find(key);
+		if (cell != LIGHT_CACHE_INVALID)
+		{
+			return cell;
+		}
+		unsigned int base = (key.hash % (capacity / LIGHT_CACHE_BUCKET_SIZE)) * LIGHT_CACHE_BUCKET_SIZE;
+		for (unsigned int i = 0; i < LIGHT_CACHE_BUCKET_SIZE; i++)
+		{
+			unsigned int previous = compareExchange(cells[base + i].checksum, 0, key.checksum);
+			if (previous == 0 || previous == key.checksum)
+			{
+				return base + i;
+			}
+		}
+		return LIGHT_CACHE_INVALID;
+	}
+
+	// Adds the luminance of one light sample's contribution to a shading point to the light's slot in the point's cell,
+	// claiming an empty slot for the light if it has none. Samples are dropped while the cell's slots are all taken;
+	// mirrors lightCacheDeposit in PT.hlsl
+	void deposit(const Vec3& pos, const Vec3& normal, float distance, unsigned int light, float contribution)
+	{
+		unsigned int cell = insert(lightCacheKey(pos, normal, distance));
+		if (cell == LIGHT_CACHE_INVALID)
+		{
+			return;
+		}
+		for (unsigned int i = 0; i < LIGHT_CACHE_SLOTS; i++)
+		{
+			LightCacheSlot& slot = cells[cell].slots[i];
+			unsigned int previous = compareExchange(slot.lightPlusOne, 0, light + 1);
+			if (previous == 0 || previous == light + 1)
+			{
+				slot.accumulated += (unsigned int)((std::min(std::max(contribution, 0.0f), LIGHT_CACHE_MAX_CONTRIBUTION) * LIGHT_CACHE_CONTRIBUTION_SCALE) + 0.5f);
+				slot.accumulatedCount += 1;
+				return;
+			}
+		}
+	}
+
+	// Fraction of the selections at a cell drawn from its learned distribution, which grows with the weight behind it,
+	// and the sum of its lights' means; mirrors lightCacheMix in PT.hlsl
+	float mix(unsigned int cell, float& total) const
+	{
+		total = 0;
+		float samples = 0;
+		for (unsigned int i = 0; i < LIGHT_CACHE_SLOTS; i++)
+		{
+			total += cells[cell].slots[i].mean;
+			samples += cells[cell].slots[i].samples;
+		}
+		return total > 0 ? LIGHT_CACHE_MAX_MIX * std::min(samples / LIGHT_CACHE_CONFIDENT_SAMPLES, 1.0f) : 0;
+	}
+
+	// Picks a light from a cell in proportion to the means; mirrors lightCacheSample in PT.hlsl
+	unsigned int sample(unsigned int cell, float total, float u) const
+	{
+		float target = u * total;
+		unsigned int last = LIGHT_CACHE_INVALID;
+		for (unsigned int i = 0; i < LIGHT_CACHE_SLOTS; i++)
+		{
+			const LightCacheSlot& slot = cells[cell].slots[i];
+			if (slot.mean > 0)
+			{
+				last = slot.lightPlusOne - 1;
+				target -= slot.mean;
+				if (target < 0)
+				{
+					return last;
+				}
+			}
+		}
+		return last;
+	}
+
+	// Probability of sample picking a light; mirrors lightCachePmf in PT.hlsl
+	float pmf(unsigned int cell, float total, unsigned int light) const
+	{
+		for (unsigned int i = 0; i < LIGHT_CACHE_SLOTS; i++)
+		{
+			if (cells[cell].slots[i].lightPlusOne == light + 1)
+			{
+				return cells[cell].slots[i].mean / total;
+			}
+		}
+		return 0;
+	}
+
+	// Folds the deposits into each slot's decaying mean, evicts stale and useless slots, and frees the cell once it has
+	// no slots left; mirrors LightCacheResolve in PT.hlsl
+	void resolveCell(unsigned int cell)
+	{
+		LightCacheCell& c = cells[cell];
+		if (c.checksum == 0)
+		{
+			return;
+		}
+		float total = 0;
+		for (unsigned int i = 0; i < LIGHT_CACHE_SLOTS; i++)
+		{
+			LightCacheSlot& slot = c.slots[i];
+			if (slot.lightPlusOne == 0)
+			{
+				continue;
+			}
+			slot.samples = slot.samples * LIGHT_CACHE_DECAY;
+			if (slot.accumulatedCount > 0)
+			{
+				float sum = (float)slot.accumulated / LIGHT_CACHE_CONTRIBUTION_SCALE;
+				slot.mean = ((slot.mean * slot.samples) + sum) / (slot.samples + (float)slot.accumulatedCount);
+				slot.samples = std::min(slot.samples + (float)slot.accumulatedCount, LIGHT_CACHE_MAX_SAMPLES);
+			}
+			slot.accumulated = 0;
+			slot.accumulatedCount = 0;
+			total += slot.mean;
+		}
+		bool empty = true;
+		for (unsigned int i = 0; i < LIGHT_CACHE_SLOTS; i++)
+		{
+			LightCacheSlot& slot = c.slots[i];
+			if (slot.lightPlusOne == 0)
+			{
+				continue;
+			}
+			if (slot.samples < LIGHT_CACHE_MIN_SAMPLES || (slot.samples >= LIGHT_CACHE_EVICT_SAMPLES && slot.mean <= LIGHT_CACHE_EVICT_FRACTION * total))
+			{
+				slot = LightCacheSlot();
+				continue;
+			}
+			empty = false;
+		}
+		if (empty)
+		{
+			c.checksum = 0;
+		}
+	}
+
+	// Resolves every cell, as the resolve pass does once per frame
+	void resolve()
+	{
+		for (unsigned int i = 0; i < capacity; i++)
+		{
+			resolveCell(i);
+		}
+	}
+
+	// Checks the table and the learned selection on a small table of its own. Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x7F4A7C15u;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+		init(1u << 10);
+		Vec3 pos(1.0f, 2.0f, 3.0f);
+		Vec3 normal(0, 1.0f, 0);
+		float distance = 4.0f;
+
+		// Deposits reach the light's slot and resolve to their mean, and a fresh cell is not used for selection
+		for (int i = 0; i < 10; i++)
+		{
+			deposit(pos, normal, distance, 5, (float)i);
+		}
+		unsigned int cell = find(lightCacheKey(pos, normal, distance));
+		failures += cell != LIGHT_CACHE_INVALID ? 0 : 1;
+		if (cell == LIGHT_CACHE_INVALID)
+		{
+			return failures;
+		}
+		float total;
+		failures += mix(cell, total) == 0 ? 0 : 1;
+		resolveCell(cell);
+		failures += (cells[cell].slots[0].lightPlusOne == 6 && fabsf(cells[cell].slots[0].mean - 4.5f) < 1e-3f && cells[cell].slots[0].samples == 10.0f) ? 0 : 1;
+
+		// The cell fills up to LIGHT_CACHE_SLOTS lights and drops deposits for further lights
+		for (unsigned int light = 100; light < 100 + LIGHT_CACHE_SLOTS; light++)
+		{
+			deposit(pos, normal, distance, light, 1.0f);
+		}
+		int stored = 0;
+		for (unsigned int i = 0; i < LIGHT_CACHE_SLOTS; i++)
+		{
+			stored += cells[cell].slots[i].lightPlusOne != 0 ? 1 : 0;
+		}
+		failures += stored == (int)LIGHT_CACHE_SLOTS ? 0 : 1;
+		failures += cells[cell].slots[LIGHT_CACHE_SLOTS - 1].lightPlusOne == 100 + LIGHT_CACHE_SLOTS - 1 ? 0 : 1;
+
+		// Without new samples the weight decays by LIGHT_CACHE_DECAY per resolve, stale slots are evicted, and the cell
+		// is freed with its last slot
+		init(1u << 10);
+		deposit(pos, normal, distance, 3, 2.0f);
+		cell = find(lightCacheKey(pos, normal, distance));
+		resolveCell(cell);
+		resolveCell(cell);
+		failures += fabsf(cells[cell].slots[0].samples - LIGHT_CACHE_DECAY) < 1e-5f ? 0 : 1;
+		failures += fabsf(cells[cell].slots[0].mean - 2.0f) < 1e-5f ? 0 : 1;
+		int resolves = 2;
+		while (cells[cell].checksum != 0 && resolves < 100)
+		{
+			resolveCell(cell);
+			resolves++;
+		}
+		int expected = 1 + (int)ceilf(logf(LIGHT_CACHE_MIN_SAMPLES) / logf(LIGHT_CACHE_DECAY));
+		failures += (cells[cell].checksum == 0 && resolves == expected && cells[cell].slots[0].lightPlusOne == 0) ? 0 : 1;
+
+		// A light that never contributes is evicted once it has enough samples, while the light next to it stays
+		init(1u << 10);
+		for (int frame = 0; frame < 4; frame++)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				deposit(pos, normal, distance, 1, 1.0f);
+				deposit(pos, normal, distance, 2, 0.0f);
+			}
+			cell = find(lightCacheKey(pos, normal, distance));
+			resolveCell(cell);
+		}
+		failures += (cells[cell].slots[0].lightPlusOne == 2 && cells[cell].slots[1].lightPlusOne == 0) ? 0 : 1;
+
+		// Learning in a cell that sees two of 64 lights of equal power: mixing the learned distribution with uniform
+		// selection concentrates the samples on the two lights, keeps the pmfs normalised and the estimate unbiased
+		init(1u << 10);
+		const int lightCount = 64;
+		float contributions[lightCount] = {};
+		contributions[7] = 3.0f;
+		contributions[41] = 1.0f;
+		float truth = contributions[7] + contributions[41];
+		double estimate = 0;
+		int estimateSamples = 0;
+		float visibleFraction = 0;
+		for (int frame = 0; frame < 64; frame++)
+		{
+			visibleFraction = 0;
+			for (int i = 0; i < 256; i++)
+			{
+				// Select as selectLight does, with the uniform distribution standing in for the default selection
+				unsigned int light = (unsigned int)std::min((int)(next() * lightCount), lightCount - 1);
+				float selectPmf = 1.0f / (float)lightCount;
+				cell = find(lightCacheKey(pos, normal, distance));
+				if (cell != LIGHT_CACHE_INVALID)
+				{
+					float m = mix(cell, total);
+					if (m > 0)
+					{
+						if (next() < m)
+						{
+							light = sample(cell, total, next());
+						}
+						selectPmf = (m * pmf(cell, total, light)) + ((1.0f - m) / (float)lightCount);
+					}
+				}
+				failures += selectPmf > 0 ? 0 : 1;
+				estimate += (double)(contributions[light] / selectPmf);
+				estimateSamples++;
+				visibleFraction += contributions[light] > 0 ? 1.0f / 256.0f : 0;
+				deposit(pos, normal, distance, light, contributions[light]);
+			}
+			resolveCell(find(lightCacheKey(pos, normal, distance)));
+		}
+		cell = find(lightCacheKey(pos, normal, distance));
+		float m = mix(cell, total);
+		float pmfSum = 0;
+		for (unsigned int light = 0; light < lightCount; light++)
+		{
+			pmfSum += (m * pmf(cell, total, light)) + ((1.0f - m) / (float)lightCount);
+		}
+		failures += fabsf(pmfSum - 1.0f) < 1e-4f ? 0 : 1;
+		failures += visibleFraction > 0.7f ? 0 : 1;
+		failures += fabs((estimate / (double)estimateSamples) - (double)truth) < 0.05 * (double)truth ? 0 : 1;
+		return failures;
+	}
+
+private:
+	// Stores desired in value if it holds expected and returns the previous value, as InterlockedCompareExchange does
+	static unsigned int compareExchange(unsigned int& value, unsigned int expected, unsigned int desired)
+	{
+		unsigned int previous = value;
+		if (previous == expected)
+		{
+			value = desired;
+		}
+		return previous;
+	}
+};
@@ -0,0 +1,177 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file implements the CPU side of light selection: a Walker alias table built from per-light
+// weights (emitted power) so that PT.hlsl can pick a light proportionally to its power in O(1)
+
+#include "Math.h"
+#include "Parallel.h"
+#include <vector>
+
+// One entry of the alias table, mirrored by LightAliasEntry in PT.hlsl
+// The pmf of both the entry and its alias are stored so the shader needs a single fetch
+struct LightAliasEntry
+{
+	float threshold;      // Probability of keeping this entry rather than taking the alias
+	unsigned int alias;   // Index returned when the entry is rejected
+	float pmf;            // Selection probability of this entry's light
+	float aliasPmf;       // Selection probability of the alias light
+};
+
+// Returns the luminance of a linear RGB colour
+static float luminance(const float* c)
+{
+	return (0.2126f * c[0]) + (0.7152f * c[1]) + (0.0722f * c[2]);
+}
+
+// Walker alias table over a set of non-negative weights
+class AliasTable
+{
+public:
+	std::vector<LightAliasEntry> entries;
+	std::vector<float> pmfs;
+	double total;
+
+	// Builds the table with Vose's method. The normalisation is computed in parallel, the pairing pass is O(n)
+	void build(const std::vector<float>& weights)
+	{
+		int n = (int)weights.size();
+		entries.resize(n);
+		pmfs.resize(n);
+		if (n == 0)
+		{
+			total = 0;
+			return;
+		}
+
+		// Parallel sum of the weights, using per-thread partial sums in double precision
+		std::vector<double> partialSums(workerThreadCount(), 0.0);
+		parallelForChunks(n, [&](int start, int end, int threadIndex)
+			{
+				double sum = 0;
+				for (int i = start; i < end; i++)
+				{
+					sum += std::max(weights[i], 0.0f);
+				}
+				partialSums[threadIndex] = sum;
+			});
+		total = 0;
+		for (unsigned int i = 0; i < partialSums.size(); i++)
+		{
+			total += partialSums[i];
+		}
+
+		// Normalise, falling back to a uniform distribution if every weight is zero
+		double invTotal = total > 0 ? 1.0 / total : 0;
+		parallelFor(n, [&](int i)
+			{
+				pmfs[i] = total > 0 ? (float)((double)std::max(weights[i], 0.0f) * invTotal) : 1.0f / (float)n;
+			});
+
+		// Vose's alias method: pair each under-full entry with an over-full one
+		std::vector<double> scaled(n);
+		std::vector<int> small;
+		std::vector<int> large;
+		small.reserve(n);
+		large.reserve(n);
+		for (int i = 0; i < n; i++)
+		{
+			scaled[i] = (double)pmfs[i] * (double)n;
+			if (scaled[i] < 1.0)
+			{
+				small.push_back(i);
+			} else
+			{
+				large.push_back(i);
+			}
+		}
+		while (small.empty() == false && large.empty() == false)
+		{
+			int s = small.back();
+			small.pop_back();
+			int l = large.back();
+			entries[s].threshold = (float)scaled[s];
+			entries[s].alias = l;
+			scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+			if (scaled[l] < 1.0)
+			{
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		// Whatever remains is full up to rounding error
+		for (unsigned int i = 0; i < large.size(); i++)
+		{
+			entries[large[i]].threshold = 1.0f;
+			entries[large[i]].alias = large[i];
+		}
+		for (unsigned int i = 0; i < small.size(); i++)
+		{
+			entries[small[i]].threshold = 1.0f;
+			entries[small[i]].alias = small[i];
+		}
+		parallelFor(n, [&](int i)
+			{
+				entries[i].pmf = pmfs[i];
+				entries[i].aliasPmf = pmfs[entries[i].alias];
+			});
+	}
+
+	// Samples an index with two uniform random numbers and returns its probability; mirrors sampleLightIndex in PT.hlsl
+	int sample(float r1, float r2, float& pmf) const
+	{
+		int n = (int)entries.size();
+		int i = std::min((int)(r1 * (float)n), n - 1);
+		if (r2 < entries[i].threshold)
+		{
+			pmf = entries[i].pmf;
+			return i;
+		}
+		pmf = entries[i].aliasPmf;
+		return (int)entries[i].alias;
+	}
+
+	// Reconstructs the distribution encoded by the table and returns the largest absolute
+	// difference from the target probabilities. Used to validate the construction.
+	float verify() const
+	{
+		int n = (int)entries.size();
+		std::vector<double> p(n, 0.0);
+		for (int i = 0; i < n; i++)
+		{
+			p[i] += (double)entries[i].threshold / (double)n;
+			p[entries[i].alias] += (1.0 - (double)entries[i].threshold) / (double)n;
+		}
+		double maxError = 0;
+		for (int i = 0; i < n; i++)
+		{
+			maxError = std::max(maxError, fabs(p[i] - (double)pmfs[i]));
+			maxError = std::max(maxError, (double)fabsf(entries[i].pmf - pmfs[i]));
+			maxError = std::max(maxError, (double)fabsf(entries[i].aliasPmf - pmfs[entries[i].alias]));
+		}
+		return (float)maxError;
+	}
+};
@@ -0,0 +1,182 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file is a CPU reference for the multiple importance sampling in PT.hlsl. It combines light
+// sampling and cosine weighted BSDF sampling of a single triangle light with the power heuristic,
+// exactly as calculateDirect and weightedEmission do, and checks the combined estimate against a
+// low variance reference so that errors in the weights show up as bias.
+
+#include "Math.h"
+#include "SphericalTriangle.h"
+#include <vector>
+
+// Power heuristic (beta = 2) weight for a sample drawn with pdf a, combined with a strategy with pdf b; mirrors powerHeuristic in PT.hlsl
+static float powerHeuristic(float a, float b)
+{
+	float a2 = a * a;
+	float b2 = b * b;
+	return (a2 + b2) > 0 ? a2 / (a2 + b2) : 0;
+}
+
+// Returns the distance along the ray to a triangle, or a negative value if it is missed
+static float intersectTriangle(const Vec3& o, const Vec3& d, const Vec3& v1, const Vec3& v2, const Vec3& v3)
+{
+	Vec3 e1 = v2 - v1;
+	Vec3 e2 = v3 - v1;
+	Vec3 h = Cross(d, e2);
+	float det = Dot(e1, h);
+	if (fabsf(det) < 1e-12f)
+	{
+		return -1.0f;
+	}
+	float invDet = 1.0f / det;
+	Vec3 s = o - v1;
+	float u = Dot(s, h) * invDet;
+	Vec3 q = Cross(s, e1);
+	float v = Dot(d, q) * invDet;
+	if (u < 0 || v < 0 || (u + v) > 1.0f)
+	{
+		return -1.0f;
+	}
+	return Dot(e2, q) * invDet;
+}
+
+struct MISReferenceStats
+{
+	int configurations = 0;
+	float maxWeightSumError = 0;   // Largest deviation of the two strategies' weights from summing to one
+	float maxRelativeError = 0;    // Largest relative difference between the MIS estimate and the reference
+};
+
+// Checks MIS for a diffuse receiver lit by one triangle light, over random receiver positions and orientations
+class MISReference
+{
+public:
+	int configurations = 32;
+	int samples = 1 << 16;          // Samples per strategy for the MIS estimate
+	int referenceSamples = 1 << 20; // Samples for the reference, drawn by solid angle without MIS
+	float selectPmf = 0.5f;         // Light selection probability folded into the light strategy's pdf, as in calculateDirect
+	MISReferenceStats stats;
+
+	// Returns the largest relative error of the MIS estimate
+	float verify()
+	{
+		stats = MISReferenceStats();
+		std::vector<float> weightErrors(configurations, 0);
+		std::vector<float> relativeErrors(configurations, 0);
+		parallelFor(configurations, [&](int c)
+			{
+				unsigned int state = 0x68E31DA4u * (unsigned int)(c + 1);
+				auto next = [&]()
+					{
+						state = (state * 1664525u) + 1013904223u;
+						return (float)(state >> 8) / 16777216.0f;
+					};
+				// A unit sized light facing down and a receiver below it, from touching distance to far away
+				Vec3 v1(-0.5f, 1.0f, -0.5f);
+				Vec3 v2(0.5f, 1.0f, -0.5f);
+				Vec3 v3(0.0f, 1.0f, 0.5f);
+				Vec3 lightNormal(0, -1.0f, 0);
+				float lightArea = Cross(v2 - v1, v3 - v1).length() * 0.5f;
+				float Le = 4.0f;
+				float height = 0.02f + (next() * next() * 8.0f);
+				Vec3 p((next() - 0.5f) * 2.0f, 1.0f - height, (next() - 0.5f) * 2.0f);
+				Vec3 n = Vec3((next() - 0.5f) * 1.5f, 1.0f, (next() - 0.5f) * 1.5f).normalize();
+				Frame frame;
+				frame.fromVector(n);
+				float f = 0.8f / SPHERICAL_PI;
+
+				// Reference: solid angle sampling alone
+				double reference = 0;
+				for (int i = 0; i < referenceSamples; i++)
+				{
+					Vec3 wi;
+					Vec3 lightPoint;
+					float pdf;
+					if (sampleTriangleLight(v1, v2, v3, lightNormal, lightArea, p, next(), next(), wi, lightPoint, pdf) && pdf > 0)
+					{
+						reference += (double)(Le * f * std::max(Dot(n, wi), 0.0f) / pdf);
+					}
+				}
+				reference /= (double)referenceSamples;
+
+				// MIS: light sampling (with the selection pmf) plus cosine weighted BSDF sampling
+				double estimate = 0;
+				float weightError = 0;
+				for (int i = 0; i < samples; i++)
+				{
+					Vec3 wi;
+					Vec3 lightPoint;
+					float pdf;
+					if (next() < selectPmf)
+					{
+						if (sampleTriangleLight(v1, v2, v3, lightNormal, lightArea, p, next(), next(), wi, lightPoint, pdf) && pdf > 0)
+						{
+							float cosTheta = Dot(n, wi);
+							if (cosTheta > 0)
+							{
+								float lightPdf = selectPmf * pdf;
+								float bsdfPdf = cosTheta / SPHERICAL_PI;
+								float weight = powerHeuristic(lightPdf, bsdfPdf);
+								weightError = std::max(weightError, fabsf((weight + powerHeuristic(bsdfPdf, lightPdf)) - 1.0f));
+								estimate += (double)(Le * f * cosTheta * weight / lightPdf);
+							}
+						}
+					} else
+					{
+						next();
+						next();
+					}
+					// BSDF sampling, as in sampleBSDF for diffuse surfaces
+					float r1 = next();
+					float r2 = next();
+					float theta = acosf(sqrtf(r1));
+					float phi = 2.0f * SPHERICAL_PI * r2;
+					Vec3 local(cosf(phi) * sinf(theta), sinf(phi) * sinf(theta), cosf(theta));
+					wi = frame.toWorld(local);
+					float bsdfPdf = local.z / SPHERICAL_PI;
+					float t = intersectTriangle(p, wi, v1, v2, v3);
+					if (t > 0 && bsdfPdf > 0 && Dot(lightNormal, -wi) > 0)
+					{
+						lightPoint = p + (wi * t);
+						float lightPdf = selectPmf * triangleLightPdf(v1, v2, v3, lightNormal, lightArea, p, wi, lightPoint);
+						float weight = powerHeuristic(bsdfPdf, lightPdf);
+						estimate += (double)(Le * f * local.z * weight / bsdfPdf);
+					}
+				}
+				estimate /= (double)samples;
+				weightErrors[c] = weightError;
+				relativeErrors[c] = reference > 0 ? (float)(fabs(estimate - reference) / reference) : (float)estimate;
+			}, 1);
+		for (int c = 0; c < configurations; c++)
+		{
+			stats.configurations++;
+			stats.maxWeightSumError = std::max(stats.maxWeightSumError, weightErrors[c]);
+			stats.maxRelativeError = std::max(stats.maxRelativeError, relativeErrors[c]);
+		}
+		return stats.maxRelativeError;
+	}
+};
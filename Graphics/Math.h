@@ -25,6 +25,8 @@ SOFTWARE.
 #pragma once
 
 #include <cmath>
+#include <cstring>
+#include <cfloat>
 #include <algorithm>
 
 #define SQ(x) ((x) * (x))
@@ -72,6 +74,62 @@ static Vec3 Cross(const Vec3 &v1, const Vec3 &v2) { return Vec3((v1.y * v2.z) -
 static Vec3 Max(const Vec3& v1, const Vec3& v2) { return Vec3(std::max(v1.x, v2.x), std::max(v1.y, v2.y), std::max(v1.z, v2.z)); }
 static Vec3 Min(const Vec3& v1, const Vec3& v2) { return Vec3(std::min(v1.x, v2.x), std::min(v1.y, v2.y), std::min(v1.z, v2.z)); }
 
+class AABB
+{
+public:
+	Vec3 max;
+	Vec3 min;
+	AABB()
+	{
+		reset();
+	}
+	void reset()
+	{
+		max = Vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		min = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	}
+	void extend(const Vec3& p)
+	{
+		max = Max(max, p);
+		min = Min(min, p);
+	}
+	void extend(const AABB& box)
+	{
+		max = Max(max, box.max);
+		min = Min(min, box.min);
+	}
+	bool valid() const
+	{
+		return min.x <= max.x && min.y <= max.y && min.z <= max.z;
+	}
+	Vec3 centre() const
+	{
+		return (max + min) * 0.5f;
+	}
+	Vec3 size() const
+	{
+		return max - min;
+	}
+	float area() const
+	{
+		if (!valid())
+		{
+			return 0;
+		}
+		Vec3 s = max - min;
+		return 2.0f * ((s.x * s.y) + (s.y * s.z) + (s.x * s.z));
+	}
+	float volume() const
+	{
+		if (!valid())
+		{
+			return 0;
+		}
+		Vec3 s = max - min;
+		return s.x * s.y * s.z;
+	}
+};
+
 class alignas(64) Matrix
 {
 public:
@@ -0,0 +1,84 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// Small helpers for running CPU side scene processing across worker threads
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// Returns the number of worker threads to use for CPU side processing
+static int workerThreadCount()
+{
+	unsigned int n = std::thread::hardware_concurrency();
+	return n > 0 ? (int)n : 4;
+}
+
+// Splits [0, n) into one contiguous chunk per worker thread and calls func(start, end, threadIndex) for each chunk
+// Ranges smaller than minChunkSize per thread run on fewer threads, down to running inline on the calling thread
+template<typename F>
+void parallelForChunks(int n, F func, int minChunkSize = 1024)
+{
+	if (n <= 0)
+	{
+		return;
+	}
+	int numThreads = std::min(workerThreadCount(), std::max(n / std::max(minChunkSize, 1), 1));
+	if (numThreads == 1)
+	{
+		func(0, n, 0);
+		return;
+	}
+	std::vector<std::thread> threads;
+	int chunk = (n + numThreads - 1) / numThreads;
+	for (int t = 0; t < numThreads; t++)
+	{
+		int start = t * chunk;
+		int end = std::min(start + chunk, n);
+		if (start >= end)
+		{
+			break;
+		}
+		threads.push_back(std::thread(func, start, end, t));
+	}
+	for (unsigned int t = 0; t < threads.size(); t++)
+	{
+		threads[t].join();
+	}
+}
+
+// Calls func(i) for every i in [0, n) across the worker threads
+template<typename F>
+void parallelFor(int n, F func, int minChunkSize = 1024)
+{
+	parallelForChunks(n, [&](int start, int end, int)
+		{
+			for (int i = start; i < end; i++)
+			{
+				func(i);
+			}
+		}, minChunkSize);
+}
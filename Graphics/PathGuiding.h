@@ -0,0 +1,808 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file holds the SD-tree behind path guiding in PT.hlsl, after Mueller et al.'s practical path guiding. A binary
+// tree over the scene's bounds (the S-tree) splits space along alternating axes, and each of its leaves owns a
+// quadtree over the square that directions map to (the D-tree) holding how much radiance arrives from each region.
+// The GPU samples scattering directions from the D-tree of the leaf around each vertex, mixed with the BSDF, and writes
+// a record of the radiance every sampled direction gathered. Between frames the records are read back and splatted
+// into a second set of D-trees on the CPU worker threads. Training runs in iterations of doubling length; at the end
+// of each, leaves holding many records are split, the recorded trees become the trees sampled from, and their
+// structure is refined to where their energy lies for recording the next iteration. guidingTree, guidingPdf and
+// guidingSample in PT.hlsl mirror leaf, DTree::pdf and DTree::sample. verify() checks the trees and the learning,
+// and benchmark() measures the training throughput.
+
+#include "Math.h"
+#include "Parallel.h"
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+static const float GUIDING_PI = 3.14159265358979f;
+// Fraction of the scattering directions at guided vertices drawn from the D-tree rather than the BSDF
+static const float GUIDING_FRACTION = 0.5f;
+// Deepest level of a D-tree, and the share of a D-tree's energy above which a quadrant is subdivided
+static const int GUIDING_DTREE_MAX_DEPTH = 20;
+static const float GUIDING_DTREE_THRESHOLD = 0.01f;
+// A leaf of the S-tree is split once it holds more than this many records times the square root of 2^iteration
+static const float GUIDING_STREE_THRESHOLD = 12000.0f;
+// Records the GPU writes per frame at most, including the record heading the buffer
+static const int GUIDING_MAX_RECORDS = 1 << 20;
+// Training iterations, of 2^iteration frames each, after which the trees stay as they are
+static const int GUIDING_ITERATIONS = 8;
+// Child index marking a node without children; no node has the root as a child
+static const unsigned int GUIDING_LEAF = 0;
+// Bits of the guidingMode constant in PT.hlsl
+static const unsigned int GUIDING_SAMPLE = 1;
+static const unsigned int GUIDING_RECORD = 2;
+
+// A node of the SD-tree as the GPU sees it, laid out as GuidingNode in PT.hlsl (32 bytes). D-tree nodes hold the
+// energy of their four quadrants and the index of each quadrant's node. S-tree nodes come first in the buffer and use
+// children as (first child, second child, axis, D-tree root), with the root only set on leaves
+struct GuidingNode
+{
+	float sums[4] = {};
+	unsigned int children[4] = {};
+};
+
+// Radiance gathered by one sampled direction, written by the GPU and laid out as GuidingRecord in PT.hlsl (32 bytes).
+// The first record of the buffer only heads it, counting the records written after it
+struct GuidingRecord
+{
+	float position[3] = {};
+	float value = 0;                    // Luminance of the incident radiance divided by the direction's pdf
+	float direction[2] = {};            // The direction mapped to the square
+	unsigned int count = 0;
+	unsigned int pad = 0;
+};
+
+// Maps a direction to the unit square by its cosine around z and its azimuth. The map preserves area, so a density
+// over the square divided by 4 pi is a density over solid angle; mirrors guidingDirectionToSquare in PT.hlsl
+static void guidingDirectionToSquare(const Vec3& d, float& u, float& v)
+{
+	u = std::min(std::max((d.z * 0.5f) + 0.5f, 0.0f), 1.0f);
+	float phi = atan2f(d.y, d.x) / (2.0f * GUIDING_PI);
+	v = phi < 0 ? phi + 1.0f : phi;
+}
+
+// Inverse of guidingDirectionToSquare; mirrors guidingSquareToDirection in PT.hlsl
+static Vec3 guidingSquareToDirection(float u, float v)
+{
+	float cosTheta = (2.0f * u) - 1.0f;
+	float sinTheta = sqrtf(std::max(1.0f - (cosTheta * cosTheta), 0.0f));
+	float phi = 2.0f * GUIDING_PI * v;
+	return Vec3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta);
+}
+
+// Directional quadtree over the square directions map to
+class DTree
+{
+public:
+	std::vector<GuidingNode> nodes;
+	float samples = 0;                  // Records splatted into the tree
+
+	DTree()
+	{
+		nodes.push_back(GuidingNode());
+	}
+
+	float total() const
+	{
+		return nodes[0].sums[0] + nodes[0].sums[1] + nodes[0].sums[2] + nodes[0].sums[3];
+	}
+
+	// Returns the quadrant of a node holding a point of its square and rescales the point to the quadrant's square;
+	// mirrors guidingQuadrant in PT.hlsl
+	static unsigned int quadrant(float& u, float& v)
+	{
+		unsigned int qx = u >= 0.5f ? 1 : 0;
+		unsigned int qy = v >= 0.5f ? 1 : 0;
+		u = (u * 2.0f) - (float)qx;
+		v = (v * 2.0f) - (float)qy;
+		return qx + (2 * qy);
+	}
+
+	// Adds a record's value to every quadrant holding its direction, from the root down to a leaf
+	void record(float u, float v, float value)
+	{
+		samples += 1.0f;
+		unsigned int node = 0;
+		while (true)
+		{
+			unsigned int q = quadrant(u, v);
+			nodes[node].sums[q] += value;
+			if (nodes[node].children[q] == GUIDING_LEAF)
+			{
+				return;
+			}
+			node = nodes[node].children[q];
+		}
+	}
+
+	// Density over solid angle of the directions sample draws, uniform over the sphere while the tree is empty;
+	// mirrors guidingPdf in PT.hlsl
+	float pdf(float u, float v) const
+	{
+		float p = 1.0f;
+		unsigned int node = 0;
+		while (true)
+		{
+			const GuidingNode& n = nodes[node];
+			float t = n.sums[0] + n.sums[1] + n.sums[2] + n.sums[3];
+			if (t <= 0)
+			{
+				break;
+			}
+			unsigned int q = quadrant(u, v);
+			p = p * 4.0f * n.sums[q] / t;
+			if (n.children[q] == GUIDING_LEAF)
+			{
+				break;
+			}
+			node = n.children[q];
+		}
+		return p / (4.0f * GUIDING_PI);
+	}
+
+	// Draws a point of the square proportionally to the energy, choosing the column then the row of a quadrant at
+	// every level and rescaling the random numbers to reuse them below; mirrors guidingSample in PT.hlsl
+	void sample(float r1, float r2, float& u, float& v) const
+	{
+		float ox = 0;
+		float oy = 0;
+		float size = 1.0f;
+		unsigned int node = 0;
+		while (true)
+		{
+			const GuidingNode& n = nodes[node];
+			float t = n.sums[0] + n.sums[1] + n.sums[2] + n.sums[3];
+			if (t <= 0)
+			{
+				break;
+			}
+			float left = (n.sums[0] + n.sums[2]) / t;
+			unsigned int qx = r1 < left ? 0 : 1;
+			r1 = qx == 0 ? r1 / left : (r1 - left) / (1.0f - left);
+			float bottom = n.sums[qx] / (n.sums[qx] + n.sums[qx + 2]);
+			unsigned int qy = r2 < bottom ? 0 : 1;
+			r2 = qy == 0 ? r2 / bottom : (r2 - bottom) / (1.0f - bottom);
+			r1 = std::min(r1, 0.99999994f);
+			r2 = std::min(r2, 0.99999994f);
+			size = size * 0.5f;
+			ox += (float)qx * size;
+			oy += (float)qy * size;
+			unsigned int q = qx + (2 * qy);
+			if (n.children[q] == GUIDING_LEAF)
+			{
+				break;
+			}
+			node = n.children[q];
+		}
+		u = ox + (r1 * size);
+		v = oy + (r2 * size);
+	}
+
+	// Returns an empty tree whose structure follows this tree's energy. Quadrants holding more than threshold of the
+	// total are subdivided, down to the maximum depth, spreading the energy of quadrants this tree does not subdivide
+	// evenly over their children; all other quadrants stay leaves
+	DTree refined(float threshold = GUIDING_DTREE_THRESHOLD) const
+	{
+		DTree result;
+		float t = total();
+		if (t <= 0)
+		{
+			return result;
+		}
+		struct Entry
+		{
+			unsigned int node;          // Node of the new tree
+			int source;                 // Node of this tree covering the same square, or -1
+			float sums[4];
+			int depth;
+		};
+		std::vector<Entry> stack;
+		Entry root = { 0, 0, { nodes[0].sums[0], nodes[0].sums[1], nodes[0].sums[2], nodes[0].sums[3] }, 1 };
+		stack.push_back(root);
+		while (stack.size() > 0)
+		{
+			Entry e = stack.back();
+			stack.pop_back();
+			for (unsigned int q = 0; q < 4; q++)
+			{
+				if (e.depth >= GUIDING_DTREE_MAX_DEPTH || e.sums[q] <= threshold * t)
+				{
+					continue;
+				}
+				Entry child;
+				child.node = (unsigned int)result.nodes.size();
+				child.depth = e.depth + 1;
+				child.source = (e.source >= 0 && nodes[e.source].children[q] != GUIDING_LEAF) ? (int)nodes[e.source].children[q] : -1;
+				for (unsigned int c = 0; c < 4; c++)
+				{
+					child.sums[c] = child.source >= 0 ? nodes[child.source].sums[c] : e.sums[q] * 0.25f;
+				}
+				result.nodes.push_back(GuidingNode());
+				result.nodes[e.node].children[q] = child.node;
+				stack.push_back(child);
+			}
+		}
+		return result;
+	}
+
+	// Scales the energy and the record count, as when a leaf is split and both halves inherit its tree
+	void scale(float s)
+	{
+		for (unsigned int i = 0; i < nodes.size(); i++)
+		{
+			for (unsigned int q = 0; q < 4; q++)
+			{
+				nodes[i].sums[q] *= s;
+			}
+		}
+		samples *= s;
+	}
+
+	int depth() const
+	{
+		int deepest = 0;
+		std::vector<std::pair<unsigned int, int>> stack(1, std::make_pair(0u, 1));
+		while (stack.size() > 0)
+		{
+			std::pair<unsigned int, int> e = stack.back();
+			stack.pop_back();
+			deepest = std::max(deepest, e.second);
+			for (unsigned int q = 0; q < 4; q++)
+			{
+				if (nodes[e.first].children[q] != GUIDING_LEAF)
+				{
+					stack.push_back(std::make_pair(nodes[e.first].children[q], e.second + 1));
+				}
+			}
+		}
+		return deepest;
+	}
+};
+
+// A node of the S-tree. Leaves have no children and own the D-trees with index dtree; axis is the axis the node is
+// split along, or will be once it is
+struct STreeNode
+{
+	unsigned int children[2] = {};
+	unsigned int axis = 0;
+	unsigned int dtree = 0;
+};
+
+// Throughput of the training measured by PathGuiding::benchmark
+struct PathGuidingBenchmark
+{
+	int records = 0;
+	double recordsPerSecond = 0;        // Records splatted into the D-trees, including finding their leaves
+	double refineSeconds = 0;           // Time to split the S-tree and refine every D-tree at the end of an iteration
+	int leaves = 0;                     // S-tree leaves after the refinement
+	int directionalNodes = 0;           // D-tree nodes the GPU samples from after the refinement
+};
+
+class PathGuiding
+{
+public:
+	Vec3 boundsMin;
+	Vec3 boundsMax;
+	std::vector<STreeNode> spatialNodes;
+	std::vector<DTree> samplingTrees;   // D-trees the GPU samples from, per S-tree leaf
+	std::vector<DTree> buildingTrees;   // D-trees recording this iteration, per S-tree leaf
+	int iteration = 0;
+	int framesLeft = 1;                 // Frames left in this iteration
+
+	// Starts from a single leaf over a cube around the scene's bounds, so that splits halve cells evenly
+	void init(const Vec3& min, const Vec3& max)
+	{
+		Vec3 centre = (min + max) * 0.5f;
+		Vec3 size = max - min;
+		float extent = std::max(std::max(std::max(size.x, size.y), size.z), 1e-3f) * 0.51f;
+		boundsMin = centre - Vec3(extent, extent, extent);
+		boundsMax = centre + Vec3(extent, extent, extent);
+		spatialNodes.assign(1, STreeNode());
+		samplingTrees.assign(1, DTree());
+		buildingTrees.assign(1, DTree());
+		iteration = 0;
+		framesLeft = 1;
+	}
+
+	bool training() const
+	{
+		return iteration < GUIDING_ITERATIONS;
+	}
+
+	// Bits of guidingMode: records are written while training, and directions are sampled from the D-trees once the
+	// first iteration has trained them
+	unsigned int mode() const
+	{
+		return (iteration > 0 ? GUIDING_SAMPLE : 0) | (training() ? GUIDING_RECORD : 0);
+	}
+
+	// Returns the D-trees of the leaf holding a point; mirrors guidingTree in PT.hlsl
+	unsigned int leaf(const Vec3& p) const
+	{
+		Vec3 lo = boundsMin;
+		Vec3 hi = boundsMax;
+		unsigned int node = 0;
+		while (true)
+		{
+			const STreeNode& n = spatialNodes[node];
+			if (n.children[0] == GUIDING_LEAF)
+			{
+				return n.dtree;
+			}
+			float mid = (lo.coords[n.axis] + hi.coords[n.axis]) * 0.5f;
+			if (p.coords[n.axis] < mid)
+			{
+				hi.coords[n.axis] = mid;
+				node = n.children[0];
+			} else
+			{
+				lo.coords[n.axis] = mid;
+				node = n.children[1];
+			}
+		}
+	}
+
+	// Splats records into the building D-trees. Records are sorted by leaf first, keeping their order, so that every
+	// tree is filled by a single worker thread
+	void record(const GuidingRecord* records, int count)
+	{
+		std::vector<unsigned int> leaves(count);
+		parallelFor(count, [&](int i)
+			{
+				leaves[i] = leaf(Vec3(records[i].position[0], records[i].position[1], records[i].position[2]));
+			});
+		std::vector<int> offsets(buildingTrees.size() + 1, 0);
+		for (int i = 0; i < count; i++)
+		{
+			offsets[leaves[i] + 1]++;
+		}
+		for (unsigned int i = 0; i < buildingTrees.size(); i++)
+		{
+			offsets[i + 1] += offsets[i];
+		}
+		std::vector<int> order(count);
+		std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+		for (int i = 0; i < count; i++)
+		{
+			order[cursor[leaves[i]]++] = i;
+		}
+		parallelFor((int)buildingTrees.size(), [&](int t)
+			{
+				for (int k = offsets[t]; k < offsets[t + 1]; k++)
+				{
+					const GuidingRecord& r = records[order[k]];
+					if (std::isfinite(r.value) && r.value >= 0)
+					{
+						buildingTrees[t].record(r.direction[0], r.direction[1], r.value);
+					}
+				}
+			}, 1);
+	}
+
+	// Ends an iteration: splits the leaves that recorded too much, has the GPU sample from the recorded trees and
+	// records the next iteration into trees refined from them
+	void refine()
+	{
+		float threshold = GUIDING_STREE_THRESHOLD * sqrtf(powf(2.0f, (float)iteration));
+		for (unsigned int i = 0; i < spatialNodes.size(); i++)
+		{
+			// Nodes appended here are visited later in the loop, which keeps splitting until every leaf is below the threshold
+			if (spatialNodes[i].children[0] != GUIDING_LEAF || buildingTrees[spatialNodes[i].dtree].samples <= threshold)
+			{
+				continue;
+			}
+			unsigned int dtree = spatialNodes[i].dtree;
+			buildingTrees[dtree].scale(0.5f);
+			STreeNode child;
+			child.axis = (spatialNodes[i].axis + 1) % 3;
+			child.dtree = dtree;
+			spatialNodes[i].children[0] = (unsigned int)spatialNodes.size();
+			spatialNodes.push_back(child);
+			child.dtree = (unsigned int)buildingTrees.size();
+			buildingTrees.push_back(buildingTrees[dtree]);
+			spatialNodes[i].children[1] = (unsigned int)spatialNodes.size();
+			spatialNodes.push_back(child);
+		}
+		samplingTrees = buildingTrees;
+		parallelFor((int)buildingTrees.size(), [&](int t)
+			{
+				buildingTrees[t] = samplingTrees[t].refined();
+			}, 1);
+		iteration++;
+		framesLeft = 1 << std::min(iteration, 30);
+	}
+
+	// Counts a trained frame, ending the iteration after its last frame. Returns true if the sampled trees changed
+	bool endFrame()
+	{
+		if (training() == false)
+		{
+			return false;
+		}
+		framesLeft--;
+		if (framesLeft > 0)
+		{
+			return false;
+		}
+		refine();
+		return true;
+	}
+
+	// Lays the S-tree and the sampled D-trees out for the GPU: the S-tree first, then every D-tree with its child
+	// indices offset to where it starts
+	void flatten(std::vector<GuidingNode>& out) const
+	{
+		out.assign(spatialNodes.size(), GuidingNode());
+		std::vector<unsigned int> roots(samplingTrees.size());
+		for (unsigned int t = 0; t < samplingTrees.size(); t++)
+		{
+			unsigned int base = (unsigned int)out.size();
+			roots[t] = base;
+			for (unsigned int i = 0; i < samplingTrees[t].nodes.size(); i++)
+			{
+				GuidingNode n = samplingTrees[t].nodes[i];
+				for (unsigned int q = 0; q < 4; q++)
+				{
+					n.children[q] = n.children[q] == GUIDING_LEAF ? GUIDING_LEAF : n.children[q] + base;
+				}
+				out.push_back(n);
+			}
+		}
+		for (unsigned int i = 0; i < spatialNodes.size(); i++)
+		{
+			const STreeNode& n = spatialNodes[i];
+			out[i].children[0] = n.children[0];
+			out[i].children[1] = n.children[1];
+			out[i].children[2] = n.axis;
+			out[i].children[3] = n.children[0] == GUIDING_LEAF ? roots[n.dtree] : 0;
+		}
+	}
+
+	// Checks the direction mapping, the D-trees, the S-tree and the learning on trees of their own. Returns the number
+	// of failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x2545F491u;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+
+		// The mapping round trips, and uniform points of the square are uniform directions
+		float roundTripError = 0;
+		double meanZ = 0;
+		double meanZ2 = 0;
+		const int mappingSamples = 1 << 16;
+		for (int i = 0; i < mappingSamples; i++)
+		{
+			Vec3 d = guidingSquareToDirection(next(), next());
+			float u;
+			float v;
+			guidingDirectionToSquare(d, u, v);
+			Vec3 back = guidingSquareToDirection(u, v);
+			roundTripError = std::max(roundTripError, (back - d).length());
+			meanZ += d.z;
+			meanZ2 += d.z * d.z;
+		}
+		failures += roundTripError < 1e-4f ? 0 : 1;
+		failures += fabs(meanZ / mappingSamples) < 0.01 ? 0 : 1;
+		failures += fabs((meanZ2 / mappingSamples) - (1.0 / 3.0)) < 0.01 ? 0 : 1;
+
+		// Uniform energy subdivides the levels whose quadrants hold more than the threshold, 1/4, 1/16 and 1/64 of it
+		DTree uniform;
+		for (int i = 0; i < 1 << 16; i++)
+		{
+			uniform.record(next(), next(), 1.0f);
+		}
+		DTree uniformRefined = uniform.refined();
+		failures += (uniformRefined.nodes.size() == 85 && uniformRefined.total() == 0 && uniformRefined.samples == 0) ? 0 : 1;
+
+		// A narrow lobe is followed deep into the tree, the pdf integrates to one, sample draws what pdf reports, and
+		// estimates of the lobe's integral with it are unbiased
+		Vec3 axis = Vec3(0.3f, -0.5f, 0.8f).normalize();
+		auto lobe = [&](const Vec3& d)
+			{
+				return expf(200.0f * (Dot(d, axis) - 1.0f));
+			};
+		float lobeIntegral = 2.0f * GUIDING_PI * (1.0f - expf(-400.0f)) / 200.0f;
+		DTree lobeTree;
+		for (int round = 0; round < 6; round++)
+		{
+			DTree next_ = lobeTree.refined();
+			if (round == 0)
+			{
+				next_ = DTree();
+			}
+			for (int i = 0; i < 1 << 15; i++)
+			{
+				float u;
+				float v;
+				if (round == 0)
+				{
+					u = next();
+					v = next();
+				} else
+				{
+					lobeTree.sample(next(), next(), u, v);
+				}
+				float p = round == 0 ? 1.0f / (4.0f * GUIDING_PI) : lobeTree.pdf(u, v);
+				next_.record(u, v, p > 0 ? lobe(guidingSquareToDirection(u, v)) / p : 0);
+			}
+			lobeTree = next_;
+		}
+		failures += lobeTree.depth() >= 6 ? 0 : 1;
+		// The midpoints of a grid finer than the deepest level integrate the piecewise constant pdf exactly
+		int grid = 1 << std::min(lobeTree.depth() + 1, 12);
+		double pdfIntegral = 0;
+		for (int y = 0; y < grid; y++)
+		{
+			for (int x = 0; x < grid; x++)
+			{
+				pdfIntegral += lobeTree.pdf(((float)x + 0.5f) / (float)grid, ((float)y + 0.5f) / (float)grid);
+			}
+		}
+		pdfIntegral = pdfIntegral * 4.0 * GUIDING_PI / ((double)grid * (double)grid);
+		failures += fabs(pdfIntegral - 1.0) < 1e-3 ? 0 : 1;
+		double lobeEstimate = 0;
+		int zeroPdf = 0;
+		for (int i = 0; i < 1 << 18; i++)
+		{
+			float u;
+			float v;
+			lobeTree.sample(next(), next(), u, v);
+			float p = lobeTree.pdf(u, v);
+			zeroPdf += p > 0 ? 0 : 1;
+			lobeEstimate += p > 0 ? lobe(guidingSquareToDirection(u, v)) / p : 0;
+		}
+		failures += zeroPdf == 0 ? 0 : 1;
+		failures += fabs((lobeEstimate / (1 << 18)) - lobeIntegral) < 0.02 * lobeIntegral ? 0 : 1;
+
+		// Leaves that record too much are split until every leaf is below the threshold, halving their records, and
+		// the parallel splatting matches splatting one record at a time
+		init(Vec3(0, 0, 0), Vec3(8.0f, 8.0f, 8.0f));
+		std::vector<GuidingRecord> records(100000);
+		for (unsigned int i = 0; i < records.size(); i++)
+		{
+			// Most records cluster in one corner
+			float s = i % 4 == 0 ? 8.0f : 1.0f;
+			records[i].position[0] = next() * s;
+			records[i].position[1] = next() * s;
+			records[i].position[2] = next() * s;
+			records[i].direction[0] = next();
+			records[i].direction[1] = next();
+			records[i].value = next();
+		}
+		record(records.data(), (int)records.size());
+		DTree serial;
+		for (unsigned int i = 0; i < records.size(); i++)
+		{
+			serial.record(records[i].direction[0], records[i].direction[1], records[i].value);
+		}
+		bool same = serial.samples == buildingTrees[0].samples;
+		for (unsigned int q = 0; q < 4; q++)
+		{
+			same = same && serial.nodes[0].sums[q] == buildingTrees[0].nodes[0].sums[q];
+		}
+		failures += same ? 0 : 1;
+		refine();
+		float threshold = GUIDING_STREE_THRESHOLD;
+		float recorded = 0;
+		int leaves = 0;
+		bool belowThreshold = true;
+		for (unsigned int i = 0; i < spatialNodes.size(); i++)
+		{
+			if (spatialNodes[i].children[0] == GUIDING_LEAF)
+			{
+				leaves++;
+				recorded += samplingTrees[spatialNodes[i].dtree].samples;
+				belowThreshold = belowThreshold && samplingTrees[spatialNodes[i].dtree].samples <= threshold;
+			}
+		}
+		failures += (leaves > 8 && belowThreshold && fabsf(recorded - (float)records.size()) < 1.0f) ? 0 : 1;
+		// Leaves are found by their cells: a point and the centre of its leaf's cell share the leaf
+		int wrongLeaf = 0;
+		for (int i = 0; i < 1000; i++)
+		{
+			Vec3 p(next() * 8.0f, next() * 8.0f, next() * 8.0f);
+			Vec3 lo = boundsMin;
+			Vec3 hi = boundsMax;
+			unsigned int node = 0;
+			while (spatialNodes[node].children[0] != GUIDING_LEAF)
+			{
+				unsigned int a = spatialNodes[node].axis;
+				float mid = (lo.coords[a] + hi.coords[a]) * 0.5f;
+				bool first = p.coords[a] < mid;
+				(first ? hi : lo).coords[a] = mid;
+				node = spatialNodes[node].children[first ? 0 : 1];
+			}
+			wrongLeaf += leaf((lo + hi) * 0.5f) == spatialNodes[node].dtree ? 0 : 1;
+		}
+		failures += wrongLeaf == 0 ? 0 : 1;
+		// The flattened nodes lead the GPU to the same D-trees
+		std::vector<GuidingNode> flat;
+		flatten(flat);
+		int wrongFlat = 0;
+		for (int i = 0; i < 1000; i++)
+		{
+			Vec3 p(next() * 8.0f, next() * 8.0f, next() * 8.0f);
+			unsigned int node = 0;
+			Vec3 lo = boundsMin;
+			Vec3 hi = boundsMax;
+			while (flat[node].children[0] != GUIDING_LEAF)
+			{
+				unsigned int a = flat[node].children[2];
+				float mid = (lo.coords[a] + hi.coords[a]) * 0.5f;
+				bool first = p.coords[a] < mid;
+				(first ? hi : lo).coords[a] = mid;
+				node = flat[node].children[first ? 0 : 1];
+			}
+			const DTree& tree = samplingTrees[leaf(p)];
+			wrongFlat += memcmp(flat[flat[node].children[3]].sums, tree.nodes[0].sums, sizeof(tree.nodes[0].sums)) == 0 ? 0 : 1;
+		}
+		failures += wrongFlat == 0 ? 0 : 1;
+
+		// Learning at a point facing up, lit dimly from everywhere and brightly through a small window: training
+		// concentrates the guided directions on the window, and mixing them with cosine sampling, as shadeHit does,
+		// keeps the estimate unbiased and cuts the variance
+		Vec3 window = Vec3(0.5f, 0, 0.8660254f);
+		float windowCos = cosf(5.0f * GUIDING_PI / 180.0f);
+		auto incident = [&](const Vec3& d)
+			{
+				return Dot(d, window) > windowCos ? 50.0f : 0.1f;
+			};
+		auto cosineSample = [&]()
+			{
+				float r = sqrtf(next());
+				float phi = 2.0f * GUIDING_PI * next();
+				return Vec3(r * cosf(phi), r * sinf(phi), sqrtf(std::max(1.0f - (r * r), 0.0f)));
+			};
+		double reference = 0;
+		const int referenceSamples = 1 << 22;
+		for (int i = 0; i < referenceSamples; i++)
+		{
+			reference += incident(cosineSample());
+		}
+		reference /= referenceSamples;
+		init(Vec3(0, 0, 0), Vec3(1.0f, 1.0f, 1.0f));
+		double cosineMoments[2] = {};
+		double guidedMoments[2] = {};
+		int measured = 0;
+		float windowFraction = 0;
+		while (iteration < 6)
+		{
+			std::vector<GuidingRecord> frame(1 << 14);
+			int inWindow = 0;
+			for (unsigned int i = 0; i < frame.size(); i++)
+			{
+				const DTree& tree = samplingTrees[leaf(Vec3(0.5f, 0.5f, 0.5f))];
+				Vec3 d;
+				bool guided = (mode() & GUIDING_SAMPLE) != 0 && next() < GUIDING_FRACTION;
+				float u;
+				float v;
+				if (guided)
+				{
+					tree.sample(next(), next(), u, v);
+					d = guidingSquareToDirection(u, v);
+				} else
+				{
+					d = cosineSample();
+					guidingDirectionToSquare(d, u, v);
+				}
+				float bsdfPdf = std::max(d.z, 0.0f) / GUIDING_PI;
+				float pdf = (mode() & GUIDING_SAMPLE) != 0 ? ((1.0f - GUIDING_FRACTION) * bsdfPdf) + (GUIDING_FRACTION * tree.pdf(u, v)) : bsdfPdf;
+				float estimate = pdf > 0 ? incident(d) * std::max(d.z, 0.0f) / GUIDING_PI / pdf : 0;
+				inWindow += guided && Dot(d, window) > windowCos ? 1 : 0;
+				frame[i].position[0] = 0.5f;
+				frame[i].position[1] = 0.5f;
+				frame[i].position[2] = 0.5f;
+				frame[i].direction[0] = u;
+				frame[i].direction[1] = v;
+				frame[i].value = pdf > 0 ? incident(d) / pdf : 0;
+				if (iteration == 5)
+				{
+					guidedMoments[0] += estimate;
+					guidedMoments[1] += estimate * estimate;
+					float c = incident(cosineSample());
+					cosineMoments[0] += c;
+					cosineMoments[1] += c * c;
+					measured++;
+				}
+			}
+			windowFraction = (float)inWindow / ((float)frame.size() * GUIDING_FRACTION);
+			record(frame.data(), (int)frame.size());
+			endFrame();
+		}
+		double guidedMean = guidedMoments[0] / measured;
+		double guidedVariance = (guidedMoments[1] / measured) - (guidedMean * guidedMean);
+		double cosineMean = cosineMoments[0] / measured;
+		double cosineVariance = (cosineMoments[1] / measured) - (cosineMean * cosineMean);
+		failures += windowFraction > 0.5f ? 0 : 1;
+		failures += fabs(guidedMean - reference) < 0.03 * reference ? 0 : 1;
+		failures += guidedVariance * 4.0 < cosineVariance ? 0 : 1;
+		return failures;
+	}
+
+	// Measures the training throughput on records spread over a scene sized box, from a scene with a few bright
+	// directions: the splatting of one GPU frame's worth of records, then the refinement ending the iteration
+	PathGuidingBenchmark benchmark(int records = GUIDING_MAX_RECORDS - 1)
+	{
+		PathGuidingBenchmark result;
+		init(Vec3(-20.0f, 0, -20.0f), Vec3(20.0f, 10.0f, 20.0f));
+		unsigned int state = 0x9E3779B9u;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+		std::vector<GuidingRecord> data(records);
+		Vec3 bright[3] = { Vec3(0, 1.0f, 0), Vec3(0.7f, 0.7f, 0).normalize(), Vec3(-0.2f, 0.3f, 0.9f).normalize() };
+		for (int i = 0; i < records; i++)
+		{
+			data[i].position[0] = (next() * 40.0f) - 20.0f;
+			data[i].position[1] = next() * 10.0f;
+			data[i].position[2] = (next() * 40.0f) - 20.0f;
+			Vec3 d = guidingSquareToDirection(next(), next());
+			float value = 0.1f;
+			for (int b = 0; b < 3; b++)
+			{
+				value += Dot(d, bright[b]) > 0.95f ? 10.0f : 0;
+			}
+			guidingDirectionToSquare(d, data[i].direction[0], data[i].direction[1]);
+			data[i].value = value;
+		}
+		// A first iteration builds a tree to splat into
+		record(data.data(), records);
+		refine();
+		result.records = records;
+		auto start = std::chrono::high_resolution_clock::now();
+		record(data.data(), records);
+		result.recordsPerSecond = (double)records / secondsSince(start);
+		start = std::chrono::high_resolution_clock::now();
+		refine();
+		result.refineSeconds = secondsSince(start);
+		for (unsigned int i = 0; i < spatialNodes.size(); i++)
+		{
+			result.leaves += spatialNodes[i].children[0] == GUIDING_LEAF ? 1 : 0;
+		}
+		for (unsigned int t = 0; t < samplingTrees.size(); t++)
+		{
+			result.directionalNodes += (int)samplingTrees[t].nodes.size();
+		}
+		return result;
+	}
+
+private:
+	static double secondsSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::max(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count(), 1e-9);
+	}
+};
@@ -0,0 +1,485 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds a CPU mirror of the camera path loop in PT.hlsl. tracePath traces a path's rays from the ray
+// generation shader, one bounce at a time: PathClosestHit only returns the instance, triangle, barycentrics and
+// distance of each hit, shadeHit shades it and sets up the next ray, and no closest hit shader traces rays of its own,
+// so the pipeline's recursion depth is two rather than one level per bounce. The work that needs what the rest of the
+// path gathers, recording the radiance a direction brings for path guiding, depositing into the radiance cache and
+// splitting the primary bounce for ReSTIR GI, is kept in a PathVertex and finished once the path ends, from the last
+// vertex back, as a recursive trace finishes it on the way back up. PathLoop runs shadeHit, shadeMiss and finishVertex
+// over a synthetic scene whose hits are drawn from a hash of the path and the bounce, both recursively and with the loop,
+// and verify() checks that the two agree exactly, that the loop keeps no more than PATH_LOOP_MAX_VERTICES vertices, and
+// that a path through a known scene gathers and deposits what it should.
+
+#include "Math.h"
+#include "LightSampling.h"
+#include "Sampler.h"
+#include <algorithm>
+#include <vector>
+
+// Vertices a path bounces from at most, as PATH_MAX_VERTICES in PT.hlsl: it lights the vertices at depths 0 to 6 and
+// bounces from those up to 5
+static const int PATH_LOOP_MAX_VERTICES = 6;
+// Depth of the last vertex a path lights, and the depth past which Russian roulette ends paths
+static const int PATH_LOOP_MAX_DEPTH = 6;
+static const int PATH_LOOP_ROULETTE_DEPTH = 3;
+// Flags of PathLoopPayload, as in the payload's flags
+static const unsigned int PATH_LOOP_SPECULAR = 1;
+static const unsigned int PATH_LOOP_GI_VERTEX = 2;
+static const unsigned int PATH_LOOP_CACHE_UPDATE = 4;
+// Flags of PathLoopVertex, as PATH_VERTEX_* in PT.hlsl
+static const unsigned int PATH_LOOP_GUIDING_RECORD = 1;
+static const unsigned int PATH_LOOP_GI = 2;
+static const unsigned int PATH_LOOP_CACHE_DEPOSIT = 4;
+// Types of PathLoopRecord
+static const int PATH_LOOP_RECORD_GUIDING = 0;
+static const int PATH_LOOP_RECORD_CACHE = 1;
+static const int PATH_LOOP_RECORD_GI_VERTEX = 2;
+static const int PATH_LOOP_RECORD_GI = 3;
+
+// What a camera path carries from vertex to vertex, as Payload
+struct PathLoopPayload
+{
+	int depth = 0;
+	unsigned int flags = 0;
+	Vec3 colour;
+	Vec3 throughput = Vec3(1.0f, 1.0f, 1.0f);
+	float lastPdf = 0;
+};
+
+// A hit of the synthetic scene as shadeHit sees it: whether the ray left the scene, what it found, the direct lighting
+// calculateDirect would return with its light samples weighted against BSDF sampling, the BSDF sample's weight
+// (f cos / pdf) and pdf, and the radiance cache's entry
+struct PathLoopHit
+{
+	bool miss = false;
+	bool light = false;
+	bool diffuse = true;                // Whether the BSDF can be light sampled, which a mirror cannot
+	Vec3 emission;                      // Of a light, or of the environment for a miss
+	Vec3 direct;
+	Vec3 weight;
+	float pdf = 1.0f;
+	bool cached = false;
+	Vec3 cachedRadiance;
+};
+
+// A vertex the path bounced from with work left for when it ends, as PathVertex
+struct PathLoopVertex
+{
+	int depth = 0;
+	float pdf = 0;
+	Vec3 throughput;                    // Throughput of the bounce ray
+	Vec3 colour;                        // Colour the path had gathered when the bounce ray was traced
+	Vec3 colourBefore;                  // Colour and throughput the path reached the vertex with
+	Vec3 throughputBefore;
+	unsigned int flags = 0;
+};
+
+// Something a path writes out besides its colour: a path guiding record, a radiance cache deposit, the ReSTIR GI
+// candidate vertex or the primary surface's reservoir built from it, with the depth of the vertex it came from
+struct PathLoopRecord
+{
+	int type = 0;
+	int depth = 0;
+	Vec3 value;
+	bool reusable = false;
+
+	bool operator==(const PathLoopRecord& other) const
+	{
+		return type == other.type && depth == other.depth && reusable == other.reusable && value.x == other.value.x && value.y == other.value.y && value.z == other.value.z;
+	}
+};
+
+// Features of the GPU path tracer that give vertices work to finish
+struct PathLoopSettings
+{
+	bool reSTIRGI = false;
+	bool radianceCache = false;
+	bool cacheUpdate = false;           // Whether the path updates the radiance cache
+	bool guidingRecord = false;
+	float guidingRecordFraction = 0.5f;
+};
+
+// Everything a path produces, and the deepest the trace went: levels of recursion, or vertices the loop kept
+struct PathLoopResult
+{
+	Vec3 colour;
+	std::vector<PathLoopRecord> records;
+	int depth = 0;
+};
+
+class PathLoop
+{
+public:
+	PathLoopSettings settings;
+	// The synthetic scene's hits, in place of the hash when not empty, with a miss past the last
+	std::vector<PathLoopHit> fixedHits;
+
+	// The hit of the given bounce of the given path, drawn from a hash of both so that every trace of a path sees
+	// the same scene
+	PathLoopHit hit(unsigned int path, int bounce) const
+	{
+		if (fixedHits.size() > 0)
+		{
+			PathLoopHit miss;
+			miss.miss = true;
+			return bounce < (int)fixedHits.size() ? fixedHits[bounce] : miss;
+		}
+		PixelSampler sampler;
+		sampler.state = hashPCG((path * 0x9e3779b9u) ^ hashPCG((unsigned int)bounce + 1));
+		PathLoopHit h;
+		float type = sampler.next();
+		h.miss = type < 0.1f;
+		h.light = type >= 0.1f && type < 0.2f;
+		h.diffuse = type >= 0.35f;
+		Vec3 colour(sampler.next(), sampler.next(), sampler.next());
+		h.emission = colour * 4.0f;
+		h.direct = colour * sampler.next();
+		h.weight = Vec3(sampler.next(), sampler.next(), sampler.next()) * (h.diffuse ? 0.9f : 1.0f);
+		h.pdf = sampler.next() < 0.05f ? 0.0f : 0.1f + sampler.next();
+		h.cached = sampler.next() < 0.5f;
+		h.cachedRadiance = Vec3(sampler.next(), sampler.next(), sampler.next());
+		return h;
+	}
+
+	// Shades a ray leaving the scene; mirrors shadeMiss
+	void shadeMiss(const PathLoopHit& h, PathLoopPayload& payload, PathLoopResult& result) const
+	{
+		// BSDF sampled directions are weighted against environment sampling, which stands in as half the weight
+		float weight = payload.depth > 0 && (payload.flags & PATH_LOOP_SPECULAR) == 0 ? 0.5f : 1.0f;
+		Vec3 emission = h.emission * weight;
+		payload.colour = payload.colour + (payload.throughput * emission);
+		if ((payload.flags & PATH_LOOP_GI_VERTEX) != 0)
+		{
+			recordGIVertex(payload.depth, emission, true, result);
+		}
+	}
+
+	// Shades a hit, returning true with the vertex to finish once the path ends if the path goes on; mirrors shadeHit
+	bool shadeHit(const PathLoopHit& h, PathLoopPayload& payload, PixelSampler& sampler, PathLoopVertex& vertex, PathLoopResult& result) const
+	{
+		vertex = PathLoopVertex();
+		if (h.light)
+		{
+			float weight = payload.depth == 0 || (payload.flags & PATH_LOOP_SPECULAR) != 0 ? 1.0f : 0.5f;
+			Vec3 emission = h.emission * weight;
+			payload.colour = payload.colour + (payload.throughput * emission);
+			if ((payload.flags & PATH_LOOP_GI_VERTEX) != 0)
+			{
+				recordGIVertex(payload.depth, emission, true, result);
+			}
+			return false;
+		}
+		if ((payload.flags & PATH_LOOP_GI_VERTEX) != 0)
+		{
+			recordGIVertex(payload.depth, Vec3(0, 0, 0), h.diffuse, result);
+			payload.flags &= ~PATH_LOOP_GI_VERTEX;
+		}
+		if (settings.radianceCache && payload.depth > 0 && (payload.flags & PATH_LOOP_CACHE_UPDATE) == 0 && h.diffuse && h.cached)
+		{
+			payload.colour = payload.colour + (payload.throughput * h.cachedRadiance);
+			return false;
+		}
+		bool restirSurface = settings.reSTIRGI && payload.depth == 0 && h.diffuse;
+		bool cacheDeposit = (payload.flags & PATH_LOOP_CACHE_UPDATE) != 0 && h.diffuse && restirSurface == false;
+		Vec3 colourBefore = payload.colour;
+		Vec3 throughputBefore = payload.throughput;
+		// The last vertex takes no BSDF sample, so its light sample takes the full weight instead of half
+		payload.colour = payload.colour + (payload.throughput * (payload.depth < PATH_LOOP_MAX_DEPTH ? h.direct : h.direct * 2.0f));
+		if (payload.depth == PATH_LOOP_MAX_DEPTH)
+		{
+			if (cacheDeposit)
+			{
+				recordCacheDeposit(payload.depth, payload.colour - colourBefore, throughputBefore, result);
+			}
+			return false;
+		}
+		if (payload.depth > PATH_LOOP_ROULETTE_DEPTH)
+		{
+			float q = std::min(luminance(payload.throughput.coords), 0.7f);
+			if (sampler.next() < q)
+			{
+				if (cacheDeposit)
+				{
+					recordCacheDeposit(payload.depth, payload.colour - colourBefore, throughputBefore, result);
+				}
+				return false;
+			}
+			payload.throughput = payload.throughput / (1.0f - q);
+		}
+		bool giVertex = restirSurface;
+		if (h.pdf <= 0)
+		{
+			if (giVertex)
+			{
+				recordGI(payload.depth, Vec3(0, 0, 0), sampler, result);
+			}
+			if (cacheDeposit)
+			{
+				recordCacheDeposit(payload.depth, payload.colour - colourBefore, throughputBefore, result);
+			}
+			return false;
+		}
+		Vec3 throughput = payload.throughput * h.weight;
+		payload.throughput = giVertex ? Vec3(1.0f, 1.0f, 1.0f) : throughput;
+		vertex.depth = payload.depth;
+		payload.depth++;
+		payload.lastPdf = h.pdf;
+		payload.flags = h.diffuse ? payload.flags & ~PATH_LOOP_SPECULAR : payload.flags | PATH_LOOP_SPECULAR;
+		payload.flags = giVertex ? payload.flags | PATH_LOOP_GI_VERTEX : payload.flags & ~PATH_LOOP_GI_VERTEX;
+		bool guidingRecorded = settings.guidingRecord && h.diffuse && giVertex == false && sampler.next() < settings.guidingRecordFraction;
+		vertex.pdf = h.pdf;
+		vertex.throughput = throughput;
+		vertex.colour = payload.colour;
+		vertex.colourBefore = colourBefore;
+		vertex.throughputBefore = throughputBefore;
+		vertex.flags = (guidingRecorded ? PATH_LOOP_GUIDING_RECORD : 0) | (giVertex ? PATH_LOOP_GI : 0) | (cacheDeposit ? PATH_LOOP_CACHE_DEPOSIT : 0);
+		return true;
+	}
+
+	// Finishes a vertex once the path has gathered all it will; mirrors finishVertex
+	void finishVertex(const PathLoopVertex& vertex, PathLoopPayload& payload, PixelSampler& sampler, PathLoopResult& result) const
+	{
+		if ((vertex.flags & PATH_LOOP_GUIDING_RECORD) != 0)
+		{
+			PathLoopRecord record;
+			record.type = PATH_LOOP_RECORD_GUIDING;
+			record.depth = vertex.depth;
+			record.value = divideThroughput(payload.colour - vertex.colour, vertex.throughput) / vertex.pdf;
+			result.records.push_back(record);
+		}
+		if ((vertex.flags & PATH_LOOP_GI) != 0)
+		{
+			// The candidate vertex is the last GI vertex recorded
+			PathLoopRecord candidate;
+			for (size_t i = 0; i < result.records.size(); i++)
+			{
+				candidate = result.records[i].type == PATH_LOOP_RECORD_GI_VERTEX ? result.records[i] : candidate;
+			}
+			Vec3 emission = candidate.value;
+			Vec3 radiance = payload.colour - vertex.colour - emission;
+			radiance = Vec3(std::max(radiance.x, 0.0f), std::max(radiance.y, 0.0f), std::max(radiance.z, 0.0f));
+			payload.colour = vertex.colour + (vertex.throughput * emission);
+			if (candidate.reusable == false)
+			{
+				payload.colour = payload.colour + (vertex.throughput * radiance);
+			}
+			recordGI(vertex.depth, radiance, sampler, result);
+		}
+		if ((vertex.flags & PATH_LOOP_CACHE_DEPOSIT) != 0)
+		{
+			recordCacheDeposit(vertex.depth, payload.colour - vertex.colourBefore, vertex.throughputBefore, result);
+		}
+	}
+
+	// Traces a path as ClosestHit once did, tracing each bounce from the hit before and finishing the vertex when
+	// the trace returns
+	PathLoopResult traceRecursive(unsigned int path) const
+	{
+		PathLoopResult result;
+		PathLoopPayload payload;
+		PixelSampler sampler;
+		sampler.state = path;
+		payload.flags = startFlags(path);
+		traceBounce(path, 0, payload, sampler, result);
+		result.colour = payload.colour;
+		return result;
+	}
+
+	// Traces a path as tracePath does, one bounce at a time, keeping the vertices with work left and finishing them
+	// from the last back once the path ends
+	PathLoopResult traceLoop(unsigned int path) const
+	{
+		PathLoopResult result;
+		PathLoopPayload payload;
+		PixelSampler sampler;
+		sampler.state = path;
+		payload.flags = startFlags(path);
+		PathLoopVertex vertices[PATH_LOOP_MAX_VERTICES];
+		int count = 0;
+		for (int bounce = 0; bounce <= PATH_LOOP_MAX_VERTICES; bounce++)
+		{
+			PathLoopHit h = hit(path, bounce);
+			if (h.miss)
+			{
+				shadeMiss(h, payload, result);
+				break;
+			}
+			PathLoopVertex vertex;
+			if (shadeHit(h, payload, sampler, vertex, result) == false)
+			{
+				break;
+			}
+			if (vertex.flags != 0 && count < PATH_LOOP_MAX_VERTICES)
+			{
+				vertices[count] = vertex;
+				count++;
+				result.depth = std::max(result.depth, count);
+			}
+		}
+		for (int i = count; i > 0; i--)
+		{
+			finishVertex(vertices[i - 1], payload, sampler, result);
+		}
+		result.colour = payload.colour;
+		return result;
+	}
+
+	// Checks that the loop and recursion agree exactly on many paths of the synthetic scene under each combination
+	// of the features that leave vertices work to finish, that the loop never needs more vertices than it keeps, and
+	// that a path through a known scene gathers and deposits the radiance it should. Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		const unsigned int paths = 20000;
+		int maxRecursion = 0;
+		for (int combination = 0; combination < 16; combination++)
+		{
+			settings = PathLoopSettings();
+			settings.reSTIRGI = (combination & 1) != 0;
+			settings.radianceCache = (combination & 2) != 0;
+			settings.cacheUpdate = (combination & 4) != 0;
+			settings.guidingRecord = (combination & 8) != 0;
+			bool same = true;
+			bool fits = true;
+			for (unsigned int path = 1; path <= paths; path++)
+			{
+				PathLoopResult recursive = traceRecursive(path);
+				PathLoopResult loop = traceLoop(path);
+				same = same && recursive.colour.x == loop.colour.x && recursive.colour.y == loop.colour.y && recursive.colour.z == loop.colour.z && recursive.records == loop.records;
+				fits = fits && loop.depth <= PATH_LOOP_MAX_VERTICES;
+				maxRecursion = std::max(maxRecursion, recursive.depth);
+			}
+			failures += same && fits ? 0 : 1;
+		}
+		// Some paths went as deep as recursion allows, so the loop was tested on full length paths
+		failures += maxRecursion == PATH_LOOP_MAX_DEPTH + 1 ? 0 : 1;
+
+		// Three diffuse vertices, each lit with 0.1 and reflecting half, then a light of 1 weighted by half against light
+		// sampling: the radiance leaving the vertices is 0.35, 0.275 and 0.2375 from the last back, which a cache
+		// update deposits deepest first, and the last is what the camera ray gathers
+		settings = PathLoopSettings();
+		settings.cacheUpdate = true;
+		PathLoopHit surface;
+		surface.direct = Vec3(0.1f, 0.1f, 0.1f);
+		surface.weight = Vec3(0.5f, 0.5f, 0.5f);
+		PathLoopHit light;
+		light.light = true;
+		light.emission = Vec3(1.0f, 1.0f, 1.0f);
+		fixedHits = { surface, surface, surface, light };
+		unsigned int update = 0;
+		while (startFlags(update) == 0)
+		{
+			update++;
+		}
+		PathLoopResult known = traceLoop(update);
+		bool gathered = fabsf(known.colour.x - 0.2375f) < 1e-6f && known.records.size() == 3;
+		float expected[3] = { 0.35f, 0.275f, 0.2375f };
+		for (size_t i = 0; i < known.records.size() && gathered; i++)
+		{
+			const PathLoopRecord& record = known.records[i];
+			gathered = record.type == PATH_LOOP_RECORD_CACHE && record.depth == 2 - (int)i && fabsf(record.value.y - expected[i]) < 1e-6f;
+		}
+		failures += gathered ? 0 : 1;
+
+		// The vertex at the maximum depth ends the path without a BSDF sample, so it takes the full light sample, twice
+		// the weighted one the vertex before it takes
+		PixelSampler lastSampler;
+		PathLoopVertex lastVertex;
+		PathLoopResult lastResult;
+		PathLoopPayload last;
+		last.depth = PATH_LOOP_MAX_DEPTH;
+		bool continued = shadeHit(surface, last, lastSampler, lastVertex, lastResult);
+		failures += continued == false && fabsf(last.colour.x - 0.2f) < 1e-6f ? 0 : 1;
+		PathLoopPayload beforeLast;
+		beforeLast.depth = PATH_LOOP_MAX_DEPTH - 1;
+		shadeHit(surface, beforeLast, lastSampler, lastVertex, lastResult);
+		failures += fabsf(beforeLast.colour.x - 0.1f) < 1e-6f ? 0 : 1;
+		fixedHits.clear();
+		settings = PathLoopSettings();
+		return failures;
+	}
+
+private:
+	// Cache update paths are chosen per path, as a share of the camera rays
+	unsigned int startFlags(unsigned int path) const
+	{
+		return settings.cacheUpdate && (hashPCG(path) & 3) == 0 ? PATH_LOOP_CACHE_UPDATE : 0;
+	}
+
+	void traceBounce(unsigned int path, int bounce, PathLoopPayload& payload, PixelSampler& sampler, PathLoopResult& result) const
+	{
+		result.depth = std::max(result.depth, bounce + 1);
+		PathLoopHit h = hit(path, bounce);
+		if (h.miss)
+		{
+			shadeMiss(h, payload, result);
+			return;
+		}
+		PathLoopVertex vertex;
+		if (shadeHit(h, payload, sampler, vertex, result))
+		{
+			traceBounce(path, bounce + 1, payload, sampler, result);
+			finishVertex(vertex, payload, sampler, result);
+		}
+	}
+
+	static Vec3 divideThroughput(const Vec3& gathered, const Vec3& throughput)
+	{
+		return Vec3(throughput.x > 0 ? gathered.x / throughput.x : 0.0f, throughput.y > 0 ? gathered.y / throughput.y : 0.0f, throughput.z > 0 ? gathered.z / throughput.z : 0.0f);
+	}
+
+	static void recordCacheDeposit(int depth, const Vec3& gathered, const Vec3& throughput, PathLoopResult& result)
+	{
+		PathLoopRecord record;
+		record.type = PATH_LOOP_RECORD_CACHE;
+		record.depth = depth;
+		record.value = divideThroughput(gathered, throughput);
+		result.records.push_back(record);
+	}
+
+	static void recordGIVertex(int depth, const Vec3& emission, bool reusable, PathLoopResult& result)
+	{
+		PathLoopRecord record;
+		record.type = PATH_LOOP_RECORD_GI_VERTEX;
+		record.depth = depth;
+		record.value = emission;
+		record.reusable = reusable;
+		result.records.push_back(record);
+	}
+
+	// The primary surface's reservoir takes a random number for its resampling, as restirGIPrimarySurface does
+	static void recordGI(int depth, const Vec3& radiance, PixelSampler& sampler, PathLoopResult& result)
+	{
+		PathLoopRecord record;
+		record.type = PATH_LOOP_RECORD_GI;
+		record.depth = depth;
+		record.value = radiance * sampler.next();
+		result.records.push_back(record);
+	}
+};
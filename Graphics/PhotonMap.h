@@ -0,0 +1,544 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file holds the caustic photon map behind the photon caustics mode in PT.hlsl. Every frame PhotonTrace emits
+// photons from the area lights by power and follows them through specular bounces, storing those that reach a
+// surface light sampling shades after at least one. Between frames the photons are read back and sorted here, on the
+// worker threads, into a hashed grid whose cells are twice the gather radius wide, so that the photons within the
+// radius of any point lie in the 2x2x2 cells around it. The next frame gathers them at diffuse hits. The radius
+// shrinks every pass as in progressive photon mapping, and since every frame is one pass averaged into the image like
+// any other sample, the radius follows the global sequence of probabilistic progressive photon mapping rather than
+// per pixel statistics. photonCellHash and photonGather in PT.hlsl mirror cellHash and gather. verify() checks the
+// grid, the queries and the density estimate, and benchmark() measures the build and the queries.
+
+#include "Math.h"
+#include "Parallel.h"
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+static const float PHOTON_PI = 3.14159265358979f;
+// Photons the GPU stores per pass at most, including the photon heading the buffer
+static const int PHOTON_MAX = 1 << 18;
+// PhotonTrace runs this many threads along each side of its dispatch, emitting one photon each
+static const int PHOTON_PASS_WIDTH = 512;
+// Specular bounces a photon follows at most before it is dropped
+static const int PHOTON_MAX_BOUNCES = 8;
+// Buckets of the hashed grid; cells hashing to the same bucket share it
+static const unsigned int PHOTON_GRID_CELLS = 1 << 18;
+// Fraction of the photons kept every pass, which sets how quickly the radius shrinks
+static const float PHOTON_ALPHA = 0.7f;
+// The first radius is the median distance from a photon to its this many nearest photons
+static const int PHOTON_RADIUS_NEIGHBOURS = 32;
+
+// A photon as the GPU writes it, laid out as Photon in PT.hlsl (48 bytes). The first photon of the buffer only heads
+// it, counting the photons written after it
+struct Photon
+{
+	float position[3] = {};
+	unsigned int count = 0;
+	float power[3] = {};
+	unsigned int pad0 = 0;
+	float direction[3] = {};            // Towards where the photon came from
+	unsigned int pad1 = 0;
+};
+
+// The photons of one bucket of the grid, laid out as uint2 in PT.hlsl
+struct PhotonCell
+{
+	unsigned int start = 0;             // First photon of the bucket, not counting the photon heading the buffer
+	unsigned int count = 0;
+};
+
+// Throughput of the photon map measured by PhotonMap::benchmark
+struct PhotonMapBenchmark
+{
+	int photons = 0;
+	double buildPhotonsPerSecond = 0;   // Photons sorted into the grid, including hashing them
+	double gathersPerSecond = 0;        // Density estimates at the gather radius
+	double nearestPerSecond = 0;        // Searches for the PHOTON_RADIUS_NEIGHBOURS nearest photons
+};
+
+class PhotonMap
+{
+public:
+	std::vector<Photon> photons;        // Sorted by bucket
+	std::vector<PhotonCell> cells;
+	float radius = 0;
+	float cellSize = 1.0f;
+
+	// Coordinates of the cell holding a point
+	void cell(const Vec3& p, int& x, int& y, int& z) const
+	{
+		x = (int)floorf(p.x / cellSize);
+		y = (int)floorf(p.y / cellSize);
+		z = (int)floorf(p.z / cellSize);
+	}
+
+	// Bucket of a cell; mirrors photonCellHash in PT.hlsl
+	static unsigned int cellHash(int x, int y, int z)
+	{
+		return (((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u) ^ ((unsigned int)z * 83492791u)) % PHOTON_GRID_CELLS;
+	}
+
+	// Sorts photons into the grid for gathers at radius r. Photons are counted and scattered into their buckets with
+	// atomics, then every bucket is put back into the order the photons came in, so the result does not depend on the
+	// threads
+	void build(const Photon* in, int count, float r)
+	{
+		radius = r;
+		cellSize = 2.0f * r;
+		std::vector<unsigned int> buckets(count);
+		std::vector<unsigned int> order(count);
+		std::vector<std::atomic<unsigned int>> counts(PHOTON_GRID_CELLS);
+		parallelFor((int)PHOTON_GRID_CELLS, [&](int c)
+			{
+				counts[c].store(0, std::memory_order_relaxed);
+			}, 1 << 14);
+		parallelFor(count, [&](int i)
+			{
+				int x;
+				int y;
+				int z;
+				cell(Vec3(in[i].position[0], in[i].position[1], in[i].position[2]), x, y, z);
+				buckets[i] = cellHash(x, y, z);
+				counts[buckets[i]].fetch_add(1, std::memory_order_relaxed);
+			});
+		cells.assign(PHOTON_GRID_CELLS, PhotonCell());
+		unsigned int start = 0;
+		for (unsigned int c = 0; c < PHOTON_GRID_CELLS; c++)
+		{
+			cells[c].start = start;
+			cells[c].count = counts[c].load(std::memory_order_relaxed);
+			start += cells[c].count;
+			counts[c].store(cells[c].start, std::memory_order_relaxed);
+		}
+		parallelFor(count, [&](int i)
+			{
+				order[counts[buckets[i]].fetch_add(1, std::memory_order_relaxed)] = (unsigned int)i;
+			});
+		parallelFor((int)PHOTON_GRID_CELLS, [&](int c)
+			{
+				std::sort(order.begin() + cells[c].start, order.begin() + cells[c].start + cells[c].count);
+			}, 1 << 12);
+		photons.resize(count);
+		parallelFor(count, [&](int i)
+			{
+				photons[i] = in[order[i]];
+				photons[i].count = 0;
+			});
+	}
+
+	// Calls func with every photon within r of p, visiting each cell overlapping the sphere once and skipping the
+	// photons of other cells sharing its bucket
+	template<typename F>
+	void query(const Vec3& p, float r, F func) const
+	{
+		if (photons.size() == 0)
+		{
+			return;
+		}
+		int lo[3];
+		int hi[3];
+		cell(p - Vec3(r, r, r), lo[0], lo[1], lo[2]);
+		cell(p + Vec3(r, r, r), hi[0], hi[1], hi[2]);
+		float r2 = r * r;
+		for (int z = lo[2]; z <= hi[2]; z++)
+		{
+			for (int y = lo[1]; y <= hi[1]; y++)
+			{
+				for (int x = lo[0]; x <= hi[0]; x++)
+				{
+					visitCell(x, y, z, [&](const Photon& photon, float d2)
+						{
+							if (d2 <= r2)
+							{
+								func(photon, d2);
+							}
+						}, p);
+				}
+			}
+		}
+	}
+
+	// Irradiance at a point from the photons within the radius arriving on the side the normal faces, the power over
+	// the area of the disc; mirrors photonGather in PT.hlsl, which multiplies it by the BSDF
+	Vec3 gather(const Vec3& p, const Vec3& n) const
+	{
+		Vec3 power;
+		query(p, radius, [&](const Photon& photon, float)
+			{
+				if (Dot(Vec3(photon.direction[0], photon.direction[1], photon.direction[2]), n) > 0)
+				{
+					power = power + Vec3(photon.power[0], photon.power[1], photon.power[2]);
+				}
+			});
+		return power / (PHOTON_PI * radius * radius);
+	}
+
+	// Finds the k photons nearest to p, as (squared distance, photon) sorted by distance. Rings of cells around p's
+	// cell are searched outwards until the kth distance is closer than any cell not searched yet
+	void nearest(const Vec3& p, int k, std::vector<std::pair<float, unsigned int>>& out, int maxRings = 64) const
+	{
+		out.clear();
+		if (photons.size() == 0 || k <= 0)
+		{
+			return;
+		}
+		int cx;
+		int cy;
+		int cz;
+		cell(p, cx, cy, cz);
+		// A max heap of the nearest photons found so far
+		auto closer = [](const std::pair<float, unsigned int>& a, const std::pair<float, unsigned int>& b)
+			{
+				return a.first < b.first;
+			};
+		for (int ring = 0; ring <= maxRings; ring++)
+		{
+			for (int z = cz - ring; z <= cz + ring; z++)
+			{
+				for (int y = cy - ring; y <= cy + ring; y++)
+				{
+					bool face = abs(z - cz) == ring || abs(y - cy) == ring;
+					for (int x = cx - ring; x <= cx + ring; x += (face || ring == 0) ? 1 : 2 * ring)
+					{
+						visitCell(x, y, z, [&](const Photon& photon, float d2)
+							{
+								unsigned int index = (unsigned int)(&photon - photons.data());
+								if ((int)out.size() < k)
+								{
+									out.push_back(std::make_pair(d2, index));
+									std::push_heap(out.begin(), out.end(), closer);
+								} else if (d2 < out.front().first)
+								{
+									std::pop_heap(out.begin(), out.end(), closer);
+									out.back() = std::make_pair(d2, index);
+									std::push_heap(out.begin(), out.end(), closer);
+								}
+							}, p);
+					}
+				}
+			}
+			// Cells outside this ring are at least ring cells away from any point of p's cell
+			float searched = (float)ring * cellSize;
+			if (((int)out.size() == k && out.front().first <= searched * searched) || out.size() == photons.size())
+			{
+				break;
+			}
+		}
+		std::sort_heap(out.begin(), out.end(), closer);
+	}
+
+	// The first radius for a set of photons: the median distance to the PHOTON_RADIUS_NEIGHBOURS nearest photons, over
+	// photons spread through the set. The grid is built with cells sized to hold a few photons each on surfaces
+	float initialRadius(const Photon* in, int count, int samples = 1024)
+	{
+		if (count <= 1)
+		{
+			return 0;
+		}
+		Vec3 lo(FLT_MAX, FLT_MAX, FLT_MAX);
+		Vec3 hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (int i = 0; i < count; i++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				lo.coords[a] = std::min(lo.coords[a], in[i].position[a]);
+				hi.coords[a] = std::max(hi.coords[a], in[i].position[a]);
+			}
+		}
+		float extent = std::max(std::max(std::max(hi.x - lo.x, hi.y - lo.y), hi.z - lo.z), 1e-4f);
+		build(in, count, 0.5f * extent * sqrtf((float)PHOTON_RADIUS_NEIGHBOURS / (float)count));
+		samples = std::min(samples, count);
+		std::vector<float> distances(samples);
+		parallelFor(samples, [&](int s)
+			{
+				std::vector<std::pair<float, unsigned int>> found;
+				const Photon& photon = photons[(int)(((long long)s * count) / samples)];
+				nearest(Vec3(photon.position[0], photon.position[1], photon.position[2]), PHOTON_RADIUS_NEIGHBOURS, found);
+				distances[s] = sqrtf(found.back().first);
+			}, 16);
+		std::nth_element(distances.begin(), distances.begin() + (samples / 2), distances.end());
+		return distances[samples / 2];
+	}
+
+	// Radius of the given pass, counting from 1, starting from r0. Every pass keeps PHOTON_ALPHA of the photons a
+	// progressive photon map would have gathered, r_i^2 = r_(i-1)^2 (i - 1 + alpha) / i, so the radius shrinks to zero
+	// slowly enough that the number of photons gathered keeps growing
+	static float passRadius(float r0, int pass)
+	{
+		double r2 = (double)r0 * (double)r0;
+		for (int i = 2; i <= pass; i++)
+		{
+			r2 = r2 * ((double)(i - 1) + PHOTON_ALPHA) / (double)i;
+		}
+		return (float)sqrt(r2);
+	}
+
+	// Checks the grid, the queries against brute force and the density estimate, on photon maps of its own. Returns
+	// the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x1B873593u;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+
+		// Photons in a box, half of them clustered in one corner, sort into the buckets they hash to, each exactly once
+		std::vector<Photon> input(20000);
+		for (unsigned int i = 0; i < input.size(); i++)
+		{
+			float s = i % 2 == 0 ? 4.0f : 0.5f;
+			for (int a = 0; a < 3; a++)
+			{
+				input[i].position[a] = (next() * s) - 1.0f;
+				input[i].direction[a] = next() - 0.5f;
+			}
+			input[i].power[0] = (float)i;
+		}
+		build(input.data(), (int)input.size(), 0.1f);
+		bool sorted = photons.size() == input.size();
+		std::vector<int> seen(input.size(), 0);
+		unsigned int total = 0;
+		for (unsigned int c = 0; c < PHOTON_GRID_CELLS; c++)
+		{
+			sorted = sorted && cells[c].start == total;
+			total += cells[c].count;
+			for (unsigned int i = cells[c].start; i < cells[c].start + cells[c].count && sorted; i++)
+			{
+				int x;
+				int y;
+				int z;
+				cell(Vec3(photons[i].position[0], photons[i].position[1], photons[i].position[2]), x, y, z);
+				sorted = cellHash(x, y, z) == c;
+				seen[(int)photons[i].power[0]]++;
+			}
+		}
+		for (unsigned int i = 0; i < input.size(); i++)
+		{
+			sorted = sorted && seen[i] == 1;
+		}
+		failures += (sorted && total == input.size()) ? 0 : 1;
+		// Building again gives the same photons in the same order
+		std::vector<Photon> first = photons;
+		build(input.data(), (int)input.size(), 0.1f);
+		bool same = true;
+		for (unsigned int i = 0; i < photons.size(); i++)
+		{
+			same = same && photons[i].power[0] == first[i].power[0];
+		}
+		failures += same ? 0 : 1;
+
+		// Radius queries, at and beyond the radius the grid was built for, and nearest photons match brute force
+		int wrongQueries = 0;
+		int wrongNearest = 0;
+		for (int q = 0; q < 300; q++)
+		{
+			Vec3 p((next() * 4.0f) - 1.0f, (next() * 4.0f) - 1.0f, (next() * 4.0f) - 1.0f);
+			if (q % 2 == 0)
+			{
+				p = Vec3((next() * 0.5f) - 1.0f, (next() * 0.5f) - 1.0f, (next() * 0.5f) - 1.0f);
+			}
+			float r = q % 3 == 0 ? 0.35f : 0.1f;
+			int found = 0;
+			double foundSum = 0;
+			query(p, r, [&](const Photon& photon, float)
+				{
+					found++;
+					foundSum += photon.power[0];
+				});
+			int expected = 0;
+			double expectedSum = 0;
+			std::vector<float> distances(input.size());
+			for (unsigned int i = 0; i < input.size(); i++)
+			{
+				distances[i] = (Vec3(input[i].position[0], input[i].position[1], input[i].position[2]) - p).lengthSq();
+				if (distances[i] <= r * r)
+				{
+					expected++;
+					expectedSum += input[i].power[0];
+				}
+			}
+			wrongQueries += (found == expected && foundSum == expectedSum) ? 0 : 1;
+			const int k = 16;
+			std::vector<std::pair<float, unsigned int>> nearestPhotons;
+			nearest(p, k, nearestPhotons);
+			std::partial_sort(distances.begin(), distances.begin() + k, distances.end());
+			bool match = nearestPhotons.size() == k;
+			for (int i = 0; i < k && match; i++)
+			{
+				match = nearestPhotons[i].first == distances[i];
+			}
+			wrongNearest += match ? 0 : 1;
+		}
+		failures += wrongQueries == 0 ? 0 : 1;
+		failures += wrongNearest == 0 ? 0 : 1;
+
+		// Photons spread evenly over a unit square facing up, carrying a known power, estimate the irradiance as that
+		// power, and as many again arriving from below are not gathered
+		const int planePhotons = 200000;
+		const float planePower = 3.0f;
+		std::vector<Photon> plane(2 * planePhotons);
+		for (int i = 0; i < 2 * planePhotons; i++)
+		{
+			plane[i].position[0] = next();
+			plane[i].position[2] = next();
+			plane[i].direction[1] = i < planePhotons ? 1.0f : -1.0f;
+			plane[i].power[0] = planePower / (float)planePhotons;
+		}
+		build(plane.data(), (int)plane.size(), 0.05f);
+		double irradiance = 0;
+		const int gathers = 64;
+		for (int g = 0; g < gathers; g++)
+		{
+			irradiance += gather(Vec3(0.1f + (next() * 0.8f), 0, 0.1f + (next() * 0.8f)), Vec3(0, 1.0f, 0)).x;
+		}
+		irradiance /= gathers;
+		failures += fabs(irradiance - planePower) < 0.01 * planePower ? 0 : 1;
+
+		// The radius follows its sequence, and over many passes the shrinking radius removes the blur a fixed radius
+		// leaves: photons with a density of 3x^2 over the square, gathered at x = 0.5, where the disc around the point
+		// averages the density to 3 (x^2 + r^2 / 4)
+		float r0 = 0.3f;
+		bool sequence = passRadius(r0, 1) == r0;
+		for (int pass = 2; pass < 100 && sequence; pass++)
+		{
+			float a = passRadius(r0, pass - 1);
+			float b = passRadius(r0, pass);
+			sequence = fabsf(((b * b) / (a * a)) - (((float)(pass - 1) + PHOTON_ALPHA) / (float)pass)) < 1e-5f;
+		}
+		failures += sequence ? 0 : 1;
+		const int passes = 64;
+		const int passPhotons = 50000;
+		double fixedEstimate = 0;
+		double progressiveEstimate = 0;
+		std::vector<Photon> curved(passPhotons);
+		for (int pass = 1; pass <= passes; pass++)
+		{
+			for (int i = 0; i < passPhotons; i++)
+			{
+				// x = cbrt(u) has density 3x^2
+				curved[i].position[0] = cbrtf(next());
+				curved[i].position[2] = next();
+				curved[i].direction[1] = 1.0f;
+				curved[i].power[0] = 1.0f / (float)passPhotons;
+			}
+			build(curved.data(), passPhotons, r0);
+			fixedEstimate += gather(Vec3(0.5f, 0, 0.5f), Vec3(0, 1.0f, 0)).x;
+			build(curved.data(), passPhotons, passRadius(r0, pass));
+			progressiveEstimate += gather(Vec3(0.5f, 0, 0.5f), Vec3(0, 1.0f, 0)).x;
+		}
+		double fixedError = fabs((fixedEstimate / passes) - 0.75);
+		double progressiveError = fabs((progressiveEstimate / passes) - 0.75);
+		failures += (fixedError > 0.05 && progressiveError < 0.5 * fixedError) ? 0 : 1;
+
+		// The first radius takes in about PHOTON_RADIUS_NEIGHBOURS photons of an evenly lit surface
+		float r = initialRadius(plane.data(), planePhotons);
+		float expectedRadius = sqrtf((float)PHOTON_RADIUS_NEIGHBOURS / ((float)planePhotons * PHOTON_PI));
+		failures += fabsf(r - expectedRadius) < 0.1f * expectedRadius ? 0 : 1;
+		return failures;
+	}
+
+	// Measures the build and the queries on a pass worth of photons spread over the floor and walls of a scene sized
+	// box, gathering at the radius taking in PHOTON_RADIUS_NEIGHBOURS photons
+	PhotonMapBenchmark benchmark(int count = PHOTON_MAX - 1)
+	{
+		PhotonMapBenchmark result;
+		unsigned int state = 0x85EBCA6Bu;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+		std::vector<Photon> data(count);
+		for (int i = 0; i < count; i++)
+		{
+			int side = i % 3;
+			data[i].position[0] = side == 1 ? 20.0f : (next() * 40.0f) - 20.0f;
+			data[i].position[1] = side == 0 ? 0 : next() * 10.0f;
+			data[i].position[2] = side == 2 ? -20.0f : (next() * 40.0f) - 20.0f;
+			data[i].direction[side == 0 ? 1 : (side == 1 ? 0 : 2)] = side == 1 ? -1.0f : 1.0f;
+			data[i].power[0] = 1.0f;
+		}
+		float r = initialRadius(data.data(), count);
+		result.photons = count;
+		auto start = std::chrono::high_resolution_clock::now();
+		build(data.data(), count, r);
+		result.buildPhotonsPerSecond = (double)count / secondsSince(start);
+		const int queries = 1 << 18;
+		std::vector<Vec3> points(queries);
+		for (int q = 0; q < queries; q++)
+		{
+			points[q] = Vec3((next() * 40.0f) - 20.0f, 0, (next() * 40.0f) - 20.0f);
+		}
+		std::vector<float> sums(queries);
+		start = std::chrono::high_resolution_clock::now();
+		parallelFor(queries, [&](int q)
+			{
+				sums[q] = gather(points[q], Vec3(0, 1.0f, 0)).x;
+			});
+		result.gathersPerSecond = (double)queries / secondsSince(start);
+		start = std::chrono::high_resolution_clock::now();
+		parallelFor(queries / 4, [&](int q)
+			{
+				std::vector<std::pair<float, unsigned int>> found;
+				nearest(points[q], PHOTON_RADIUS_NEIGHBOURS, found);
+				sums[q] = found.size() > 0 ? found.back().first : 0;
+			}, 256);
+		result.nearestPerSecond = (double)(queries / 4) / secondsSince(start);
+		return result;
+	}
+
+private:
+	// Calls func(photon, squared distance to p) for the photons of one cell
+	template<typename F>
+	void visitCell(int x, int y, int z, F func, const Vec3& p) const
+	{
+		const PhotonCell& c = cells[cellHash(x, y, z)];
+		for (unsigned int i = c.start; i < c.start + c.count; i++)
+		{
+			const Photon& photon = photons[i];
+			Vec3 position(photon.position[0], photon.position[1], photon.position[2]);
+			int px;
+			int py;
+			int pz;
+			cell(position, px, py, pz);
+			if (px == x && py == y && pz == z)
+			{
+				func(photon, (position - p).lengthSq());
+			}
+		}
+	}
+
+	static double secondsSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::max(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count(), 1e-9);
+	}
+};
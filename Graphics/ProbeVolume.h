@@ -0,0 +1,364 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file places the irradiance probes of the DDGI style preview mode in PT.hlsl and holds the math the shader
+// shares with the CPU. Probes sit at the centres of a regular grid of cells fitted to the scene bounds. Every probe
+// owns a square octahedral tile of irradiance texels and a larger one of distance moments (mean and mean squared
+// distance) in two atlas buffers, with the tiles of consecutive probes stored one after another. The shader samples
+// the tiles bilinearly, reading across the tile edges with probeWrapTexel in place of the border texels a texture
+// atlas would need. verify() checks the placement and the octahedral mapping.
+
+#include "Math.h"
+#include <vector>
+
+// Probes along one axis, and in the whole volume, at most
+static const int PROBE_MAX_AXIS_COUNT = 32;
+static const int PROBE_MAX_COUNT = 4096;
+// Texels along each side of a probe's irradiance and distance tiles
+static const int PROBE_IRRADIANCE_TEXELS = 8;
+static const int PROBE_DISTANCE_TEXELS = 16;
+// Rays each probe traces per frame
+static const int PROBE_RAYS = 64;
+
+#define PROBE_PI 3.14159265358979f
+
+// Maps a unit direction to the octahedral square [-1, 1]^2. The upper hemisphere (z >= 0) fills the inner diamond and
+// the lower hemisphere is folded out into the corners; mirrors probeOctEncode in PT.hlsl
+static void probeOctEncode(const Vec3& d, float& u, float& v)
+{
+	float l1 = fabsf(d.x) + fabsf(d.y) + fabsf(d.z);
+	u = d.x / l1;
+	v = d.y / l1;
+	if (d.z < 0)
+	{
+		float foldedU = (1.0f - fabsf(v)) * (u >= 0 ? 1.0f : -1.0f);
+		float foldedV = (1.0f - fabsf(u)) * (v >= 0 ? 1.0f : -1.0f);
+		u = foldedU;
+		v = foldedV;
+	}
+}
+
+// Maps a point of the octahedral square back to a unit direction; mirrors probeOctDecode in PT.hlsl
+static Vec3 probeOctDecode(float u, float v)
+{
+	Vec3 d(u, v, 1.0f - fabsf(u) - fabsf(v));
+	if (d.z < 0)
+	{
+		float x = (1.0f - fabsf(v)) * (u >= 0 ? 1.0f : -1.0f);
+		float y = (1.0f - fabsf(u)) * (v >= 0 ? 1.0f : -1.0f);
+		d.x = x;
+		d.y = y;
+	}
+	return d.normalize();
+}
+
+// Direction through the centre of a texel of a tile with the given number of texels along each side
+static Vec3 probeTexelDirection(int x, int y, int texels)
+{
+	float u = ((((float)x + 0.5f) / (float)texels) * 2.0f) - 1.0f;
+	float v = ((((float)y + 0.5f) / (float)texels) * 2.0f) - 1.0f;
+	return probeOctDecode(u, v);
+}
+
+// Maps a texel one step outside a tile to the texel inside it that covers the same directions. The octahedral map
+// mirrors each edge about its midpoint, and a corner onto the opposite corner; mirrors probeWrapTexel in PT.hlsl
+static void probeWrapTexel(int& x, int& y, int texels)
+{
+	if (x < 0 || x >= texels)
+	{
+		x = clamp(x, 0, texels - 1);
+		y = texels - 1 - y;
+	}
+	if (y < 0 || y >= texels)
+	{
+		y = clamp(y, 0, texels - 1);
+		x = texels - 1 - x;
+	}
+}
+
+// Bilinearly samples a tile of texels in the direction d, reading texels past the edges through probeWrapTexel; mirrors
+// probeSampleIrradiance and probeSampleDistance in PT.hlsl
+static float probeSampleTile(const std::vector<float>& tile, int texels, const Vec3& d)
+{
+	float u;
+	float v;
+	probeOctEncode(d, u, v);
+	float tx = (((u + 1.0f) * 0.5f) * (float)texels) - 0.5f;
+	float ty = (((v + 1.0f) * 0.5f) * (float)texels) - 0.5f;
+	int x0 = (int)floorf(tx);
+	int y0 = (int)floorf(ty);
+	float fx = tx - (float)x0;
+	float fy = ty - (float)y0;
+	float value = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		int x = x0 + (i & 1);
+		int y = y0 + (i >> 1);
+		probeWrapTexel(x, y, texels);
+		value += tile[(y * texels) + x] * ((i & 1) ? fx : 1.0f - fx) * ((i >> 1) ? fy : 1.0f - fy);
+	}
+	return value;
+}
+
+// Direction of the i-th of n points spread evenly over the sphere on a spherical Fibonacci spiral; mirrors
+// sphericalFibonacci in PT.hlsl
+static Vec3 sphericalFibonacci(int i, int n)
+{
+	float phi = 2.0f * PROBE_PI * (((float)i * 0.6180339887f) - floorf((float)i * 0.6180339887f));
+	float cosTheta = 1.0f - ((2.0f * (float)i) + 1.0f) / (float)n;
+	float sinTheta = sqrtf(std::max(1.0f - (cosTheta * cosTheta), 0.0f));
+	return Vec3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta);
+}
+
+// Irradiance arriving around a texel's direction from a probe's rays, estimated as pi times the cosine weighted mean
+// radiance of the rays in its hemisphere; mirrors the irradiance update in ProbeBlend
+static Vec3 probeBlendIrradiance(const Vec3& texelDirection, const std::vector<Vec3>& directions, const std::vector<Vec3>& radiance)
+{
+	Vec3 sum;
+	float weightSum = 0;
+	for (unsigned int i = 0; i < directions.size(); i++)
+	{
+		float weight = std::max(Dot(texelDirection, directions[i]), 0.0f);
+		sum += radiance[i] * weight;
+		weightSum += weight;
+	}
+	return weightSum > 0 ? sum * (PROBE_PI / weightSum) : Vec3(0, 0, 0);
+}
+
+// Grid of probes over the scene, uploaded to the shader as probeOrigin, probeSpacing and probeCounts
+class ProbeVolume
+{
+public:
+	Vec3 origin;          // Position of the first probe
+	Vec3 spacing;         // Distance between neighbouring probes along each axis
+	int counts[3] = { 1, 1, 1 };
+
+	// Fits the grid to a box. The box is split into cells no longer than a common edge length, chosen as the shortest
+	// that keeps within the probe budget, and a probe is placed at the centre of each cell so that none sits on the
+	// walls that usually bound the scene
+	void fit(const Vec3& boundsMin, const Vec3& boundsMax)
+	{
+		Vec3 extent = Max(boundsMax - boundsMin, Vec3(0, 0, 0));
+		float longest = std::max(extent.x, std::max(extent.y, extent.z));
+		if (longest <= 0)
+		{
+			origin = boundsMin;
+			spacing = Vec3(1.0f, 1.0f, 1.0f);
+			counts[0] = counts[1] = counts[2] = 1;
+			return;
+		}
+		float cellSize = longest / (float)PROBE_MAX_AXIS_COUNT;
+		while (true)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				counts[i] = clamp((int)ceilf((extent.coords[i] / cellSize) - 1e-4f), 1, PROBE_MAX_AXIS_COUNT);
+			}
+			if (count() <= PROBE_MAX_COUNT)
+			{
+				break;
+			}
+			cellSize = cellSize * 1.02f;
+		}
+		for (int i = 0; i < 3; i++)
+		{
+			spacing.coords[i] = extent.coords[i] > 0 ? extent.coords[i] / (float)counts[i] : cellSize;
+			origin.coords[i] = boundsMin.coords[i] + (extent.coords[i] > 0 ? spacing.coords[i] * 0.5f : 0);
+		}
+	}
+
+	int count() const
+	{
+		return counts[0] * counts[1] * counts[2];
+	}
+
+	// Index of the probe at grid coordinates (x, y, z); mirrors probeIndex in PT.hlsl
+	int probeIndex(int x, int y, int z) const
+	{
+		return x + (counts[0] * (y + (counts[1] * z)));
+	}
+
+	// Position of a probe; mirrors probePosition in PT.hlsl
+	Vec3 probePosition(int index) const
+	{
+		int x = index % counts[0];
+		int y = (index / counts[0]) % counts[1];
+		int z = index / (counts[0] * counts[1]);
+		return origin + (spacing * Vec3((float)x, (float)y, (float)z));
+	}
+
+	// Finds the cage of eight probes surrounding a point: the grid coordinates of its lowest corner and the point's
+	// trilinear coordinates within it. Points outside the grid are clamped onto it; mirrors probeVolumeIrradiance
+	void cage(const Vec3& p, int base[3], Vec3& alpha) const
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			float g = clamp((p.coords[i] - origin.coords[i]) / spacing.coords[i], 0.0f, (float)(counts[i] - 1));
+			base[i] = std::min((int)floorf(g), std::max(counts[i] - 2, 0));
+			alpha.coords[i] = clamp(g - (float)base[i], 0.0f, 1.0f);
+		}
+	}
+
+	// Checks the placement of a few grids and the octahedral mapping shared with the shader. Returns the number of
+	// failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x1B873593u;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+
+		// Grids fitted to a cube, a long corridor, a flat floor and an empty box keep within the budget, place every
+		// probe inside the bounds with the outermost probes half a cell from them, and enclose any point in a cage
+		Vec3 boxes[4][2] =
+		{
+			{ Vec3(-1.0f, -1.0f, -1.0f), Vec3(1.0f, 1.0f, 1.0f) },
+			{ Vec3(0, 0, 0), Vec3(40.0f, 3.0f, 2.0f) },
+			{ Vec3(-5.0f, 0, -5.0f), Vec3(5.0f, 0, 5.0f) },
+			{ Vec3(2.0f, 2.0f, 2.0f), Vec3(2.0f, 2.0f, 2.0f) }
+		};
+		for (int b = 0; b < 4; b++)
+		{
+			ProbeVolume volume;
+			volume.fit(boxes[b][0], boxes[b][1]);
+			failures += (volume.count() >= 1 && volume.count() <= PROBE_MAX_COUNT) ? 0 : 1;
+			for (int i = 0; i < 3; i++)
+			{
+				failures += (volume.counts[i] >= 1 && volume.counts[i] <= PROBE_MAX_AXIS_COUNT) ? 0 : 1;
+				float extent = boxes[b][1].coords[i] - boxes[b][0].coords[i];
+				float first = volume.origin.coords[i] - boxes[b][0].coords[i];
+				float last = boxes[b][1].coords[i] - (volume.origin.coords[i] + (volume.spacing.coords[i] * (float)(volume.counts[i] - 1)));
+				float expected = extent > 0 ? volume.spacing.coords[i] * 0.5f : 0;
+				failures += (fabsf(first - expected) < 1e-4f && fabsf(last - expected) < 1e-4f) ? 0 : 1;
+			}
+			// The longest axis uses the full axis budget unless the total budget is the limit
+			int longestCount = std::max(volume.counts[0], std::max(volume.counts[1], volume.counts[2]));
+			failures += (b == 3 || longestCount == PROBE_MAX_AXIS_COUNT || volume.count() > PROBE_MAX_COUNT / 2) ? 0 : 1;
+			for (int i = 0; i < volume.count(); i++)
+			{
+				Vec3 p = volume.probePosition(i);
+				int x = i % volume.counts[0];
+				int y = (i / volume.counts[0]) % volume.counts[1];
+				int z = i / (volume.counts[0] * volume.counts[1]);
+				failures += volume.probeIndex(x, y, z) == i ? 0 : 1;
+				for (int a = 0; a < 3; a++)
+				{
+					failures += (p.coords[a] >= boxes[b][0].coords[a] - 1e-4f && p.coords[a] <= boxes[b][1].coords[a] + 1e-4f) ? 0 : 1;
+				}
+			}
+			for (int n = 0; n < 256; n++)
+			{
+				Vec3 p = boxes[b][0] + ((boxes[b][1] - boxes[b][0]) * Vec3(next(), next(), next()));
+				int base[3];
+				Vec3 alpha;
+				volume.cage(p, base, alpha);
+				for (int a = 0; a < 3; a++)
+				{
+					failures += (base[a] >= 0 && base[a] + 1 <= std::max(volume.counts[a] - 1, 1)) ? 0 : 1;
+					// Inside the grid the trilinear coordinates reproduce the point, outside it they clamp to the nearest probe
+					float lo = volume.origin.coords[a] + (volume.spacing.coords[a] * (float)base[a]);
+					float clamped = clamp(p.coords[a], volume.origin.coords[a], volume.origin.coords[a] + (volume.spacing.coords[a] * (float)(volume.counts[a] - 1)));
+					float reconstructed = volume.counts[a] > 1 ? lo + (volume.spacing.coords[a] * alpha.coords[a]) : volume.origin.coords[a];
+					failures += fabsf(reconstructed - clamped) < 1e-3f * std::max(volume.spacing.coords[a], 1.0f) ? 0 : 1;
+				}
+			}
+		}
+
+		// Encoding and decoding random directions round trips, and encodes into the square
+		float maxRoundTripError = 0;
+		for (int n = 0; n < 100000; n++)
+		{
+			Vec3 d = sphericalFibonacci(n, 100000);
+			float u;
+			float v;
+			probeOctEncode(d, u, v);
+			failures += (fabsf(u) <= 1.0f && fabsf(v) <= 1.0f) ? 0 : 1;
+			maxRoundTripError = std::max(maxRoundTripError, (probeOctDecode(u, v) - d).length());
+		}
+		failures += maxRoundTripError < 1e-5f ? 0 : 1;
+		// The axes land where the mapping puts them: +z at the centre and -z at the corners
+		float u;
+		float v;
+		probeOctEncode(Vec3(0, 0, 1.0f), u, v);
+		failures += (fabsf(u) < 1e-6f && fabsf(v) < 1e-6f) ? 0 : 1;
+		probeOctEncode(Vec3(0, 0, -1.0f), u, v);
+		failures += (fabsf(fabsf(u) - 1.0f) < 1e-6f && fabsf(fabsf(v) - 1.0f) < 1e-6f) ? 0 : 1;
+
+		// Bilinear sampling of a tile holding a linear function of direction follows the function as closely across
+		// the tile edges, where probeWrapTexel supplies the texels, as it does inside the tile. Clamping to the edge
+		// instead is half as accurate again
+		int sizes[2] = { PROBE_IRRADIANCE_TEXELS, PROBE_DISTANCE_TEXELS };
+		for (int s = 0; s < 2; s++)
+		{
+			int texels = sizes[s];
+			std::vector<float> tile(texels * texels);
+			for (int y = 0; y < texels; y++)
+			{
+				for (int x = 0; x < texels; x++)
+				{
+					Vec3 d = probeTexelDirection(x, y, texels);
+					tile[(y * texels) + x] = d.x + (2.0f * d.y) + (3.0f * d.z);
+				}
+			}
+			float maxInsideError = 0;
+			float maxEdgeError = 0;
+			for (int n = 0; n < 65536; n++)
+			{
+				Vec3 d = sphericalFibonacci(n, 65536);
+				float u;
+				float v;
+				probeOctEncode(d, u, v);
+				float error = fabsf(probeSampleTile(tile, texels, d) - (d.x + (2.0f * d.y) + (3.0f * d.z)));
+				float tx = (((u + 1.0f) * 0.5f) * (float)texels) - 0.5f;
+				float ty = (((v + 1.0f) * 0.5f) * (float)texels) - 0.5f;
+				bool inside = tx >= 0 && ty >= 0 && tx < (float)(texels - 1) && ty < (float)(texels - 1);
+				maxInsideError = inside ? std::max(maxInsideError, error) : maxInsideError;
+				maxEdgeError = inside ? maxEdgeError : std::max(maxEdgeError, error);
+			}
+			failures += maxEdgeError <= maxInsideError * 1.05f ? 0 : 1;
+		}
+
+		// Irradiance from the probe's ray budget under a uniform sky of unit radiance is pi facing up and zero facing
+		// down, and a cosine lobe of radiance around +z gives 2 pi / 3 facing it
+		std::vector<Vec3> directions(PROBE_RAYS);
+		std::vector<Vec3> sky(PROBE_RAYS);
+		std::vector<Vec3> lobe(PROBE_RAYS);
+		for (int i = 0; i < PROBE_RAYS; i++)
+		{
+			directions[i] = sphericalFibonacci(i, PROBE_RAYS);
+			float up = std::max(directions[i].z, 0.0f);
+			sky[i] = up > 0 ? Vec3(1.0f, 1.0f, 1.0f) : Vec3(0, 0, 0);
+			lobe[i] = Vec3(up, up, up);
+		}
+		failures += fabsf(probeBlendIrradiance(Vec3(0, 0, 1.0f), directions, sky).x - PROBE_PI) < 1e-3f ? 0 : 1;
+		failures += probeBlendIrradiance(Vec3(0, 0, -1.0f), directions, sky).x == 0 ? 0 : 1;
+		failures += fabsf(probeBlendIrradiance(Vec3(0, 0, 1.0f), directions, lobe).x - (2.0f * PROBE_PI / 3.0f)) < 0.1f ? 0 : 1;
+		return failures;
+	}
+};
@@ -33,7 +33,10 @@ SOFTWARE.
 #include "Scene.h"
 #include "Camera.h"
 #include "Texture.h"
+#include "TriangleSplitter.h"
+#include "SceneReorder.h"
 
+// World space bounds of every instance in the scene
 class SceneBounds
 {
 public:
@@ -61,6 +64,8 @@ class StaticModel
 public:
 	// Vector of pointers to mesh objects belonging to the static model
 	std::vector<Mesh*> meshes;
+	// Bounds of the model's vertices in model space
+	AABB bounds;
 
 	// Loads a static model from a file using the GEMLoader and initializes mesh objects from the loaded data
 	void load(Core* core, std::string filename, Scene* scene)
@@ -80,14 +85,19 @@ public:
 				STATIC_VERTEX v;
 				memcpy(&v, &gemmeshes[i].verticesStatic[n], sizeof(STATIC_VERTEX));
 				vertices.push_back(v);
-				use<SceneBounds>().extend(v.pos);
+				bounds.extend(v.pos);
 			}
+			// Optionally split large triangles to tighten the BLAS bounding boxes
+			std::vector<unsigned int> indices = gemmeshes[i].indices;
+			use<TriangleSplitter>().split(vertices, indices);
+			// Sort triangles spatially so neighbouring hits fetch neighbouring vertices
+			use<SceneReorder>().reorderTriangles(vertices, indices);
 			// Initialize the mesh with the core context, vertices and indices
-			mesh->init(core, vertices, gemmeshes[i].indices);
+			mesh->init(core, vertices, indices);
 			// Store the mesh pointer in the vector
 			meshes.push_back(mesh);
 			// Add mesh data (vertices and indices) to the scene
-			scene->addMeshData(filename + std::to_string(i), vertices, gemmeshes[i].indices);
+			scene->addMeshData(filename + std::to_string(i), vertices, indices);
 		}
 	}
 	// Updates the world transformation for each mesh and adds them to the scene
@@ -120,6 +130,12 @@ public:
 			meshes.insert({ filename, model });
 		}
 		StaticModel* model = meshes[filename];
+		// Extend the scene bounds by the corners of the model's bounds placed in the world
+		for (int i = 0; i < 8; i++)
+		{
+			Vec3 corner((i & 1) ? model->bounds.max.x : model->bounds.min.x, (i & 2) ? model->bounds.max.y : model->bounds.min.y, (i & 4) ? model->bounds.max.z : model->bounds.min.z);
+			use<SceneBounds>().extend(w.mulPoint(corner));
+		}
 		// Add each mesh instance to the scene
 		for (int i = 0; i < model->meshes.size(); i++)
 		{
@@ -129,40 +145,43 @@ public:
 	}
 };
 
-// Loads mesh data from a file and converts triangles into area light data
-void loadAsAreaLights(std::string filename, Matrix transform, std::vector<AreaLightData>& lightData)
+// Converts the triangles of an already loaded model into area light data
+// The geometry is read from the scene's mesh data rather than re-parsing the model file
+void loadAsAreaLights(Scene* scene, std::string filename, int numMeshes, Matrix transform, std::vector<AreaLightData>& lightData)
 {
-	GEMLoader::GEMModelLoader loader;
-	std::vector<GEMLoader::GEMMesh> gemmeshes;
-	// Load GEM mesh data from file
-	loader.load(filename, gemmeshes);
+	// Normals are transformed with the inverse transpose so non-uniform scales keep them perpendicular
+	InstanceNormalMatrix normalMatrix;
+	normalMatrix.build(transform.m);
 	// Process each mesh
-	for (int i = 0; i < gemmeshes.size(); i++)
+	for (int i = 0; i < numMeshes; i++)
 	{
+		std::string meshName = filename + std::to_string(i);
+		int start = scene->indexOffset[meshName];
+		int count = scene->indexSize[meshName];
 		// Process each triangle (assumed 3 indices per triangle)
-		for (int n = 0; n < gemmeshes[i].indices.size(); n = n + 3)
+		for (int n = 0; n < count; n = n + 3)
 		{
 			AreaLightData data;
+			const STATIC_VERTEX& vertex = scene->allVertices[scene->allIndices[start + n]];
 			// Copy triangle vertex positions into area light data
-			memcpy(&data.v1, &gemmeshes[i].verticesStatic[gemmeshes[i].indices[n]].position, sizeof(Vec3));
-			memcpy(&data.v2, &gemmeshes[i].verticesStatic[gemmeshes[i].indices[n + 1]].position, sizeof(Vec3));
-			memcpy(&data.v3, &gemmeshes[i].verticesStatic[gemmeshes[i].indices[n + 2]].position, sizeof(Vec3));
+			data.v1 = vertex.pos;
+			data.v2 = scene->allVertices[scene->allIndices[start + n + 1]].pos;
+			data.v3 = scene->allVertices[scene->allIndices[start + n + 2]].pos;
 			// Compute edge vectors
 			Vec3 e1 = data.v3 - data.v2;
 			Vec3 e2 = data.v1 - data.v3;
 			// Calculate the face normal and normalize it
 			data.normal = Cross(e1, e2).normalize();
-			Vec3 v1n;
-			// Get the stored normal from the first vertex
-			memcpy(&v1n, &gemmeshes[i].verticesStatic[gemmeshes[i].indices[n]].normal, sizeof(Vec3));
 			// Ensure the computed normal faces the same direction as the stored vertex normal
-			data.normal = data.normal * (Dot(v1n, data.normal) > 0 ? 1.0f : -1.0f);
+			data.normal = data.normal * (Dot(vertex.normal, data.normal) > 0 ? 1.0f : -1.0f);
 			// Apply the transformation to the vertices and normal
 			data.v1 = transform.mulPoint(data.v1);
 			data.v2 = transform.mulPoint(data.v2);
 			data.v3 = transform.mulPoint(data.v3);
-			data.normal = transform.mulVec(data.normal);
-			data.normal = data.normal.normalize();
+			data.normal = normalMatrix.transform(data.normal).normalize();
+			// Precompute the world space area used for sampling
+			data.area = Cross(data.v3 - data.v2, data.v1 - data.v3).length() * 0.5f;
+			data.power = 0;
 			// Add the area light data to the vector
 			lightData.push_back(data);
 		}
@@ -248,12 +267,22 @@ void loadInstance(Core* core, std::string sceneName, GEMLoader::GEMInstance& ins
 	Matrix transform;
 	memcpy(transform.m, instance.w.m, 16 * sizeof(float));
 	// Load the static model using the StaticModelManager and add it to the scene
+	int firstInstance = (int)scene->instanceData.size();
 	use<StaticModelManager>().load(core, sceneName + "/" + instance.meshFilename, scene, textures, meshInstanceData, transform);
 	// If the material has emission properties, create area lights from the mesh
 	if (instance.material.find("emission").getValue("") != "")
 	{
 		std::vector<AreaLightData> lightData;
-		loadAsAreaLights(sceneName + "/" + instance.meshFilename, transform, lightData);
+		std::string filename = sceneName + "/" + instance.meshFilename;
+		int numMeshes = (int)use<StaticModelManager>().meshes[filename]->meshes.size();
+		// Lights are created mesh by mesh in triangle order, so the light hit by a ray is the instance's light offset plus PrimitiveIndex()
+		int lightOffset = (int)scene->lights.size();
+		for (int i = 0; i < numMeshes; i++)
+		{
+			scene->instanceData[firstInstance + i].lightOffset = lightOffset;
+			lightOffset += scene->indexSize[filename + std::to_string(i)] / 3;
+		}
+		loadAsAreaLights(scene, filename, numMeshes, transform, lightData);
 		// Set the emission data and add each light to the scene
 		for (int i = 0; i < lightData.size(); i++)
 		{
@@ -306,23 +335,52 @@ void loadScene(Core* core, Scene* scene, Textures* textures, Camera* camera, std
 	camera->init(P, width, height);
 	camera->initView(V);
 
+	// Configure the optional triangle pre-splitting pass
+	use<TriangleSplitter>().enabled = gemscene.findProperty("presplit").getValue(0) == 1;
+	use<TriangleSplitter>().budget = gemscene.findProperty("presplitBudget").getValue(0.5f);
+	use<SceneReorder>().enabled = gemscene.findProperty("reorder").getValue(1) == 1;
+
 	// Load all model instances defined in the scene
 	for (int i = 0; i < gemscene.instances.size(); i++)
 	{
 		loadInstance(core, sceneName, gemscene.instances[i], scene, textures);
 	}
+	// Sort instances and mesh data spatially before the TLAS and buffers are built
+	use<SceneReorder>().reorderInstances(scene);
 	// Load and assign the environment map if available
 	if (gemscene.findProperty("envmap").getValue("") != "")
 	{
-		scene->environmentMap = textures->loadFromFile(core, sceneName + "/" + gemscene.findProperty("envmap").getValue(""));
+		std::string envFilename = sceneName + "/" + gemscene.findProperty("envmap").getValue("");
+		// Decode the map once and build the importance sampling distribution from the values that are uploaded
+		int envWidth = 0;
+		int envHeight = 0;
+		int envChannels = 0;
+		if (envFilename.find(".hdr") != std::string::npos)
+		{
+			float* envData = stbi_loadf(envFilename.c_str(), &envWidth, &envHeight, &envChannels, 0);
+			scene->environmentMap = textures->loadFromMemory(core, envWidth, envHeight, envChannels, envData);
+			scene->environmentDistribution.build(envData, envWidth, envHeight, envChannels);
+			stbi_image_free(envData);
+		} else
+		{
+			// Standard images are read raw, without the gamma stbi_loadf would apply, as the shader sees them
+			unsigned char* envData = stbi_load(envFilename.c_str(), &envWidth, &envHeight, &envChannels, 4);
+			scene->environmentMap = textures->loadFromMemory(core, envWidth, envHeight, 4, envData);
+			scene->environmentDistribution.build(EnvironmentDistribution::unorm(envData, envWidth * envHeight * 4).data(), envWidth, envHeight, 4);
+			stbi_image_free(envData);
+		}
 		scene->envLum = 1.0f;
 	} else
 	{
 		// Use a default black environment
 		float env[3] = { 0, 0, 0 };
 		scene->environmentMap = textures->loadFromMemory(core, 1, 1, 3, env);
+		scene->environmentDistribution.build(env, 1, 1, 3);
 		scene->envLum = 0;
 	}
+	// Fit the probe volume used by the preview mode and the cell of the path guiding tree's root to the scene
+	scene->probeVolume.fit(use<SceneBounds>().min, use<SceneBounds>().max);
+	scene->pathGuiding.init(use<SceneBounds>().min, use<SceneBounds>().max);
 	// Set the camera movement speed
 	//Vec3 size = use<SceneBounds>().max - use<SceneBounds>().min;
 	camera->moveSpeed = 0.1f;// size.length() * 0.05f;
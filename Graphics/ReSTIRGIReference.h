@@ -0,0 +1,339 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file is a CPU reference for the ReSTIR GI passes in PT.hlsl. Secondary vertices found by cosine
+// weighted rays are resampled temporally and spatially with the GIReservoir math and reconnection Jacobian
+// from Reservoir.h, with the same visibility tests as the shader, and the mean of every pixel is checked
+// against an independent estimate of its one bounce indirect lighting. Variants without the Jacobian and
+// with M normalisation show the bias each of them removes.
+
+#include "Math.h"
+#include "Parallel.h"
+#include "Reservoir.h"
+#include <vector>
+
+#define RESTIR_GI_REFERENCE_PI 3.14159265358979f
+
+struct ReSTIRGIReferenceStats
+{
+	int pixels = 0;
+	float maxRelativeError = 0;           // Largest relative difference between the mean ReSTIR GI estimate and the reference
+	float maxStandardErrors = 0;          // Largest difference from the reference in standard errors of the mean over the chains
+	float maxNoJacobianStandardErrors = 0;  // The same measure when neighbours' reservoirs are reused without the Jacobian
+	float maxBiasedStandardErrors = 0;    // The same measure with reservoirs normalised by M instead of 1/Z
+	float meanM = 0;                      // Mean number of candidates behind each final reservoir
+};
+
+// Runs the ReSTIR GI passes of PT.hlsl on a row of diffuse pixels under a textured ceiling, next to a bright
+// wall and a sphere. Every secondary surface is diffuse, so the radiance a vertex sends towards one pixel is
+// the radiance it sends towards any other, and reuse is unbiased exactly when the weights are right.
+class ReSTIRGIReference
+{
+public:
+	int pixels = 16;
+	int chains = 512;             // Independent sequences of frames
+	int frames = 64;              // Frames per sequence, each reusing the previous frame's reservoirs
+	int spatialNeighbours = 3;
+	int spatialRadius = 3;
+	int referenceSamples = 1 << 18;
+	ReSTIRGIReferenceStats stats;
+
+	// Returns the largest difference between the estimate and the reference in standard errors, which stays
+	// below about four when the weights are unbiased
+	float verify()
+	{
+		stats = ReSTIRGIReferenceStats();
+		stats.pixels = pixels;
+
+		// A row of pixels on the ground with normals fanning from left to right
+		std::vector<ReSTIRSurface> surfaces(pixels);
+		for (int i = 0; i < pixels; i++)
+		{
+			float t = ((float)i + 0.5f) / (float)pixels;
+			float angle = (t - 0.5f) * 2.0f;
+			surfaces[i].pos = Vec3((t - 0.5f) * 3.0f, 0, 0);
+			surfaces[i].normal = Vec3(sinf(angle), cosf(angle), 0);
+			surfaces[i].albedo = Vec3(0.8f, 0.8f, 0.8f);
+			surfaces[i].depth = 1.0f;
+			surfaces[i].valid = 1;
+		}
+
+		// Reference by cosine weighted sampling, where the estimator is the albedo times the radiance found
+		std::vector<double> reference(pixels, 0);
+		parallelFor(pixels, [&](int i)
+			{
+				unsigned int state = 0x9E3779B9u * (unsigned int)(i + 1);
+				double sum = 0;
+				for (int s = 0; s < referenceSamples; s++)
+				{
+					Vec3 pos;
+					Vec3 normal;
+					Vec3 wi = sampleCosine(surfaces[i], state);
+					sum += (double)(surfaces[i].albedo.x * trace(surfaces[i].pos, wi, pos, normal));
+				}
+				reference[i] = sum / (double)referenceSamples;
+			}, 1);
+
+		// Run the unbiased weights, the weights without the Jacobian and M normalisation over independent chains of frames
+		const int variants = 3;
+		std::vector<double> estimates[variants];
+		std::vector<double> standardErrors[variants];
+		std::vector<double> meanM(chains, 0);
+		for (int variant = 0; variant < variants; variant++)
+		{
+			bool useJacobian = variant != 1;
+			bool normaliseByZ = variant != 2;
+			std::vector<double> chainSums((size_t)chains * pixels, 0);
+			parallelFor(chains, [&](int c)
+				{
+					unsigned int state = (0x85EBCA6Bu * (unsigned int)(c + 1)) ^ (unsigned int)variant;
+					std::vector<GIReservoir> temporal(pixels);
+					for (int f = 0; f < frames; f++)
+					{
+						// One BSDF sampled vertex per pixel and temporal reuse of the same pixel (the camera is static). The history
+						// is last frame's temporal result; reusing the spatial result instead feeds the neighbours' reservoirs back
+						// into the canonical one, so the two are no longer independent and the estimate comes out biased
+						for (int i = 0; i < pixels; i++)
+						{
+							GIReservoir initial = initialReservoir(surfaces[i], state);
+							GIReservoir r;
+							r.merge(initial, initial.targetPdf, 1.0f, next(state));
+							float Z = initial.M;
+							float total = initial.M;
+							if (f > 0)
+							{
+								GIReservoir previous = temporal[i];
+								previous.M = std::min(previous.M, RESTIR_TEMPORAL_MAX_M * initial.M);
+								r.merge(previous, target(surfaces[i], previous), reconnectionJacobian(surfaces[i].pos, surfaces[i].pos, previous.samplePos, previous.sampleNormal), next(state));
+								Z += target(surfaces[i], r) > 0 ? previous.M : 0;
+								total += previous.M;
+							}
+							r.finalise(normaliseByZ ? Z : total);
+							temporal[i] = r;
+						}
+						// Spatial reuse, reading only the temporal reservoirs and reconnecting each pixel to its neighbours' vertices
+						for (int i = 0; i < pixels; i++)
+						{
+							GIReservoir r;
+							r.merge(temporal[i], temporal[i].targetPdf, 1.0f, next(state));
+							int neighbours[16];
+							int count = 0;
+							for (int k = 0; k < spatialNeighbours; k++)
+							{
+								int offset = (int)(next(state) * (float)(2 * spatialRadius)) - spatialRadius;
+								int q = i + (offset >= 0 ? offset + 1 : offset);
+								if (q < 0 || q >= pixels)
+								{
+									continue;
+								}
+								const GIReservoir& neighbour = temporal[q];
+								float jacobian = reconnectionJacobian(surfaces[q].pos, surfaces[i].pos, neighbour.samplePos, neighbour.sampleNormal);
+								if (!useJacobian && jacobian > 0)
+								{
+									jacobian = 1.0f;
+								}
+								// Reconnection needs the vertex to be visible, which keeps every reservoir to vertices its own surface sees
+								float value = visible(surfaces[i].pos, neighbour.samplePos) ? target(surfaces[i], neighbour) : 0;
+								r.merge(neighbour, value, jacobian, next(state));
+								neighbours[count++] = q;
+							}
+							float Z = temporal[i].M;
+							for (int k = 0; k < count; k++)
+							{
+								// A neighbour's reservoir can only hold vertices it sees, so the check includes visibility
+								bool canHold = target(surfaces[neighbours[k]], r) > 0 && visible(surfaces[neighbours[k]].pos, r.samplePos);
+								Z += canHold ? temporal[neighbours[k]].M : 0;
+							}
+							r.finalise(normaliseByZ ? Z : r.M);
+							// The vertex is known to be visible, so shading needs no further ray
+							if (r.W > 0)
+							{
+								chainSums[((size_t)c * pixels) + i] += (double)(target(surfaces[i], r) * r.W);
+							}
+							meanM[c] += variant == 0 ? (double)r.M : 0;
+						}
+					}
+				}, 1);
+			// Frames within a chain are correlated, so the noise is measured between the independent chains
+			estimates[variant].assign(pixels, 0);
+			standardErrors[variant].assign(pixels, 0);
+			for (int i = 0; i < pixels; i++)
+			{
+				double sum = 0;
+				double sumSq = 0;
+				for (int c = 0; c < chains; c++)
+				{
+					double chainMean = chainSums[((size_t)c * pixels) + i] / (double)frames;
+					sum += chainMean;
+					sumSq += chainMean * chainMean;
+				}
+				double mean = sum / (double)chains;
+				estimates[variant][i] = mean;
+				standardErrors[variant][i] = sqrt(std::max((sumSq / (double)chains) - (mean * mean), 0.0) / (double)std::max(chains - 1, 1));
+			}
+		}
+		for (int i = 0; i < pixels; i++)
+		{
+			if (reference[i] <= 0)
+			{
+				continue;
+			}
+			stats.maxRelativeError = std::max(stats.maxRelativeError, (float)(fabs(estimates[0][i] - reference[i]) / reference[i]));
+			stats.maxStandardErrors = std::max(stats.maxStandardErrors, (float)(fabs(estimates[0][i] - reference[i]) / std::max(standardErrors[0][i], 1e-12)));
+			stats.maxNoJacobianStandardErrors = std::max(stats.maxNoJacobianStandardErrors, (float)(fabs(estimates[1][i] - reference[i]) / std::max(standardErrors[1][i], 1e-12)));
+			stats.maxBiasedStandardErrors = std::max(stats.maxBiasedStandardErrors, (float)(fabs(estimates[2][i] - reference[i]) / std::max(standardErrors[2][i], 1e-12)));
+		}
+		double sumM = 0;
+		for (int c = 0; c < chains; c++)
+		{
+			sumM += meanM[c];
+		}
+		stats.meanM = (float)(sumM / ((double)chains * (double)frames * (double)pixels));
+		return stats.maxStandardErrors;
+	}
+
+private:
+	static float next(unsigned int& state)
+	{
+		state = (state * 1664525u) + 1013904223u;
+		return (float)(state >> 8) / 16777216.0f;
+	}
+
+	// Cosine weighted direction about the surface normal, as sampleBSDF does for diffuse surfaces
+	static Vec3 sampleCosine(const ReSTIRSurface& surface, unsigned int& state)
+	{
+		float r1 = next(state);
+		float r2 = next(state);
+		float sinTheta = sqrtf(1.0f - r1);
+		float phi = 2.0f * RESTIR_GI_REFERENCE_PI * r2;
+		Frame frame;
+		frame.fromVector(surface.normal);
+		return frame.toWorld(Vec3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, sqrtf(r1)));
+	}
+
+	// Intersects the ceiling, the wall and the sphere and returns the outgoing radiance of the closest hit, zero on a miss
+	static float trace(const Vec3& o, const Vec3& d, Vec3& pos, Vec3& normal, float tMax = 1e30f)
+	{
+		float closest = tMax;
+		float radiance = 0;
+		if (d.y > 0)
+		{
+			float t = (1.2f - o.y) / d.y;
+			Vec3 p = o + (d * t);
+			if (t > 1e-4f && t < closest && fabsf(p.x) < 2.5f && fabsf(p.z) < 2.5f)
+			{
+				closest = t;
+				pos = p;
+				normal = Vec3(0, -1.0f, 0);
+				radiance = 1.0f + (0.8f * sinf(3.0f * p.x) * cosf(2.0f * p.z));
+			}
+		}
+		if (d.x > 0)
+		{
+			float t = (2.0f - o.x) / d.x;
+			Vec3 p = o + (d * t);
+			if (t > 1e-4f && t < closest && p.y > 0 && p.y < 1.2f && fabsf(p.z) < 2.5f)
+			{
+				closest = t;
+				pos = p;
+				normal = Vec3(-1.0f, 0, 0);
+				radiance = 2.5f;
+			}
+		}
+		Vec3 centre(0.1f, 0.55f, 0.0f);
+		float sphereRadius = 0.25f;
+		Vec3 oc = o - centre;
+		float b = Dot(oc, d);
+		float disc = (b * b) - (oc.lengthSq() - (sphereRadius * sphereRadius));
+		if (disc > 0)
+		{
+			float t = -b - sqrtf(disc);
+			if (t > 1e-4f && t < closest)
+			{
+				closest = t;
+				pos = o + (d * t);
+				normal = (pos - centre).normalize();
+				radiance = 0.4f;
+			}
+		}
+		if (closest == tMax)
+		{
+			// Misses are kept as vertices far along the ray, as the Miss shader records them
+			pos = o + (d * 1000.0f);
+			normal = -d;
+		}
+		return radiance;
+	}
+
+	// Checks the segment between a surface and a secondary vertex, excluding the vertex itself
+	static bool visible(const Vec3& from, const Vec3& to)
+	{
+		Vec3 d = to - from;
+		float length = d.length();
+		Vec3 pos;
+		Vec3 normal;
+		trace(from, d / length, pos, normal, length - 1e-3f);
+		return (pos - from).length() >= length - 1e-3f;
+	}
+
+	// Unshadowed contribution of a reservoir's vertex to a diffuse surface with respect to solid angle; mirrors restirGITarget in PT.hlsl
+	static float target(const ReSTIRSurface& surface, const GIReservoir& r)
+	{
+		Vec3 d = r.samplePos - surface.pos;
+		float distanceSq = d.lengthSq();
+		if (distanceSq <= 0)
+		{
+			return 0;
+		}
+		Vec3 wi = d / sqrtf(distanceSq);
+		float cosTheta = Dot(surface.normal, wi);
+		float cosVertex = -Dot(r.sampleNormal, wi);
+		if (cosTheta <= 0 || cosVertex <= 0)
+		{
+			return 0;
+		}
+		return (surface.albedo.x / RESTIR_GI_REFERENCE_PI) * r.radiance.x * cosTheta;
+	}
+
+	// Traces one cosine weighted ray and keeps the vertex it finds; mirrors restirGIPrimarySurface in PT.hlsl
+	static GIReservoir initialReservoir(const ReSTIRSurface& surface, unsigned int& state)
+	{
+		Vec3 wi = sampleCosine(surface, state);
+		Vec3 pos;
+		Vec3 normal;
+		float L = trace(surface.pos, wi, pos, normal);
+		float sourcePdf = std::max(Dot(surface.normal, wi), 0.0f) / RESTIR_GI_REFERENCE_PI;
+		GIReservoir candidate;
+		candidate.samplePos = pos;
+		candidate.sampleNormal = normal;
+		candidate.radiance = Vec3(L, L, L);
+		float value = sourcePdf > 0 ? target(surface, candidate) : 0;
+		GIReservoir r;
+		r.update(pos, normal, candidate.radiance, sourcePdf > 0 ? value / sourcePdf : 0, value, next(state));
+		r.finalise(r.M);
+		return r;
+	}
+};
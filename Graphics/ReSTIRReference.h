@@ -0,0 +1,332 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file is a CPU reference for the ReSTIR direct illumination passes in PT.hlsl. It runs initial
+// candidate generation, temporal reuse and spatial reuse with the reservoir math from Reservoir.h over many
+// frames, and checks the mean of every pixel against an independent estimate of its direct lighting.
+
+#include "Math.h"
+#include "Parallel.h"
+#include "Reservoir.h"
+#include "SphericalTriangle.h"
+#include <vector>
+
+struct ReSTIRReferenceStats
+{
+	int pixels = 0;
+	float maxRelativeError = 0;        // Largest relative difference between the mean ReSTIR estimate and the reference, with 1/Z weights
+	float maxStandardErrors = 0;       // Largest difference from the reference in standard errors of the mean over the chains
+	float maxBiasedRelativeError = 0;  // The same two measures with reservoirs normalised by M, which is biased when neighbours' targets differ
+	float maxBiasedStandardErrors = 0;
+	float meanM = 0;                   // Mean number of candidates behind each final reservoir
+};
+
+// Runs the ReSTIR passes of PT.hlsl on a row of diffuse pixels lit by triangle lights with an occluder, and
+// compares the mean estimate of every pixel over many frames with an independent reference. The pixels' normals
+// fan out so that some lights are below the horizon of some pixels, the case the 1/Z weights exist for.
+class ReSTIRReference
+{
+public:
+	int pixels = 16;
+	int chains = 512;             // Independent sequences of frames
+	int frames = 64;              // Frames per sequence, each reusing the previous frame's reservoirs
+	int initialCandidates = 4;
+	int spatialNeighbours = 3;
+	int spatialRadius = 3;
+	int referenceSamples = 1 << 18;
+	ReSTIRReferenceStats stats;
+
+	// Returns the largest difference between the unbiased estimate and the reference in standard errors, which
+	// stays below about four for an unbiased estimator while the M normalised variant is far outside
+	float verify()
+	{
+		stats = ReSTIRReferenceStats();
+		stats.pixels = pixels;
+
+		// Three lights facing down at different heights and brightnesses
+		std::vector<AreaLightData> lights(3);
+		setLight(lights[0], Vec3(-1.2f, 1.0f, -0.4f), Vec3(-0.6f, 1.0f, -0.4f), Vec3(-0.9f, 1.0f, 0.3f), 6.0f);
+		setLight(lights[1], Vec3(0.2f, 1.6f, -0.5f), Vec3(1.0f, 1.6f, -0.5f), Vec3(0.6f, 1.6f, 0.5f), 12.0f);
+		setLight(lights[2], Vec3(1.4f, 0.7f, 0.2f), Vec3(1.8f, 0.7f, 0.2f), Vec3(1.6f, 0.7f, 0.6f), 3.0f);
+		std::vector<float> pmfs(lights.size());
+		float totalPower = 0;
+		for (unsigned int l = 0; l < lights.size(); l++)
+		{
+			pmfs[l] = lights[l].Le[0] * lights[l].area;
+			totalPower += pmfs[l];
+		}
+		for (unsigned int l = 0; l < lights.size(); l++)
+		{
+			pmfs[l] /= totalPower;
+		}
+
+		// A row of pixels on the ground with normals fanning from left to right
+		std::vector<ReSTIRSurface> surfaces(pixels);
+		for (int i = 0; i < pixels; i++)
+		{
+			float t = ((float)i + 0.5f) / (float)pixels;
+			float angle = (t - 0.5f) * 2.4f;
+			surfaces[i].pos = Vec3((t - 0.5f) * 3.0f, 0, 0);
+			surfaces[i].normal = Vec3(sinf(angle), cosf(angle), 0);
+			surfaces[i].albedo = Vec3(0.8f, 0.8f, 0.8f);
+			surfaces[i].depth = 1.0f;
+			surfaces[i].valid = 1;
+		}
+
+		// Reference by uniform area sampling of every light
+		std::vector<double> reference(pixels, 0);
+		parallelFor(pixels, [&](int i)
+			{
+				unsigned int state = 0x9E3779B9u * (unsigned int)(i + 1);
+				for (unsigned int l = 0; l < lights.size(); l++)
+				{
+					double sum = 0;
+					for (int s = 0; s < referenceSamples; s++)
+					{
+						float su = sqrtf(next(state));
+						float u2 = next(state);
+						Vec3 point = (lights[l].v1 * (1.0f - su)) + (lights[l].v2 * (su * u2)) + (lights[l].v3 * (su * (1.0f - u2)));
+						sum += (double)(contribution(lights, surfaces[i], l, point) * lights[l].area);
+					}
+					reference[i] += sum / (double)referenceSamples;
+				}
+			}, 1);
+
+		// Run both normalisations over independent chains of frames
+		std::vector<double> estimates[2];
+		std::vector<double> standardErrors[2];
+		std::vector<double> meanM(chains, 0);
+		for (int variant = 0; variant < 2; variant++)
+		{
+			std::vector<double> chainSums((size_t)chains * pixels, 0);
+			parallelFor(chains, [&](int c)
+				{
+					unsigned int state = (0x85EBCA6Bu * (unsigned int)(c + 1)) ^ (unsigned int)variant;
+					std::vector<Reservoir> temporal(pixels);
+					std::vector<Reservoir> spatial(pixels);
+					for (int f = 0; f < frames; f++)
+					{
+						// Initial candidates and temporal reuse of the same pixel (the camera is static)
+						for (int i = 0; i < pixels; i++)
+						{
+							Reservoir initial = initialReservoir(lights, pmfs, surfaces[i], state);
+							Reservoir r;
+							r.merge(initial, initial.targetPdf, next(state));
+							float Z = initial.M;
+							float total = initial.M;
+							if (f > 0)
+							{
+								Reservoir previous = spatial[i];
+								previous.M = std::min(previous.M, RESTIR_TEMPORAL_MAX_M * initial.M);
+								r.merge(previous, target(lights, surfaces[i], previous.lightIndex, previous.samplePoint), next(state));
+								Z += target(lights, surfaces[i], r.lightIndex, r.samplePoint) > 0 ? previous.M : 0;
+								total += previous.M;
+							}
+							r.finalise(variant == 0 ? Z : total);
+							temporal[i] = r;
+						}
+						// Spatial reuse, reading only the temporal reservoirs
+						for (int i = 0; i < pixels; i++)
+						{
+							Reservoir r;
+							r.merge(temporal[i], temporal[i].targetPdf, next(state));
+							int neighbours[16];
+							int count = 0;
+							for (int k = 0; k < spatialNeighbours; k++)
+							{
+								int offset = (int)(next(state) * (float)(2 * spatialRadius)) - spatialRadius;
+								int q = i + (offset >= 0 ? offset + 1 : offset);
+								if (q < 0 || q >= pixels)
+								{
+									continue;
+								}
+								r.merge(temporal[q], target(lights, surfaces[i], temporal[q].lightIndex, temporal[q].samplePoint), next(state));
+								neighbours[count++] = q;
+							}
+							float Z = temporal[i].M;
+							for (int k = 0; k < count; k++)
+							{
+								Z += target(lights, surfaces[neighbours[k]], r.lightIndex, r.samplePoint) > 0 ? temporal[neighbours[k]].M : 0;
+							}
+							r.finalise(variant == 0 ? Z : r.M);
+							spatial[i] = r;
+							// Shade with the final shadow ray
+							if (r.W > 0)
+							{
+								chainSums[((size_t)c * pixels) + i] += (double)(contribution(lights, surfaces[i], r.lightIndex, r.samplePoint) * r.W);
+							}
+							meanM[c] += variant == 0 ? (double)r.M : 0;
+						}
+					}
+				}, 1);
+			// Frames within a chain are correlated, so the noise is measured between the independent chains
+			estimates[variant].assign(pixels, 0);
+			standardErrors[variant].assign(pixels, 0);
+			for (int i = 0; i < pixels; i++)
+			{
+				double sum = 0;
+				double sumSq = 0;
+				for (int c = 0; c < chains; c++)
+				{
+					double chainMean = chainSums[((size_t)c * pixels) + i] / (double)frames;
+					sum += chainMean;
+					sumSq += chainMean * chainMean;
+				}
+				double mean = sum / (double)chains;
+				estimates[variant][i] = mean;
+				standardErrors[variant][i] = sqrt(std::max((sumSq / (double)chains) - (mean * mean), 0.0) / (double)std::max(chains - 1, 1));
+			}
+		}
+		for (int i = 0; i < pixels; i++)
+		{
+			if (reference[i] <= 0)
+			{
+				continue;
+			}
+			stats.maxRelativeError = std::max(stats.maxRelativeError, (float)(fabs(estimates[0][i] - reference[i]) / reference[i]));
+			stats.maxBiasedRelativeError = std::max(stats.maxBiasedRelativeError, (float)(fabs(estimates[1][i] - reference[i]) / reference[i]));
+			stats.maxStandardErrors = std::max(stats.maxStandardErrors, (float)(fabs(estimates[0][i] - reference[i]) / std::max(standardErrors[0][i], 1e-12)));
+			stats.maxBiasedStandardErrors = std::max(stats.maxBiasedStandardErrors, (float)(fabs(estimates[1][i] - reference[i]) / std::max(standardErrors[1][i], 1e-12)));
+		}
+		double sumM = 0;
+		for (int c = 0; c < chains; c++)
+		{
+			sumM += meanM[c];
+		}
+		stats.meanM = (float)(sumM / ((double)chains * (double)frames * (double)pixels));
+		return stats.maxStandardErrors;
+	}
+
+private:
+	static float next(unsigned int& state)
+	{
+		state = (state * 1664525u) + 1013904223u;
+		return (float)(state >> 8) / 16777216.0f;
+	}
+
+	static void setLight(AreaLightData& light, const Vec3& v1, const Vec3& v2, const Vec3& v3, float Le)
+	{
+		light.v1 = v1;
+		light.v2 = v2;
+		light.v3 = v3;
+		Vec3 n = Cross(v2 - v1, v3 - v1);
+		light.area = n.length() * 0.5f;
+		light.normal = n.normalize();
+		// Face the ground
+		if (light.normal.y > 0)
+		{
+			light.normal = -light.normal;
+		}
+		light.Le[0] = Le;
+		light.Le[1] = Le;
+		light.Le[2] = Le;
+		light.power = Le * light.area * SPHERICAL_PI;
+	}
+
+	// Unshadowed contribution of a point on a light to a diffuse surface, per unit light area; mirrors restirContribution in PT.hlsl
+	static float target(const std::vector<AreaLightData>& lights, const ReSTIRSurface& surface, unsigned int lightIndex, const Vec3& point)
+	{
+		if (lightIndex >= lights.size())
+		{
+			return 0;
+		}
+		const AreaLightData& light = lights[lightIndex];
+		Vec3 d = point - surface.pos;
+		float distanceSq = d.lengthSq();
+		if (distanceSq <= 0)
+		{
+			return 0;
+		}
+		Vec3 wi = d / sqrtf(distanceSq);
+		float cosTheta = Dot(surface.normal, wi);
+		float cosLight = -Dot(light.normal, wi);
+		if (cosTheta <= 0 || cosLight <= 0)
+		{
+			return 0;
+		}
+		return light.Le[0] * (surface.albedo.x / SPHERICAL_PI) * cosTheta * cosLight / distanceSq;
+	}
+
+	// Shadowed contribution, with a sphere between the ground and the lights
+	static float contribution(const std::vector<AreaLightData>& lights, const ReSTIRSurface& surface, unsigned int lightIndex, const Vec3& point)
+	{
+		float value = target(lights, surface, lightIndex, point);
+		if (value <= 0)
+		{
+			return 0;
+		}
+		Vec3 centre(0.1f, 0.55f, 0.0f);
+		float radius = 0.25f;
+		Vec3 d = point - surface.pos;
+		float length = d.length();
+		d = d / length;
+		Vec3 oc = surface.pos - centre;
+		float b = Dot(oc, d);
+		float c = oc.lengthSq() - (radius * radius);
+		float disc = (b * b) - c;
+		if (disc > 0)
+		{
+			float t = -b - sqrtf(disc);
+			if (t > 0 && t < length)
+			{
+				return 0;
+			}
+		}
+		return value;
+	}
+
+	// Streams light candidates through a reservoir; mirrors restirInitialCandidates in PT.hlsl without the environment map
+	Reservoir initialReservoir(const std::vector<AreaLightData>& lights, const std::vector<float>& pmfs, const ReSTIRSurface& surface, unsigned int& state) const
+	{
+		Reservoir r;
+		for (int c = 0; c < initialCandidates; c++)
+		{
+			float u = next(state);
+			int l = 0;
+			float cdf = pmfs[0];
+			while (u >= cdf && l < (int)lights.size() - 1)
+			{
+				l++;
+				cdf += pmfs[l];
+			}
+			const AreaLightData& light = lights[l];
+			Vec3 wi;
+			Vec3 point;
+			float pdf = 0;
+			float sourcePdf = 0;
+			if (sampleTriangleLight(light.v1, light.v2, light.v3, light.normal, light.area, surface.pos, next(state), next(state), wi, point, pdf) && pdf > 0)
+			{
+				// Convert the solid angle pdf to the area measure the reservoirs share
+				float cosLight = -Dot(wi, light.normal);
+				sourcePdf = pmfs[l] * pdf * cosLight / (point - surface.pos).lengthSq();
+			}
+			float value = sourcePdf > 0 ? target(lights, surface, l, point) : 0;
+			r.update(l, point, sourcePdf > 0 ? value / sourcePdf : 0, value, next(state));
+		}
+		r.finalise(r.M);
+		return r;
+	}
+};
@@ -0,0 +1,185 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file holds the reservoir math of the ReSTIR direct illumination passes in PT.hlsl (Bitterli et al. 2020).
+// Each pixel streams light candidates through a weighted reservoir, then combines its reservoir with last
+// frame's reservoir at the reprojected pixel and with a few spatial neighbours. Combined reservoirs are
+// normalised by the number of candidates whose surface could have produced the selected sample (the 1/Z
+// weights), which keeps reuse across surfaces with different normals unbiased. The shader functions
+// reservoirUpdate, reservoirMerge and reservoirFinalise are line for line copies of the methods below, and
+// ReSTIRReference.h runs the same passes on the CPU to check that the result is unbiased.
+// ReSTIR GI (Ouyang et al. 2021) resamples the first vertex of each pixel's indirect path in the same way. A
+// surface reusing another surface's vertex reconnects to it, so the reused contribution weight is scaled by
+// the reconnection Jacobian; ReSTIRGIReference.h checks those passes.
+
+#include "Math.h"
+
+// Light index stored in a reservoir whose sample is an environment map direction
+static const unsigned int RESERVOIR_ENVIRONMENT = 0xFFFFFFFEu;
+
+// Largest multiple of the current pixel's candidate count that last frame's reservoir may carry into temporal reuse
+static const float RESTIR_TEMPORAL_MAX_M = 20.0f;
+
+// A weighted reservoir holding one light sample, laid out as ReSTIRReservoir in PT.hlsl (32 bytes)
+// Light samples are points on the light so reservoirs can be shared between surfaces without a change of measure
+struct Reservoir
+{
+	Vec3 samplePoint;             // Point on the selected area light, or the direction of an environment map sample
+	unsigned int lightIndex = 0;  // Index of the area light, or RESERVOIR_ENVIRONMENT
+	float weightSum = 0;          // Sum of the resampling weights of every candidate seen so far
+	float M = 0;                  // Number of candidates the reservoir represents
+	float W = 0;                  // Unbiased contribution weight of the selected sample
+	float targetPdf = 0;          // Target function of the selected sample at the reservoir's own surface
+
+	// Streams in one candidate with resampling weight target / sourcePdf, keeping it with probability weight / weightSum
+	bool update(unsigned int index, const Vec3& point, float weight, float target, float u)
+	{
+		weightSum += weight;
+		M += 1.0f;
+		if (weight > 0 && (u * weightSum) < weight)
+		{
+			samplePoint = point;
+			lightIndex = index;
+			targetPdf = target;
+			return true;
+		}
+		return false;
+	}
+
+	// Streams in another reservoir, where target is the target function of its sample at this reservoir's surface
+	bool merge(const Reservoir& r, float target, float u)
+	{
+		float weight = target * r.W * r.M;
+		weightSum += weight;
+		M += r.M;
+		if (weight > 0 && (u * weightSum) < weight)
+		{
+			samplePoint = r.samplePoint;
+			lightIndex = r.lightIndex;
+			targetPdf = target;
+			return true;
+		}
+		return false;
+	}
+
+	// Computes the contribution weight once every candidate is in. Z is the number of candidates that came from
+	// surfaces where the selected sample has a non-zero target function; for plain RIS this is M
+	void finalise(float Z)
+	{
+		W = (targetPdf > 0 && Z > 0) ? weightSum / (Z * targetPdf) : 0;
+	}
+};
+
+// Primary surface seen through a pixel, laid out as ReSTIRSurface in PT.hlsl (64 bytes)
+struct ReSTIRSurface
+{
+	Vec3 pos;
+	float depth = 0;            // Distance from the camera, used to scale the similarity test
+	Vec3 normal;
+	unsigned int bsdf = 0;
+	Vec3 albedo;
+	unsigned int valid = 0;     // Zero where the pixel sees no surface that direct lighting can be resampled for
+	Vec3 radiance;              // Everything the path tracer gathered for the pixel except the lighting the spatial pass resamples
+	float pad = 0;
+};
+
+// Jacobian of moving a reconnection to a secondary vertex from the surface at 'from' to the surface at 'to', the ratio of
+// the solid angles the same area around the vertex subtends at both surfaces. A reservoir's contribution weight is an
+// estimate of one over a solid angle pdf at its own surface, so it is multiplied by this ratio when reused at another surface.
+// Returns zero when the vertex faces away from either surface; mirrors reconnectionJacobian in PT.hlsl
+static float reconnectionJacobian(const Vec3& from, const Vec3& to, const Vec3& samplePos, const Vec3& sampleNormal)
+{
+	Vec3 dFrom = from - samplePos;
+	Vec3 dTo = to - samplePos;
+	float distanceFromSq = dFrom.lengthSq();
+	float distanceToSq = dTo.lengthSq();
+	if (distanceFromSq <= 0 || distanceToSq <= 0)
+	{
+		return 0;
+	}
+	float cosFrom = Dot(sampleNormal, dFrom) / sqrtf(distanceFromSq);
+	float cosTo = Dot(sampleNormal, dTo) / sqrtf(distanceToSq);
+	if (cosFrom <= 0 || cosTo <= 0)
+	{
+		return 0;
+	}
+	return (cosTo / cosFrom) * (distanceFromSq / distanceToSq);
+}
+
+// Reservoir holding one secondary path vertex for ReSTIR GI, laid out as GIReservoir in PT.hlsl (64 bytes)
+// The sample is the vertex found by a BSDF sampled ray from the primary surface and the radiance leaving it
+// towards that surface, so other pixels can reuse it by reconnecting to the vertex
+struct GIReservoir
+{
+	Vec3 samplePos;
+	float weightSum = 0;
+	Vec3 sampleNormal;
+	float M = 0;
+	Vec3 radiance;               // Outgoing radiance of the vertex towards the surface that found it, without its emission
+	float W = 0;                 // Unbiased contribution weight, with respect to solid angle at the reservoir's own surface
+	float targetPdf = 0;
+	float pad[3] = {};
+
+	// Streams in one candidate with resampling weight target / sourcePdf
+	bool update(const Vec3& pos, const Vec3& normal, const Vec3& L, float weight, float target, float u)
+	{
+		weightSum += weight;
+		M += 1.0f;
+		if (weight > 0 && (u * weightSum) < weight)
+		{
+			samplePos = pos;
+			sampleNormal = normal;
+			radiance = L;
+			targetPdf = target;
+			return true;
+		}
+		return false;
+	}
+
+	// Streams in a reservoir from another surface. target is the target function of its sample at this reservoir's
+	// surface and jacobian the reconnectionJacobian from the other surface to this one
+	bool merge(const GIReservoir& r, float target, float jacobian, float u)
+	{
+		float weight = target * jacobian * r.W * r.M;
+		weightSum += weight;
+		M += r.M;
+		if (weight > 0 && (u * weightSum) < weight)
+		{
+			samplePos = r.samplePos;
+			sampleNormal = r.sampleNormal;
+			radiance = r.radiance;
+			targetPdf = target;
+			return true;
+		}
+		return false;
+	}
+
+	// Computes the contribution weight, with Z as in Reservoir::finalise
+	void finalise(float Z)
+	{
+		W = (targetPdf > 0 && Z > 0) ? weightSum / (Z * targetPdf) : 0;
+	}
+};
@@ -0,0 +1,639 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file holds the samplers that supply the random numbers of camera paths, shared by rnd in PT.hlsl and the CPU
+// path tracer in BDPT.h. Each call to rnd takes the next dimension of the pixel's current sample.
+// - SAMPLER_PCG is the original generator, independent white noise in every dimension.
+// - SAMPLER_SOBOL is Owen scrambled Sobol after Burley's "Practical Hash-based Owen Scrambling". Dimensions are taken
+//   in pairs from the first two Sobol dimensions, with each pair's sample order shuffled and each dimension scrambled
+//   by a hash of the pixel, so every pair is a (0,2) sequence and every dimension is stratified on its own, without
+//   tables of direction numbers.
+// - SAMPLER_BLUE_NOISE is blue noise dithered sampling after Georgiev and Fajardo. Every pixel takes the same
+//   scrambled Sobol sequence, rotated per dimension by the value of a blue noise mask at the pixel, so each pixel still
+//   sees a low discrepancy sequence but neighbouring pixels' errors cancel out, leaving noise of high frequency only.
+//   The mask is made on the CPU by Ulichney's void and cluster method, once, and cached in a file (see Headless.cpp).
+// The state rnd threads through the shaders is the PCG state, or the next dimension for the other two. sobolSample and
+// blueNoiseSample in PT.hlsl are copies of PixelSampler's methods below. verify() checks the stratification of the
+// sequences and the spectrum of the mask, and benchmark() measures their speed and convergence rate.
+
+#include "HashGrid.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+static const int SAMPLER_PCG = 0;
+static const int SAMPLER_SOBOL = 1;
+static const int SAMPLER_BLUE_NOISE = 2;
+static const int SAMPLER_TYPES = 3;
+// Width and height of the blue noise mask, a power of two, and the width of the Gaussian it spreads energy with
+static const int BLUE_NOISE_SIZE = 64;
+static const float BLUE_NOISE_SIGMA = 1.5f;
+// File the mask is kept in, next to the executable's working directory as the scenes are
+static const char* BLUE_NOISE_FILENAME = "bluenoise.bin";
+// Scrambles the sequence every pixel shares when dithered by the mask
+static const unsigned int BLUE_NOISE_SEED = 0x2C1B3C6Du;
+
+static const char* samplerName(int type)
+{
+	return type == SAMPLER_SOBOL ? "Owen Sobol" : (type == SAMPLER_BLUE_NOISE ? "Blue noise" : "PCG");
+}
+
+static unsigned int reverseBits(unsigned int x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Laine and Karras' permutation, in which every bit depends on the bits below it only
+static unsigned int laineKarrasPermutation(unsigned int x, unsigned int seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// Owen scrambling of a 32 bit fraction: every bit is flipped by a hash of the bits above it
+static unsigned int nestedUniformScramble(unsigned int x, unsigned int seed)
+{
+	return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// The first (van der Corput) and second Sobol dimensions as 32 bit fractions. The second has the primitive polynomial
+// x + 1, whose direction numbers follow from each other as v ^ (v >> 1)
+static unsigned int sobol(unsigned int index, unsigned int dimension)
+{
+	if (dimension == 0)
+	{
+		return reverseBits(index);
+	}
+	unsigned int x = 0;
+	unsigned int v = 0x80000000u;
+	for (; index != 0; index >>= 1)
+	{
+		if (index & 1)
+		{
+			x ^= v;
+		}
+		v ^= v >> 1;
+	}
+	return x;
+}
+
+static unsigned int samplerHashCombine(unsigned int seed, unsigned int v)
+{
+	return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+// A blue noise mask of BLUE_NOISE_SIZE squared values, each of (rank + 0.5) / count for a distinct rank
+class BlueNoiseMask
+{
+public:
+	std::vector<float> values;
+
+	float value(unsigned int x, unsigned int y) const
+	{
+		return values[((y & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE) + (x & (BLUE_NOISE_SIZE - 1))];
+	}
+
+	// Void and cluster. An initial pattern of a tenth of the pixels is relaxed by moving its tightest cluster into its
+	// largest void until that changes nothing, and ranked by taking away its tightest clusters. Pixels are then added at
+	// the largest void until the mask is full, which past the half way point is the same as taking away the tightest
+	// clusters of the pixels not yet added, as the energies of the two sets sum to a constant
+	void generate(unsigned int seed = 0x1B873593u)
+	{
+		const int n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+		// Energy one pixel adds at each toroidal offset
+		std::vector<float> kernel(n);
+		for (int y = 0; y < BLUE_NOISE_SIZE; y++)
+		{
+			for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+			{
+				int dx = std::min(x, BLUE_NOISE_SIZE - x);
+				int dy = std::min(y, BLUE_NOISE_SIZE - y);
+				kernel[(y * BLUE_NOISE_SIZE) + x] = expf(-(float)((dx * dx) + (dy * dy)) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+			}
+		}
+		std::vector<unsigned char> pattern(n, 0);
+		std::vector<float> energy(n, 0);
+		auto toggle = [&](int pixel, bool on)
+			{
+				pattern[pixel] = on ? 1 : 0;
+				int px = pixel % BLUE_NOISE_SIZE;
+				int py = pixel / BLUE_NOISE_SIZE;
+				float sign = on ? 1.0f : -1.0f;
+				for (int y = 0; y < BLUE_NOISE_SIZE; y++)
+				{
+					int ky = ((y - py) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE;
+					for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+					{
+						energy[(y * BLUE_NOISE_SIZE) + x] += sign * kernel[ky + ((x - px) & (BLUE_NOISE_SIZE - 1))];
+					}
+				}
+			};
+		// The set pixel of highest energy, or the unset one of lowest
+		auto tightestCluster = [&]()
+			{
+				int best = -1;
+				for (int i = 0; i < n; i++)
+				{
+					best = (pattern[i] == 1 && (best < 0 || energy[i] > energy[best])) ? i : best;
+				}
+				return best;
+			};
+		auto largestVoid = [&]()
+			{
+				int best = -1;
+				for (int i = 0; i < n; i++)
+				{
+					best = (pattern[i] == 0 && (best < 0 || energy[i] < energy[best])) ? i : best;
+				}
+				return best;
+			};
+		unsigned int state = seed;
+		int initial = n / 10;
+		for (int placed = 0; placed < initial;)
+		{
+			state = hashPCG(state);
+			int pixel = (int)(state % (unsigned int)n);
+			if (pattern[pixel] == 0)
+			{
+				toggle(pixel, true);
+				placed++;
+			}
+		}
+		for (int iteration = 0; iteration < n; iteration++)
+		{
+			int cluster = tightestCluster();
+			toggle(cluster, false);
+			int gap = largestVoid();
+			toggle(gap, true);
+			if (gap == cluster)
+			{
+				break;
+			}
+		}
+		std::vector<unsigned char> prototype = pattern;
+		std::vector<float> prototypeEnergy = energy;
+		std::vector<int> ranks(n, 0);
+		for (int rank = initial - 1; rank >= 0; rank--)
+		{
+			int cluster = tightestCluster();
+			toggle(cluster, false);
+			ranks[cluster] = rank;
+		}
+		pattern = prototype;
+		energy = prototypeEnergy;
+		for (int rank = initial; rank < n; rank++)
+		{
+			int gap = largestVoid();
+			toggle(gap, true);
+			ranks[gap] = rank;
+		}
+		values.resize(n);
+		for (int i = 0; i < n; i++)
+		{
+			values[i] = ((float)ranks[i] + 0.5f) / (float)n;
+		}
+	}
+
+	bool load(std::string filename)
+	{
+		std::ifstream file(filename, std::ios::binary);
+		if (file.is_open() == false)
+		{
+			return false;
+		}
+		std::vector<float> data(BLUE_NOISE_SIZE * BLUE_NOISE_SIZE);
+		file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+		if (file.gcount() != (std::streamsize)(data.size() * sizeof(float)))
+		{
+			return false;
+		}
+		values = data;
+		return true;
+	}
+
+	bool save(std::string filename) const
+	{
+		std::ofstream file(filename, std::ios::binary);
+		if (file.is_open() == false)
+		{
+			return false;
+		}
+		file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(float));
+		return true;
+	}
+
+	// Loads the mask from a file, or makes it and writes the file for next time
+	void loadOrGenerate(std::string filename)
+	{
+		if (load(filename) == false)
+		{
+			generate();
+			save(filename);
+		}
+	}
+};
+
+// The random numbers of one sample of one pixel
+class PixelSampler
+{
+public:
+	int type = SAMPLER_PCG;
+	unsigned int state = 0;             // PCG state, or the next dimension
+	unsigned int index = 0;             // Sample of the pixel
+	unsigned int x = 0;
+	unsigned int y = 0;
+	const BlueNoiseMask* mask = NULL;
+
+	float next()
+	{
+		if (type == SAMPLER_SOBOL)
+		{
+			return sobolSample(index, state++, hashPCG((y << 16) ^ x));
+		}
+		if (type == SAMPLER_BLUE_NOISE)
+		{
+			return blueNoiseSample(index, state++);
+		}
+		state = (state * 747796405u) + 2891336453u;
+		unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+		return std::min((float)((word >> 22u) ^ word) / 4294967296.0f, 0.99999994f);
+	}
+
+	// A dimension of a sample of the scrambled sequence seeded by seed. The pair a dimension belongs to shuffles its
+	// samples by Owen scrambling the sample index, which keeps every run of a power of two samples from the start a
+	// (0,m,2) net, and scrambles each dimension apart
+	static float sobolSample(unsigned int index, unsigned int dimension, unsigned int seed)
+	{
+		unsigned int shuffled = nestedUniformScramble(index, hashPCG(samplerHashCombine(seed, dimension >> 1)));
+		unsigned int value = nestedUniformScramble(sobol(shuffled, dimension & 1), hashPCG(samplerHashCombine(seed ^ 0x5bd1e995u, dimension)));
+		return (float)(value >> 8) / 16777216.0f;
+	}
+
+	// A dimension of the sequence every pixel shares, rotated by the mask read at an offset for each dimension. The
+	// offsets step through the mask along the R2 sequence so that the dimensions' rotations are unrelated
+	float blueNoiseSample(unsigned int sampleIndex, unsigned int dimension) const
+	{
+		unsigned int ox = (dimension * 3242174889u) >> 26;
+		unsigned int oy = (dimension * 2447445414u) >> 26;
+		float value = sobolSample(sampleIndex, dimension, BLUE_NOISE_SEED) + mask->value(x + ox, y + oy);
+		return value >= 1.0f ? value - 1.0f : value;
+	}
+};
+
+// Slope of a least squares line through log error against log samples, from the measurement first on. Independent
+// samples converge with a slope of -0.5
+static double convergenceSlope(const std::vector<double>& samples, const std::vector<double>& errors, unsigned int first)
+{
+	double sx = 0;
+	double sy = 0;
+	double sxx = 0;
+	double sxy = 0;
+	int n = 0;
+	for (unsigned int k = first; k < errors.size(); k++)
+	{
+		double lx = log(samples[k]);
+		double ly = log(std::max(errors[k], 1e-12));
+		sx += lx;
+		sy += ly;
+		sxx += lx * lx;
+		sxy += lx * ly;
+		n++;
+	}
+	return n > 1 ? ((n * sxy) - (sx * sy)) / ((n * sxx) - (sx * sx)) : 0;
+}
+
+// Speed and convergence of the samplers measured by Sampler::benchmark
+struct SamplerBenchmark
+{
+	double samplesPerSecond[SAMPLER_TYPES] = {};
+	// Root mean square error over the pixels of a four dimensional integral at the most samples, and the slope of its
+	// logarithm against that of the samples
+	double error[SAMPLER_TYPES] = {};
+	double slope[SAMPLER_TYPES] = {};
+	double maskSeconds = 0;             // Time generating the blue noise mask
+};
+
+class Sampler
+{
+public:
+	int type = SAMPLER_PCG;
+	BlueNoiseMask mask;
+
+	// The sampler for a sample of a pixel. PCG starts from pcgState, the others from the first dimension
+	PixelSampler pixel(unsigned int x, unsigned int y, unsigned int index, unsigned int pcgState) const
+	{
+		PixelSampler sampler;
+		sampler.type = (type == SAMPLER_BLUE_NOISE && mask.values.size() == 0) ? SAMPLER_SOBOL : type;
+		sampler.state = sampler.type == SAMPLER_PCG ? pcgState : 0;
+		sampler.index = index;
+		sampler.x = x;
+		sampler.y = y;
+		sampler.mask = &mask;
+		return sampler;
+	}
+
+	// Checks the (0,m,2) nets of the Sobol pairs, that each sampler's dimensions average to a
+	// half across pixels, that the mask holds every rank once and keeps its noise at high frequencies, and that both
+	// low discrepancy samplers integrate a smooth function better than PCG. Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		if (mask.values.size() == 0)
+		{
+			mask.generate();
+		}
+
+		// Every power of two run of samples from the start of each pair is a (0,m,2) net: every box of the 2^m
+		// elementary intervals of area 2^-m holds one sample. The sequence the dithered sampler rotates is included
+		int badNets = 0;
+		const unsigned int seeds[] = { hashPCG(0), hashPCG(1), hashPCG((7 << 16) ^ 3), BLUE_NOISE_SEED };
+		for (unsigned int seed : seeds)
+		{
+			for (unsigned int pair = 0; pair < 6; pair++)
+			{
+				for (int m = 0; m <= 10; m++)
+				{
+					int count = 1 << m;
+					std::vector<unsigned int> u(count);
+					std::vector<unsigned int> v(count);
+					for (int i = 0; i < count; i++)
+					{
+						u[i] = (unsigned int)(PixelSampler::sobolSample(i, pair * 2, seed) * 16777216.0f);
+						v[i] = (unsigned int)(PixelSampler::sobolSample(i, (pair * 2) + 1, seed) * 16777216.0f);
+					}
+					for (int a = 0; a <= m; a++)
+					{
+						std::vector<int> boxes(count, 0);
+						for (int i = 0; i < count; i++)
+						{
+							unsigned int bu = a == 0 ? 0 : u[i] >> (24 - a);
+							unsigned int bv = (m - a) == 0 ? 0 : v[i] >> (24 - (m - a));
+							boxes[(bu << (m - a)) | bv]++;
+						}
+						for (int b = 0; b < count; b++)
+						{
+							badNets += boxes[b] == 1 ? 0 : 1;
+						}
+					}
+				}
+			}
+		}
+		failures += badNets == 0 ? 0 : 1;
+
+		// The first sample of every dimension is uniform over the pixels, so no sampler favours part of the domain
+		for (int type = 0; type < SAMPLER_TYPES; type++)
+		{
+			int saved = this->type;
+			this->type = type;
+			bool uniform = true;
+			for (unsigned int index = 0; index < 3; index++)
+			{
+				double sums[16] = {};
+				for (unsigned int py = 0; py < 128; py++)
+				{
+					for (unsigned int px = 0; px < 128; px++)
+					{
+						PixelSampler sampler = pixel(px, py, index, hashPCG((py * 128) + px + (index << 16)));
+						for (int d = 0; d < 16; d++)
+						{
+							sums[d] += sampler.next();
+						}
+					}
+				}
+				for (int d = 0; d < 16; d++)
+				{
+					uniform = uniform && fabs((sums[d] / (128.0 * 128.0)) - 0.5) < 0.01;
+				}
+			}
+			failures += uniform ? 0 : 1;
+			this->type = saved;
+		}
+
+		// The mask holds every rank once
+		std::vector<float> sorted = mask.values;
+		std::sort(sorted.begin(), sorted.end());
+		bool permutation = sorted.size() == BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+		for (unsigned int i = 0; permutation && i < sorted.size(); i++)
+		{
+			permutation = fabsf(sorted[i] - (((float)i + 0.5f) / (float)sorted.size())) < 1e-6f;
+		}
+		failures += permutation ? 0 : 1;
+
+		// The mask, and the first dimension of the dithered sampler's first sample, have a small fraction of the power
+		// of white noise at low frequencies
+		std::vector<float> white(BLUE_NOISE_SIZE * BLUE_NOISE_SIZE);
+		std::vector<float> dithered(white.size());
+		unsigned int state = 0x68BC21EBu;
+		for (unsigned int i = 0; i < white.size(); i++)
+		{
+			state = hashPCG(state);
+			white[i] = (float)(state >> 8) / 16777216.0f;
+			PixelSampler sampler = pixel(i % BLUE_NOISE_SIZE, i / BLUE_NOISE_SIZE, 0, 0);
+			sampler.type = SAMPLER_BLUE_NOISE;
+			dithered[i] = sampler.next();
+		}
+		double whiteLow = lowFrequencyPower(white);
+		failures += lowFrequencyPower(mask.values) < 0.2 * whiteLow ? 0 : 1;
+		failures += lowFrequencyPower(dithered) < 0.2 * whiteLow ? 0 : 1;
+
+		// Both low discrepancy samplers integrate a smooth function of a pair of dimensions with a quarter of the error
+		// of PCG or less after 256 samples
+		double errors[SAMPLER_TYPES];
+		for (int type = 0; type < SAMPLER_TYPES; type++)
+		{
+			std::vector<double> e;
+			convergence(type, 256, 32, false, e);
+			errors[type] = e.back();
+		}
+		failures += (errors[SAMPLER_SOBOL] < 0.25 * errors[SAMPLER_PCG] && errors[SAMPLER_BLUE_NOISE] < 0.25 * errors[SAMPLER_PCG]) ? 0 : 1;
+		return failures;
+	}
+
+	// Measures the samplers' speed, and their convergence on a four dimensional integral with a discontinuity like
+	// those of visibility, over 64 by 64 pixels up to 1024 samples each
+	SamplerBenchmark benchmark()
+	{
+		SamplerBenchmark result;
+		auto start = std::chrono::high_resolution_clock::now();
+		BlueNoiseMask generated;
+		generated.generate();
+		result.maskSeconds = secondsSince(start);
+		if (mask.values.size() == 0)
+		{
+			mask = generated;
+		}
+		int saved = type;
+		for (int t = 0; t < SAMPLER_TYPES; t++)
+		{
+			type = t;
+			const int pixels = 1 << 16;
+			const int dimensions = 64;
+			std::vector<float> sums(pixels);
+			start = std::chrono::high_resolution_clock::now();
+			parallelFor(pixels, [&](int i)
+				{
+					PixelSampler sampler = pixel(i & 255, i >> 8, 7, hashPCG(i));
+					float sum = 0;
+					for (int d = 0; d < dimensions; d++)
+					{
+						sum += sampler.next();
+					}
+					sums[i] = sum;
+				});
+			result.samplesPerSecond[t] = (double)pixels * dimensions / secondsSince(start);
+			std::vector<double> errors;
+			convergence(t, 1024, 64, true, errors);
+			result.error[t] = errors.back();
+			// Fitted over 4 to 1024 samples
+			std::vector<double> samples(errors.size());
+			for (unsigned int k = 0; k < errors.size(); k++)
+			{
+				samples[k] = (double)(1 << k);
+			}
+			result.slope[t] = convergenceSlope(samples, errors, 2);
+		}
+		type = saved;
+		return result;
+	}
+
+private:
+	static double secondsSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::max(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count(), 1e-9);
+	}
+
+	// Estimates an integral at every pixel of a square with up to maxSamples samples, recording the root mean square
+	// error of the estimates after each power of two. The integrand is the product of the first pair's dimensions, and
+	// with shadowed set is zero where the second pair falls outside a quarter disc, as a partly shadowed point would be
+	void convergence(int samplerType, int maxSamples, int side, bool shadowed, std::vector<double>& errors)
+	{
+		int saved = type;
+		type = samplerType;
+		const double exact = shadowed ? 0.25 * (3.14159265358979 / 4.0) : 0.25;
+		int levels = 0;
+		while ((1 << levels) <= maxSamples)
+		{
+			levels++;
+		}
+		std::vector<double> squared(levels, 0.0);
+		std::vector<std::vector<double>> perPixel(side * side, std::vector<double>(levels, 0.0));
+		parallelFor(side * side, [&](int i)
+			{
+				double sum = 0;
+				int level = 0;
+				for (int s = 0; s < maxSamples; s++)
+				{
+					PixelSampler sampler = pixel(i % side, i / side, (unsigned int)s, hashPCG(((unsigned int)i << 12) ^ (unsigned int)s));
+					float u0 = sampler.next();
+					float u1 = sampler.next();
+					float u2 = sampler.next();
+					float u3 = sampler.next();
+					sum += (shadowed == false || ((u2 * u2) + (u3 * u3)) < 1.0f) ? (double)(u0 * u1) : 0.0;
+					if (s + 1 == (1 << level))
+					{
+						double e = (sum / (double)(s + 1)) - exact;
+						perPixel[i][level] = e * e;
+						level++;
+					}
+				}
+			}, 16);
+		errors.resize(levels);
+		for (int k = 0; k < levels; k++)
+		{
+			double total = 0;
+			for (int i = 0; i < side * side; i++)
+			{
+				total += perPixel[i][k];
+			}
+			errors[k] = sqrt(total / (double)(side * side));
+		}
+		type = saved;
+	}
+
+	// Fraction of an image's power, without its mean, at frequencies within a quarter of the Nyquist limit
+	static double lowFrequencyPower(const std::vector<float>& image)
+	{
+		const int n = BLUE_NOISE_SIZE;
+		double mean = 0;
+		for (unsigned int i = 0; i < image.size(); i++)
+		{
+			mean += image[i];
+		}
+		mean /= (double)image.size();
+		// Discrete Fourier transform of the rows, then of the columns
+		std::vector<double> re(n * n);
+		std::vector<double> im(n * n);
+		for (int y = 0; y < n; y++)
+		{
+			for (int k = 0; k < n; k++)
+			{
+				double sr = 0;
+				double si = 0;
+				for (int x = 0; x < n; x++)
+				{
+					double angle = -2.0 * 3.14159265358979 * (double)(k * x) / (double)n;
+					sr += (image[(y * n) + x] - mean) * cos(angle);
+					si += (image[(y * n) + x] - mean) * sin(angle);
+				}
+				re[(y * n) + k] = sr;
+				im[(y * n) + k] = si;
+			}
+		}
+		double low = 0;
+		double total = 0;
+		for (int kx = 0; kx < n; kx++)
+		{
+			for (int ky = 0; ky < n; ky++)
+			{
+				double sr = 0;
+				double si = 0;
+				for (int y = 0; y < n; y++)
+				{
+					double angle = -2.0 * 3.14159265358979 * (double)(ky * y) / (double)n;
+					sr += (re[(y * n) + kx] * cos(angle)) - (im[(y * n) + kx] * sin(angle));
+					si += (re[(y * n) + kx] * sin(angle)) + (im[(y * n) + kx] * cos(angle));
+				}
+				double power = (sr * sr) + (si * si);
+				int fx = std::min(kx, n - kx);
+				int fy = std::min(ky, n - ky);
+				total += power;
+				low += ((fx * fx) + (fy * fy)) <= (n / 8) * (n / 8) ? power : 0;
+			}
+		}
+		return total > 0 ? low / total : 0;
+	}
+};
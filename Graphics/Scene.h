@@ -25,67 +25,30 @@ SOFTWARE.
 #pragma once
 
 #include "Math.h"
+#include "SceneData.h"
 #include <d3d12.h>
 #include "Core.h"
 #include "Shaders.h"
 #include "Texture.h"
+#include "LightSampling.h"
+#include "LightBVH.h"
+#include "EnvironmentSampling.h"
+#include "Reservoir.h"
+#include "HashGrid.h"
+#include "ProbeVolume.h"
+#include "LightCache.h"
+#include "PathGuiding.h"
+#include "PhotonMap.h"
+#include "Sampler.h"
+#include "AdaptiveSampling.h"
+#include "Denoiser.h"
+#include "Wavefront.h"
+#include "TiledDispatch.h"
+#include "DynamicResolution.h"
 
 #pragma warning( disable : 6387)
 #pragma warning( disable : 26495)
 
-// Structure for static vertex data (used for non-animated meshes)
-struct STATIC_VERTEX
-{
-    Vec3 pos;       // Position of the vertex
-    Vec3 normal;    // Normal at the vertex
-    Vec3 tangent;   // Tangent vector at the vertex
-    float tu;       // Texture coordinate (u)
-    float tv;       // Texture coordinate (v)
-};
-
-// Structure for animated vertex data (includes bone influence information)
-struct ANIMATED_VERTEX
-{
-    Vec3 pos;             // Position of the vertex
-    Vec3 normal;          // Normal at the vertex
-    Vec3 tangent;         // Tangent vector at the vertex
-    float tu;             // Texture coordinate (u)
-    float tv;             // Texture coordinate (v)
-    unsigned int bonesIDs[4];  // IDs of influencing bones
-    float boneWeights[4];      // Weights for each bone influence
-};
-
-// Structure for area light data (defined by three vertices and a normal)
-struct AreaLightData
-{
-    Vec3 v1;      // First vertex of the light area
-    Vec3 v2;      // Second vertex of the light area
-    Vec3 v3;      // Third vertex of the light area
-    Vec3 normal;  // Normal vector of the light surface
-    float Le[3];  // Emission radiance (RGB)
-};
-
-// Structure for per-instance data used during rendering
-struct InstanceData
-{
-    unsigned int startIndex = 0;   // Starting index for the instance mesh
-    unsigned int bsdfAlbedoID = 0;   // Encodes BSDF type and texture ID
-    float bsdfData[7] = {};        // BSDF parameters
-    float coatingData[6] = {};     // Coating parameters
-
-    // Update the BSDF type (stored in the upper 16 bits of bsdfAlbedoID)
-    void updateBSDFType(int type)
-    {
-        bsdfAlbedoID = bsdfAlbedoID | (type << 16);
-    }
-
-    // Update the texture ID (stored in the lower 16 bits of bsdfAlbedoID)
-    void updatetextureID(int ID)
-    {
-        bsdfAlbedoID = bsdfAlbedoID | (ID & 0xFFFF);
-    }
-};
-
 // Represents a mesh with its vertex/index buffers and a BLAS for ray tracing.
 class Mesh
 {
@@ -93,11 +56,24 @@ public:
     ID3D12Resource* vertexBuffer;   // GPU resource for vertex data
     ID3D12Resource* indexBuffer;    // GPU resource for index data
     ID3D12Resource* blas;           // Bottom Level Acceleration Structure for ray tracing
+    AABB bounds;                    // Object space bounding box of the mesh
+    int numVertices;                // Number of vertices in the mesh
+    int numIndices;                 // Number of indices in the mesh
 
     // Initialize mesh resources using provided vertex and index data.
     // This method creates GPU buffers, copies the data, and builds a BLAS.
-    void init(Core* core, void* vertices, int vertexSizeInBytes, int numVertices, unsigned int* indices, int numIndices)
+    void init(Core* core, void* vertices, int vertexSizeInBytes, int _numVertices, unsigned int* indices, int _numIndices)
     {
+        numVertices = _numVertices;
+        numIndices = _numIndices;
+
+        // Compute the object space bounds from the vertex positions (position is the first member of every vertex type)
+        bounds.reset();
+        for (int i = 0; i < numVertices; i++)
+        {
+            bounds.extend(*(Vec3*)((unsigned char*)vertices + ((size_t)i * vertexSizeInBytes)));
+        }
+
         // Set up heap properties for upload heap using {} initializer
         D3D12_HEAP_PROPERTIES heapDesc{};
         heapDesc.Type = D3D12_HEAP_TYPE_UPLOAD;
@@ -221,27 +197,6 @@ public:
     }
 };
 
-// Wrapper class for storing a 3x4 transformation matrix used in TLAS.
-class TLASTransform
-{
-public:
-    union
-    {
-        float w[3][4]; // 3x4 matrix representation
-        float a[12];   // Flat array representation (alternative)
-    };
-
-    TLASTransform()
-    {
-    }
-
-    // Construct TLASTransform from a Matrix object (copies 12 floats)
-    TLASTransform(const Matrix& m)
-    {
-        memcpy(a, m.m, sizeof(float) * 12);
-    }
-};
-
 // Represents the complete scene including meshes, lights, and acceleration structures.
 class Scene
 {
@@ -251,6 +206,7 @@ public:
     std::vector<unsigned int> allIndices;      // Combined index data from all meshes
     std::vector<std::string> filenames;        // Filenames corresponding to mesh data
     std::vector<InstanceData> instanceData;      // Instance-specific data for rendering
+    std::vector<std::string> instanceMeshNames;  // Name of the mesh data each instance draws
     std::vector<AreaLightData> lights;         // Area light data in the scene
 
     // Structured buffers for GPU consumption
@@ -258,10 +214,28 @@ public:
     StructuredBuffer allIndexBuffer;
     StructuredBuffer instanceBuffer;
     StructuredBuffer areaLightBuffer;
+    StructuredBuffer instanceNormalBuffer;
+    StructuredBuffer shadingRecordBuffer;
+    StructuredBuffer lightAliasBuffer;
+    StructuredBuffer lightBVHNodeBuffer;
+    StructuredBuffer lightBVHTrailBuffer;
+    StructuredBuffer environmentDistributionBuffer;
+
+    // Alias table used to select area lights proportionally to their power
+    AliasTable lightTable;
 
-    // Mapping from filename to index offsets and sizes
+    // Light BVH used to select area lights by their estimated contribution to each shading point
+    LightBVH lightBVH;
+
+    // Precomputed hit attribute data built from the mesh data and transforms
+    std::vector<InstanceNormalMatrix> instanceNormals;
+    std::vector<TriangleShadingRecord> shadingRecords;
+
+    // Mapping from filename to index and vertex offsets and sizes
     std::map<std::string, int> indexOffset;
     std::map<std::string, int> indexSize;
+    std::map<std::string, int> vertexOffset;
+    std::map<std::string, int> vertexSize;
 
     // Resources for top level acceleration structure (TLAS)
     ID3D12Resource* instances;         // GPU resource for instance descriptions
@@ -275,10 +249,145 @@ public:
     // Dispatch description for ray tracing
     D3D12_DISPATCH_RAYS_DESC dispatchDesc;
 
+    // ReSTIR direct illumination: per pixel reservoirs (temporal results, then spatial results) and primary
+    // surfaces (two frames, alternating), and the dispatch of the spatial reuse and shading pass
+    bool useReSTIR = false;
+    RWStructuredBuffer restirReservoirBuffer;
+    RWStructuredBuffer restirSurfaceBuffer;
+    D3D12_DISPATCH_RAYS_DESC restirSpatialDispatchDesc;
+
+    // ReSTIR GI: per pixel reservoirs of secondary path vertices (temporal results, then the temporal results of two
+    // frames kept for reuse), which share the primary surfaces and the spatial pass with ReSTIR direct illumination
+    bool useReSTIRGI = false;
+    RWStructuredBuffer restirGIReservoirBuffer;
+
+    // Radiance cache: the hash grid's checksums and slot data, and the dispatch of the pass resolving it over the slots
+    bool useRadianceCache = false;
+    RWStructuredBuffer hashGridChecksumBuffer;
+    RWStructuredBuffer hashGridEntryBuffer;
+    D3D12_DISPATCH_RAYS_DESC hashGridResolveDispatchDesc;
+
+    // Probe volume preview: the probe grid fitted to the scene, its irradiance and distance atlases and per frame rays,
+    // and the dispatches of the passes tracing the rays and blending them into the atlases
+    bool useProbeVolume = false;
+    ProbeVolume probeVolume;
+    RWStructuredBuffer probeIrradianceBuffer;
+    RWStructuredBuffer probeDistanceBuffer;
+    RWStructuredBuffer probeRayBuffer;
+    D3D12_DISPATCH_RAYS_DESC probeTraceDispatchDesc;
+    D3D12_DISPATCH_RAYS_DESC probeBlendDispatchDesc;
+
+    // Light cache: world space cells learning which lights contribute to the points inside them, and the dispatch of the
+    // pass resolving it over the cells
+    bool useLightCache = false;
+    RWStructuredBuffer lightCacheCellBuffer;
+    D3D12_DISPATCH_RAYS_DESC lightCacheResolveDispatchDesc;
+
+    // Path guiding: the SD-tree trained from the paths, the nodes the GPU samples directions from, and the records of
+    // radiance the paths gather for training, each frame's read back into records
+    bool usePathGuiding = false;
+    PathGuiding pathGuiding;
+    RWStructuredBuffer guidingNodeBuffer;
+    RWStructuredBuffer guidingRecordBuffer;
+    std::vector<GuidingNode> guidingNodes;
+    std::vector<GuidingRecord> guidingRecords;
+
+    // Photon caustics: the map built each frame from the photons the previous frame traced, the photons the GPU writes
+    // and gathers from, the grid's buckets, and the dispatch of the pass tracing them. The first radius is measured
+    // from the first photons found and shrinks with the pass
+    bool usePhotonCaustics = false;
+    PhotonMap photonMap;
+    RWStructuredBuffer photonBuffer;
+    RWStructuredBuffer photonCellBuffer;
+    std::vector<Photon> photonData;
+    D3D12_DISPATCH_RAYS_DESC photonTraceDispatchDesc;
+    float photonInitialRadius = 0;
+    float photonRadius = 0;
+    unsigned int photonCount = 0;
+    unsigned int photonPass = 0;
+
+    // The buffers of ReSTIR, the radiance cache, the probe volume, the light cache, path guiding and the photon map are
+    // bound through one descriptor table, whose views follow each other in the heap from featureTableIndex. The views
+    // are allocated by the first draw and rewritten in place before the next draw whenever a buffer is reallocated
+    int featureTableIndex = -1;
+    bool featureViewsStale = true;
+
+    // Samplers of the camera paths' random numbers, of which only the blue noise mask lives here, as rnd in PT.hlsl
+    // switches between them with samplerType
+    Sampler sampler;
+    StructuredBuffer blueNoiseBuffer;
+
+    // Adaptive sampling: the scheduler choosing the pixels still sampled from their statistics, the statistics the GPU
+    // keeps and their copy read back, the work list of pixels, and the dispatch running along it. ReSTIR resamples
+    // across whole frames of pixels, so adaptive sampling is off while it is on
+    bool useAdaptiveSampling = false;
+    AdaptiveSampler adaptiveSampler;
+    RWStructuredBuffer adaptivePixelBuffer;
+    RWStructuredBuffer adaptiveWorkListBuffer;
+    std::vector<AdaptivePixel> adaptivePixels;
+    D3D12_DISPATCH_RAYS_DESC adaptiveDispatchDesc;
+
+    // Tiled dispatch: the scheduler taking the tiles each frame samples within the time budget, the last frame's tiles,
+    // and the dispatch running a TILE_SIZE square of invocations per tile
+    bool useTiledDispatch = false;
+    TileScheduler tileScheduler;
+    TileFrame tileFrame;
+    D3D12_DISPATCH_RAYS_DESC tiledDispatchDesc;
+
+    // Dynamic resolution: whether frames of a moving camera render at a lower resolution, whether the camera is moving,
+    // the controller choosing the resolution, the frame's jitter, and the dispatches of the path tracing pass at that
+    // resolution and of the pass upsampling it to the screen
+    bool useDynamicResolution = false;
+    bool interacting = false;
+    DynamicResolution dynamicResolution;
+    float resolutionJitter[2] = { 0.5f, 0.5f };
+    D3D12_DISPATCH_RAYS_DESC resolutionDispatchDesc;
+    D3D12_DISPATCH_RAYS_DESC upsampleDispatchDesc;
+
+    // Dispatch of the pass encoding the accumulated image into the render target
+    D3D12_DISPATCH_RAYS_DESC tonemapDispatchDesc;
+
+    // Denoiser: the dispatches of its passes, which run before the tonemap pass while it is on
+    bool useDenoiser = false;
+    D3D12_DISPATCH_RAYS_DESC denoisePrepareDispatchDesc;
+    D3D12_DISPATCH_RAYS_DESC denoiseStepDispatchDescs[DENOISER_ITERATIONS];
+
+    // Temporal reprojection: whether a moving camera keeps the accumulated samples, which adaptive sampling does not
+    // as it counts them itself, whether this frame reprojects them, and the dispatch of the pass copying the history
+    // it reprojects from
+    bool useTemporalReprojection = true;
+    bool temporalReproject = false;
+    D3D12_DISPATCH_RAYS_DESC temporalHistoryDispatchDesc;
+
+    // Wavefront path tracing: whether camera paths are traced a bounce at a time by the wavefront passes, the queues
+    // they pass the paths along in, laid out as in PT.hlsl, the heap index of the descriptor table reaching them, and
+    // the dispatches of the passes
+    bool useWavefront = false;
+    RWStructuredBuffer wavefrontPathBuffer;
+    RWStructuredBuffer wavefrontRayBuffer;
+    RWStructuredBuffer wavefrontHitBuffer;
+    RWStructuredBuffer wavefrontSortedBuffer;
+    RWStructuredBuffer wavefrontShadowRayBuffer;
+    RWStructuredBuffer wavefrontCounterBuffer;
+    int wavefrontTableIndex = 0;
+    D3D12_DISPATCH_RAYS_DESC wavefrontGenerateDispatchDesc;
+    D3D12_DISPATCH_RAYS_DESC wavefrontTraceDispatchDesc;
+    D3D12_DISPATCH_RAYS_DESC wavefrontSortDispatchDesc;
+    D3D12_DISPATCH_RAYS_DESC wavefrontShadeDispatchDesc;
+    D3D12_DISPATCH_RAYS_DESC wavefrontShadowDispatchDesc;
+    D3D12_DISPATCH_RAYS_DESC wavefrontAccumulateDispatchDesc;
+
+    // The AOVs the path tracing pass writes, the denoiser's ping-pong buffers and the history temporal reprojection
+    // reads, laid out as aovBuffer in PT.hlsl
+    RWStructuredBuffer aovBuffer;
+
     // Environment map and its luminance
     Texture* environmentMap;
     float envLum;
 
+    // Luminance based distribution used to importance sample the environment map
+    EnvironmentDistribution environmentDistribution;
+
     // Initialize TLAS and instance buffer with a maximum number of instances.
     void init(Core* core, int maxInstances)
     {
@@ -359,6 +468,8 @@ public:
         filenames.push_back(filename);
         indexOffset[filename] = initialIndexOffset;
         indexSize[filename] = (int)indices.size();
+        vertexOffset[filename] = offset;
+        vertexSize[filename] = (int)vertices.size();
     }
 
     // Add an instance of a mesh to the scene.
@@ -367,6 +478,7 @@ public:
     {
         meshInstanceData.startIndex = indexOffset[filename];
         instanceData.push_back(meshInstanceData);
+        instanceMeshNames.push_back(filename);
     }
 
     // Add an area light to the scene.
@@ -442,9 +554,50 @@ public:
         allVertexBuffer.init(core, sizeof(STATIC_VERTEX), (int)allVertices.size(), &allVertices[0], &core->uavsrvHeap);
         allIndexBuffer.init(core, sizeof(unsigned int), (int)allIndices.size(), &allIndices[0], &core->uavsrvHeap);
         instanceBuffer.init(core, sizeof(InstanceData), (int)instanceData.size(), &instanceData[0], &core->uavsrvHeap);
+
+        // Precompute per-instance normal matrices and per-triangle shading records so hits avoid a matrix inverse and the index indirection
+        instanceNormals.resize(meshes.size());
+        for (int i = 0; i < meshes.size(); i++)
+        {
+            instanceNormals[i].build(transforms[i].a);
+        }
+        shadingRecords.resize(allIndices.size() / 3);
+        for (int i = 0; i < shadingRecords.size(); i++)
+        {
+            shadingRecords[i].encode(allVertices[allIndices[i * 3]], allVertices[allIndices[(i * 3) + 1]], allVertices[allIndices[(i * 3) + 2]]);
+        }
+        instanceNormalBuffer.init(core, sizeof(InstanceNormalMatrix), (int)instanceNormals.size(), &instanceNormals[0], &core->uavsrvHeap);
+        shadingRecordBuffer.init(core, sizeof(TriangleShadingRecord), (int)shadingRecords.size(), &shadingRecords[0], &core->uavsrvHeap);
+        environmentDistributionBuffer.init(core, sizeof(float), (int)environmentDistribution.cdfs.size(), &environmentDistribution.cdfs[0], &core->uavsrvHeap);
+        // The blue noise mask is made once and read back from its file after that
+        sampler.mask.loadOrGenerate(BLUE_NOISE_FILENAME);
+        blueNoiseBuffer.init(core, sizeof(float), (int)sampler.mask.values.size(), &sampler.mask.values[0], &core->uavsrvHeap);
         if (lights.size() > 0)
         {
+            // Compute light powers in parallel and build the alias table used for power proportional selection
+            std::vector<float> weights(lights.size());
+            parallelFor((int)lights.size(), [&](int i)
+                {
+                    lights[i].power = luminance(lights[i].Le) * lights[i].area * 3.1415926535f;
+                    weights[i] = lights[i].power;
+                });
+            lightTable.build(weights);
+
+            // Build the light BVH from the triangle bounds, normals and powers
+            std::vector<LightBVHPrimitive> lightPrimitives(lights.size());
+            parallelFor((int)lights.size(), [&](int i)
+                {
+                    lightPrimitives[i].bounds.extend(lights[i].v1);
+                    lightPrimitives[i].bounds.extend(lights[i].v2);
+                    lightPrimitives[i].bounds.extend(lights[i].v3);
+                    lightPrimitives[i].normal = lights[i].normal;
+                    lightPrimitives[i].power = lights[i].power;
+                });
+            lightBVH.build(lightPrimitives);
             areaLightBuffer.init(core, sizeof(AreaLightData), (int)lights.size(), &lights[0], &core->uavsrvHeap);
+            lightAliasBuffer.init(core, sizeof(LightAliasEntry), (int)lightTable.entries.size(), &lightTable.entries[0], &core->uavsrvHeap);
+            lightBVHNodeBuffer.init(core, sizeof(LightBVHNode), (int)lightBVH.nodes.size(), &lightBVH.nodes[0], &core->uavsrvHeap);
+            lightBVHTrailBuffer.init(core, sizeof(unsigned int), (int)lightBVH.trails.size(), &lightBVH.trails[0], &core->uavsrvHeap);
         }
     }
 
@@ -452,15 +605,403 @@ public:
     void updateDrawInfo(Core* core, RTShader* shader)
     {
         dispatchDesc = {};
-        dispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress();
+        dispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_PATH_TRACE);
         dispatchDesc.RayGenerationShaderRecord.SizeInBytes = D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES;
-        dispatchDesc.MissShaderTable.StartAddress = shader->shaderList->GetGPUVirtualAddress() + D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
-        dispatchDesc.MissShaderTable.SizeInBytes = D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES;
-        dispatchDesc.HitGroupTable.StartAddress = shader->shaderList->GetGPUVirtualAddress() + (2 * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT);
-        dispatchDesc.HitGroupTable.SizeInBytes = D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES;
+        // Two miss shaders and two hit groups, for Payload rays and camera paths, which TraceRay picks by index
+        dispatchDesc.MissShaderTable.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::missRecordOffset();
+        dispatchDesc.MissShaderTable.SizeInBytes = 2 * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
+        dispatchDesc.MissShaderTable.StrideInBytes = D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
+        dispatchDesc.HitGroupTable.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::hitGroupRecordOffset();
+        dispatchDesc.HitGroupTable.SizeInBytes = 2 * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
+        dispatchDesc.HitGroupTable.StrideInBytes = D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
         dispatchDesc.Width = core->width;
         dispatchDesc.Height = core->height;
         dispatchDesc.Depth = 1;
+
+        // The spatial reuse pass shares the miss shader and hit group used by its shadow and visibility rays
+        restirSpatialDispatchDesc = dispatchDesc;
+        restirSpatialDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_RESTIR_SPATIAL);
+
+        // Per pixel ReSTIR buffers follow the screen size
+        int pixels = core->width * core->height;
+        if (restirReservoirBuffer.size != pixels * 2)
+        {
+            restirReservoirBuffer.free();
+            restirSurfaceBuffer.free();
+            restirReservoirBuffer.init(core, sizeof(Reservoir), pixels * 2);
+            restirSurfaceBuffer.init(core, sizeof(ReSTIRSurface), pixels * 2);
+        }
+        if (restirGIReservoirBuffer.size != pixels * 3)
+        {
+            restirGIReservoirBuffer.free();
+            restirGIReservoirBuffer.init(core, sizeof(GIReservoir), pixels * 3);
+        }
+
+        // The resolve pass runs one ray generation invocation per hash grid slot
+        hashGridResolveDispatchDesc = dispatchDesc;
+        hashGridResolveDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_HASH_GRID_RESOLVE);
+        hashGridResolveDispatchDesc.Width = 1024;
+        hashGridResolveDispatchDesc.Height = HASH_GRID_CAPACITY / 1024;
+        if (hashGridChecksumBuffer.size != (int)HASH_GRID_CAPACITY)
+        {
+            hashGridChecksumBuffer.init(core, sizeof(unsigned int), HASH_GRID_CAPACITY);
+            hashGridEntryBuffer.init(core, sizeof(HashGridEntry), HASH_GRID_CAPACITY);
+        }
+
+        // The probe passes run over each probe's rays and over the texels of its distance tile
+        int probes = probeVolume.count();
+        probeTraceDispatchDesc = dispatchDesc;
+        probeTraceDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_PROBE_TRACE);
+        probeTraceDispatchDesc.Width = PROBE_RAYS;
+        probeTraceDispatchDesc.Height = probes;
+        probeBlendDispatchDesc = dispatchDesc;
+        probeBlendDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_PROBE_BLEND);
+        probeBlendDispatchDesc.Width = PROBE_DISTANCE_TEXELS * PROBE_DISTANCE_TEXELS;
+        probeBlendDispatchDesc.Height = probes;
+        if (probeRayBuffer.size != probes * PROBE_RAYS)
+        {
+            probeIrradianceBuffer.free();
+            probeDistanceBuffer.free();
+            probeRayBuffer.free();
+            probeIrradianceBuffer.init(core, sizeof(float) * 4, probes * PROBE_IRRADIANCE_TEXELS * PROBE_IRRADIANCE_TEXELS);
+            probeDistanceBuffer.init(core, sizeof(float) * 2, probes * PROBE_DISTANCE_TEXELS * PROBE_DISTANCE_TEXELS);
+            probeRayBuffer.init(core, sizeof(float) * 4, probes * PROBE_RAYS);
+        }
+
+        // The light cache resolve pass runs one ray generation invocation per cell
+        lightCacheResolveDispatchDesc = dispatchDesc;
+        lightCacheResolveDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_LIGHT_CACHE_RESOLVE);
+        lightCacheResolveDispatchDesc.Width = 256;
+        lightCacheResolveDispatchDesc.Height = LIGHT_CACHE_CAPACITY / 256;
+        if (lightCacheCellBuffer.size != (int)LIGHT_CACHE_CAPACITY)
+        {
+            lightCacheCellBuffer.init(core, sizeof(LightCacheCell), LIGHT_CACHE_CAPACITY);
+        }
+
+        // Path guiding starts from the tree it has trained so far, a single leaf sampling uniformly at first
+        if (guidingRecordBuffer.size != GUIDING_MAX_RECORDS)
+        {
+            guidingRecordBuffer.init(core, sizeof(GuidingRecord), GUIDING_MAX_RECORDS);
+        }
+        uploadGuidingNodes(core);
+
+        // The photon pass emits one photon per ray generation invocation
+        photonTraceDispatchDesc = dispatchDesc;
+        photonTraceDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_PHOTON_TRACE);
+        photonTraceDispatchDesc.Width = PHOTON_PASS_WIDTH;
+        photonTraceDispatchDesc.Height = PHOTON_PASS_WIDTH;
+        if (photonBuffer.size != PHOTON_MAX)
+        {
+            photonBuffer.init(core, sizeof(Photon), PHOTON_MAX);
+            photonCellBuffer.init(core, sizeof(PhotonCell), PHOTON_GRID_CELLS);
+        }
+
+        // The adaptive dispatch runs along the work list, which starts out listing every pixel
+        if (adaptivePixelBuffer.size != pixels)
+        {
+            adaptivePixelBuffer.free();
+            adaptiveWorkListBuffer.free();
+            adaptivePixelBuffer.init(core, sizeof(AdaptivePixel), pixels);
+            adaptiveWorkListBuffer.init(core, sizeof(unsigned int), pixels);
+            adaptiveSampler.init(core->width, core->height);
+            adaptiveWorkListBuffer.upload(core, adaptiveSampler.workList.data(), pixels);
+        }
+        adaptiveDispatchDesc = dispatchDesc;
+        adaptiveDispatchDesc.Width = (UINT)adaptiveSampler.workList.size();
+        adaptiveDispatchDesc.Height = 1;
+
+        // The tiled dispatch runs the frame's tiles along its depth
+        if (tileScheduler.width != core->width || tileScheduler.height != core->height)
+        {
+            tileScheduler.init(core->width, core->height);
+        }
+        tiledDispatchDesc = dispatchDesc;
+        tiledDispatchDesc.Width = TILE_SIZE;
+        tiledDispatchDesc.Height = TILE_SIZE;
+        tiledDispatchDesc.Depth = tileFrame.count;
+
+        // The path tracing pass runs at the controller's resolution while the camera moves, and the upsampling pass
+        // over the screen
+        if (dynamicResolution.width != core->width || dynamicResolution.height != core->height)
+        {
+            dynamicResolution.init(core->width, core->height);
+        }
+        resolutionDispatchDesc = dispatchDesc;
+        resolutionDispatchDesc.Width = dynamicResolution.renderWidth;
+        resolutionDispatchDesc.Height = dynamicResolution.renderHeight;
+        upsampleDispatchDesc = dispatchDesc;
+        upsampleDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_UPSAMPLE);
+
+        // The tonemap pass runs over the screen
+        tonemapDispatchDesc = dispatchDesc;
+        tonemapDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_TONEMAP);
+
+        // The AOVs, the denoiser and temporal reprojection keep nine float4 sections per pixel, and their passes run
+        // over the screen
+        if (aovBuffer.size != pixels * 9)
+        {
+            aovBuffer.free();
+            aovBuffer.init(core, sizeof(float) * 4, pixels * 9);
+        }
+        temporalHistoryDispatchDesc = dispatchDesc;
+        temporalHistoryDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_TEMPORAL_HISTORY);
+        denoisePrepareDispatchDesc = dispatchDesc;
+        denoisePrepareDispatchDesc.RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_DENOISE_PREPARE);
+        for (int i = 0; i < DENOISER_ITERATIONS; i++)
+        {
+            denoiseStepDispatchDescs[i] = dispatchDesc;
+            denoiseStepDispatchDescs[i].RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_DENOISE_STEP0 + i);
+        }
+
+        // The wavefront queues hold a path per pixel, two extension queues and a shadow ray queue as long, and their
+        // views follow each other in the heap for the descriptor table. Every wavefront pass runs over the screen
+        if (wavefrontPathBuffer.size != pixels)
+        {
+            wavefrontPathBuffer.free();
+            wavefrontRayBuffer.free();
+            wavefrontHitBuffer.free();
+            wavefrontSortedBuffer.free();
+            wavefrontShadowRayBuffer.free();
+            wavefrontCounterBuffer.free();
+            wavefrontPathBuffer.init(core, sizeof(WavefrontPath), pixels);
+            wavefrontRayBuffer.init(core, sizeof(WavefrontRay), pixels * 2);
+            wavefrontHitBuffer.init(core, sizeof(WavefrontHit), pixels);
+            wavefrontSortedBuffer.init(core, sizeof(unsigned int), pixels);
+            wavefrontShadowRayBuffer.init(core, sizeof(WavefrontShadowRay), pixels);
+            wavefrontCounterBuffer.init(core, sizeof(unsigned int), WAVEFRONT_COUNTERS);
+            wavefrontTableIndex = wavefrontPathBuffer.createUAV(core, &core->uavsrvHeap);
+            wavefrontRayBuffer.createUAV(core, &core->uavsrvHeap);
+            wavefrontHitBuffer.createUAV(core, &core->uavsrvHeap);
+            wavefrontSortedBuffer.createUAV(core, &core->uavsrvHeap);
+            wavefrontShadowRayBuffer.createUAV(core, &core->uavsrvHeap);
+            wavefrontCounterBuffer.createUAV(core, &core->uavsrvHeap);
+        }
+        D3D12_DISPATCH_RAYS_DESC* wavefrontDispatchDescs[6] = { &wavefrontGenerateDispatchDesc, &wavefrontTraceDispatchDesc, &wavefrontSortDispatchDesc,
+            &wavefrontShadeDispatchDesc, &wavefrontShadowDispatchDesc, &wavefrontAccumulateDispatchDesc };
+        for (int i = 0; i < 6; i++)
+        {
+            *wavefrontDispatchDescs[i] = dispatchDesc;
+            wavefrontDispatchDescs[i]->RayGenerationShaderRecord.StartAddress = shader->shaderList->GetGPUVirtualAddress() + RTShader::rayGenerationRecordOffset(RAYGEN_WAVEFRONT_GENERATE + i);
+        }
+        featureViewsStale = true;
+    }
+
+    // Makes the views of the feature buffers in the order of their registers, u1 to u13, for their descriptor table
+    void createFeatureViews(Core* core)
+    {
+        RWStructuredBuffer* buffers[13] = { &restirReservoirBuffer, &restirSurfaceBuffer, &restirGIReservoirBuffer, &hashGridChecksumBuffer,
+            &hashGridEntryBuffer, &probeIrradianceBuffer, &probeDistanceBuffer, &probeRayBuffer, &lightCacheCellBuffer, &guidingNodeBuffer,
+            &guidingRecordBuffer, &photonBuffer, &photonCellBuffer };
+        if (featureTableIndex < 0)
+        {
+            featureTableIndex = buffers[0]->createUAV(core, &core->uavsrvHeap);
+            for (int i = 1; i < 13; i++)
+            {
+                buffers[i]->createUAV(core, &core->uavsrvHeap);
+            }
+        } else
+        {
+            for (int i = 0; i < 13; i++)
+            {
+                buffers[i]->createUAV(core, &core->uavsrvHeap, featureTableIndex + i);
+            }
+        }
+        featureViewsStale = false;
+    }
+
+    // Uploads the SD-tree the GPU samples directions from, growing the buffer if the tree outgrew it
+    void uploadGuidingNodes(Core* core)
+    {
+        pathGuiding.flatten(guidingNodes);
+        if (guidingNodeBuffer.size < (int)guidingNodes.size())
+        {
+            guidingNodeBuffer.free();
+            guidingNodeBuffer.init(core, sizeof(GuidingNode), (int)guidingNodes.size() * 2);
+            featureViewsStale = true;
+        }
+        guidingNodeBuffer.upload(core, guidingNodes.data(), (int)guidingNodes.size());
+    }
+
+    // Trains path guiding on the records written by the frame just finished, once the GPU is idle. The records are
+    // splatted into the SD-tree on the worker threads and the buffer is emptied, and at the end of a training iteration
+    // the refined tree is uploaded for the next frame to sample from. Returns true if the sampled tree changed
+    bool trainPathGuiding(Core* core)
+    {
+        if (usePathGuiding == false || pathGuiding.training() == false)
+        {
+            return false;
+        }
+        GuidingRecord header;
+        guidingRecordBuffer.readback(core, &header, 1);
+        int count = std::min((int)header.count, GUIDING_MAX_RECORDS - 1);
+        guidingRecords.resize(count + 1);
+        guidingRecordBuffer.readback(core, guidingRecords.data(), count + 1);
+        pathGuiding.record(guidingRecords.data() + 1, count);
+        header = GuidingRecord();
+        guidingRecordBuffer.upload(core, &header, 1);
+        if (pathGuiding.endFrame())
+        {
+            uploadGuidingNodes(core);
+            return true;
+        }
+        return false;
+    }
+
+    // Builds the caustic photon map from the photons traced by the frame just finished, once the GPU is idle, for the
+    // next frame to gather from at the radius of the given pass. The photons are read back, sorted into the grid on the
+    // worker threads and uploaded over themselves behind an emptied header, and the grid's buckets after them
+    void buildPhotonMap(Core* core, int pass)
+    {
+        if (usePhotonCaustics == false)
+        {
+            photonInitialRadius = 0;
+            photonCount = 0;
+            return;
+        }
+        Photon header;
+        photonBuffer.readback(core, &header, 1);
+        int count = std::min((int)header.count, PHOTON_MAX - 1);
+        photonData.resize(count + 1);
+        photonBuffer.readback(core, photonData.data(), count + 1);
+        if (photonInitialRadius <= 0 && count > PHOTON_RADIUS_NEIGHBOURS)
+        {
+            photonInitialRadius = photonMap.initialRadius(photonData.data() + 1, count);
+        }
+        photonCount = 0;
+        photonData[0] = Photon();
+        if (photonInitialRadius > 0)
+        {
+            photonRadius = PhotonMap::passRadius(photonInitialRadius, pass);
+            photonMap.build(photonData.data() + 1, count, photonRadius);
+            std::copy(photonMap.photons.begin(), photonMap.photons.end(), photonData.begin() + 1);
+            photonCellBuffer.upload(core, photonMap.cells.data(), PHOTON_GRID_CELLS);
+            photonCount = count;
+        }
+        photonBuffer.upload(core, photonData.data(), photonCount + 1);
+        photonPass++;
+    }
+
+    // Whether the path tracing pass samples adaptively, which it does unless ReSTIR is on
+    bool adaptiveSamplingActive() const
+    {
+        return useAdaptiveSampling && useReSTIR == false && useReSTIRGI == false;
+    }
+
+    // Whether the path tracing pass samples the screen a few tiles a frame, which it does unless ReSTIR, which resamples
+    // across whole frames of pixels, adaptive sampling or wavefront path tracing is on, or the frame is rendered at a
+    // lower resolution
+    bool tiledDispatchActive() const
+    {
+        return useTiledDispatch && useReSTIR == false && useReSTIRGI == false && adaptiveSamplingActive() == false && wavefrontActive() == false &&
+            dynamicResolutionActive() == false;
+    }
+
+    // Whether the frame is rendered at a lower resolution, which it is while the camera moves unless ReSTIR, adaptive
+    // sampling or wavefront path tracing, which work over the whole screen, is on
+    bool dynamicResolutionActive() const
+    {
+        return useDynamicResolution && interacting && useReSTIR == false && useReSTIRGI == false && adaptiveSamplingActive() == false && wavefrontActive() == false;
+    }
+
+    // Chooses the resolution of the next frame while the camera moves, from the time the GPU took over the last frame,
+    // and its jitter, which steps with the frame counter
+    void scheduleResolution(bool cameraMoving, float frameMilliseconds, int frame)
+    {
+        interacting = cameraMoving;
+        if (dynamicResolutionActive() == false)
+        {
+            dynamicResolution.restart();
+            return;
+        }
+        dynamicResolution.adapt(frameMilliseconds);
+        dynamicResolution.schedule();
+        resolutionDispatchDesc.Width = dynamicResolution.renderWidth;
+        resolutionDispatchDesc.Height = dynamicResolution.renderHeight;
+        DynamicResolution::jitter(frame, resolutionJitter[0], resolutionJitter[1]);
+    }
+
+    // Takes the tiles the next frame samples, as many as the time budget fits from the time the GPU took over the last
+    // frame, starting from the first tile again when accumulation restarts. Returns whether the frame starts a pass
+    // over the screen, which every frame does without tiled dispatch
+    bool scheduleTiles(bool restart, float frameMilliseconds)
+    {
+        if (tiledDispatchActive() == false)
+        {
+            tileScheduler.restart();
+            tileScheduler.lastCount = 0;
+            tileFrame = TileFrame();
+            return true;
+        }
+        if (restart)
+        {
+            tileScheduler.restart();
+        }
+        tileScheduler.adapt(frameMilliseconds);
+        tileFrame = tileScheduler.schedule();
+        tiledDispatchDesc.Depth = tileFrame.count;
+        return tileFrame.startsPass;
+    }
+
+    // Whether camera paths are traced by the wavefront passes, which they are unless a feature whose work spans a whole
+    // path or pixel is on: ReSTIR, the radiance cache's updates, path guiding's training records and adaptive sampling
+    bool wavefrontActive() const
+    {
+        bool guidingRecords = usePathGuiding && pathGuiding.training();
+        return useWavefront && useReSTIR == false && useReSTIRGI == false && useRadianceCache == false && guidingRecords == false && adaptiveSamplingActive() == false;
+    }
+
+    // Traces the camera paths through the wavefront passes, a trace, sort, shade and shadow pass per bounce. Each pass
+    // reads what the last wrote to several queues, so the barriers between them order every UAV access
+    void drawWavefront(Core* core)
+    {
+        D3D12_RESOURCE_BARRIER barrier{};
+        barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+        barrier.UAV.pResource = nullptr;
+        core->graphicsCommandList->DispatchRays(&wavefrontGenerateDispatchDesc);
+        for (int bounce = 0; bounce < WAVEFRONT_BOUNCES; bounce++)
+        {
+            core->graphicsCommandList->ResourceBarrier(1, &barrier);
+            core->graphicsCommandList->DispatchRays(&wavefrontTraceDispatchDesc);
+            core->graphicsCommandList->ResourceBarrier(1, &barrier);
+            core->graphicsCommandList->DispatchRays(&wavefrontSortDispatchDesc);
+            core->graphicsCommandList->ResourceBarrier(1, &barrier);
+            core->graphicsCommandList->DispatchRays(&wavefrontShadeDispatchDesc);
+            core->graphicsCommandList->ResourceBarrier(1, &barrier);
+            core->graphicsCommandList->DispatchRays(&wavefrontShadowDispatchDesc);
+        }
+        core->graphicsCommandList->ResourceBarrier(1, &barrier);
+        core->graphicsCommandList->DispatchRays(&wavefrontAccumulateDispatchDesc);
+    }
+
+    // Chooses the pixels the next frame samples adaptively, before it begins, from the given number of frames
+    // accumulated so far. Every pixel is listed again when accumulation restarts, and every ADAPTIVE_SCHEDULE_INTERVAL
+    // frames after that the statistics are read back, once the GPU is idle, and the scheduler lists only the pixels
+    // around tiles still over the threshold, until there are none
+    void scheduleAdaptiveSampling(Core* core, unsigned int samples)
+    {
+        if (adaptiveSamplingActive() == false)
+        {
+            return;
+        }
+        if (samples == 0)
+        {
+            adaptiveSampler.reset();
+        }
+        else if (samples % ADAPTIVE_SCHEDULE_INTERVAL == 0 && adaptiveSampler.converged() == false)
+        {
+            adaptivePixels.resize(adaptivePixelBuffer.size);
+            adaptivePixelBuffer.readback(core, adaptivePixels.data(), adaptivePixelBuffer.size);
+            adaptiveSampler.schedule(adaptivePixels.data());
+        }
+        else
+        {
+            return;
+        }
+        if (adaptiveSampler.converged() == false)
+        {
+            adaptiveWorkListBuffer.upload(core, adaptiveSampler.workList.data(), (int)adaptiveSampler.workList.size());
+        }
+        adaptiveDispatchDesc.Width = (UINT)adaptiveSampler.workList.size();
     }
 
     // Bind resources and dispatch ray tracing commands to draw the scene.
@@ -473,12 +1014,125 @@ public:
         if (lights.size() > 0)
         {
             core->graphicsCommandList->SetComputeRootShaderResourceView(7, areaLightBuffer.buffer->GetGPUVirtualAddress());
+            core->graphicsCommandList->SetComputeRootShaderResourceView(11, lightAliasBuffer.buffer->GetGPUVirtualAddress());
+            core->graphicsCommandList->SetComputeRootShaderResourceView(12, lightBVHNodeBuffer.buffer->GetGPUVirtualAddress());
+            core->graphicsCommandList->SetComputeRootShaderResourceView(13, lightBVHTrailBuffer.buffer->GetGPUVirtualAddress());
         }
+        core->graphicsCommandList->SetComputeRootShaderResourceView(9, instanceNormalBuffer.buffer->GetGPUVirtualAddress());
+        core->graphicsCommandList->SetComputeRootShaderResourceView(10, shadingRecordBuffer.buffer->GetGPUVirtualAddress());
+        core->graphicsCommandList->SetComputeRootShaderResourceView(14, environmentDistributionBuffer.buffer->GetGPUVirtualAddress());
+        core->graphicsCommandList->SetComputeRootShaderResourceView(16, blueNoiseBuffer.buffer->GetGPUVirtualAddress());
         // Calculate descriptor offset for the environment map
         unsigned int descriptorSize = core->device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
         D3D12_GPU_DESCRIPTOR_HANDLE offset;
         offset.ptr = core->uavsrvHeap.heap->GetGPUDescriptorHandleForHeapStart().ptr + ((environmentMap->heapOffset + 2) * descriptorSize);
         core->graphicsCommandList->SetComputeRootDescriptorTable(8, offset);
-        core->graphicsCommandList->DispatchRays(&dispatchDesc);
+        if (featureViewsStale)
+        {
+            createFeatureViews(core);
+        }
+        offset.ptr = core->uavsrvHeap.heap->GetGPUDescriptorHandleForHeapStart().ptr + (featureTableIndex * descriptorSize);
+        core->graphicsCommandList->SetComputeRootDescriptorTable(15, offset);
+        core->graphicsCommandList->SetComputeRootUnorderedAccessView(17, adaptivePixelBuffer.buffer->GetGPUVirtualAddress());
+        core->graphicsCommandList->SetComputeRootUnorderedAccessView(18, adaptiveWorkListBuffer.buffer->GetGPUVirtualAddress());
+        core->graphicsCommandList->SetComputeRootUnorderedAccessView(20, aovBuffer.buffer->GetGPUVirtualAddress());
+        offset.ptr = core->uavsrvHeap.heap->GetGPUDescriptorHandleForHeapStart().ptr + (wavefrontTableIndex * descriptorSize);
+        core->graphicsCommandList->SetComputeRootDescriptorTable(21, offset);
+        if (temporalReproject)
+        {
+            // Copy the history before the path tracing pass reprojects it over the pixels it came from
+            core->graphicsCommandList->DispatchRays(&temporalHistoryDispatchDesc);
+            D3D12_RESOURCE_BARRIER historyBarrier{};
+            historyBarrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+            historyBarrier.UAV.pResource = core->accumulation;
+            core->graphicsCommandList->ResourceBarrier(1, &historyBarrier);
+            aovBuffer.barrier(core);
+        }
+        if (useProbeVolume)
+        {
+            // Update the probes before the path tracing pass shades with them
+            core->graphicsCommandList->DispatchRays(&probeTraceDispatchDesc);
+            probeRayBuffer.barrier(core);
+            core->graphicsCommandList->DispatchRays(&probeBlendDispatchDesc);
+            probeIrradianceBuffer.barrier(core);
+            probeDistanceBuffer.barrier(core);
+        }
+        if (adaptiveSamplingActive())
+        {
+            // One invocation per listed pixel, and none once every tile has converged
+            if (adaptiveDispatchDesc.Width > 0)
+            {
+                core->graphicsCommandList->DispatchRays(&adaptiveDispatchDesc);
+            }
+        }
+        else if (wavefrontActive())
+        {
+            drawWavefront(core);
+        }
+        else if (dynamicResolutionActive())
+        {
+            core->graphicsCommandList->DispatchRays(&resolutionDispatchDesc);
+        }
+        else if (tiledDispatchActive())
+        {
+            core->graphicsCommandList->DispatchRays(&tiledDispatchDesc);
+        }
+        else
+        {
+            core->graphicsCommandList->DispatchRays(&dispatchDesc);
+        }
+        if (useReSTIR || useReSTIRGI)
+        {
+            // Spatial reuse reads the reservoirs and surfaces of neighbouring pixels written by the path tracing pass
+            restirReservoirBuffer.barrier(core);
+            restirSurfaceBuffer.barrier(core);
+            restirGIReservoirBuffer.barrier(core);
+            core->graphicsCommandList->DispatchRays(&restirSpatialDispatchDesc);
+        }
+        if (useRadianceCache)
+        {
+            // Resolve the radiance deposited by this frame's paths, ready for the next frame's lookups
+            hashGridChecksumBuffer.barrier(core);
+            hashGridEntryBuffer.barrier(core);
+            core->graphicsCommandList->DispatchRays(&hashGridResolveDispatchDesc);
+        }
+        if (useLightCache)
+        {
+            // Resolve the light contributions deposited by this frame's light samples, ready for the next frame's selection
+            lightCacheCellBuffer.barrier(core);
+            core->graphicsCommandList->DispatchRays(&lightCacheResolveDispatchDesc);
+        }
+        if (usePhotonCaustics)
+        {
+            // Trace the photons for the next frame's map once this frame has gathered from the current one
+            photonBuffer.barrier(core);
+            core->graphicsCommandList->DispatchRays(&photonTraceDispatchDesc);
+        }
+
+        // Encode the image once every pass has added its samples
+        D3D12_RESOURCE_BARRIER barrier{};
+        barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+        barrier.UAV.pResource = core->accumulation;
+        core->graphicsCommandList->ResourceBarrier(1, &barrier);
+        aovBuffer.barrier(core);
+        if (dynamicResolutionActive())
+        {
+            // Upsample the frame rendered at a lower resolution to the screen, which the denoiser, filtering over the
+            // screen, leaves alone
+            core->graphicsCommandList->DispatchRays(&upsampleDispatchDesc);
+            return;
+        }
+        if (useDenoiser)
+        {
+            // Filter the accumulated image, each pass reading the neighbours the last one wrote
+            core->graphicsCommandList->DispatchRays(&denoisePrepareDispatchDesc);
+            for (int i = 0; i < DENOISER_ITERATIONS; i++)
+            {
+                aovBuffer.barrier(core);
+                core->graphicsCommandList->DispatchRays(&denoiseStepDispatchDescs[i]);
+            }
+            aovBuffer.barrier(core);
+        }
+        core->graphicsCommandList->DispatchRays(&tonemapDispatchDesc);
     }
 };
@@ -0,0 +1,187 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// The scene's data as the GPU reads it: vertices, area lights, instances, their transforms and normal matrices, and
+// triangle shading records. None of it needs Direct3D, so the CPU only tools share it with Scene.
+
+#include "Math.h"
+#include <algorithm>
+#include <cstring>
+
+// Structure for static vertex data (used for non-animated meshes)
+struct STATIC_VERTEX
+{
+    Vec3 pos;       // Position of the vertex
+    Vec3 normal;    // Normal at the vertex
+    Vec3 tangent;   // Tangent vector at the vertex
+    float tu;       // Texture coordinate (u)
+    float tv;       // Texture coordinate (v)
+};
+
+// Structure for animated vertex data (includes bone influence information)
+struct ANIMATED_VERTEX
+{
+    Vec3 pos;             // Position of the vertex
+    Vec3 normal;          // Normal at the vertex
+    Vec3 tangent;         // Tangent vector at the vertex
+    float tu;             // Texture coordinate (u)
+    float tv;             // Texture coordinate (v)
+    unsigned int bonesIDs[4];  // IDs of influencing bones
+    float boneWeights[4];      // Weights for each bone influence
+};
+
+// Structure for area light data (defined by three vertices and a normal)
+struct AreaLightData
+{
+    Vec3 v1;      // First vertex of the light area
+    Vec3 v2;      // Second vertex of the light area
+    Vec3 v3;      // Third vertex of the light area
+    Vec3 normal;  // Normal vector of the light surface
+    float Le[3];  // Emission radiance (RGB)
+    float area;   // World space area of the triangle
+    float power;  // Emitted power (luminance of Le * area * PI), used to build the light selection table
+};
+
+// Structure for per-instance data used during rendering
+struct InstanceData
+{
+    unsigned int startIndex = 0;   // Starting index for the instance mesh
+    unsigned int bsdfAlbedoID = 0;   // Encodes BSDF type and texture ID
+    float bsdfData[7] = {};        // BSDF parameters
+    float coatingData[6] = {};     // Coating parameters
+    unsigned int lightOffset = 0;  // For emitters, index of the area light created from the first triangle of the mesh
+
+    // Update the BSDF type (stored in the upper 16 bits of bsdfAlbedoID)
+    void updateBSDFType(int type)
+    {
+        bsdfAlbedoID = bsdfAlbedoID | (type << 16);
+    }
+
+    // Update the texture ID (stored in the lower 16 bits of bsdfAlbedoID)
+    void updatetextureID(int ID)
+    {
+        bsdfAlbedoID = bsdfAlbedoID | (ID & 0xFFFF);
+    }
+};
+
+// Per-instance normal matrix (transpose of the inverse of the upper 3x3 of the instance transform), stored as rows
+struct InstanceNormalMatrix
+{
+    Vec3 rows[3];
+
+    // Builds the normal matrix from a row major 3x4 transform (12 floats). The cofactor matrix divided by the
+    // determinant is the inverse transpose, and its rows are cross products of the transform's rows.
+    void build(const float* w)
+    {
+        Vec3 r0(w[0], w[1], w[2]);
+        Vec3 r1(w[4], w[5], w[6]);
+        Vec3 r2(w[8], w[9], w[10]);
+        rows[0] = Cross(r1, r2);
+        rows[1] = Cross(r2, r0);
+        rows[2] = Cross(r0, r1);
+        float det = Dot(r0, rows[0]);
+        float invDet = det != 0 ? 1.0f / det : 1.0f;
+        rows[0] = rows[0] * invDet;
+        rows[1] = rows[1] * invDet;
+        rows[2] = rows[2] * invDet;
+    }
+
+    // Transforms an object space normal (the result is not normalised)
+    Vec3 transform(const Vec3& n) const
+    {
+        return Vec3(Dot(rows[0], n), Dot(rows[1], n), Dot(rows[2], n));
+    }
+};
+
+// Compact per-triangle shading record holding everything calculateHitData interpolates, read with a single 48 byte fetch
+// Normals are stored as three signed 16-bit values so the unnormalised normals created by triangle splitting survive packing
+struct TriangleShadingRecord
+{
+    unsigned int normals[3][2]; // xy in the first word, z in the low half of the second word
+    float uvs[3][2];
+
+    static unsigned int packSnorm16(float v)
+    {
+        int i = (int)roundf(clamp(v, -1.0f, 1.0f) * 32767.0f);
+        return (unsigned int)i & 0xFFFF;
+    }
+
+    static float unpackSnorm16(unsigned int v)
+    {
+        int i = (int)(v << 16) >> 16;
+        return std::max((float)i / 32767.0f, -1.0f);
+    }
+
+    // Fills the record from the three vertices of a triangle
+    void encode(const STATIC_VERTEX& v0, const STATIC_VERTEX& v1, const STATIC_VERTEX& v2)
+    {
+        const STATIC_VERTEX* v[3] = { &v0, &v1, &v2 };
+        for (int i = 0; i < 3; i++)
+        {
+            normals[i][0] = packSnorm16(v[i]->normal.x) | (packSnorm16(v[i]->normal.y) << 16);
+            normals[i][1] = packSnorm16(v[i]->normal.z);
+            uvs[i][0] = v[i]->tu;
+            uvs[i][1] = v[i]->tv;
+        }
+    }
+
+    // Returns the unpacked normal of one corner
+    Vec3 decodeNormal(int corner) const
+    {
+        return Vec3(unpackSnorm16(normals[corner][0] & 0xFFFF), unpackSnorm16(normals[corner][0] >> 16), unpackSnorm16(normals[corner][1] & 0xFFFF));
+    }
+
+    // Reference decoder matching calculateHitData in PT.hlsl: interpolates the normal and uv at barycentrics (u, v)
+    void decode(float u, float v, Vec3& normal, float& tu, float& tv) const
+    {
+        float w = 1.0f - u - v;
+        normal = ((decodeNormal(0) * w) + (decodeNormal(1) * u) + (decodeNormal(2) * v)).normalize();
+        tu = (uvs[0][0] * w) + (uvs[1][0] * u) + (uvs[2][0] * v);
+        tv = (uvs[0][1] * w) + (uvs[1][1] * u) + (uvs[2][1] * v);
+    }
+};
+
+// Wrapper class for storing a 3x4 transformation matrix used in TLAS.
+class TLASTransform
+{
+public:
+    union
+    {
+        float w[3][4]; // 3x4 matrix representation
+        float a[12];   // Flat array representation (alternative)
+    };
+
+    TLASTransform()
+    {
+    }
+
+    // Construct TLASTransform from a Matrix object (copies 12 floats)
+    TLASTransform(const Matrix& m)
+    {
+        memcpy(a, m.m, sizeof(float) * 12);
+    }
+};
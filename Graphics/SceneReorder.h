@@ -0,0 +1,413 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file implements a build time pass that reorders scene data along a Morton curve so that
+// spatially neighbouring hits read neighbouring memory. Triangles are sorted within each mesh at
+// import (before the BLAS is built so PrimitiveIndex() stays consistent), and instances and their
+// mesh data blocks are sorted before the TLAS and structured buffers are created.
+// A simple CPU cache simulator measures the effect without needing a GPU. It replays every triangle of the scene,
+// so it only runs when measure is set, as the headless reorder mode does.
+// The scene passes are templates over the scene so the headless tool can run them on the scene's data without
+// Direct3D; SceneType needs the members of Scene that they use.
+
+#include "Math.h"
+#include "SceneData.h"
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
+// Spreads the lower 10 bits of v so there are two zero bits between each bit
+static unsigned int mortonExpandBits(unsigned int v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// Computes a 30 bit Morton code for a point inside the given bounds
+static unsigned int morton3D(const Vec3& p, const AABB& bounds)
+{
+	Vec3 size = bounds.size();
+	unsigned int code[3];
+	for (int i = 0; i < 3; i++)
+	{
+		float t = size.coords[i] > 0 ? (p.coords[i] - bounds.min.coords[i]) / size.coords[i] : 0.5f;
+		code[i] = (unsigned int)clamp(t * 1024.0f, 0.0f, 1023.0f);
+	}
+	return (mortonExpandBits(code[0]) << 2) | (mortonExpandBits(code[1]) << 1) | mortonExpandBits(code[2]);
+}
+
+// Transforms an object space box by a 3x4 instance transform and returns the world space box
+static AABB transformBounds(const AABB& box, const TLASTransform& transform)
+{
+	AABB world;
+	for (int i = 0; i < 8; i++)
+	{
+		Vec3 p((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y, (i & 4) ? box.max.z : box.min.z);
+		world.extend(Vec3(
+			(transform.w[0][0] * p.x) + (transform.w[0][1] * p.y) + (transform.w[0][2] * p.z) + transform.w[0][3],
+			(transform.w[1][0] * p.x) + (transform.w[1][1] * p.y) + (transform.w[1][2] * p.z) + transform.w[1][3],
+			(transform.w[2][0] * p.x) + (transform.w[2][1] * p.y) + (transform.w[2][2] * p.z) + transform.w[2][3]));
+	}
+	return world;
+}
+
+// Set associative cache with LRU replacement, used to estimate how cache friendly an access stream is
+// Each set is a row of tags with the time each was last used, so an access scans a few words and never allocates
+class CacheSimulator
+{
+public:
+	unsigned int lineSize;
+	unsigned int numSets;
+	unsigned int ways;
+	std::vector<unsigned long long> tags;
+	std::vector<unsigned long long> lastUsed;
+	unsigned long long accesses;
+	unsigned long long misses;
+
+	// Defaults approximate a GPU L1 data cache (128 byte lines, 32KB, 8 way)
+	CacheSimulator(unsigned int _lineSize = 128, unsigned int sizeInBytes = 32768, unsigned int _ways = 8)
+	{
+		lineSize = _lineSize;
+		ways = _ways;
+		numSets = std::max(sizeInBytes / (lineSize * ways), 1u);
+		reset();
+	}
+
+	void reset()
+	{
+		tags.assign((size_t)numSets * ways, ~0ull);
+		lastUsed.assign((size_t)numSets * ways, 0);
+		accesses = 0;
+		misses = 0;
+	}
+
+	// Records a read of sizeInBytes starting at address, touching every line it spans
+	void access(unsigned long long address, unsigned int sizeInBytes)
+	{
+		unsigned long long first = address / lineSize;
+		unsigned long long last = (address + sizeInBytes - 1) / lineSize;
+		for (unsigned long long line = first; line <= last; line++)
+		{
+			accesses++;
+			size_t set = (size_t)(line % numSets) * ways;
+			size_t oldest = set;
+			bool hit = false;
+			for (size_t way = set; way < set + ways; way++)
+			{
+				if (tags[way] == line)
+				{
+					oldest = way;
+					hit = true;
+					break;
+				}
+				if (lastUsed[way] < lastUsed[oldest])
+				{
+					oldest = way;
+				}
+			}
+			if (hit == false)
+			{
+				misses++;
+				tags[oldest] = line;
+			}
+			lastUsed[oldest] = accesses;
+		}
+	}
+
+	float missRate() const
+	{
+		return accesses > 0 ? (float)misses / (float)accesses : 0;
+	}
+};
+
+// Statistics reported by the reordering pass
+struct SceneReorderStats
+{
+	float meshMissRateBefore = 0;     // Average over meshes of the per mesh miss rate before triangle sorting
+	float meshMissRateAfter = 0;      // Average over meshes of the per mesh miss rate after triangle sorting
+	int meshes = 0;
+	float sceneMissRateBefore = 0;    // Miss rate of the whole scene before instances were sorted
+	float sceneMissRateAfter = 0;     // Miss rate of the whole scene after instances were sorted
+};
+
+// Reorders triangles, vertices, instances and mesh data along a Morton curve
+class SceneReorder
+{
+public:
+	bool enabled = true;
+	bool measure = false;  // Simulate the cache before and after each pass and record the miss rates in stats
+	SceneReorderStats stats;
+
+	// Simulates the vertex and index fetches of hits on a mesh visited in spatial order
+	// The visiting order is independent of the storage order, so the result only depends on memory layout
+	static float simulateMesh(const std::vector<STATIC_VERTEX>& vertices, const std::vector<unsigned int>& indices)
+	{
+		int numTriangles = (int)indices.size() / 3;
+		if (numTriangles == 0)
+		{
+			return 0;
+		}
+		AABB bounds;
+		std::vector<Vec3> centroids(numTriangles);
+		for (int i = 0; i < numTriangles; i++)
+		{
+			centroids[i] = (vertices[indices[i * 3]].pos + vertices[indices[(i * 3) + 1]].pos + vertices[indices[(i * 3) + 2]].pos) / 3.0f;
+			bounds.extend(centroids[i]);
+		}
+		std::vector<std::pair<unsigned int, int>> visit(numTriangles);
+		for (int i = 0; i < numTriangles; i++)
+		{
+			visit[i] = { morton3D(centroids[i], bounds), i };
+		}
+		std::sort(visit.begin(), visit.end());
+		CacheSimulator cache;
+		unsigned long long vertexBase = (unsigned long long)indices.size() * sizeof(unsigned int);
+		for (int i = 0; i < numTriangles; i++)
+		{
+			int triangle = visit[i].second;
+			cache.access((unsigned long long)triangle * 3 * sizeof(unsigned int), 3 * sizeof(unsigned int));
+			for (int n = 0; n < 3; n++)
+			{
+				cache.access(vertexBase + ((unsigned long long)indices[(triangle * 3) + n] * sizeof(STATIC_VERTEX)), sizeof(STATIC_VERTEX));
+			}
+		}
+		return cache.missRate();
+	}
+
+	// Simulates the fetches made by calculateHitData for every triangle of every instance, visited in world space Morton order
+	template <typename SceneType>
+	static float simulateScene(SceneType* scene)
+	{
+		struct Hit
+		{
+			unsigned int code;
+			unsigned int instance;
+			unsigned int primitive;
+		};
+		std::vector<Hit> hits;
+		std::vector<AABB> instanceBounds(scene->meshes.size());
+		AABB sceneBounds;
+		for (unsigned int i = 0; i < scene->meshes.size(); i++)
+		{
+			instanceBounds[i] = transformBounds(scene->meshes[i]->bounds, scene->transforms[i]);
+			sceneBounds.extend(instanceBounds[i]);
+		}
+		for (unsigned int i = 0; i < scene->meshes.size(); i++)
+		{
+			unsigned int start = scene->instanceData[i].startIndex;
+			unsigned int numTriangles = (unsigned int)scene->meshes[i]->numIndices / 3;
+			const TLASTransform& w = scene->transforms[i];
+			for (unsigned int n = 0; n < numTriangles; n++)
+			{
+				Vec3 c = (scene->allVertices[scene->allIndices[start + (n * 3)]].pos + scene->allVertices[scene->allIndices[start + (n * 3) + 1]].pos + scene->allVertices[scene->allIndices[start + (n * 3) + 2]].pos) / 3.0f;
+				Vec3 p(
+					(w.w[0][0] * c.x) + (w.w[0][1] * c.y) + (w.w[0][2] * c.z) + w.w[0][3],
+					(w.w[1][0] * c.x) + (w.w[1][1] * c.y) + (w.w[1][2] * c.z) + w.w[1][3],
+					(w.w[2][0] * c.x) + (w.w[2][1] * c.y) + (w.w[2][2] * c.z) + w.w[2][3]);
+				hits.push_back({ morton3D(p, sceneBounds), i, n });
+			}
+		}
+		std::sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b) { return a.code < b.code; });
+
+		// Place the three buffers at separate, line aligned base addresses
+		unsigned long long instanceBase = 0;
+		unsigned long long indexBase = ((scene->instanceData.size() * sizeof(InstanceData)) + 4095) & ~4095ull;
+		unsigned long long vertexBase = indexBase + (((scene->allIndices.size() * sizeof(unsigned int)) + 4095) & ~4095ull);
+		CacheSimulator cache;
+		for (unsigned int i = 0; i < hits.size(); i++)
+		{
+			cache.access(instanceBase + ((unsigned long long)hits[i].instance * sizeof(InstanceData)), sizeof(InstanceData));
+			unsigned int start = scene->instanceData[hits[i].instance].startIndex + (hits[i].primitive * 3);
+			cache.access(indexBase + ((unsigned long long)start * sizeof(unsigned int)), 3 * sizeof(unsigned int));
+			for (int n = 0; n < 3; n++)
+			{
+				cache.access(vertexBase + ((unsigned long long)scene->allIndices[start + n] * sizeof(STATIC_VERTEX)), sizeof(STATIC_VERTEX));
+			}
+		}
+		return cache.missRate();
+	}
+
+	// Sorts the triangles of a mesh by the Morton code of their centroids, then renumbers the vertices
+	// in order of first use. Must run before Mesh::init so the BLAS primitive order matches the index buffer.
+	void reorderTriangles(std::vector<STATIC_VERTEX>& vertices, std::vector<unsigned int>& indices)
+	{
+		int numTriangles = (int)indices.size() / 3;
+		if (enabled == false || numTriangles == 0)
+		{
+			return;
+		}
+		float before = measure ? simulateMesh(vertices, indices) : 0;
+
+		AABB bounds;
+		std::vector<Vec3> centroids(numTriangles);
+		for (int i = 0; i < numTriangles; i++)
+		{
+			centroids[i] = (vertices[indices[i * 3]].pos + vertices[indices[(i * 3) + 1]].pos + vertices[indices[(i * 3) + 2]].pos) / 3.0f;
+			bounds.extend(centroids[i]);
+		}
+		std::vector<std::pair<unsigned int, int>> order(numTriangles);
+		for (int i = 0; i < numTriangles; i++)
+		{
+			order[i] = { morton3D(centroids[i], bounds), i };
+		}
+		std::stable_sort(order.begin(), order.end(), [](const std::pair<unsigned int, int>& a, const std::pair<unsigned int, int>& b) { return a.first < b.first; });
+
+		// Rebuild the index buffer in sorted order, assigning new vertex indices by first use
+		std::vector<unsigned int> remap(vertices.size(), 0xFFFFFFFF);
+		std::vector<STATIC_VERTEX> newVertices;
+		std::vector<unsigned int> newIndices;
+		newVertices.reserve(vertices.size());
+		newIndices.reserve(indices.size());
+		for (int i = 0; i < numTriangles; i++)
+		{
+			for (int n = 0; n < 3; n++)
+			{
+				unsigned int index = indices[(order[i].second * 3) + n];
+				if (remap[index] == 0xFFFFFFFF)
+				{
+					remap[index] = (unsigned int)newVertices.size();
+					newVertices.push_back(vertices[index]);
+				}
+				newIndices.push_back(remap[index]);
+			}
+		}
+		vertices.swap(newVertices);
+		indices.swap(newIndices);
+
+		if (measure == false)
+		{
+			return;
+		}
+		float after = simulateMesh(vertices, indices);
+		stats.meshMissRateBefore = ((stats.meshMissRateBefore * stats.meshes) + before) / (float)(stats.meshes + 1);
+		stats.meshMissRateAfter = ((stats.meshMissRateAfter * stats.meshes) + after) / (float)(stats.meshes + 1);
+		stats.meshes++;
+	}
+
+	// Sorts instances by the Morton code of their world space bounds and lays out the mesh data blocks
+	// in the order they are first used. InstanceID() and startIndex are remapped consistently.
+	// Must run before Scene::build.
+	template <typename SceneType>
+	void reorderInstances(SceneType* scene)
+	{
+		int numInstances = (int)scene->meshes.size();
+		if (enabled == false || numInstances == 0)
+		{
+			return;
+		}
+		if (measure)
+		{
+			stats.sceneMissRateBefore = simulateScene(scene);
+		}
+
+		std::vector<AABB> instanceBounds(numInstances);
+		AABB centreBounds;
+		for (int i = 0; i < numInstances; i++)
+		{
+			instanceBounds[i] = transformBounds(scene->meshes[i]->bounds, scene->transforms[i]);
+			centreBounds.extend(instanceBounds[i].centre());
+		}
+		std::vector<std::pair<unsigned int, int>> order(numInstances);
+		for (int i = 0; i < numInstances; i++)
+		{
+			order[i] = { morton3D(instanceBounds[i].centre(), centreBounds), i };
+		}
+		std::stable_sort(order.begin(), order.end(), [](const std::pair<unsigned int, int>& a, const std::pair<unsigned int, int>& b) { return a.first < b.first; });
+
+		// Permute the per instance arrays together so InstanceID() still indexes matching data
+		auto meshes = scene->meshes;
+		std::vector<TLASTransform> transforms(numInstances);
+		std::vector<InstanceData> instanceData(numInstances);
+		std::vector<std::string> instanceMeshNames(numInstances);
+		for (int i = 0; i < numInstances; i++)
+		{
+			meshes[i] = scene->meshes[order[i].second];
+			transforms[i] = scene->transforms[order[i].second];
+			instanceData[i] = scene->instanceData[order[i].second];
+			instanceMeshNames[i] = scene->instanceMeshNames[order[i].second];
+		}
+		scene->meshes.swap(meshes);
+		scene->transforms.swap(transforms);
+		scene->instanceData.swap(instanceData);
+		scene->instanceMeshNames.swap(instanceMeshNames);
+
+		// Lay out the mesh data blocks in the order the sorted instances first reference them. Blocks are found by
+		// name, as meshes without triangles start where the next block does
+		std::vector<std::string> blockOrder;
+		std::map<std::string, int> emitted;
+		for (int i = 0; i < numInstances; i++)
+		{
+			const std::string& name = scene->instanceMeshNames[i];
+			if (emitted.find(name) == emitted.end())
+			{
+				emitted[name] = 1;
+				blockOrder.push_back(name);
+			}
+		}
+		for (unsigned int i = 0; i < scene->filenames.size(); i++)
+		{
+			if (emitted.find(scene->filenames[i]) == emitted.end())
+			{
+				emitted[scene->filenames[i]] = 1;
+				blockOrder.push_back(scene->filenames[i]);
+			}
+		}
+		std::vector<STATIC_VERTEX> allVertices;
+		std::vector<unsigned int> allIndices;
+		allVertices.reserve(scene->allVertices.size());
+		allIndices.reserve(scene->allIndices.size());
+		for (unsigned int i = 0; i < blockOrder.size(); i++)
+		{
+			const std::string& filename = blockOrder[i];
+			int oldVertexOffset = scene->vertexOffset[filename];
+			int oldIndexOffset = scene->indexOffset[filename];
+			int newVertexOffset = (int)allVertices.size();
+			int newIndexOffset = (int)allIndices.size();
+			allVertices.insert(allVertices.end(), scene->allVertices.begin() + oldVertexOffset, scene->allVertices.begin() + oldVertexOffset + scene->vertexSize[filename]);
+			for (int n = 0; n < scene->indexSize[filename]; n++)
+			{
+				allIndices.push_back(scene->allIndices[oldIndexOffset + n] - oldVertexOffset + newVertexOffset);
+			}
+			scene->vertexOffset[filename] = newVertexOffset;
+			scene->indexOffset[filename] = newIndexOffset;
+		}
+		scene->allVertices.swap(allVertices);
+		scene->allIndices.swap(allIndices);
+		for (int i = 0; i < numInstances; i++)
+		{
+			scene->instanceData[i].startIndex = scene->indexOffset[scene->instanceMeshNames[i]];
+		}
+
+		if (measure)
+		{
+			stats.sceneMissRateAfter = simulateScene(scene);
+		}
+	}
+};
@@ -151,6 +151,64 @@ public:
     }
 };
 
+// Ray generation shaders exported by the ray tracing shaders. The first is the path tracer and the others are
+// extra passes dispatched by the scene. Each has a record at the start of the shader table, followed by the two
+// miss shaders and the two hit groups.
+static const wchar_t* rayGenerationShaderNames[] =
+{
+    L"RayGeneration",
+    L"ReSTIRSpatial",
+    L"HashGridResolve",
+    L"ProbeTrace",
+    L"ProbeBlend",
+    L"LightCacheResolve",
+    L"PhotonTrace",
+    L"Tonemap",
+    L"DenoisePrepare",
+    L"DenoiseStep0",
+    L"DenoiseStep1",
+    L"DenoiseStep2",
+    L"DenoiseStep3",
+    L"DenoiseStep4",
+    L"TemporalHistory",
+    L"WavefrontGenerate",
+    L"WavefrontTrace",
+    L"WavefrontSort",
+    L"WavefrontShade",
+    L"WavefrontShadow",
+    L"WavefrontAccumulate",
+    L"Upsample"
+};
+
+// Indices of the ray generation shaders in rayGenerationShaderNames, which rayGenerationRecordOffset takes
+enum RayGenerationShader
+{
+    RAYGEN_PATH_TRACE,
+    RAYGEN_RESTIR_SPATIAL,
+    RAYGEN_HASH_GRID_RESOLVE,
+    RAYGEN_PROBE_TRACE,
+    RAYGEN_PROBE_BLEND,
+    RAYGEN_LIGHT_CACHE_RESOLVE,
+    RAYGEN_PHOTON_TRACE,
+    RAYGEN_TONEMAP,
+    RAYGEN_DENOISE_PREPARE,
+    RAYGEN_DENOISE_STEP0,
+    RAYGEN_DENOISE_STEP1,
+    RAYGEN_DENOISE_STEP2,
+    RAYGEN_DENOISE_STEP3,
+    RAYGEN_DENOISE_STEP4,
+    RAYGEN_TEMPORAL_HISTORY,
+    RAYGEN_WAVEFRONT_GENERATE,
+    RAYGEN_WAVEFRONT_TRACE,
+    RAYGEN_WAVEFRONT_SORT,
+    RAYGEN_WAVEFRONT_SHADE,
+    RAYGEN_WAVEFRONT_SHADOW,
+    RAYGEN_WAVEFRONT_ACCUMULATE,
+    RAYGEN_UPSAMPLE,
+    RAYGEN_COUNT
+};
+static_assert(RAYGEN_COUNT == _countof(rayGenerationShaderNames), "RayGenerationShader must list every entry of rayGenerationShaderNames");
+
 // Class representing a ray tracing shader and its associated resources.
 class RTShader
 {
@@ -249,7 +307,9 @@ public:
         {
             { L"RayGeneration", NULL, D3D12_EXPORT_FLAG_NONE },
             { L"Miss", NULL, D3D12_EXPORT_FLAG_NONE },
-            { L"ClosestHit", NULL, D3D12_EXPORT_FLAG_NONE }
+            { L"ClosestHit", NULL, D3D12_EXPORT_FLAG_NONE },
+            { L"PathMiss", NULL, D3D12_EXPORT_FLAG_NONE },
+            { L"PathClosestHit", NULL, D3D12_EXPORT_FLAG_NONE }
         };
 
         // Initialize DXIL library description using an initializer list
@@ -258,7 +318,7 @@ public:
         libraryDesc.DXILLibrary.BytecodeLength = code->GetBufferSize();
         // Add exports if names need to be made explicit
         // libraryDesc.pExports = exports;
-        // libraryDesc.NumExports = 3;
+        // libraryDesc.NumExports = 5;
 
         // Create a subobject for the DXIL library
         D3D12_STATE_SUBOBJECT librarySubobject{};
@@ -277,9 +337,20 @@ public:
         hitGroupSubobject.pDesc = &hitGroupDesc;
         subobjects.push_back(hitGroupSubobject);
 
+        // Define the hit group of camera paths, which only returns where their rays hit
+        D3D12_HIT_GROUP_DESC pathHitGroupDesc{};
+        pathHitGroupDesc.ClosestHitShaderImport = L"PathClosestHit";
+        pathHitGroupDesc.HitGroupExport = L"PathHitGroup";
+        pathHitGroupDesc.Type = D3D12_HIT_GROUP_TYPE_TRIANGLES;
+
+        D3D12_STATE_SUBOBJECT pathHitGroupSubobject{};
+        pathHitGroupSubobject.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP;
+        pathHitGroupSubobject.pDesc = &pathHitGroupDesc;
+        subobjects.push_back(pathHitGroupSubobject);
+
         // Configure the shader with payload and attribute size limits
         D3D12_RAYTRACING_SHADER_CONFIG shaderConfig{};
-        shaderConfig.MaxPayloadSizeInBytes = 36;  // Colour(3*4) + Throughput(3*4) + depth(4) + flags(4) + rndState(4)
+        shaderConfig.MaxPayloadSizeInBytes = 64;  // Colour(3*4) + Throughput(3*4) + depth(4) + flags(4) + rndState(4) + lastPosition(3*4) + lastNormal(3*4) + lastPdf(4), which PathHit's 20 bytes fit in
         shaderConfig.MaxAttributeSizeInBytes = 16;
 
         D3D12_STATE_SUBOBJECT shaderConfigSubobject{};
@@ -287,9 +358,10 @@ public:
         shaderConfigSubobject.pDesc = &shaderConfig;
         subobjects.push_back(shaderConfigSubobject);
 
-        // Set the maximum recursion depth for ray tracing
+        // Set the maximum recursion depth for ray tracing. Camera paths trace every ray from the ray generation shader,
+        // and only the shadow rays of probe rays' hits are traced from a closest hit shader
         D3D12_RAYTRACING_PIPELINE_CONFIG pipelineConfig{};
-        pipelineConfig.MaxTraceRecursionDepth = 8; // Update this value as needed
+        pipelineConfig.MaxTraceRecursionDepth = 2;
 
         D3D12_STATE_SUBOBJECT pipelineConfigSubobject{};
         pipelineConfigSubobject.Type = D3D12_STATE_SUBOBJECT_TYPE_RAYTRACING_PIPELINE_CONFIG;
@@ -325,7 +397,7 @@ public:
         D3D12_RESOURCE_DESC bd;
         memset(&bd, 0, sizeof(D3D12_RESOURCE_DESC));
         bd.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
-        bd.Width = 3 * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
+        bd.Width = (_countof(rayGenerationShaderNames) + 4) * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
         bd.Height = 1;
         bd.DepthOrArraySize = 1;
         bd.MipLevels = 1;
@@ -342,17 +414,24 @@ public:
         ID3D12StateObjectProperties* psoProps;
         pso->QueryInterface(IID_PPV_ARGS(&psoProps));
 
-        // Copy the RayGeneration shader identifier
-        void* rayGenID = psoProps->GetShaderIdentifier(L"RayGeneration");
-        memcpy(data, rayGenID, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
+        // Copy the ray generation shader identifiers
+        for (int i = 0; i < _countof(rayGenerationShaderNames); i++)
+        {
+            void* rayGenID = psoProps->GetShaderIdentifier(rayGenerationShaderNames[i]);
+            memcpy(data + (i * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT), rayGenID, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
+        }
 
-        // Copy the Miss shader identifier
+        // Copy the Miss shader identifiers, that of Payload rays first and then that of camera paths
         void* missID = psoProps->GetShaderIdentifier(L"Miss");
-        memcpy(data + D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT, missID, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
+        memcpy(data + missRecordOffset(), missID, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
+        void* pathMissID = psoProps->GetShaderIdentifier(L"PathMiss");
+        memcpy(data + missRecordOffset() + D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT, pathMissID, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
 
-        // Copy the HitGroup shader identifier
+        // Copy the HitGroup shader identifiers in the same order
         void* hitGroupID = psoProps->GetShaderIdentifier(L"HitGroup");
-        memcpy(data + (2 * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT), hitGroupID, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
+        memcpy(data + hitGroupRecordOffset(), hitGroupID, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
+        void* pathHitGroupID = psoProps->GetShaderIdentifier(L"PathHitGroup");
+        memcpy(data + hitGroupRecordOffset() + D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT, pathHitGroupID, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
 
         psoProps->Release();
         shaderList->Unmap(0, NULL);
@@ -361,6 +440,24 @@ public:
         initConstantBuffers(core, code, constantBuffers);
     }
 
+    // Offset of a ray generation shader's record in the shader table, by its index in rayGenerationShaderNames
+    static unsigned int rayGenerationRecordOffset(int index)
+    {
+        return index * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
+    }
+
+    // Offset of the miss shaders' records in the shader table, D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT apart
+    static unsigned int missRecordOffset()
+    {
+        return _countof(rayGenerationShaderNames) * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
+    }
+
+    // Offset of the hit groups' records in the shader table, D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT apart
+    static unsigned int hitGroupRecordOffset()
+    {
+        return (_countof(rayGenerationShaderNames) + 2) * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
+    }
+
     // Update a specific constant variable in a given constant buffer.
     void updateConstant(std::string constantBufferName, std::string variableName, void* data, std::vector<ConstantBuffer>& buffers)
     {
@@ -0,0 +1,337 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file is the C++ reference for sampling area light triangles by solid angle (Arvo 1995).
+// sampleTriangleLight and triangleLightPdf are implemented identically in PT.hlsl. Triangles that
+// subtend a very small or very large solid angle fall back to uniform area sampling, where the
+// spherical construction loses precision. A small harness compares the variance of both strategies.
+
+#include "Math.h"
+#include "SceneData.h"
+#include "Parallel.h"
+#include "LightSampling.h"
+#include <vector>
+
+#define SPHERICAL_PI 3.14159265358979f
+
+// Solid angle limits outside which area sampling is used instead
+static const float sphericalSampleMinSolidAngle = 3e-4f;
+static const float sphericalSampleMaxSolidAngle = 6.22f;
+
+// Angle between two unit vectors, accurate for nearly parallel and nearly opposite vectors
+static float angleBetween(const Vec3& a, const Vec3& b)
+{
+	if (Dot(a, b) < 0)
+	{
+		return SPHERICAL_PI - (2.0f * asinf(std::min((a + b).length() * 0.5f, 1.0f)));
+	}
+	return 2.0f * asinf(std::min((b - a).length() * 0.5f, 1.0f));
+}
+
+// Returns the component of v perpendicular to the unit vector w, normalised
+static Vec3 orthogonalise(const Vec3& v, const Vec3& w)
+{
+	return (v - (w * Dot(v, w))).normalize();
+}
+
+// Computes the unit directions from p to the triangle's vertices and the interior angles of the spherical triangle
+// Returns false if the triangle is degenerate as seen from p
+static bool sphericalTriangleAngles(const Vec3& v1, const Vec3& v2, const Vec3& v3, const Vec3& p, Vec3& a, Vec3& b, Vec3& c, float& alpha, float& beta, float& gamma)
+{
+	a = (v1 - p).normalize();
+	b = (v2 - p).normalize();
+	c = (v3 - p).normalize();
+	Vec3 nab = Cross(a, b);
+	Vec3 nbc = Cross(b, c);
+	Vec3 nca = Cross(c, a);
+	if (nab.lengthSq() <= 0 || nbc.lengthSq() <= 0 || nca.lengthSq() <= 0)
+	{
+		return false;
+	}
+	nab = nab.normalize();
+	nbc = nbc.normalize();
+	nca = nca.normalize();
+	alpha = angleBetween(nab, -nca);
+	beta = angleBetween(nbc, -nab);
+	gamma = angleBetween(nca, -nbc);
+	return true;
+}
+
+// Solid angle subtended by a triangle from p, zero if degenerate
+static float sphericalTriangleSolidAngle(const Vec3& v1, const Vec3& v2, const Vec3& v3, const Vec3& p)
+{
+	Vec3 a;
+	Vec3 b;
+	Vec3 c;
+	float alpha;
+	float beta;
+	float gamma;
+	if (sphericalTriangleAngles(v1, v2, v3, p, a, b, c, alpha, beta, gamma) == false)
+	{
+		return 0;
+	}
+	return std::max((alpha + beta + gamma) - SPHERICAL_PI, 0.0f);
+}
+
+// Samples a direction uniformly within the solid angle of a triangle as seen from p
+// Returns false if the triangle is degenerate, otherwise sets the direction and its pdf (one over the solid angle)
+static bool sampleSphericalTriangle(const Vec3& v1, const Vec3& v2, const Vec3& v3, const Vec3& p, float u1, float u2, Vec3& wi, float& pdf)
+{
+	Vec3 a;
+	Vec3 b;
+	Vec3 c;
+	float alpha;
+	float beta;
+	float gamma;
+	if (sphericalTriangleAngles(v1, v2, v3, p, a, b, c, alpha, beta, gamma) == false)
+	{
+		return false;
+	}
+	float areaPi = alpha + beta + gamma;
+	float area = areaPi - SPHERICAL_PI;
+	if (area <= 0)
+	{
+		return false;
+	}
+	pdf = 1.0f / area;
+	// Pick the sub-triangle area with u1 and find the vertex c' that produces it
+	float areaPiSampled = SPHERICAL_PI + (u1 * area);
+	float cosAlpha = cosf(alpha);
+	float sinAlpha = sinf(alpha);
+	float sinPhi = (sinf(areaPiSampled) * cosAlpha) - (cosf(areaPiSampled) * sinAlpha);
+	float cosPhi = (cosf(areaPiSampled) * cosAlpha) + (sinf(areaPiSampled) * sinAlpha);
+	float k1 = cosPhi + cosAlpha;
+	float k2 = sinPhi - (sinAlpha * Dot(a, b));
+	float cosBp = (k2 + (((k2 * cosPhi) - (k1 * sinPhi)) * cosAlpha)) / (((k2 * sinPhi) + (k1 * cosPhi)) * sinAlpha);
+	cosBp = clamp(cosBp, -1.0f, 1.0f);
+	float sinBp = sqrtf(std::max(1.0f - (cosBp * cosBp), 0.0f));
+	Vec3 cp = (a * cosBp) + (orthogonalise(c, a) * sinBp);
+	// Pick a point along the arc from b to c' with u2
+	float cosTheta = 1.0f - (u2 * (1.0f - Dot(cp, b)));
+	float sinTheta = sqrtf(std::max(1.0f - (cosTheta * cosTheta), 0.0f));
+	wi = ((b * cosTheta) + (orthogonalise(cp, b) * sinTheta)).normalize();
+	return true;
+}
+
+// Samples a direction towards a one sided triangle light from p, by solid angle when the subtended solid angle is in
+// the well conditioned range and by area otherwise. Sets the direction, the point on the light and the solid angle pdf.
+// Returns false if the sample carries no emission (degenerate triangle or back facing point); mirrors sampleTriangleLight in PT.hlsl
+static bool sampleTriangleLight(const Vec3& v1, const Vec3& v2, const Vec3& v3, const Vec3& lightNormal, float lightArea, const Vec3& p, float u1, float u2, Vec3& wi, Vec3& lightPoint, float& pdf)
+{
+	float denom;
+	float solidAngle = sphericalTriangleSolidAngle(v1, v2, v3, p);
+	if (solidAngle >= sphericalSampleMinSolidAngle && solidAngle <= sphericalSampleMaxSolidAngle)
+	{
+		if (sampleSphericalTriangle(v1, v2, v3, p, u1, u2, wi, pdf) == false)
+		{
+			return false;
+		}
+		// Intersect the sampled direction with the light's plane to find the point for visibility
+		denom = Dot(wi, lightNormal);
+		if (denom >= 0)
+		{
+			return false;
+		}
+		lightPoint = p + (wi * (Dot(v1 - p, lightNormal) / denom));
+		return true;
+	}
+	// Uniform area sampling, converted to solid angle
+	float su = sqrtf(u1);
+	lightPoint = (v1 * (1.0f - su)) + (v2 * (su * u2)) + (v3 * (su * (1.0f - u2)));
+	wi = lightPoint - p;
+	float distanceSq = wi.lengthSq();
+	if (distanceSq <= 0 || lightArea <= 0)
+	{
+		return false;
+	}
+	wi = wi / sqrtf(distanceSq);
+	float cosLight = -Dot(wi, lightNormal);
+	if (cosLight <= 0)
+	{
+		return false;
+	}
+	pdf = distanceSq / (cosLight * lightArea);
+	return true;
+}
+
+// Returns the solid angle pdf of sampleTriangleLight producing the direction wi that reaches the light at lightPoint; mirrors triangleLightPdf in PT.hlsl
+static float triangleLightPdf(const Vec3& v1, const Vec3& v2, const Vec3& v3, const Vec3& lightNormal, float lightArea, const Vec3& p, const Vec3& wi, const Vec3& lightPoint)
+{
+	float cosLight = -Dot(wi, lightNormal);
+	if (cosLight <= 0)
+	{
+		return 0;
+	}
+	float solidAngle = sphericalTriangleSolidAngle(v1, v2, v3, p);
+	if (solidAngle >= sphericalSampleMinSolidAngle && solidAngle <= sphericalSampleMaxSolidAngle)
+	{
+		return 1.0f / solidAngle;
+	}
+	if (lightArea <= 0)
+	{
+		return 0;
+	}
+	return (lightPoint - p).lengthSq() / (cosLight * lightArea);
+}
+
+// Result of comparing light sampling strategies over a scene's lights
+struct LightSamplingComparisonStats
+{
+	int points = 0;                 // Shading points that receive light from at least one light
+	double areaVariance = 0;        // Mean per point variance of the irradiance estimate with area sampling
+	double sphericalVariance = 0;   // Mean per point variance with solid angle sampling (with the area fallback)
+	double meanIrradiance = 0;      // Mean irradiance, which both strategies must agree on
+	double areaMean = 0;
+	double sphericalMean = 0;
+	float fallbackFraction = 0;     // Fraction of samples that used the area sampling fallback
+};
+
+// Estimates the unoccluded irradiance from every light at random shading points with both strategies and
+// compares their variance. Points are placed inside the lights' bounds, expanded to cover nearby geometry, with
+// normals facing the lights so the comparison focuses on the near field cases the sampling is aimed at.
+class LightSamplingComparison
+{
+public:
+	int numPoints = 256;
+	int samplesPerLight = 64;
+	LightSamplingComparisonStats stats;
+
+	void compare(const std::vector<AreaLightData>& lights)
+	{
+		stats = LightSamplingComparisonStats();
+		if (lights.size() == 0)
+		{
+			return;
+		}
+		AABB bounds;
+		for (unsigned int i = 0; i < lights.size(); i++)
+		{
+			bounds.extend(lights[i].v1);
+			bounds.extend(lights[i].v2);
+			bounds.extend(lights[i].v3);
+		}
+		float extent = std::max(bounds.size().length(), 1e-3f);
+		std::vector<double> areaVariance(numPoints, 0);
+		std::vector<double> sphericalVariance(numPoints, 0);
+		std::vector<double> areaMean(numPoints, 0);
+		std::vector<double> sphericalMean(numPoints, 0);
+		std::vector<int> fallbacks(numPoints, 0);
+		std::vector<int> valid(numPoints, 0);
+		parallelFor(numPoints, [&](int i)
+			{
+				unsigned int state = 0x2545F491u * (unsigned int)(i + 1);
+				auto next = [&]()
+					{
+						state = (state * 1664525u) + 1013904223u;
+						return (float)(state >> 8) / 16777216.0f;
+					};
+				// Place the point below a random light, between almost touching it and one scene extent away
+				const AreaLightData& target = lights[std::min((int)(next() * (float)lights.size()), (int)lights.size() - 1)];
+				Vec3 onLight = (target.v1 + target.v2 + target.v3) / 3.0f;
+				Vec3 offset((next() - 0.5f) * extent, (next() - 0.5f) * extent, (next() - 0.5f) * extent);
+				float distance = extent * next() * next();
+				Vec3 p = onLight + (target.normal * (distance + (1e-3f * extent))) + (offset * next() * 0.5f);
+				Vec3 n = (onLight - p).normalize();
+				for (unsigned int l = 0; l < lights.size(); l++)
+				{
+					const AreaLightData& light = lights[l];
+					float Le = luminance(light.Le);
+					double sums[2] = { 0, 0 };
+					double sumsSq[2] = { 0, 0 };
+					for (int s = 0; s < samplesPerLight; s++)
+					{
+						float u1 = next();
+						float u2 = next();
+						for (int strategy = 0; strategy < 2; strategy++)
+						{
+							Vec3 wi;
+							Vec3 lightPoint;
+							float pdf = 0;
+							float value = 0;
+							bool sampled;
+							if (strategy == 0)
+							{
+								// Area sampling only, as used before solid angle sampling
+								float su = sqrtf(u1);
+								lightPoint = (light.v1 * (1.0f - su)) + (light.v2 * (su * u2)) + (light.v3 * (su * (1.0f - u2)));
+								wi = lightPoint - p;
+								float distanceSq = wi.lengthSq();
+								wi = wi / sqrtf(distanceSq);
+								float cosLight = -Dot(wi, light.normal);
+								sampled = cosLight > 0 && light.area > 0;
+								pdf = sampled ? distanceSq / (cosLight * light.area) : 0;
+							} else
+							{
+								sampled = sampleTriangleLight(light.v1, light.v2, light.v3, light.normal, light.area, p, u1, u2, wi, lightPoint, pdf);
+								if (s == 0)
+								{
+									float solidAngle = sphericalTriangleSolidAngle(light.v1, light.v2, light.v3, p);
+									fallbacks[i] += (solidAngle < sphericalSampleMinSolidAngle || solidAngle > sphericalSampleMaxSolidAngle) ? 1 : 0;
+								}
+							}
+							if (sampled && pdf > 0)
+							{
+								value = Le * std::max(Dot(n, wi), 0.0f) / pdf;
+							}
+							sums[strategy] += value;
+							sumsSq[strategy] += (double)value * (double)value;
+						}
+					}
+					for (int strategy = 0; strategy < 2; strategy++)
+					{
+						double mean = sums[strategy] / (double)samplesPerLight;
+						double variance = std::max((sumsSq[strategy] / (double)samplesPerLight) - (mean * mean), 0.0);
+						(strategy == 0 ? areaMean[i] : sphericalMean[i]) += mean;
+						(strategy == 0 ? areaVariance[i] : sphericalVariance[i]) += variance;
+					}
+				}
+				valid[i] = areaMean[i] > 0 || sphericalMean[i] > 0 ? 1 : 0;
+			}, 1);
+		int totalFallbacks = 0;
+		for (int i = 0; i < numPoints; i++)
+		{
+			totalFallbacks += fallbacks[i];
+			if (valid[i] == 0)
+			{
+				continue;
+			}
+			stats.points++;
+			stats.areaVariance += areaVariance[i];
+			stats.sphericalVariance += sphericalVariance[i];
+			stats.areaMean += areaMean[i];
+			stats.sphericalMean += sphericalMean[i];
+		}
+		if (stats.points > 0)
+		{
+			stats.areaVariance /= (double)stats.points;
+			stats.sphericalVariance /= (double)stats.points;
+			stats.areaMean /= (double)stats.points;
+			stats.sphericalMean /= (double)stats.points;
+			stats.meanIrradiance = (stats.areaMean + stats.sphericalMean) * 0.5;
+		}
+		stats.fallbackFraction = (float)totalFallbacks / (float)(numPoints * lights.size());
+	}
+};
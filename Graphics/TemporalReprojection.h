@@ -0,0 +1,384 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds the temporal reprojection that keeps a pixel's samples when the camera moves, where accumulation
+// used to start again. In the first frame after a move the TemporalHistory pass copies each pixel's accumulated colour
+// and sample count and the means of its first-hit AOVs (see Denoiser.h), and the first hit of each camera path is
+// projected into the previous frame with last frame's view projection. Of the four history pixels around it, weighted
+// bilinearly, only those showing the same surface count: the previous camera's ray through the pixel, taken out to the
+// pixel's mean distance, must end on the plane of the first hit, and the pixel's mean normal must be within
+// TEMPORAL_NORMAL_THRESHOLD of the first hit's. Lights and rays leaving the scene have no normal and compare their
+// distances instead. What the accepted pixels hold becomes the pixel's accumulation, with the sample count capped at
+// TEMPORAL_MAX_HISTORY so that the history fades out as new samples come in; a pixel none of whose neighbours were
+// accepted, where the surface was hidden or outside the image, starts again from its new sample. temporalReproject in
+// PT.hlsl mirrors TemporalReprojection::reproject, and verify() checks the projections and reprojects the view of a
+// camera moving past an occluder.
+
+#include "Math.h"
+#include "Camera.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Samples a reprojected pixel keeps at most, so that it follows the new view after a few dozen frames
+static const float TEMPORAL_MAX_HISTORY = 32.0f;
+// Cosine the mean normal of a history pixel must be within of the first hit's normal
+static const float TEMPORAL_NORMAL_THRESHOLD = 0.9f;
+// Distance from the first hit's plane, relative to its depth, within which a history pixel shows the same surface
+static const float TEMPORAL_PLANE_TOLERANCE = 0.05f;
+// Bilinear weight of the accepted history pixels under which a pixel starts again
+static const float TEMPORAL_MIN_WEIGHT = 0.01f;
+
+// A pixel of the history, as the TemporalHistory pass copies it from the accumulation and the AOV means: the colour
+// and its sample count, and the albedo, distance, normal and emission of the first hits
+struct TemporalPixel
+{
+	float colour[3] = {};
+	float count = 0;
+	float albedo[3] = {};
+	float depth = 0;
+	float normal[3] = {};
+	float emission[3] = {};
+
+	// Adds another pixel's values weighted by w
+	void add(const TemporalPixel& other, float w)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			colour[c] += other.colour[c] * w;
+			albedo[c] += other.albedo[c] * w;
+			normal[c] += other.normal[c] * w;
+			emission[c] += other.emission[c] * w;
+		}
+		count += other.count * w;
+		depth += other.depth * w;
+	}
+};
+
+// A frame's camera as the shaders see its matrices: world to clip space, clip to view space and view to world space
+struct TemporalCamera
+{
+	Matrix viewProjection;
+	Matrix inverseProjection;
+	Matrix inverseView;
+
+	// The matrices of a camera, which keeps its inverses transposed for the shaders
+	static TemporalCamera fromCamera(Camera& camera)
+	{
+		TemporalCamera result;
+		result.viewProjection = camera.viewProjection();
+		result.inverseProjection = camera.inverseProjection.transpose();
+		result.inverseView = camera.inverseView.transpose();
+		return result;
+	}
+
+	// mul(m, v) in HLSL
+	static void transform(const Matrix& m, const float* v, float* out)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			out[i] = (m.a[i][0] * v[0]) + (m.a[i][1] * v[1]) + (m.a[i][2] * v[2]) + (m.a[i][3] * v[3]);
+		}
+	}
+
+	Vec3 position() const
+	{
+		float origin[4] = { 0, 0, 0, 1.0f };
+		float p[4];
+		transform(inverseView, origin, p);
+		return Vec3(p[0], p[1], p[2]);
+	}
+
+	// Direction of the ray through a point of the image in pixels, as RayGeneration computes it
+	Vec3 direction(float fx, float fy, int width, int height) const
+	{
+		float uv[4] = { ((fx / (float)width) * 2.0f) - 1.0f, ((1.0f - (fy / (float)height)) * 2.0f) - 1.0f, 0, 1.0f };
+		float p[4];
+		transform(inverseProjection, uv, p);
+		Vec3 v = Vec3(p[0] / p[3], p[1] / p[3], p[2] / p[3]).normalize();
+		float d[4] = { v.x, v.y, v.z, 0 };
+		float w[4];
+		transform(inverseView, d, w);
+		return Vec3(w[0], w[1], w[2]);
+	}
+
+	// Finds where a point appears in the image in pixels, returning false if it is behind the camera
+	bool project(const Vec3& p, int width, int height, float& fx, float& fy) const
+	{
+		float v[4] = { p.x, p.y, p.z, 1.0f };
+		float clip[4];
+		transform(viewProjection, v, clip);
+		if (clip[3] <= 0)
+		{
+			return false;
+		}
+		fx = (((clip[0] / clip[3]) * 0.5f) + 0.5f) * (float)width;
+		fy = (((-clip[1] / clip[3]) * 0.5f) + 0.5f) * (float)height;
+		return true;
+	}
+};
+
+class TemporalReprojection
+{
+public:
+	int width = 0;
+	int height = 0;
+	TemporalCamera previous;
+	std::vector<TemporalPixel> history;
+
+	void init(int _width, int _height)
+	{
+		width = _width;
+		height = _height;
+		history.assign(width * height, TemporalPixel());
+	}
+
+	// Whether history pixel (x, y) shows the surface of a first hit at pos with the given normal, zero for lights and
+	// rays leaving the scene, found at depth along the current camera's ray; mirrors temporalSimilar
+	bool similar(int x, int y, const Vec3& pos, const Vec3& normal, float depth) const
+	{
+		const TemporalPixel& pixel = history[(y * width) + x];
+		if (pixel.count <= 0)
+		{
+			return false;
+		}
+		Vec3 historyNormal(pixel.normal[0], pixel.normal[1], pixel.normal[2]);
+		float historyLengthSq = historyNormal.lengthSq();
+		float lengthSq = normal.lengthSq();
+		Vec3 origin = previous.position();
+		if (historyLengthSq < 0.25f || lengthSq < 0.25f)
+		{
+			return historyLengthSq < 0.25f && lengthSq < 0.25f && fabsf((pos - origin).length() - pixel.depth) < TEMPORAL_PLANE_TOLERANCE * depth;
+		}
+		Vec3 n = normal / sqrtf(lengthSq);
+		Vec3 p = origin + (previous.direction((float)x + 0.5f, (float)y + 0.5f, width, height) * pixel.depth);
+		return Dot(historyNormal, n) > TEMPORAL_NORMAL_THRESHOLD * sqrtf(historyLengthSq) && fabsf(Dot(n, pos - p)) < TEMPORAL_PLANE_TOLERANCE * depth;
+	}
+
+	// The history of a first hit at pos with the given normal found at depth along the current camera's ray, bilinearly
+	// resampled from the history pixels showing its surface, with the count capped. The count is zero if there are
+	// none; mirrors temporalReproject
+	TemporalPixel reproject(const Vec3& pos, const Vec3& normal, float depth) const
+	{
+		TemporalPixel result;
+		float fx;
+		float fy;
+		if (previous.project(pos, width, height, fx, fy) == false)
+		{
+			return result;
+		}
+		fx -= 0.5f;
+		fy -= 0.5f;
+		int x0 = (int)floorf(fx);
+		int y0 = (int)floorf(fy);
+		float tx = fx - (float)x0;
+		float ty = fy - (float)y0;
+		float sumWeight = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			int x = x0 + (i & 1);
+			int y = y0 + (i >> 1);
+			float w = ((i & 1) != 0 ? tx : 1.0f - tx) * ((i >> 1) != 0 ? ty : 1.0f - ty);
+			if (x < 0 || y < 0 || x >= width || y >= height || w <= 0 || similar(x, y, pos, normal, depth) == false)
+			{
+				continue;
+			}
+			result.add(history[(y * width) + x], w);
+			sumWeight += w;
+		}
+		if (sumWeight < TEMPORAL_MIN_WEIGHT)
+		{
+			return TemporalPixel();
+		}
+		TemporalPixel scaled;
+		scaled.add(result, 1.0f / sumWeight);
+		scaled.count = std::min(scaled.count, TEMPORAL_MAX_HISTORY);
+		return scaled;
+	}
+
+	// Checks that points seen through the camera project back to where they were seen, the normal and distance
+	// tests, and that reprojecting the view of a camera moving past an occluder in front of a wall keeps the history
+	// of what was in view, at the right colour and with the count capped, and drops that of what was hidden without
+	// any of the occluder's colour ghosting onto the wall. Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		unsigned int state = 0x510E527Fu;
+		auto next = [&]()
+			{
+				state = (state * 1664525u) + 1013904223u;
+				return (float)(state >> 8) / 16777216.0f;
+			};
+		const int w = 64;
+		const int h = 48;
+		auto makeCamera = [&](const Vec3& from, const Vec3& to)
+			{
+				Camera camera;
+				camera.init(Matrix::perspective(0.001f, 10000.0f, (float)w / (float)h, 45.0f), w, h);
+				camera.initView(Matrix::lookAt(from, to, Vec3(0, 1.0f, 0)));
+				return TemporalCamera::fromCamera(camera);
+			};
+
+		// Points along the rays through random points of the image project back onto them
+		bool roundTrip = true;
+		for (int i = 0; i < 100; i++)
+		{
+			Vec3 from((next() - 0.5f) * 10.0f, (next() - 0.5f) * 10.0f, (next() - 0.5f) * 10.0f);
+			Vec3 to((next() - 0.5f) * 10.0f, (next() - 0.5f) * 10.0f, (next() - 0.5f) * 10.0f);
+			TemporalCamera camera = makeCamera(from, to);
+			float fx = next() * (float)w;
+			float fy = next() * (float)h;
+			Vec3 p = camera.position() + (camera.direction(fx, fy, w, h) * (0.1f + (next() * 20.0f)));
+			float px;
+			float py;
+			roundTrip = roundTrip && (camera.position() - from).length() < 1e-3f && camera.project(p, w, h, px, py) && fabsf(px - fx) < 1e-2f && fabsf(py - fy) < 1e-2f;
+		}
+		failures += roundTrip ? 0 : 1;
+
+		// A wall at z = 0 whose colour follows the position, and an occluder at z = 1 in front of its middle
+		auto trace = [&](const Vec3& o, const Vec3& d, TemporalPixel& pixel, Vec3& pos)
+			{
+				float t = (1.0f - o.z) / d.z;
+				pos = o + (d * t);
+				bool occluder = t > 0 && fabsf(pos.x) < 0.6f && fabsf(pos.y) < 0.6f;
+				if (occluder == false)
+				{
+					t = -o.z / d.z;
+					pos = o + (d * t);
+				}
+				pixel = TemporalPixel();
+				pixel.colour[0] = occluder ? 0.9f : 0.5f + (0.1f * pos.x);
+				pixel.colour[1] = occluder ? 0.1f : 0.5f + (0.1f * pos.y);
+				pixel.colour[2] = 0.2f;
+				pixel.count = 100.0f;
+				pixel.albedo[0] = pixel.albedo[1] = pixel.albedo[2] = 0.5f;
+				pixel.depth = t;
+				pixel.normal[2] = 1.0f;
+				return occluder;
+			};
+		auto render = [&](const TemporalCamera& camera)
+			{
+				previous = camera;
+				init(w, h);
+				for (int y = 0; y < h; y++)
+				{
+					for (int x = 0; x < w; x++)
+					{
+						Vec3 pos;
+						trace(camera.position(), camera.direction((float)x + 0.5f, (float)y + 0.5f, w, h), history[(y * w) + x], pos);
+					}
+				}
+			};
+
+		// With the camera where it was, every pixel gets its own history back, its count capped
+		TemporalCamera still = makeCamera(Vec3(0, 0, 5.0f), Vec3(0, 0, 0));
+		render(still);
+		bool same = true;
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				TemporalPixel expected;
+				Vec3 pos;
+				trace(still.position(), still.direction((float)x + 0.5f, (float)y + 0.5f, w, h), expected, pos);
+				TemporalPixel pixel = reproject(pos, Vec3(0, 0, 1.0f), expected.depth);
+				same = same && pixel.count == TEMPORAL_MAX_HISTORY && fabsf(pixel.colour[0] - expected.colour[0]) < 1e-3f && fabsf(pixel.depth - expected.depth) < 1e-3f;
+			}
+		}
+		failures += same ? 0 : 1;
+
+		// The camera moves sideways past the occluder: what was in view keeps its history, and what the occluder hid
+		// starts again without taking on the occluder's colour
+		TemporalCamera moved = makeCamera(Vec3(1.0f, 0.5f, 5.0f), Vec3(1.0f, 0.5f, 0));
+		int visible = 0;
+		int visibleKept = 0;
+		int hidden = 0;
+		int hiddenKept = 0;
+		float meanError = 0;
+		float maxError = 0;
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				TemporalPixel expected;
+				Vec3 pos;
+				trace(moved.position(), moved.direction((float)x + 0.5f, (float)y + 0.5f, w, h), expected, pos);
+				TemporalPixel pixel = reproject(pos, Vec3(0, 0, 1.0f), expected.depth);
+				if (pixel.count > 0)
+				{
+					float error = std::max(fabsf(pixel.colour[0] - expected.colour[0]), fabsf(pixel.colour[1] - expected.colour[1]));
+					meanError += error;
+					maxError = std::max(maxError, error);
+					same = same && pixel.count == TEMPORAL_MAX_HISTORY;
+				}
+				// Points the previous camera saw in the image should be kept, and points all of whose history
+				// pixels show the occluder dropped
+				float fx;
+				float fy;
+				if (still.project(pos, w, h, fx, fy) == false)
+				{
+					continue;
+				}
+				int x0 = (int)floorf(fx - 0.5f);
+				int y0 = (int)floorf(fy - 0.5f);
+				if (x0 < 0 || y0 < 0 || x0 + 1 >= w || y0 + 1 >= h || expected.depth < 4.5f)
+				{
+					continue;
+				}
+				int occluded = 0;
+				for (int i = 0; i < 4; i++)
+				{
+					occluded += history[((y0 + (i >> 1)) * w) + x0 + (i & 1)].depth < 4.5f ? 1 : 0;
+				}
+				if (occluded == 0)
+				{
+					visible++;
+					visibleKept += pixel.count > 0 ? 1 : 0;
+				} else if (occluded == 4)
+				{
+					hidden++;
+					hiddenKept += pixel.count > 0 ? 1 : 0;
+				}
+			}
+		}
+		meanError /= (float)std::max(visibleKept, 1);
+		bool moving = hidden > 20 && visibleKept == visible && hiddenKept == 0 && meanError < 0.005f && maxError < 0.05f;
+		failures += moving && same ? 0 : 1;
+
+		// A history pixel tilted by more than the threshold is another surface, one tilted less is the same, and lights
+		// match only lights at the same distance
+		render(still);
+		int centre = ((h / 2) * w) + (w / 2);
+		Vec3 pos = still.position() + (still.direction((float)(w / 2) + 0.5f, (float)(h / 2) + 0.5f, w, h) * history[centre].depth);
+		bool normals = similar(w / 2, h / 2, pos, Vec3(0, sinf(0.1f), cosf(0.1f)), 5.0f) && similar(w / 2, h / 2, pos, Vec3(0, sinf(0.6f), cosf(0.6f)), 5.0f) == false;
+		bool lights = similar(w / 2, h / 2, pos, Vec3(0, 0, 0), 5.0f) == false;
+		history[centre].normal[2] = 0;
+		lights = lights && similar(w / 2, h / 2, pos, Vec3(0, 0, 0), 5.0f) && similar(w / 2, h / 2, still.position() + ((pos - still.position()) * 1.2f), Vec3(0, 0, 0), 5.0f) == false;
+		failures += normals && lights ? 0 : 1;
+		return failures;
+	}
+};
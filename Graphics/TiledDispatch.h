@@ -0,0 +1,260 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds the scheduling of the tiled dispatch. With tiled dispatch on, the path tracing pass samples the
+// screen a few tiles a frame rather than all of it, so a frame's work keeps within a time budget however heavy the
+// scene or large the screen, and the window stays responsive while the image refines. Tiles are taken in scanline
+// order, a frame taking the next run of them, and the sample count moves on with each pass over the screen. The number
+// a frame takes adapts from the measured time of the frames before: the cost of a tile is estimated from each frame's
+// time over its tiles, rising at once when a frame runs long and falling smoothly, and the next frame takes as many
+// tiles as that cost fits in the budget, growing at most twofold a frame. PT.hlsl maps a tile dispatch's invocations
+// to pixels as pixel() does. verify() checks the schedule covers the screen once a pass and that the controller
+// settles within the budget, and simulate() runs the controller against a synthetic frame time.
+
+#include <algorithm>
+#include <vector>
+
+// Side of a tile in pixels, TILE_SIZE in PT.hlsl
+static const int TILE_SIZE = 64;
+// Time the frames' GPU work aims for, leaving a 60 Hz frame room for the CPU side and presenting
+static const float TILE_BUDGET_MILLISECONDS = 14.0f;
+// Weight of a frame's tile cost in the estimate when it is lower than the estimate
+static const float TILE_COST_SMOOTHING = 0.25f;
+
+// A frame's tiles: the run of tiles from first, and whether it starts a pass over the screen
+struct TileFrame
+{
+	int first = 0;
+	int count = 0;
+	bool startsPass = true;
+};
+
+// The controller run against a synthetic frame time by TileScheduler::simulate: the tiles of the screen, the tiles
+// and time of the last frame, and the frames the last full pass over the screen took
+struct TileSimulation
+{
+	int tiles = 0;
+	int tilesPerFrame = 0;
+	float frameMilliseconds = 0;
+	int framesPerPass = 0;
+};
+
+class TileScheduler
+{
+public:
+	int width = 0;
+	int height = 0;
+	int columns = 0;
+	int rows = 0;
+	int tiles = 0;
+	float budgetMilliseconds = TILE_BUDGET_MILLISECONDS;
+	int tilesPerFrame = 0;
+	float tileMilliseconds = 0;         // Estimated cost of a tile, 0 until a frame has been measured
+	int cursor = 0;                     // First tile of the next frame
+	int lastCount = 0;                  // Tiles of the last frame if it took all it was allowed, otherwise 0
+
+	// Splits the screen into tiles, the last row and column clipped by its edges, and starts at a sixteenth of them a
+	// frame until the controller has measured a frame
+	void init(int _width, int _height)
+	{
+		width = _width;
+		height = _height;
+		columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+		rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+		tiles = columns * rows;
+		tilesPerFrame = std::max(tiles / 16, 1);
+		tileMilliseconds = 0;
+		cursor = 0;
+		lastCount = 0;
+	}
+
+	// Starts the next pass over the screen from the first tile, as when accumulation starts again
+	void restart()
+	{
+		cursor = 0;
+	}
+
+	// Updates the tile cost estimate from the measured time of the last frame, and from it the tiles the next frame
+	// takes. Frames cut short at the end of a pass are not measured, as their fixed costs would weigh on few tiles
+	void adapt(float frameMilliseconds)
+	{
+		if (lastCount == 0 || frameMilliseconds <= 0)
+		{
+			return;
+		}
+		float cost = frameMilliseconds / (float)lastCount;
+		if (tileMilliseconds <= 0 || cost > tileMilliseconds)
+		{
+			tileMilliseconds = cost;
+		}
+		else
+		{
+			tileMilliseconds = tileMilliseconds + ((cost - tileMilliseconds) * TILE_COST_SMOOTHING);
+		}
+		int fit = (int)std::min(budgetMilliseconds / tileMilliseconds, (float)tiles);
+		tilesPerFrame = std::min(std::max(fit, 1), lastCount * 2);
+	}
+
+	// Takes the next frame's tiles, up to the end of the pass
+	TileFrame schedule()
+	{
+		TileFrame frame;
+		frame.first = cursor;
+		frame.count = std::min(tilesPerFrame, tiles - cursor);
+		frame.startsPass = cursor == 0;
+		cursor = (cursor + frame.count) % tiles;
+		lastCount = frame.count == tilesPerFrame ? frame.count : 0;
+		return frame;
+	}
+
+	// Pixel of an invocation of a tile dispatch, which runs a TILE_SIZE square per tile of the frame; tile is counted
+	// from the frame's first. Returns false for the invocations of tiles clipped by the screen's edges
+	bool pixel(const TileFrame& frame, int tile, int x, int y, int& pixelX, int& pixelY) const
+	{
+		int index = frame.first + tile;
+		pixelX = ((index % columns) * TILE_SIZE) + x;
+		pixelY = ((index / columns) * TILE_SIZE) + y;
+		return pixelX < width && pixelY < height;
+	}
+
+	// Runs the controller for a number of frames on a screen whose frames take a fixed time plus a time per megapixel
+	// sampled, with multiplicative noise of the given amplitude, and returns how it ends up
+	TileSimulation simulate(int simulationWidth, int simulationHeight, float fixedMilliseconds, float megapixelMilliseconds,
+		float noise, int frames)
+	{
+		init(simulationWidth, simulationHeight);
+		TileSimulation result;
+		result.tiles = tiles;
+		unsigned int state = 0x9E3779B9u;
+		int passStart = 0;
+		for (int i = 0; i < frames; i++)
+		{
+			TileFrame frame = schedule();
+			if (frame.startsPass)
+			{
+				result.framesPerPass = i > 0 ? i - passStart : 0;
+				passStart = i;
+			}
+			state = (state * 1664525u) + 1013904223u;
+			float jitter = 1.0f + (noise * ((((float)(state >> 8) / 16777216.0f) * 2.0f) - 1.0f));
+			float megapixels = (float)(frame.count * TILE_SIZE * TILE_SIZE) / 1e6f;
+			float frameMilliseconds = (fixedMilliseconds + (megapixels * megapixelMilliseconds)) * jitter;
+			adapt(frameMilliseconds);
+			result.tilesPerFrame = frame.count;
+			result.frameMilliseconds = frameMilliseconds;
+		}
+		return result;
+	}
+
+	// Checks that schedules of varying lengths take every tile once a pass and start passes at the first tile, that
+	// the tiles' invocations cover every pixel once, and that the controller settles within the budget on a heavy
+	// screen, takes the whole screen a frame on a light one and recovers the budget within two frames of the scene
+	// getting ten times heavier. Returns the number of failed checks
+	int verify()
+	{
+		int failures = 0;
+		const int sizes[][2] = { { 1, 1 }, { 64, 64 }, { 65, 63 }, { 640, 360 }, { 1920, 1080 }, { 3840, 2160 } };
+		for (const auto& size : sizes)
+		{
+			init(size[0], size[1]);
+			unsigned int state = 12345u + (unsigned int)size[0];
+			std::vector<int> visits(tiles, 0);
+			int passes = 0;
+			bool scheduleCorrect = true;
+			while (passes < 3)
+			{
+				state = (state * 1664525u) + 1013904223u;
+				tilesPerFrame = 1 + (int)((state >> 8) % (unsigned int)(tiles + 3));
+				TileFrame frame = schedule();
+				scheduleCorrect = scheduleCorrect && frame.count >= 1 && frame.startsPass == (frame.first == 0);
+				for (int i = 0; i < frame.count; i++)
+				{
+					visits[frame.first + i]++;
+				}
+				if (cursor == 0)
+				{
+					passes++;
+					for (int v : visits)
+					{
+						scheduleCorrect = scheduleCorrect && v == passes;
+					}
+				}
+			}
+			failures += scheduleCorrect ? 0 : 1;
+
+			// Every pixel once over a pass of single tile frames
+			restart();
+			tilesPerFrame = 1;
+			std::vector<int> pixels(width * height, 0);
+			bool coverageCorrect = true;
+			for (int t = 0; t < tiles; t++)
+			{
+				TileFrame frame = schedule();
+				for (int y = 0; y < TILE_SIZE; y++)
+				{
+					for (int x = 0; x < TILE_SIZE; x++)
+					{
+						int pixelX;
+						int pixelY;
+						if (pixel(frame, 0, x, y, pixelX, pixelY))
+						{
+							pixels[(pixelY * width) + pixelX]++;
+						}
+					}
+				}
+			}
+			for (int p : pixels)
+			{
+				coverageCorrect = coverageCorrect && p == 1;
+			}
+			failures += coverageCorrect && cursor == 0 ? 0 : 1;
+		}
+
+		// A heavy 4K screen, 400 ms for the whole of it, settles within the budget and a light one takes all its tiles
+		// every frame
+		TileSimulation heavy = simulate(3840, 2160, 2.0f, 48.0f, 0.05f, 120);
+		failures += heavy.frameMilliseconds <= budgetMilliseconds * 1.1f && heavy.frameMilliseconds >= budgetMilliseconds * 0.6f ? 0 : 1;
+		failures += heavy.tilesPerFrame < heavy.tiles && heavy.framesPerPass > 1 ? 0 : 1;
+		TileSimulation light = simulate(1280, 720, 1.0f, 2.0f, 0.05f, 60);
+		failures += light.tilesPerFrame == light.tiles && light.framesPerPass == 1 ? 0 : 1;
+
+		// A scene ten times heavier is back within the budget two frames after the first slow one, the frame between
+		// overrunning by the fixed costs the first one spread over more tiles
+		simulate(1920, 1080, 2.0f, 20.0f, 0.0f, 100);
+		bool recovered = true;
+		for (int i = 0; i < 20; i++)
+		{
+			TileFrame frame = schedule();
+			float frameMilliseconds = 2.0f + ((float)(frame.count * TILE_SIZE * TILE_SIZE) / 1e6f * 200.0f);
+			adapt(frameMilliseconds);
+			recovered = recovered && (i < 2 || lastCount == 0 || frameMilliseconds <= budgetMilliseconds * 1.05f);
+			recovered = recovered && tilesPerFrame >= 1 && tilesPerFrame <= tiles;
+		}
+		failures += recovered ? 0 : 1;
+		return failures;
+	}
+};
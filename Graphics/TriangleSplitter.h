@@ -0,0 +1,575 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+// This file implements an optional import pass that splits large triangles with poorly
+// fitting bounding boxes before the BLAS is built, and a CPU SAH cost estimate used to
+// measure the effect of the pass on each mesh
+
+#include "Math.h"
+#include "SceneData.h"
+#include <vector>
+#include <map>
+#include <queue>
+#include <tuple>
+#include <algorithm>
+
+// Computes the SAH cost of a binned BVH built over a triangle list
+// The cost is normalised by the surface area of the root node so meshes of different sizes can be compared
+class SAHCost
+{
+public:
+	float traversalCost = 1.0f;
+	float intersectionCost = 1.0f;
+	int maxLeafSize = 4;
+	static const int binCount = 16;
+
+	std::vector<AABB> boxes;
+	std::vector<Vec3> centroids;
+	std::vector<int> order;
+
+	// Builds the BVH over the given triangles and returns its SAH cost
+	float evaluate(const std::vector<STATIC_VERTEX>& vertices, const std::vector<unsigned int>& indices)
+	{
+		int numTriangles = (int)indices.size() / 3;
+		if (numTriangles == 0)
+		{
+			return 0;
+		}
+		boxes.resize(numTriangles);
+		centroids.resize(numTriangles);
+		order.resize(numTriangles);
+		AABB root;
+		for (int i = 0; i < numTriangles; i++)
+		{
+			boxes[i].reset();
+			boxes[i].extend(vertices[indices[(i * 3)]].pos);
+			boxes[i].extend(vertices[indices[(i * 3) + 1]].pos);
+			boxes[i].extend(vertices[indices[(i * 3) + 2]].pos);
+			centroids[i] = boxes[i].centre();
+			order[i] = i;
+			root.extend(boxes[i]);
+		}
+		float rootArea = root.area();
+		if (rootArea <= 0)
+		{
+			return intersectionCost * (float)numTriangles;
+		}
+		return build(0, numTriangles) / rootArea;
+	}
+
+	// Recursively builds a node over order[start, end) and returns its area weighted cost
+	float build(int start, int end)
+	{
+		AABB box;
+		AABB centroidBox;
+		for (int i = start; i < end; i++)
+		{
+			box.extend(boxes[order[i]]);
+			centroidBox.extend(centroids[order[i]]);
+		}
+		int n = end - start;
+		float leafCost = intersectionCost * (float)n;
+		if (n == 1)
+		{
+			return box.area() * leafCost;
+		}
+
+		// Find the best binned split over all three axes
+		float bestCost = FLT_MAX;
+		int bestAxis = -1;
+		int bestBin = 0;
+		Vec3 extent = centroidBox.size();
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (extent.coords[axis] <= 0)
+			{
+				continue;
+			}
+			AABB binBoxes[binCount];
+			int binCounts[binCount] = {};
+			float scale = (float)binCount / extent.coords[axis];
+			for (int i = start; i < end; i++)
+			{
+				int b = std::min((int)((centroids[order[i]].coords[axis] - centroidBox.min.coords[axis]) * scale), binCount - 1);
+				binBoxes[b].extend(boxes[order[i]]);
+				binCounts[b]++;
+			}
+			// Sweep from the right to accumulate the right hand side areas
+			float rightAreas[binCount];
+			int rightCounts[binCount];
+			AABB right;
+			int rightCount = 0;
+			for (int b = binCount - 1; b > 0; b--)
+			{
+				right.extend(binBoxes[b]);
+				rightCount += binCounts[b];
+				rightAreas[b] = right.area();
+				rightCounts[b] = rightCount;
+			}
+			AABB left;
+			int leftCount = 0;
+			for (int b = 0; b < binCount - 1; b++)
+			{
+				left.extend(binBoxes[b]);
+				leftCount += binCounts[b];
+				if (leftCount == 0 || rightCounts[b + 1] == 0)
+				{
+					continue;
+				}
+				float cost = (left.area() * (float)leftCount) + (rightAreas[b + 1] * (float)rightCounts[b + 1]);
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b;
+				}
+			}
+		}
+
+		float nodeArea = box.area();
+		float splitCost = traversalCost + (nodeArea > 0 ? (intersectionCost * bestCost / nodeArea) : 0);
+		if (bestAxis == -1 || (splitCost >= leafCost && n <= maxLeafSize))
+		{
+			if (bestAxis == -1 && n > maxLeafSize)
+			{
+				// All centroids coincide, fall back to an object median split
+				int mid = start + (n / 2);
+				return (nodeArea * traversalCost) + build(start, mid) + build(mid, end);
+			}
+			return nodeArea * leafCost;
+		}
+
+		// Partition the primitives by the chosen bin
+		float scale = (float)binCount / extent.coords[bestAxis];
+		float minCoord = centroidBox.min.coords[bestAxis];
+		int* mid = std::partition(&order[start], &order[start] + n, [&](int index)
+			{
+				int b = std::min((int)((centroids[index].coords[bestAxis] - minCoord) * scale), binCount - 1);
+				return b <= bestBin;
+			});
+		int midIndex = (int)(mid - &order[0]);
+		return (nodeArea * traversalCost) + build(start, midIndex) + build(midIndex, end);
+	}
+};
+
+// Statistics gathered by the splitter, accumulated over every mesh it processes
+struct TriangleSplitStats
+{
+	int meshes = 0;
+	int trianglesIn = 0;
+	int trianglesOut = 0;
+	float sahBefore = 0;
+	float sahAfter = 0;
+};
+
+// Splits triangles whose bounding box covers far more area than the triangle itself
+// Triangles are split at the midpoint of their longest edge. The new vertex is the average of the edge's
+// vertices with normals and tangents left unnormalised, so barycentric interpolation in the shader
+// reproduces exactly the same shading as the original triangle. Every triangle sharing the split edge is
+// split with it, so the mesh stays watertight and no T-junctions are left for rays to leak through
+// The SAH cost of a mesh on its own rarely drops: every split adds a triangle to intersect, which outweighs the box
+// area it saves unless the pieces let the BVH separate the sliver from geometry its box overlaps. The cost is
+// measured per mesh so a scene's budget can be tuned against it
+class TriangleSplitter
+{
+public:
+	bool enabled = false;
+	float budget = 0.5f;           // Maximum number of extra triangles as a fraction of the input count
+	float minBoxFraction = 0.01f;  // Triangles whose box area is below this fraction of the mesh box area are never split
+	float minBoxRatio = 2.0f;      // Triangles whose box fits them this well or better are never split
+	bool measure = false;          // Compute SAH cost before and after splitting
+	TriangleSplitStats stats;
+
+	// Returns how poorly the triangle's bounding box fits it: half the box's surface area over the triangle's area.
+	// This is at least 2, which a triangle lying in an axis aligned plane with two edges along the axes reaches.
+	// Splitting such a triangle cannot improve the fit, as both halves have the same ratio again
+	static float boxRatio(const Vec3& p0, const Vec3& p1, const Vec3& p2, float& boxArea)
+	{
+		AABB box;
+		box.extend(p0);
+		box.extend(p1);
+		box.extend(p2);
+		boxArea = box.area();
+		float triangleArea = Cross(p1 - p0, p2 - p0).length() * 0.5f;
+		return triangleArea > 0 ? (boxArea * 0.5f) / triangleArea : 0.0f;
+	}
+
+	// Returns the key of the undirected edge between two vertices
+	static unsigned long long edgeKey(unsigned int a, unsigned int b)
+	{
+		return ((unsigned long long)std::min(a, b) << 32) | (unsigned long long)std::max(a, b);
+	}
+
+	// Creates (or reuses) the midpoint vertex of the edge between two vertices
+	static unsigned int midpoint(std::vector<STATIC_VERTEX>& vertices, std::map<unsigned long long, unsigned int>& edgeCache, unsigned int a, unsigned int b)
+	{
+		unsigned long long key = edgeKey(a, b);
+		auto it = edgeCache.find(key);
+		if (it != edgeCache.end())
+		{
+			return it->second;
+		}
+		STATIC_VERTEX v;
+		v.pos = (vertices[a].pos + vertices[b].pos) * 0.5f;
+		v.normal = (vertices[a].normal + vertices[b].normal) * 0.5f;
+		v.tangent = (vertices[a].tangent + vertices[b].tangent) * 0.5f;
+		v.tu = (vertices[a].tu + vertices[b].tu) * 0.5f;
+		v.tv = (vertices[a].tv + vertices[b].tv) * 0.5f;
+		unsigned int index = (unsigned int)vertices.size();
+		vertices.push_back(v);
+		edgeCache.insert({ key, index });
+		return index;
+	}
+
+	// Gives vertices at the same position the same id, so triangles either side of a UV or normal seam
+	// are found as neighbours even though they index different vertices
+	static std::vector<unsigned int> weldPositions(const std::vector<STATIC_VERTEX>& vertices)
+	{
+		std::vector<unsigned int> order(vertices.size());
+		for (unsigned int i = 0; i < order.size(); i++)
+		{
+			order[i] = i;
+		}
+		auto less = [&](unsigned int a, unsigned int b)
+			{
+				const Vec3& p = vertices[a].pos;
+				const Vec3& q = vertices[b].pos;
+				return p.x != q.x ? p.x < q.x : (p.y != q.y ? p.y < q.y : p.z < q.z);
+			};
+		std::sort(order.begin(), order.end(), less);
+		std::vector<unsigned int> weld(vertices.size());
+		unsigned int id = 0;
+		for (unsigned int i = 0; i < order.size(); i++)
+		{
+			if (i > 0 && less(order[i - 1], order[i]))
+			{
+				id++;
+			}
+			weld[order[i]] = id;
+		}
+		return weld;
+	}
+
+	// Splits triangles in place until the budget is exhausted or no triangle qualifies
+	// Returns the statistics for this mesh and adds them to the running totals
+	TriangleSplitStats split(std::vector<STATIC_VERTEX>& vertices, std::vector<unsigned int>& indices)
+	{
+		TriangleSplitStats meshStats;
+		int numTriangles = (int)indices.size() / 3;
+		if (enabled == false || numTriangles == 0)
+		{
+			return meshStats;
+		}
+		meshStats.meshes = 1;
+		meshStats.trianglesIn = numTriangles;
+		SAHCost sah;
+		if (measure)
+		{
+			meshStats.sahBefore = sah.evaluate(vertices, indices);
+		}
+
+		AABB meshBox;
+		for (unsigned int i = 0; i < vertices.size(); i++)
+		{
+			meshBox.extend(vertices[i].pos);
+		}
+		float minBoxArea = meshBox.area() * minBoxFraction;
+		int maxTriangles = numTriangles + (int)((float)numTriangles * budget);
+
+		// Triangles around each welded edge. Triangles with coincident corners have no well defined edges
+		// and are left out, so they are never split
+		std::vector<unsigned int> weld = weldPositions(vertices);
+		unsigned int nextWeld = weld.empty() ? 0 : *std::max_element(weld.begin(), weld.end()) + 1;
+		std::map<unsigned long long, std::vector<int>> edgeTriangles;
+		auto welded = [&](int triangle, int corner)
+			{
+				return weld[indices[(triangle * 3) + corner]];
+			};
+		auto degenerate = [&](int triangle)
+			{
+				return welded(triangle, 0) == welded(triangle, 1) || welded(triangle, 1) == welded(triangle, 2) || welded(triangle, 2) == welded(triangle, 0);
+			};
+		auto link = [&](int triangle)
+			{
+				for (int i = 0; i < 3; i++)
+				{
+					edgeTriangles[edgeKey(welded(triangle, i), welded(triangle, (i + 1) % 3))].push_back(triangle);
+				}
+			};
+		auto unlink = [&](int triangle, unsigned long long key)
+			{
+				std::vector<int>& list = edgeTriangles[key];
+				list.erase(std::find(list.begin(), list.end(), triangle));
+			};
+		for (int i = 0; i < numTriangles; i++)
+		{
+			if (degenerate(i) == false)
+			{
+				link(i);
+			}
+		}
+
+		// Queue of triangles ordered by how poorly their bounding boxes fit them. Splitting a neighbour changes a
+		// triangle, so entries carry the triangle's version and stale ones are skipped
+		std::priority_queue<std::tuple<float, int, int>> queue;
+		std::vector<int> version(numTriangles, 0);
+		auto push = [&](int triangle)
+			{
+				float boxArea;
+				float priority = boxRatio(vertices[indices[triangle * 3]].pos, vertices[indices[(triangle * 3) + 1]].pos, vertices[indices[(triangle * 3) + 2]].pos, boxArea);
+				// A small margin keeps rounding from splitting triangles that already fit as well as they can
+				if (boxArea > minBoxArea && priority > minBoxRatio * 1.001f)
+				{
+					queue.push({ priority, triangle, version[triangle] });
+				}
+			};
+		for (int i = 0; i < numTriangles; i++)
+		{
+			if (degenerate(i) == false)
+			{
+				push(i);
+			}
+		}
+
+		std::map<unsigned long long, unsigned int> edgeCache;
+		std::map<unsigned long long, unsigned int> weldedMidpoints;
+		while (queue.empty() == false && numTriangles < maxTriangles)
+		{
+			int triangle = std::get<1>(queue.top());
+			int entryVersion = std::get<2>(queue.top());
+			queue.pop();
+			if (entryVersion != version[triangle])
+			{
+				continue;
+			}
+			// Find the longest edge
+			int e = 0;
+			float longest = -1.0f;
+			for (int i = 0; i < 3; i++)
+			{
+				float l = (vertices[indices[(triangle * 3) + ((i + 1) % 3)]].pos - vertices[indices[(triangle * 3) + i]].pos).lengthSq();
+				if (l > longest)
+				{
+					longest = l;
+					e = i;
+				}
+			}
+			unsigned long long key = edgeKey(welded(triangle, e), welded(triangle, (e + 1) % 3));
+			std::vector<int> sharing = edgeTriangles[key];
+			if (numTriangles + (int)sharing.size() > maxTriangles)
+			{
+				break;
+			}
+			auto found = weldedMidpoints.find(key);
+			unsigned int midWeld = found != weldedMidpoints.end() ? found->second : nextWeld++;
+			weldedMidpoints[key] = midWeld;
+
+			// Split every triangle on the edge. Each uses the midpoint of its own vertices, so seams keep their
+			// attributes while the new vertices share a position
+			for (int s : sharing)
+			{
+				int i = 0;
+				while (edgeKey(welded(s, i), welded(s, (i + 1) % 3)) != key)
+				{
+					i++;
+				}
+				unsigned int p = indices[(s * 3) + i];
+				unsigned int q = indices[(s * 3) + ((i + 1) % 3)];
+				unsigned int r = indices[(s * 3) + ((i + 2) % 3)];
+				unsigned int m = midpoint(vertices, edgeCache, p, q);
+				weld.resize(vertices.size(), midWeld);
+				unlink(s, edgeKey(weld[q], weld[r]));
+				// Replace the triangle with (p, m, r) and append (m, q, r), preserving the winding order
+				indices[(s * 3) + ((i + 1) % 3)] = m;
+				int added = numTriangles;
+				indices.push_back(m);
+				indices.push_back(q);
+				indices.push_back(r);
+				version.push_back(0);
+				numTriangles++;
+				edgeTriangles[edgeKey(weld[p], midWeld)].push_back(s);
+				edgeTriangles[edgeKey(midWeld, weld[r])].push_back(s);
+				link(added);
+				version[s]++;
+				push(s);
+				push(added);
+			}
+			edgeTriangles.erase(key);
+		}
+
+		meshStats.trianglesOut = numTriangles;
+		if (measure)
+		{
+			meshStats.sahAfter = sah.evaluate(vertices, indices);
+		}
+		stats.meshes += meshStats.meshes;
+		stats.trianglesIn += meshStats.trianglesIn;
+		stats.trianglesOut += meshStats.trianglesOut;
+		stats.sahBefore += meshStats.sahBefore;
+		stats.sahAfter += meshStats.sahAfter;
+		return meshStats;
+	}
+
+	// Counts the places where a vertex lies inside an edge of a triangle that does not use it, which is where
+	// a split left a T-junction
+	static int countTJunctions(const std::vector<STATIC_VERTEX>& vertices, const std::vector<unsigned int>& indices)
+	{
+		std::vector<unsigned int> weld = weldPositions(vertices);
+		std::map<unsigned int, Vec3> positions;
+		for (unsigned int i = 0; i < indices.size(); i++)
+		{
+			positions[weld[indices[i]]] = vertices[indices[i]].pos;
+		}
+		int count = 0;
+		for (unsigned int t = 0; t + 2 < indices.size(); t += 3)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				const Vec3& a = vertices[indices[t + i]].pos;
+				const Vec3& b = vertices[indices[t + ((i + 1) % 3)]].pos;
+				Vec3 edge = b - a;
+				float lengthSq = edge.lengthSq();
+				for (auto it = positions.begin(); it != positions.end(); ++it)
+				{
+					Vec3 d = it->second - a;
+					float t0 = Dot(d, edge) / lengthSq;
+					if (t0 > 1e-4f && t0 < 1.0f - 1e-4f && (d - (edge * t0)).lengthSq() < lengthSq * 1e-10f)
+					{
+						count++;
+					}
+				}
+			}
+		}
+		return count;
+	}
+
+	// Checks that splitting a mesh of long thin triangles with a UV seam down its middle leaves no T-junctions,
+	// keeps the surface area and shading and stays within the budget. Returns the number of
+	// failed checks
+	int verify()
+	{
+		int failures = 0;
+		// A strip of quads, each made of two slivers sharing a long diagonal. The vertices of the middle column
+		// are duplicated with different UVs, as a texture seam would be
+		// The strip runs diagonally so its slivers' boxes are mostly empty
+		const int columns = 8;
+		const float diagonal = sqrtf(0.5f);
+		auto makeStrip = [&](std::vector<STATIC_VERTEX>& vertices, std::vector<unsigned int>& indices)
+			{
+				for (int i = 0; i <= columns; i++)
+				{
+					for (int side = 0; side < 2; side++)
+					{
+						for (int row = 0; row < 2; row++)
+						{
+							STATIC_VERTEX v;
+							float along = (float)i * 4.0f;
+							float across = (float)row * 0.25f;
+							v.pos = Vec3((along - across) * diagonal, (along + across) * diagonal, 0);
+							v.normal = Vec3(0, 0, 1);
+							v.tangent = Vec3(1, 0, 0);
+							v.tu = ((float)i / (float)columns) + (float)side;
+							v.tv = across;
+							vertices.push_back(v);
+						}
+					}
+				}
+				for (int i = 0; i < columns; i++)
+				{
+					unsigned int side = i < columns / 2 ? 0 : 2;
+					unsigned int left = (i * 4) + side;
+					unsigned int right = ((i + 1) * 4) + side;
+					indices.insert(indices.end(), { left, right, right + 1, left, right + 1, left + 1 });
+				}
+			};
+		auto surfaceArea = [](const std::vector<STATIC_VERTEX>& vertices, const std::vector<unsigned int>& indices)
+			{
+				double area = 0;
+				for (unsigned int t = 0; t + 2 < indices.size(); t += 3)
+				{
+					area += Cross(vertices[indices[t + 1]].pos - vertices[indices[t]].pos, vertices[indices[t + 2]].pos - vertices[indices[t]].pos).length() * 0.5;
+				}
+				return area;
+			};
+		const int trianglesBefore = columns * 2;
+		const float budgets[2] = { 4.0f, 0.25f };
+		for (float testBudget : budgets)
+		{
+			std::vector<STATIC_VERTEX> vertices;
+			std::vector<unsigned int> indices;
+			makeStrip(vertices, indices);
+			double areaBefore = surfaceArea(vertices, indices);
+			TriangleSplitter splitter;
+			splitter.enabled = true;
+			splitter.budget = testBudget;
+			splitter.minBoxFraction = 0;
+			TriangleSplitStats result = splitter.split(vertices, indices);
+			int maxTriangles = trianglesBefore + (int)((float)trianglesBefore * testBudget);
+			failures += result.trianglesOut > trianglesBefore && result.trianglesOut <= maxTriangles && result.trianglesOut == (int)indices.size() / 3 ? 0 : 1;
+			failures += countTJunctions(vertices, indices) == 0 ? 0 : 1;
+			failures += fabs(surfaceArea(vertices, indices) - areaBefore) < areaBefore * 1e-4 ? 0 : 1;
+			// UVs stay linear along the strip on either side of the seam, so interpolation is unchanged
+			bool shading = true;
+			for (unsigned int i = 0; i < indices.size(); i++)
+			{
+				const STATIC_VERTEX& v = vertices[indices[i]];
+				float u = (v.pos.x + v.pos.y) * diagonal / (4.0f * (float)columns);
+				float across = (v.pos.y - v.pos.x) * diagonal;
+				shading = shading && (fabs(v.tu - u) < 1e-5f || fabs(v.tu - (u + 1.0f)) < 1e-5f) && fabs(v.tv - across) < 1e-5f;
+			}
+			failures += shading ? 0 : 1;
+		}
+
+		// A wall in an axis aligned plane already fits its boxes as well as triangles can, so it is left as it is
+		{
+			std::vector<STATIC_VERTEX> wall(4);
+			wall[0].pos = Vec3(0, 0, 0);
+			wall[1].pos = Vec3(4, 0, 0);
+			wall[2].pos = Vec3(4, 1, 0);
+			wall[3].pos = Vec3(0, 1, 0);
+			std::vector<unsigned int> wallIndices = { 0, 1, 2, 0, 2, 3 };
+			TriangleSplitter splitter;
+			splitter.enabled = true;
+			splitter.budget = 4.0f;
+			splitter.minBoxFraction = 0;
+			failures += splitter.split(wall, wallIndices).trianglesOut == 2 ? 0 : 1;
+		}
+
+		// Splitting only one side of each shared edge, as a splitter that ignores neighbours would, is detected
+		std::vector<STATIC_VERTEX> vertices;
+		std::vector<unsigned int> indices;
+		makeStrip(vertices, indices);
+		std::map<unsigned long long, unsigned int> edgeCache;
+		unsigned int a = indices[0];
+		unsigned int b = indices[1];
+		unsigned int c = indices[2];
+		unsigned int m = midpoint(vertices, edgeCache, c, a);
+		indices[2] = m;
+		indices.insert(indices.end(), { m, b, c });
+		failures += countTJunctions(vertices, indices) > 0 ? 0 : 1;
+		return failures;
+	}
+};
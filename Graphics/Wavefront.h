@@ -0,0 +1,442 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+// This file holds the queue logic of the wavefront path tracer. With wavefront path tracing on, PT.hlsl traces every
+// pixel's camera path a bounce at a time across separate passes: WavefrontGenerate writes the camera rays into an
+// extension ray queue, WavefrontTrace traces the queue into hit records and counts them into one bin per BSDF type and
+// one for rays leaving the scene, WavefrontSort scatters the records into bin order, from an exclusive prefix sum over
+// the bin counts, and WavefrontShade shades them in that order, so that the invocations of a wave run the same branch
+// of sampleBSDF and evaluateBSDF. Shading appends the paths that go on to the next extension queue and their light
+// samples to a shadow ray queue, which WavefrontShadow traces. WavefrontQueues is the CPU implementation of the queues:
+// exclusive prefix sums over the worker threads, stream compaction of the paths still alive into a queue, stable
+// binning of keys by a counting sort and the binning with atomic counters and cursors the GPU does, which keeps bins
+// contiguous but not their order. verify() checks each against a serial reference, and benchmark() measures their
+// throughput and how many BSDFs the waves of a frame's hits run before and after binning.
+
+#include "Parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+// BSDF types of sampleBSDF, and the bins hits are sorted into: one per type and the last for rays leaving the scene
+static const int WAVEFRONT_BSDFS = 8;
+static const int WAVEFRONT_MISS_BIN = WAVEFRONT_BSDFS;
+static const int WAVEFRONT_BINS = WAVEFRONT_BSDFS + 1;
+// Trace and shade passes a frame runs, one per bounce of the longest path: shadeHit ends paths at depth 6
+static const int WAVEFRONT_BOUNCES = 7;
+// Layout of the counters buffer, wavefrontCounters in PT.hlsl: the extension queue being traced, the lengths of the
+// two extension queues and of the shadow ray queue, and each bin's count and cursor
+static const int WAVEFRONT_COUNTER_QUEUE = 0;
+static const int WAVEFRONT_COUNTER_RAYS = 1;
+static const int WAVEFRONT_COUNTER_SHADOW_RAYS = 3;
+static const int WAVEFRONT_COUNTER_BIN_COUNTS = 4;
+static const int WAVEFRONT_COUNTER_BIN_CURSORS = WAVEFRONT_COUNTER_BIN_COUNTS + WAVEFRONT_BINS;
+static const int WAVEFRONT_COUNTERS = WAVEFRONT_COUNTER_BIN_CURSORS + WAVEFRONT_BINS;
+// Invocations of a wave, over which benchmark() counts the BSDFs run together
+static const int WAVEFRONT_WAVE_SIZE = 32;
+
+// Layouts of the entries of the queues in PT.hlsl, which the scene sizes their buffers by: a path's payload, a ray of
+// an extension queue with the path it continues, a hit record, and a light sample of the shadow ray queue with the
+// segment its shadow ray tests
+struct WavefrontPath
+{
+	unsigned int depth = 0;
+	unsigned int flags = 0;
+	unsigned int rndState = 0;
+	float colour[3] = {};
+	float throughput[3] = {};
+	float lastPosition[3] = {};
+	float lastNormal[3] = {};
+	float lastPdf = 0;
+};
+
+struct WavefrontRay
+{
+	float origin[3] = {};
+	unsigned int path = 0;
+	float direction[3] = {};
+	unsigned int pad = 0;
+};
+
+struct WavefrontHit
+{
+	unsigned int instance = 0;
+	unsigned int primitive = 0;
+	float barycentrics[2] = {};
+	float t = 0;                        // Negative for a ray leaving the scene
+};
+
+struct WavefrontShadowRay
+{
+	float from[3] = {};
+	unsigned int path = 0;
+	float to[3] = {};
+	unsigned int lightIndex = 0;
+	float radiance[3] = {};
+	float deposit = 0;
+	float normal[3] = {};
+	unsigned int pad = 0;
+};
+
+// Throughput of the queue operations measured by WavefrontQueues::benchmark, in millions of elements a second, and the
+// mean number of bins the waves of the hits run before and after binning
+struct WavefrontBenchmark
+{
+	int elements = 0;
+	double scanRate = 0;
+	double compactRate = 0;
+	double binRate = 0;
+	double atomicBinRate = 0;
+	double unsortedBinsPerWave = 0;
+	double sortedBinsPerWave = 0;
+	int threads = 0;
+};
+
+class WavefrontQueues
+{
+public:
+	// Writes the exclusive prefix sum of n values to out, which may be in, and returns their total. Each worker thread
+	// sums a chunk, the chunk totals are scanned, and each thread scans its chunk again from its total's offset
+	unsigned int exclusiveScan(const unsigned int* in, unsigned int* out, int n)
+	{
+		chunkTotals.assign(workerThreadCount() + 1, 0);
+		parallelForChunks(n, [&](int start, int end, int threadIndex)
+			{
+				unsigned int sum = 0;
+				for (int i = start; i < end; i++)
+				{
+					sum += in[i];
+				}
+				chunkTotals[threadIndex + 1] = sum;
+			}, SCAN_CHUNK);
+		for (size_t i = 1; i < chunkTotals.size(); i++)
+		{
+			chunkTotals[i] += chunkTotals[i - 1];
+		}
+		parallelForChunks(n, [&](int start, int end, int threadIndex)
+			{
+				unsigned int sum = chunkTotals[threadIndex];
+				for (int i = start; i < end; i++)
+				{
+					unsigned int v = in[i];
+					out[i] = sum;
+					sum += v;
+				}
+			}, SCAN_CHUNK);
+		return chunkTotals.back();
+	}
+
+	// Writes the indices of the n entries still alive to out in order, as the extension queue of the paths that go on,
+	// and returns how many there are
+	int compact(const unsigned int* alive, int n, unsigned int* out)
+	{
+		offsets.resize(n);
+		for (int i = 0; i < n; i++)
+		{
+			offsets[i] = alive[i] != 0 ? 1 : 0;
+		}
+		unsigned int count = exclusiveScan(offsets.data(), offsets.data(), n);
+		parallelFor(n, [&](int i)
+			{
+				if (alive[i] != 0)
+				{
+					out[offsets[i]] = (unsigned int)i;
+				}
+			}, SCAN_CHUNK);
+		return (int)count;
+	}
+
+	// Writes the indices of n entries to sorted in the order of their keys, each below WAVEFRONT_BINS, keeping the order
+	// of entries with the same key, and each bin's count and first position to counts and starts. Each worker thread
+	// counts a chunk, the counts are scanned bin by bin and chunk by chunk, and each thread scatters its chunk
+	void bin(const unsigned int* keys, int n, unsigned int* sorted, unsigned int* counts, unsigned int* starts)
+	{
+		int threads = workerThreadCount();
+		chunkCounts.assign(threads * WAVEFRONT_BINS, 0);
+		parallelForChunks(n, [&](int start, int end, int threadIndex)
+			{
+				unsigned int* local = &chunkCounts[threadIndex * WAVEFRONT_BINS];
+				for (int i = start; i < end; i++)
+				{
+					local[keys[i]]++;
+				}
+			}, SCAN_CHUNK);
+		unsigned int sum = 0;
+		for (int b = 0; b < WAVEFRONT_BINS; b++)
+		{
+			starts[b] = sum;
+			for (int t = 0; t < threads; t++)
+			{
+				unsigned int count = chunkCounts[(t * WAVEFRONT_BINS) + b];
+				chunkCounts[(t * WAVEFRONT_BINS) + b] = sum;
+				sum += count;
+			}
+			counts[b] = sum - starts[b];
+		}
+		parallelForChunks(n, [&](int start, int end, int threadIndex)
+			{
+				unsigned int* cursor = &chunkCounts[threadIndex * WAVEFRONT_BINS];
+				for (int i = start; i < end; i++)
+				{
+					sorted[cursor[keys[i]]++] = (unsigned int)i;
+				}
+			}, SCAN_CHUNK);
+	}
+
+	// Bins n entries as WavefrontTrace and WavefrontSort do: every entry adds to its bin's count with an atomic, the
+	// counts are scanned, and every entry takes the next position in its bin from an atomic cursor. The bins come out
+	// contiguous and in order but the entries within them in whatever order the cursors were taken
+	void binAtomic(const unsigned int* keys, int n, unsigned int* sorted, unsigned int* counts, unsigned int* starts)
+	{
+		std::atomic<unsigned int> binCounts[WAVEFRONT_BINS];
+		std::atomic<unsigned int> binCursors[WAVEFRONT_BINS];
+		for (int b = 0; b < WAVEFRONT_BINS; b++)
+		{
+			binCounts[b] = 0;
+			binCursors[b] = 0;
+		}
+		parallelFor(n, [&](int i)
+			{
+				binCounts[keys[i]].fetch_add(1, std::memory_order_relaxed);
+			}, SCAN_CHUNK);
+		for (int b = 0; b < WAVEFRONT_BINS; b++)
+		{
+			counts[b] = binCounts[b];
+		}
+		exclusiveScan(counts, starts, WAVEFRONT_BINS);
+		parallelFor(n, [&](int i)
+			{
+				unsigned int key = keys[i];
+				sorted[starts[key] + binCursors[key].fetch_add(1, std::memory_order_relaxed)] = (unsigned int)i;
+			}, SCAN_CHUNK);
+	}
+
+	// Mean number of different keys among the entries of each wave of WAVEFRONT_WAVE_SIZE, taking the entries in the
+	// given order, or in index order without one
+	static double binsPerWave(const unsigned int* keys, const unsigned int* order, int n)
+	{
+		if (n <= 0)
+		{
+			return 0;
+		}
+		double total = 0;
+		for (int wave = 0; wave < n; wave += WAVEFRONT_WAVE_SIZE)
+		{
+			unsigned int seen = 0;
+			for (int i = wave; i < std::min(wave + WAVEFRONT_WAVE_SIZE, n); i++)
+			{
+				seen |= 1u << keys[order != nullptr ? order[i] : i];
+			}
+			for (int b = 0; b < WAVEFRONT_BINS; b++)
+			{
+				total += (seen >> b) & 1;
+			}
+		}
+		return total / (double)((n + WAVEFRONT_WAVE_SIZE - 1) / WAVEFRONT_WAVE_SIZE);
+	}
+
+	// Checks the prefix sums, compaction and both binnings against serial references over sizes around the chunk
+	// boundaries, and that binning keys whose bins fill whole waves leaves one bin per wave. Returns the number of failed
+	// checks
+	int verify()
+	{
+		int failures = 0;
+		const int sizes[] = { 0, 1, 2, 31, 1000, SCAN_CHUNK - 1, SCAN_CHUNK + 1, (SCAN_CHUNK * 7) + 3, (1 << 20) + 17 };
+		unsigned int state = 0x6A09E667u;
+		for (int n : sizes)
+		{
+			std::vector<unsigned int> values(n);
+			std::vector<unsigned int> keys(n);
+			for (int i = 0; i < n; i++)
+			{
+				state = (state * 1664525u) + 1013904223u;
+				values[i] = (state >> 24) % 5;
+				keys[i] = (state >> 8) % WAVEFRONT_BINS;
+			}
+
+			// Prefix sums, out of place and in place
+			std::vector<unsigned int> scanned(n);
+			unsigned int total = exclusiveScan(values.data(), scanned.data(), n);
+			std::vector<unsigned int> inPlace = values;
+			unsigned int inPlaceTotal = exclusiveScan(inPlace.data(), inPlace.data(), n);
+			unsigned int sum = 0;
+			bool scanCorrect = true;
+			for (int i = 0; i < n; i++)
+			{
+				scanCorrect = scanCorrect && scanned[i] == sum && inPlace[i] == sum;
+				sum += values[i];
+			}
+			failures += scanCorrect && total == sum && inPlaceTotal == sum ? 0 : 1;
+
+			// Compaction keeps the entries with non-zero values in order
+			std::vector<unsigned int> queue(n);
+			int count = compact(values.data(), n, queue.data());
+			std::vector<unsigned int> expected;
+			for (int i = 0; i < n; i++)
+			{
+				if (values[i] != 0)
+				{
+					expected.push_back((unsigned int)i);
+				}
+			}
+			failures += count == (int)expected.size() && std::equal(expected.begin(), expected.end(), queue.begin()) ? 0 : 1;
+
+			// The stable binning is a stable sort by key
+			std::vector<unsigned int> sorted(n);
+			unsigned int counts[WAVEFRONT_BINS];
+			unsigned int starts[WAVEFRONT_BINS];
+			bin(keys.data(), n, sorted.data(), counts, starts);
+			std::vector<unsigned int> reference(n);
+			for (int i = 0; i < n; i++)
+			{
+				reference[i] = (unsigned int)i;
+			}
+			std::stable_sort(reference.begin(), reference.end(), [&](unsigned int a, unsigned int b) { return keys[a] < keys[b]; });
+			failures += reference == sorted && binsMatch(keys.data(), n, sorted.data(), counts, starts) ? 0 : 1;
+
+			// The atomic binning is a permutation with every entry in its key's bin
+			binAtomic(keys.data(), n, sorted.data(), counts, starts);
+			std::vector<unsigned char> seen(n, 0);
+			bool permutation = true;
+			for (int i = 0; i < n; i++)
+			{
+				permutation = permutation && sorted[i] < (unsigned int)n && seen[sorted[i]] == 0;
+				if (permutation)
+				{
+					seen[sorted[i]] = 1;
+				}
+			}
+			failures += permutation && binsMatch(keys.data(), n, sorted.data(), counts, starts) ? 0 : 1;
+		}
+
+		// Keys cycling through the bins put every bin in every wave, and once binned, with each bin filling whole waves,
+		// every wave runs one bin
+		std::vector<unsigned int> keys(WAVEFRONT_BINS * WAVEFRONT_WAVE_SIZE * 4);
+		for (int i = 0; i < (int)keys.size(); i++)
+		{
+			keys[i] = (unsigned int)(i % WAVEFRONT_BINS);
+		}
+		std::vector<unsigned int> sorted(keys.size());
+		unsigned int counts[WAVEFRONT_BINS];
+		unsigned int starts[WAVEFRONT_BINS];
+		binAtomic(keys.data(), (int)keys.size(), sorted.data(), counts, starts);
+		failures += binsPerWave(keys.data(), nullptr, (int)keys.size()) == (double)WAVEFRONT_BINS && binsPerWave(keys.data(), sorted.data(), (int)keys.size()) == 1.0 ? 0 : 1;
+		return failures;
+	}
+
+	// Measures each operation over a frame's worth of hits at the given resolution, keyed by BSDFs laid out in screen
+	// space regions as a scene's objects are, with some pixels' paths ended
+	WavefrontBenchmark benchmark(int benchmarkWidth = 1920, int benchmarkHeight = 1080, int repeats = 8)
+	{
+		WavefrontBenchmark result;
+		int n = benchmarkWidth * benchmarkHeight;
+		result.elements = n;
+		result.threads = workerThreadCount();
+		std::vector<unsigned int> keys(n);
+		std::vector<unsigned int> alive(n);
+		unsigned int state = 0xBB67AE85u;
+		for (int i = 0; i < n; i++)
+		{
+			// Regions of a few dozen pixels, with a third of the pixels within them taking a second BSDF, as textures
+			// and small objects break regions up
+			int region = (((i % benchmarkWidth) / 23) * 7) + (((i / benchmarkWidth) / 17) * 3);
+			state = (state * 1664525u) + 1013904223u;
+			keys[i] = (state >> 8) % 3 == 0 ? (state >> 12) % WAVEFRONT_BINS : region % WAVEFRONT_BINS;
+			alive[i] = (state >> 20) % 4 != 0 ? 1 : 0;
+		}
+		std::vector<unsigned int> out(n);
+		unsigned int counts[WAVEFRONT_BINS];
+		unsigned int starts[WAVEFRONT_BINS];
+		double* rates[4] = { &result.scanRate, &result.compactRate, &result.binRate, &result.atomicBinRate };
+		for (int operation = 0; operation < 4; operation++)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int r = 0; r <= repeats; r++)
+			{
+				// The first run warms up and is not timed
+				if (r == 1)
+				{
+					start = std::chrono::high_resolution_clock::now();
+				}
+				if (operation == 0)
+				{
+					exclusiveScan(alive.data(), out.data(), n);
+				} else if (operation == 1)
+				{
+					compact(alive.data(), n, out.data());
+				} else if (operation == 2)
+				{
+					bin(keys.data(), n, out.data(), counts, starts);
+				} else
+				{
+					binAtomic(keys.data(), n, out.data(), counts, starts);
+				}
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			*rates[operation] = ((double)n * repeats) / (seconds * 1e6);
+		}
+		result.unsortedBinsPerWave = binsPerWave(keys.data(), nullptr, n);
+		result.sortedBinsPerWave = binsPerWave(keys.data(), out.data(), n);
+		return result;
+	}
+
+private:
+	// Entries a worker thread takes at least, below which the operations run on fewer threads
+	static const int SCAN_CHUNK = 1 << 14;
+
+	std::vector<unsigned int> chunkTotals;
+	std::vector<unsigned int> chunkCounts;
+	std::vector<unsigned int> offsets;
+
+	// Whether the bins' counts and starts describe the keys, and every sorted entry lies in its key's bin
+	static bool binsMatch(const unsigned int* keys, int n, const unsigned int* sorted, const unsigned int* counts, const unsigned int* starts)
+	{
+		unsigned int expected[WAVEFRONT_BINS] = {};
+		for (int i = 0; i < n; i++)
+		{
+			expected[keys[i]]++;
+		}
+		unsigned int start = 0;
+		for (int b = 0; b < WAVEFRONT_BINS; b++)
+		{
+			if (counts[b] != expected[b] || starts[b] != start)
+			{
+				return false;
+			}
+			for (unsigned int i = start; i < start + counts[b]; i++)
+			{
+				if (keys[sorted[i]] != (unsigned int)b)
+				{
+					return false;
+				}
+			}
+			start += counts[b];
+		}
+		return true;
+	}
+};
@@ -0,0 +1,1114 @@
+/*
+MIT License
+
+Copyright (c) 2024 MSc Games Engineering Team
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// CPU only tools that build without Windows or Direct3D, see the README.
+// - headless [scene] [seconds] [divisor] renders a scene with the path tracer and with bidirectional path tracing, and
+//   reports how long each takes to reach a given error against a converged reference.
+// - headless samplers [passes] [divisor] [scenes...] measures how fast the path tracer converges with each sampler of
+//   Sampler.h, over the scenes given or every bundled scene present.
+// - headless bluenoise makes the blue noise mask the path tracer dithers its samples with and saves it for the GPU.
+// - headless adaptive [scene] [seconds] [divisor] renders a scene with the path tracer sampling every pixel each frame
+//   and sampling adaptively, and reports how long each takes to reach a given error against a converged reference.
+// - headless denoise [scene] [passes] [divisor] [reference passes] denoises a scene path traced to increasing sample
+//   counts, reports the error before and after against a converged reference, and measures the denoiser's throughput.
+// - headless temporal runs the checks of temporal reprojection and of the accumulation it carries samples over into.
+// - headless pathloop runs the checks that the camera path loop shades as the recursive trace it replaced did.
+// - headless wavefront runs the checks of the wavefront queue operations and measures their throughput.
+// - headless tiles runs the checks of the tiled dispatch's scheduling and shows its controller on synthetic frame times.
+// - headless resolution runs the checks of dynamic resolution's controller, jitter and upsampler and shows the
+//   controller on synthetic frame times.
+// - headless presplit [scenes...] runs the checks of the triangle splitter and reports the triangle counts and SAH cost
+//   of each scene's meshes before and after splitting, over the scenes given or every bundled scene present.
+// - headless alias runs the checks of the alias table that selects lights by power.
+// - headless environment [scenes...] runs the checks of environment map importance sampling over synthetic maps and
+//   the environment maps of the scenes given or every bundled scene present.
+// - headless mis runs the checks of the multiple importance sampling of light and BSDF samples against a reference.
+// - headless restir runs the checks of ReSTIR direct illumination's reservoir reuse against a reference.
+// - headless restirgi runs the checks of ReSTIR GI's reservoir reuse and reconnection Jacobian against a reference.
+// - headless hashgrid runs the checks of the radiance cache's hash grid and measures its throughput.
+// - headless probes runs the checks of the irradiance probe grid's placement and octahedral mapping.
+// - headless lightcache runs the checks of the light selection cache and of the selection it learns.
+// - headless guiding runs the checks of path guiding's trees and learning and measures the speed of its training.
+// - headless photons runs the checks of the caustic photon map and measures the speed of its build and queries.
+// - headless lightsampling [scenes...] compares the variance of area and solid angle sampling of triangle lights over
+//   synthetic light setups and the lights of the scenes given or every bundled scene present.
+// - headless lightbvh [scenes...] runs the checks of the light BVH over synthetic sets of lights and the lights of the
+//   scenes given or every bundled scene present.
+// - headless reorder [scenes...] reports the simulated cache miss rates of each scene's hits before and after its
+//   triangles and instances are sorted spatially, over the scenes given or every bundled scene present.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "Graphics/BDPT.h"
+#include "Graphics/AdaptiveSampling.h"
+#include "Graphics/Accumulation.h"
+#include "Graphics/Denoiser.h"
+#include "Graphics/TemporalReprojection.h"
+#include "Graphics/PathLoop.h"
+#include "Graphics/Wavefront.h"
+#include "Graphics/TiledDispatch.h"
+#include "Graphics/DynamicResolution.h"
+#include "Graphics/TriangleSplitter.h"
+#include "Graphics/SceneReorder.h"
+#include "Graphics/LightSampling.h"
+#include "Graphics/LightBVH.h"
+#include "Graphics/EnvironmentSampling.h"
+#include "Graphics/MISReference.h"
+#include "Graphics/ReSTIRReference.h"
+#include "Graphics/ReSTIRGIReference.h"
+#include "Graphics/HashGrid.h"
+#include "Graphics/ProbeVolume.h"
+#include "Graphics/LightCache.h"
+#include "Graphics/PathGuiding.h"
+#include "Graphics/PhotonMap.h"
+#include <cstdio>
+#include <cstdlib>
+
+// The scenes Main.cpp lists
+static const char* bundledScenes[] = { "cornell-box", "bathroom", "bathroom2", "bedroom", "car2", "classroom", "coffee",
+    "dining-room", "glass-of-water", "house", "kitchen", "living-room", "living-room-2", "living-room-3", "MaterialsScene",
+    "Sibenik", "staircase", "staircase2", "teapot-full", "Terrain", "veach-bidir", "veach-mis" };
+
+// Loads a scene at a fraction of its resolution, returning false if it is not there
+static bool loadScene(BDPTScene& scene, std::string sceneName, int divisor)
+{
+    std::ifstream file(sceneName + "/scene.json");
+    if (file.is_open() == false || scene.load(sceneName) == false)
+    {
+        return false;
+    }
+    scene.width = std::max(scene.width / divisor, 1);
+    scene.height = std::max(scene.height / divisor, 1);
+    printf("%s: %d triangles, %d lights, %dx%d, %d threads\n", sceneName.c_str(), (int)scene.triangles.size(), (int)scene.lights.size(), scene.width, scene.height, workerThreadCount());
+    return true;
+}
+
+static int compareIntegrators(std::string sceneName, double seconds, int divisor)
+{
+    BDPT bdpt;
+    int failures = bdpt.verify();
+    printf("Integrator checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+
+    BDPTScene scene;
+    if (loadScene(scene, sceneName, divisor) == false)
+    {
+        printf("Could not load %s\n", sceneName.c_str());
+        return 1;
+    }
+
+    // The reference gets four times the time of each integrator
+    bdpt.init(&scene);
+    BDPTComparison comparison = bdpt.compare(seconds, seconds * 4.0);
+    printf("Reference: %d BDPT passes in %.1fs\n", comparison.referencePasses, comparison.referenceSeconds);
+    printf("%-10s %-14s %-14s %s\n", "Error", "Path tracer", "BDPT", "Speedup");
+    const double errors[] = { 0.5, 0.3, 0.2, 0.15, 0.1, 0.07, 0.05 };
+    for (double error : errors)
+    {
+        double pt = BDPTComparison::timeToError(comparison.pathTracer, error);
+        double bd = BDPTComparison::timeToError(comparison.bidirectional, error);
+        char ptText[32] = "-";
+        char bdText[32] = "-";
+        char speedup[32] = "-";
+        if (pt >= 0)
+        {
+            snprintf(ptText, sizeof(ptText), "%.2fs", pt);
+        }
+        if (bd >= 0)
+        {
+            snprintf(bdText, sizeof(bdText), "%.2fs", bd);
+        }
+        if (pt >= 0 && bd >= 0)
+        {
+            snprintf(speedup, sizeof(speedup), "%.2fx", pt / bd);
+        }
+        printf("%-10.2f %-14s %-14s %s\n", error, ptText, bdText, speedup);
+    }
+    const BDPTErrorPoint& ptLast = comparison.pathTracer.back();
+    const BDPTErrorPoint& bdLast = comparison.bidirectional.back();
+    printf("After %.0fs: path tracer %d passes, error %.4f; BDPT %d passes, error %.4f\n", seconds, ptLast.passes, ptLast.error, bdLast.passes, bdLast.error);
+
+    // Save the final images of both integrators, rendered again for the same time
+    std::vector<float> rgb;
+    for (int bidirectional = 0; bidirectional < 2; bidirectional++)
+    {
+        bdpt.reset();
+        int passes = bidirectional == 0 ? ptLast.passes : bdLast.passes;
+        for (int i = 0; i < passes; i++)
+        {
+            bdpt.renderPass(bidirectional == 1);
+        }
+        bdpt.image(rgb);
+        writePFM(bidirectional == 0 ? "headless_pt.pfm" : "headless_bdpt.pfm", rgb, scene.width, scene.height);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+static int compareSamplers(int passes, int divisor, std::vector<std::string> sceneNames)
+{
+    Sampler sampler;
+    int failures = sampler.verify();
+    printf("Sampler checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+    SamplerBenchmark benchmark = sampler.benchmark();
+    printf("%-12s %-14s %-16s %s\n", "Sampler", "Msamples/s", "Error (4D, 1024)", "Slope");
+    for (int type = 0; type < SAMPLER_TYPES; type++)
+    {
+        printf("%-12s %-14.1f %-16.5f %.2f\n", samplerName(type), benchmark.samplesPerSecond[type] / 1e6, benchmark.error[type], benchmark.slope[type]);
+    }
+
+    if (sceneNames.size() == 0)
+    {
+        for (const char* name : bundledScenes)
+        {
+            sceneNames.push_back(name);
+        }
+    }
+    for (unsigned int i = 0; i < sceneNames.size(); i++)
+    {
+        BDPTScene scene;
+        if (loadScene(scene, sceneNames[i], divisor) == false)
+        {
+            continue;
+        }
+        BDPT bdpt;
+        bdpt.init(&scene);
+        bdpt.sampling.mask = sampler.mask;
+        BDPTSamplerConvergence convergence = bdpt.samplerConvergence(passes, passes * 16);
+        printf("%-8s", "Passes");
+        for (int type = 0; type < SAMPLER_TYPES; type++)
+        {
+            printf(" %-12s", samplerName(type));
+        }
+        printf("\n");
+        for (unsigned int k = 0; k < convergence.passes.size(); k++)
+        {
+            printf("%-8d", (int)convergence.passes[k]);
+            for (int type = 0; type < SAMPLER_TYPES; type++)
+            {
+                printf(" %-12.5f", convergence.errors[type][k]);
+            }
+            printf("\n");
+        }
+        printf("%-8s", "Slope");
+        for (int type = 0; type < SAMPLER_TYPES; type++)
+        {
+            printf(" %-12.2f", convergence.slope[type]);
+        }
+        printf("\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+static int compareAdaptive(std::string sceneName, double seconds, int divisor)
+{
+    AdaptiveSampler adaptive;
+    int failures = adaptive.verify();
+    printf("Adaptive sampling checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+    int accumulationFailures = verifyAccumulation();
+    printf("Accumulation checks: %s (%d failed)\n", accumulationFailures == 0 ? "passed" : "FAILED", accumulationFailures);
+    failures += accumulationFailures;
+
+    BDPTScene scene;
+    if (loadScene(scene, sceneName, divisor) == false)
+    {
+        printf("Could not load %s\n", sceneName.c_str());
+        return 1;
+    }
+
+    // The reference is path traced for four times the time of each way of sampling
+    BDPT bdpt;
+    bdpt.init(&scene);
+    auto start = std::chrono::high_resolution_clock::now();
+    while (std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() < seconds * 4.0 || bdpt.passes == 0)
+    {
+        bdpt.renderPass(false);
+    }
+    std::vector<float> reference;
+    bdpt.image(reference);
+    printf("Reference: %d passes in %.1fs\n", bdpt.passes, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+
+    // Both take the path tracer's samples the way the GPU does, numbered by the pixel's own sample count
+    adaptive.init(scene.width, scene.height);
+    AdaptiveComparison comparison = adaptive.compare([&](int x, int y, unsigned int index)
+        {
+            unsigned int pixel = (unsigned int)((y * scene.width) + x);
+            PixelSampler sampler = bdpt.sampling.pixel(x, y, index, hashPCG(samplerHashCombine(pixel, index ^ 0x2545F491u)));
+            return bdpt.pathTraceSample(x, y, sampler);
+        }, reference, seconds);
+    printf("%-10s %-14s %-14s %s\n", "Error", "Uniform", "Adaptive", "Speedup");
+    const double errors[] = { 0.5, 0.3, 0.2, 0.15, 0.1, 0.07, 0.05 };
+    for (double error : errors)
+    {
+        double uniform = AdaptiveComparison::timeToError(comparison.uniform, error);
+        double adaptiveTime = AdaptiveComparison::timeToError(comparison.adaptive, error);
+        char uniformText[32] = "-";
+        char adaptiveText[32] = "-";
+        char speedup[32] = "-";
+        if (uniform >= 0)
+        {
+            snprintf(uniformText, sizeof(uniformText), "%.2fs", uniform);
+        }
+        if (adaptiveTime >= 0)
+        {
+            snprintf(adaptiveText, sizeof(adaptiveText), "%.2fs", adaptiveTime);
+        }
+        if (uniform >= 0 && adaptiveTime >= 0)
+        {
+            snprintf(speedup, sizeof(speedup), "%.2fx", uniform / adaptiveTime);
+        }
+        printf("%-10.2f %-14s %-14s %s\n", error, uniformText, adaptiveText, speedup);
+    }
+    const AdaptiveErrorPoint& uniformLast = comparison.uniform.back();
+    const AdaptiveErrorPoint& adaptiveLast = comparison.adaptive.back();
+    printf("Uniform: %.1f samples per pixel in %.1fs, error %.4f\n", uniformLast.samples, uniformLast.seconds, uniformLast.error);
+    printf("Adaptive: %.1f samples per pixel in %.1fs, error %.4f%s\n", adaptiveLast.samples, adaptiveLast.seconds, adaptiveLast.error, adaptiveLast.seconds < seconds ? ", converged" : "");
+    return failures == 0 ? 0 : 1;
+}
+
+// Root mean square error of an image against a reference, over the reference's mean, as BDPT::error measures it.
+// Given the emission AOV, only over the pixels that see no light directly
+static double imageError(const std::vector<float>& image, const std::vector<float>& reference, const std::vector<float>* emission = NULL)
+{
+    double squared = 0;
+    double mean = 0;
+    int count = 0;
+    for (unsigned int i = 0; i < reference.size(); i++)
+    {
+        if (emission != NULL && (*emission)[i - (i % 3)] + (*emission)[i - (i % 3) + 1] + (*emission)[i - (i % 3) + 2] > 0)
+        {
+            continue;
+        }
+        double e = (double)image[i] - (double)reference[i];
+        squared += e * e;
+        mean += reference[i];
+        count++;
+    }
+    mean /= (double)std::max(count, 1);
+    return mean > 0 ? sqrt(squared / (double)count) / mean : 0;
+}
+
+static int compareDenoiser(std::string sceneName, int passes, int divisor, int referencePasses)
+{
+    Denoiser denoiser;
+    int failures = denoiser.verify();
+    printf("Denoiser checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+    DenoiserBenchmark benchmark = denoiser.benchmark();
+    printf("Denoiser at %dx%d on %d threads: scalar %.2f MP/s, SSE2 %.2f MP/s (%.2fx)\n", benchmark.width, benchmark.height, benchmark.threads,
+        benchmark.scalarMegapixelsPerSecond, benchmark.simdMegapixelsPerSecond, benchmark.simdMegapixelsPerSecond / benchmark.scalarMegapixelsPerSecond);
+
+    BDPTScene scene;
+    if (loadScene(scene, sceneName, divisor) == false)
+    {
+        printf("Could not load %s\n", sceneName.c_str());
+        return 1;
+    }
+    BDPT bdpt;
+    bdpt.init(&scene);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < referencePasses; i++)
+    {
+        bdpt.renderPass(false);
+    }
+    std::vector<float> reference;
+    bdpt.image(reference);
+    printf("Reference: %d passes in %.1fs\n", bdpt.passes, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+
+    // Denoise the path tracer's image each time its sample count doubles, with the AOVs of the same camera rays. The
+    // light seen directly is left as it is, so the error is also given without the pixels that see it
+    bdpt.reset();
+    std::vector<float> noisy;
+    std::vector<float> denoised;
+    std::vector<float> albedo;
+    std::vector<float> normal;
+    std::vector<float> depth;
+    std::vector<float> emission;
+    printf("%-8s %-14s %-14s %-14s %-14s %s\n", "Passes", "Noisy error", "Denoised error", "Without lights", "Denoised", "Denoise time");
+    for (int target = 1; target <= passes; target *= 2)
+    {
+        while (bdpt.passes < target)
+        {
+            bdpt.renderPass(false);
+        }
+        bdpt.image(noisy);
+        bdpt.firstHitAOVs(target, albedo, normal, depth, emission);
+        auto denoiseStart = std::chrono::high_resolution_clock::now();
+        denoiser.denoise(noisy.data(), albedo.data(), normal.data(), depth.data(), emission.data(), scene.width, scene.height, denoised);
+        double milliseconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - denoiseStart).count() * 1000.0;
+        printf("%-8d %-14.4f %-14.4f %-14.4f %-14.4f %.1fms\n", target, imageError(noisy, reference), imageError(denoised, reference),
+            imageError(noisy, reference, &emission), imageError(denoised, reference, &emission), milliseconds);
+    }
+    writePFM("headless_noisy.pfm", noisy, scene.width, scene.height);
+    writePFM("headless_denoised.pfm", denoised, scene.width, scene.height);
+    return failures == 0 ? 0 : 1;
+}
+
+static int reportPresplit(std::vector<std::string> sceneNames)
+{
+    TriangleSplitter splitter;
+    int failures = splitter.verify();
+    printf("Triangle splitter checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+    if (sceneNames.size() == 0)
+    {
+        for (const char* name : bundledScenes)
+        {
+            sceneNames.push_back(name);
+        }
+    }
+    for (unsigned int i = 0; i < sceneNames.size(); i++)
+    {
+        std::ifstream file(sceneNames[i] + "/scene.json");
+        if (file.is_open() == false)
+        {
+            continue;
+        }
+        // Split every model once, with the budget the scene asks for, as StaticModel::load does
+        GEMLoader::GEMScene gemscene;
+        gemscene.load(sceneNames[i] + "/scene.json");
+        TriangleSplitter sceneSplitter;
+        sceneSplitter.enabled = true;
+        sceneSplitter.budget = gemscene.findProperty("presplitBudget").getValue(0.5f);
+        sceneSplitter.measure = true;
+        std::map<std::string, int> loaded;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (unsigned int n = 0; n < gemscene.instances.size(); n++)
+        {
+            std::string modelFilename = sceneNames[i] + "/" + gemscene.instances[n].meshFilename;
+            if (loaded.find(modelFilename) != loaded.end())
+            {
+                continue;
+            }
+            loaded[modelFilename] = 1;
+            GEMLoader::GEMModelLoader loader;
+            std::vector<GEMLoader::GEMMesh> gemmeshes;
+            loader.load(modelFilename, gemmeshes);
+            for (unsigned int m = 0; m < gemmeshes.size(); m++)
+            {
+                std::vector<STATIC_VERTEX> vertices(gemmeshes[m].verticesStatic.size());
+                for (unsigned int k = 0; k < vertices.size(); k++)
+                {
+                    memcpy((void*)&vertices[k], &gemmeshes[m].verticesStatic[k], sizeof(STATIC_VERTEX));
+                }
+                sceneSplitter.split(vertices, gemmeshes[m].indices);
+            }
+        }
+        const TriangleSplitStats& stats = sceneSplitter.stats;
+        float meshes = (float)std::max(stats.meshes, 1);
+        printf("%s: %d meshes, %d triangles split to %d with a budget of %.2f in %.2f s, mean SAH cost %.3f before, %.3f after\n", sceneNames[i].c_str(), stats.meshes,
+            stats.trianglesIn, stats.trianglesOut, sceneSplitter.budget,
+            std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count(), stats.sahBefore / meshes, stats.sahAfter / meshes);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+// The members of Scene that SceneReorder reads, filled from a scene's models as loadScene fills Scene
+struct ReorderMesh
+{
+    AABB bounds;
+    int numIndices = 0;
+};
+
+struct ReorderScene
+{
+    std::vector<STATIC_VERTEX> allVertices;
+    std::vector<unsigned int> allIndices;
+    std::vector<std::string> filenames;
+    std::vector<InstanceData> instanceData;
+    std::vector<std::string> instanceMeshNames;
+    std::map<std::string, int> indexOffset;
+    std::map<std::string, int> indexSize;
+    std::map<std::string, int> vertexOffset;
+    std::map<std::string, int> vertexSize;
+    std::vector<ReorderMesh*> meshes;
+    std::vector<TLASTransform> transforms;
+    std::map<std::string, ReorderMesh> meshData;
+
+    // Sums the world space positions of every instance's triangles, which reordering must not change
+    double checksum()
+    {
+        double sum = 0;
+        for (unsigned int i = 0; i < meshes.size(); i++)
+        {
+            const TLASTransform& w = transforms[i];
+            for (int n = 0; n < meshes[i]->numIndices; n++)
+            {
+                const Vec3& p = allVertices[allIndices[instanceData[i].startIndex + n]].pos;
+                for (int k = 0; k < 3; k++)
+                {
+                    sum += (double)((w.w[k][0] * p.x) + (w.w[k][1] * p.y) + (w.w[k][2] * p.z) + w.w[k][3]) * (double)(k + 1) * (double)((n % 3) + 1);
+                }
+            }
+        }
+        return sum;
+    }
+};
+
+static int reportReorder(std::vector<std::string> sceneNames)
+{
+    int failures = 0;
+    if (sceneNames.size() == 0)
+    {
+        for (const char* name : bundledScenes)
+        {
+            sceneNames.push_back(name);
+        }
+    }
+    for (unsigned int i = 0; i < sceneNames.size(); i++)
+    {
+        std::ifstream file(sceneNames[i] + "/scene.json");
+        if (file.is_open() == false)
+        {
+            continue;
+        }
+        GEMLoader::GEMScene gemscene;
+        gemscene.load(sceneNames[i] + "/scene.json");
+        SceneReorder reorder;
+        reorder.measure = true;
+        ReorderScene scene;
+        std::map<std::string, int> modelMeshes;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (unsigned int n = 0; n < gemscene.instances.size(); n++)
+        {
+            std::string modelFilename = sceneNames[i] + "/" + gemscene.instances[n].meshFilename;
+            // Sort each model's triangles once and append its mesh data, as StaticModel::load and Scene::addMeshData do
+            if (modelMeshes.find(modelFilename) == modelMeshes.end())
+            {
+                GEMLoader::GEMModelLoader loader;
+                std::vector<GEMLoader::GEMMesh> gemmeshes;
+                loader.load(modelFilename, gemmeshes);
+                modelMeshes[modelFilename] = (int)gemmeshes.size();
+                for (unsigned int m = 0; m < gemmeshes.size(); m++)
+                {
+                    std::string meshName = modelFilename + std::to_string(m);
+                    std::vector<STATIC_VERTEX> vertices(gemmeshes[m].verticesStatic.size());
+                    ReorderMesh& mesh = scene.meshData[meshName];
+                    for (unsigned int k = 0; k < vertices.size(); k++)
+                    {
+                        memcpy((void*)&vertices[k], &gemmeshes[m].verticesStatic[k], sizeof(STATIC_VERTEX));
+                        mesh.bounds.extend(vertices[k].pos);
+                    }
+                    reorder.reorderTriangles(vertices, gemmeshes[m].indices);
+                    mesh.numIndices = (int)gemmeshes[m].indices.size();
+                    scene.indexOffset[meshName] = (int)scene.allIndices.size();
+                    scene.indexSize[meshName] = mesh.numIndices;
+                    scene.vertexOffset[meshName] = (int)scene.allVertices.size();
+                    scene.vertexSize[meshName] = (int)vertices.size();
+                    for (unsigned int k = 0; k < gemmeshes[m].indices.size(); k++)
+                    {
+                        scene.allIndices.push_back(gemmeshes[m].indices[k] + (unsigned int)scene.allVertices.size());
+                    }
+                    scene.allVertices.insert(scene.allVertices.end(), vertices.begin(), vertices.end());
+                    scene.filenames.push_back(meshName);
+                }
+            }
+            Matrix w;
+            memcpy(w.m, gemscene.instances[n].w.m, 16 * sizeof(float));
+            for (int m = 0; m < modelMeshes[modelFilename]; m++)
+            {
+                std::string meshName = modelFilename + std::to_string(m);
+                InstanceData data;
+                data.startIndex = scene.indexOffset[meshName];
+                scene.instanceData.push_back(data);
+                scene.instanceMeshNames.push_back(meshName);
+                scene.meshes.push_back(&scene.meshData[meshName]);
+                scene.transforms.push_back(TLASTransform(w));
+            }
+        }
+        double before = scene.checksum();
+        reorder.reorderInstances(&scene);
+        double after = scene.checksum();
+        bool consistent = fabs(after - before) <= fabs(before) * 1e-9;
+        failures += consistent ? 0 : 1;
+        const SceneReorderStats& stats = reorder.stats;
+        printf("%s: %d meshes, %d instances in %.2f s, %s\n", sceneNames[i].c_str(), stats.meshes, (int)scene.meshes.size(),
+            std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count(), consistent ? "geometry unchanged" : "geometry CHANGED");
+        printf("Cache miss rate per mesh %.2f%% before, %.2f%% after; whole scene %.2f%% before, %.2f%% after\n", stats.meshMissRateBefore * 100.0f,
+            stats.meshMissRateAfter * 100.0f, stats.sceneMissRateBefore * 100.0f, stats.sceneMissRateAfter * 100.0f);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+// Builds alias tables over uniform, skewed, sparse and large sets of weights, checks that each encodes its weights and
+// that sampling it picks each entry as often as its probability says. Returns the number of failed checks
+static int verifyAliasTables()
+{
+    int failures = 0;
+    unsigned int state = 0x9E3779B9u;
+    auto random = [&]()
+        {
+            state = (state * 1664525u) + 1013904223u;
+            return (float)(state >> 8) / 16777216.0f;
+        };
+    std::vector<std::vector<float>> cases(6);
+    cases[0] = std::vector<float>(7, 1.0f);
+    cases[1] = std::vector<float>(5, 0.0f);
+    cases[2] = { 1000.0f, 1.0f, 0.001f, 0.0f, 2.5f };
+    cases[3] = std::vector<float>(64, 0.0f);
+    cases[3][17] = 3.0f;
+    cases[4].resize(1000);
+    for (unsigned int i = 0; i < cases[4].size(); i++)
+    {
+        cases[4][i] = powf(random(), 8.0f) * 100.0f;
+    }
+    cases[5].resize(1 << 20);
+    for (unsigned int i = 0; i < cases[5].size(); i++)
+    {
+        cases[5][i] = random() < 0.5f ? 0.0f : random();
+    }
+    for (unsigned int c = 0; c < cases.size(); c++)
+    {
+        AliasTable table;
+        table.build(cases[c]);
+        float maxError = table.verify();
+        bool encoded = maxError < 1e-6f;
+        // Sampling the small tables follows their probabilities to within a few standard deviations
+        bool sampled = true;
+        int n = (int)cases[c].size();
+        if (n <= 1000)
+        {
+            const int samples = 1 << 20;
+            std::vector<int> counts(n, 0);
+            bool pmfsMatch = true;
+            for (int i = 0; i < samples; i++)
+            {
+                float pmf = 0;
+                int index = table.sample(random(), random(), pmf);
+                counts[index]++;
+                pmfsMatch = pmfsMatch && pmf == table.pmfs[index];
+            }
+            for (int i = 0; i < n; i++)
+            {
+                double expected = (double)table.pmfs[i] * (double)samples;
+                sampled = sampled && fabs((double)counts[i] - expected) <= (5.0 * sqrt(expected)) + 1.0;
+            }
+            sampled = sampled && pmfsMatch;
+        }
+        printf("Alias table over %d weights: largest probability error %.2e, %s\n", n, maxError, encoded && sampled ? "passed" : "FAILED");
+        failures += (encoded ? 0 : 1) + (sampled ? 0 : 1);
+    }
+    return failures;
+}
+
+// Checks the light BVH's sampling against its pmf over a set of lights, as Scene::build builds it. Returns true if it
+// passes
+static bool verifyLightBVH(std::string name, const std::vector<LightBVHPrimitive>& lights)
+{
+    LightBVH bvh;
+    bvh.build(lights);
+    float maxError = bvh.verify();
+    bool passed = maxError < 1e-4f;
+    printf("Light BVH over %s, %d lights, %d nodes: largest probability error %.2e, %s\n", name.c_str(), (int)lights.size(), (int)bvh.nodes.size(), maxError,
+        passed ? "passed" : "FAILED");
+    return passed;
+}
+
+static int verifyLightBVHs(std::vector<std::string> sceneNames)
+{
+    int failures = 0;
+    unsigned int state = 0x3C6EF372u;
+    auto random = [&]()
+        {
+            state = (state * 1664525u) + 1013904223u;
+            return (float)(state >> 8) / 16777216.0f;
+        };
+    auto randomLight = [&](Vec3 centre, float spread, float size, float power)
+        {
+            LightBVHPrimitive light;
+            Vec3 p = centre + (Vec3(random() - 0.5f, random() - 0.5f, random() - 0.5f) * spread);
+            light.bounds.extend(p);
+            light.bounds.extend(p + (Vec3(random(), random(), random()) * size));
+            float z = (random() * 2.0f) - 1.0f;
+            float r = sqrtf(std::max(1.0f - (z * z), 0.0f));
+            float phi = random() * 2.0f * LIGHT_BVH_PI;
+            light.normal = Vec3(r * cosf(phi), r * sinf(phi), z);
+            light.power = power;
+            return light;
+        };
+    // One light, a ceiling of downward facing panels, clusters of very different power and a large random set
+    std::vector<LightBVHPrimitive> single(1, randomLight(Vec3(0, 0, 0), 1.0f, 0.1f, 1.0f));
+    failures += verifyLightBVH("one light", single) ? 0 : 1;
+    std::vector<LightBVHPrimitive> ceiling;
+    for (int i = 0; i < 256; i++)
+    {
+        LightBVHPrimitive light;
+        light.bounds.extend(Vec3((float)(i % 16), 4.0f, (float)(i / 16)));
+        light.bounds.extend(Vec3((float)(i % 16) + 0.5f, 4.0f, (float)(i / 16) + 0.5f));
+        light.normal = Vec3(0, -1.0f, 0);
+        light.power = 1.0f;
+        ceiling.push_back(light);
+    }
+    failures += verifyLightBVH("a ceiling of panels", ceiling) ? 0 : 1;
+    std::vector<LightBVHPrimitive> clusters;
+    for (int i = 0; i < 3000; i++)
+    {
+        int cluster = i % 3;
+        clusters.push_back(randomLight(Vec3((float)cluster * 20.0f, 0, 0), 2.0f, 0.2f, powf(100.0f, (float)cluster) * random()));
+    }
+    failures += verifyLightBVH("three clusters", clusters) ? 0 : 1;
+    std::vector<LightBVHPrimitive> scattered;
+    for (int i = 0; i < 100000; i++)
+    {
+        scattered.push_back(randomLight(Vec3(0, 0, 0), 100.0f, 1.0f, random() + 0.01f));
+    }
+    failures += verifyLightBVH("scattered lights", scattered) ? 0 : 1;
+
+    // The emitters of the bundled scenes, with the power Scene::build gives them
+    if (sceneNames.size() == 0)
+    {
+        for (const char* name : bundledScenes)
+        {
+            sceneNames.push_back(name);
+        }
+    }
+    for (unsigned int i = 0; i < sceneNames.size(); i++)
+    {
+        std::ifstream file(sceneNames[i] + "/scene.json");
+        BDPTScene scene;
+        if (file.is_open() == false || scene.load(sceneNames[i]) == false || scene.lights.size() == 0)
+        {
+            continue;
+        }
+        std::vector<LightBVHPrimitive> lights(scene.lights.size());
+        for (unsigned int l = 0; l < lights.size(); l++)
+        {
+            const BDPTTriangle& triangle = scene.triangles[scene.lights[l]];
+            for (int k = 0; k < 3; k++)
+            {
+                lights[l].bounds.extend(triangle.v[k]);
+            }
+            lights[l].normal = triangle.normal;
+            lights[l].power = luminance(&scene.materials[triangle.material].emission.x) * triangle.area * 3.1415926535f;
+        }
+        failures += verifyLightBVH(sceneNames[i], lights) ? 0 : 1;
+    }
+    return failures;
+}
+
+// Checks the importance sampling distribution built over an environment map. Returns true if it passes
+static bool verifyEnvironmentDistribution(std::string name, const float* pixels, int width, int height, int channels)
+{
+    EnvironmentDistribution distribution;
+    distribution.build(pixels, width, height, channels);
+    float maxError = distribution.verify();
+    bool passed = maxError < 1e-3f;
+    printf("Environment distribution over %s, %dx%d: largest error %.2e, %s\n", name.c_str(), width, height, maxError, passed ? "passed" : "FAILED");
+    return passed;
+}
+
+static int verifyEnvironmentDistributions(std::vector<std::string> sceneNames)
+{
+    int failures = 0;
+    // A black map as a scene without one gets, a constant sky, a sky with a small bright sun, and a map of odd size
+    // with a black row, each in the channel counts the loader passes
+    float black[3] = { 0, 0, 0 };
+    failures += verifyEnvironmentDistribution("a black pixel", black, 1, 1, 3) ? 0 : 1;
+    std::vector<float> constant(64 * 32 * 3, 1.0f);
+    failures += verifyEnvironmentDistribution("a constant sky", constant.data(), 64, 32, 3) ? 0 : 1;
+    std::vector<float> sun(128 * 64 * 4, 0.2f);
+    for (int y = 20; y < 23; y++)
+    {
+        for (int x = 90; x < 93; x++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                sun[(((y * 128) + x) * 4) + c] = 10000.0f;
+            }
+        }
+    }
+    failures += verifyEnvironmentDistribution("a sky with a sun", sun.data(), 128, 64, 4) ? 0 : 1;
+    std::vector<float> odd(37 * 19 * 3, 0);
+    for (int y = 0; y < 19; y++)
+    {
+        for (int x = 0; x < 37; x++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                odd[(((y * 37) + x) * 3) + c] = y == 9 ? 0.0f : (float)((x * 7) + (y * 3) + c) / 100.0f;
+            }
+        }
+    }
+    failures += verifyEnvironmentDistribution("an odd sized map", odd.data(), 37, 19, 3) ? 0 : 1;
+
+    if (sceneNames.size() == 0)
+    {
+        for (const char* name : bundledScenes)
+        {
+            sceneNames.push_back(name);
+        }
+    }
+    for (unsigned int i = 0; i < sceneNames.size(); i++)
+    {
+        std::ifstream file(sceneNames[i] + "/scene.json");
+        if (file.is_open() == false)
+        {
+            continue;
+        }
+        GEMLoader::GEMScene gemscene;
+        gemscene.load(sceneNames[i] + "/scene.json");
+        std::string envmap = gemscene.findProperty("envmap").getValue("");
+        if (envmap == "")
+        {
+            continue;
+        }
+        // Read the map as loadScene does
+        std::string filename = sceneNames[i] + "/" + envmap;
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        if (filename.find(".hdr") != std::string::npos)
+        {
+            float* pixels = stbi_loadf(filename.c_str(), &width, &height, &channels, 0);
+            if (pixels == NULL)
+            {
+                continue;
+            }
+            failures += verifyEnvironmentDistribution(sceneNames[i], pixels, width, height, channels) ? 0 : 1;
+            stbi_image_free(pixels);
+        } else
+        {
+            unsigned char* pixels = stbi_load(filename.c_str(), &width, &height, &channels, 4);
+            if (pixels == NULL)
+            {
+                continue;
+            }
+            failures += verifyEnvironmentDistribution(sceneNames[i], EnvironmentDistribution::unorm(pixels, width * height * 4).data(), width, height, 4) ? 0 : 1;
+            stbi_image_free(pixels);
+        }
+    }
+    return failures;
+}
+
+// Appends a quad light as two triangles, facing along normal, as loadAsAreaLights makes them
+static void addQuadLight(std::vector<AreaLightData>& lights, Vec3 corner, Vec3 edge1, Vec3 edge2, float radiance)
+{
+    Vec3 v[4] = { corner, corner + edge1, corner + edge1 + edge2, corner + edge2 };
+    for (int t = 0; t < 2; t++)
+    {
+        AreaLightData light;
+        light.v1 = v[0];
+        light.v2 = v[t + 1];
+        light.v3 = v[t + 2];
+        light.normal = Cross(edge1, edge2).normalize();
+        light.Le[0] = radiance;
+        light.Le[1] = radiance;
+        light.Le[2] = radiance;
+        light.area = Cross(light.v3 - light.v2, light.v1 - light.v3).length() * 0.5f;
+        light.power = radiance * light.area * 3.1415926535f;
+        lights.push_back(light);
+    }
+}
+
+// Compares area and solid angle sampling over a set of lights. Both must estimate the same irradiance to within four
+// standard errors of their difference, and solid angle sampling must not be noisier. Returns true if it passes
+static bool compareLightSampling(std::string name, const std::vector<AreaLightData>& lights)
+{
+    LightSamplingComparison comparison;
+    comparison.compare(lights);
+    const LightSamplingComparisonStats& stats = comparison.stats;
+    double standardError = sqrt((stats.areaVariance + stats.sphericalVariance) / ((double)comparison.samplesPerLight * (double)std::max(stats.points, 1)));
+    bool passed = fabs(stats.areaMean - stats.sphericalMean) <= 4.0 * standardError && stats.sphericalVariance <= stats.areaVariance;
+    printf("%-24s %-8d %-8d %-14.4g %-14.4g %-8.2f %-10.4g %-10.4g %-10.2f %s\n", name.c_str(), (int)lights.size(), stats.points, stats.areaVariance,
+        stats.sphericalVariance, stats.sphericalVariance > 0 ? stats.areaVariance / stats.sphericalVariance : 0.0, stats.areaMean, stats.sphericalMean,
+        stats.fallbackFraction * 100.0f, passed ? "passed" : "FAILED");
+    return passed;
+}
+
+static int compareLightSamplingSetups(std::vector<std::string> sceneNames)
+{
+    int failures = 0;
+    printf("%-24s %-8s %-8s %-14s %-14s %-8s %-10s %-10s %-10s\n", "Setup", "Lights", "Points", "Area var", "Solid var", "Ratio", "Area E", "Solid E",
+        "Fallback %");
+    // A small ceiling light, a wall panel beside a bright spot, a long thin strip, and a grid of small lights facing
+    // different ways
+    std::vector<AreaLightData> ceiling;
+    addQuadLight(ceiling, Vec3(-0.25f, 2.0f, -0.25f), Vec3(0.5f, 0, 0), Vec3(0, 0, 0.5f), 10.0f);
+    failures += compareLightSampling("small ceiling light", ceiling) ? 0 : 1;
+    std::vector<AreaLightData> panel;
+    addQuadLight(panel, Vec3(-2.0f, 0, -2.0f), Vec3(0, 4.0f, 0), Vec3(0, 0, 4.0f), 1.0f);
+    addQuadLight(panel, Vec3(1.0f, 3.0f, 0), Vec3(0.1f, 0, 0), Vec3(0, 0, 0.1f), 500.0f);
+    failures += compareLightSampling("panel and spot", panel) ? 0 : 1;
+    std::vector<AreaLightData> strip;
+    addQuadLight(strip, Vec3(-5.0f, 1.0f, 0), Vec3(10.0f, 0, 0), Vec3(0, 0, 0.05f), 20.0f);
+    failures += compareLightSampling("thin strip", strip) ? 0 : 1;
+    std::vector<AreaLightData> grid;
+    for (int i = 0; i < 16; i++)
+    {
+        Vec3 corner((float)(i % 4) * 2.0f, (float)(i / 4) * 0.5f, (float)(i / 4) * 2.0f);
+        Vec3 edge1 = i % 2 == 0 ? Vec3(0.2f, 0, 0) : Vec3(0, 0.2f, 0);
+        Vec3 edge2 = i % 3 == 0 ? Vec3(0, 0, 0.2f) : Vec3(0, 0, -0.2f);
+        addQuadLight(grid, corner, edge1, edge2, 5.0f);
+    }
+    failures += compareLightSampling("grid of small lights", grid) ? 0 : 1;
+
+    // The emitters of the bundled scenes
+    if (sceneNames.size() == 0)
+    {
+        for (const char* name : bundledScenes)
+        {
+            sceneNames.push_back(name);
+        }
+    }
+    for (unsigned int i = 0; i < sceneNames.size(); i++)
+    {
+        std::ifstream file(sceneNames[i] + "/scene.json");
+        BDPTScene scene;
+        if (file.is_open() == false || scene.load(sceneNames[i]) == false || scene.lights.size() == 0)
+        {
+            continue;
+        }
+        std::vector<AreaLightData> lights(scene.lights.size());
+        for (unsigned int l = 0; l < lights.size(); l++)
+        {
+            const BDPTTriangle& triangle = scene.triangles[scene.lights[l]];
+            const Vec3& emission = scene.materials[triangle.material].emission;
+            lights[l].v1 = triangle.v[0];
+            lights[l].v2 = triangle.v[1];
+            lights[l].v3 = triangle.v[2];
+            lights[l].normal = triangle.normal;
+            lights[l].Le[0] = emission.x;
+            lights[l].Le[1] = emission.y;
+            lights[l].Le[2] = emission.z;
+            lights[l].area = triangle.area;
+            lights[l].power = luminance(lights[l].Le) * triangle.area * 3.1415926535f;
+        }
+        failures += compareLightSampling(sceneNames[i], lights) ? 0 : 1;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    std::string mode = argc > 1 ? argv[1] : "veach-bidir";
+    if (mode == "bluenoise")
+    {
+        BlueNoiseMask mask;
+        mask.generate();
+        bool saved = mask.save(BLUE_NOISE_FILENAME);
+        printf("%s %s\n", saved ? "Wrote" : "Could not write", BLUE_NOISE_FILENAME);
+        return saved ? 0 : 1;
+    }
+    if (mode == "samplers")
+    {
+        int passes = argc > 2 ? std::max(atoi(argv[2]), 1) : 256;
+        int divisor = argc > 3 ? std::max(atoi(argv[3]), 1) : 8;
+        std::vector<std::string> sceneNames(argv + std::min(argc, 4), argv + argc);
+        return compareSamplers(passes, divisor, sceneNames);
+    }
+    if (mode == "adaptive")
+    {
+        std::string sceneName = argc > 2 ? argv[2] : "cornell-box";
+        double seconds = argc > 3 ? atof(argv[3]) : 30.0;
+        int divisor = argc > 4 ? std::max(atoi(argv[4]), 1) : 4;
+        return compareAdaptive(sceneName, seconds, divisor);
+    }
+    if (mode == "temporal")
+    {
+        TemporalReprojection temporal;
+        int failures = temporal.verify();
+        printf("Temporal reprojection checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        int accumulationFailures = verifyAccumulation();
+        printf("Accumulation checks: %s (%d failed)\n", accumulationFailures == 0 ? "passed" : "FAILED", accumulationFailures);
+        return failures + accumulationFailures == 0 ? 0 : 1;
+    }
+    if (mode == "pathloop")
+    {
+        PathLoop loop;
+        int failures = loop.verify();
+        printf("Path loop checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "wavefront")
+    {
+        WavefrontQueues queues;
+        int failures = queues.verify();
+        printf("Wavefront queue checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        WavefrontBenchmark benchmark = queues.benchmark();
+        printf("Wavefront queues over %d paths on %d threads: scan %.1f, compact %.1f, bin %.1f, atomic bin %.1f Melem/s\n", benchmark.elements, benchmark.threads,
+            benchmark.scanRate, benchmark.compactRate, benchmark.binRate, benchmark.atomicBinRate);
+        printf("BSDFs per %d-wide wave: %.2f unsorted, %.2f binned\n", WAVEFRONT_WAVE_SIZE, benchmark.unsortedBinsPerWave, benchmark.sortedBinsPerWave);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "resolution")
+    {
+        DynamicResolution resolution;
+        int failures = resolution.verify();
+        printf("Dynamic resolution checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        // 4K screens taking 100 ms and 400 ms and a 720p one taking 2 ms to render whole, each with 2 ms of fixed
+        // costs a frame
+        const int sizes[3][2] = { { 3840, 2160 }, { 3840, 2160 }, { 1280, 720 } };
+        const float megapixelMilliseconds[3] = { 12.0f, 48.0f, 2.0f };
+        for (int i = 0; i < 3; i++)
+        {
+            ResolutionSimulation simulation = resolution.simulate(sizes[i][0], sizes[i][1], 2.0f, megapixelMilliseconds[i], 0.05f, 240);
+            printf("%dx%d at %.0f ms: scale %.2f, %dx%d in %.2f ms against %.2f ms\n", sizes[i][0], sizes[i][1],
+                2.0f + (megapixelMilliseconds[i] * (float)(sizes[i][0] * sizes[i][1]) / 1e6f), simulation.scale, simulation.renderWidth,
+                simulation.renderHeight, simulation.frameMilliseconds, RESOLUTION_BUDGET_MILLISECONDS);
+        }
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "tiles")
+    {
+        TileScheduler scheduler;
+        int failures = scheduler.verify();
+        printf("Tiled dispatch checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        // A 4K screen taking 400 ms and a 720p one taking 2 ms to sample whole, each with 2 ms of fixed costs a frame
+        const int sizes[2][2] = { { 3840, 2160 }, { 1280, 720 } };
+        const float megapixelMilliseconds[2] = { 48.0f, 2.0f };
+        for (int i = 0; i < 2; i++)
+        {
+            TileSimulation simulation = scheduler.simulate(sizes[i][0], sizes[i][1], 2.0f, megapixelMilliseconds[i], 0.05f, 240);
+            printf("%dx%d, %d tiles: %d tiles a frame in %.2f ms against %.2f ms, %d frames per pass\n", sizes[i][0], sizes[i][1], simulation.tiles,
+                simulation.tilesPerFrame, simulation.frameMilliseconds, TILE_BUDGET_MILLISECONDS, simulation.framesPerPass);
+        }
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "presplit")
+    {
+        std::vector<std::string> sceneNames(argv + std::min(argc, 2), argv + argc);
+        return reportPresplit(sceneNames);
+    }
+    if (mode == "alias")
+    {
+        int failures = verifyAliasTables();
+        printf("Alias table checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "environment")
+    {
+        std::vector<std::string> sceneNames(argv + std::min(argc, 2), argv + argc);
+        int failures = verifyEnvironmentDistributions(sceneNames);
+        printf("Environment sampling checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "mis")
+    {
+        // The MIS estimate uses 2^16 samples per strategy, so over 32 configurations its largest relative error from the
+        // reference is around 1% from noise alone; errors in the weights give biases of tens of percent
+        MISReference mis;
+        float maxError = mis.verify();
+        bool passed = maxError < 0.02f && mis.stats.maxWeightSumError < 1e-5f;
+        printf("MIS over %d configurations: largest relative error %.4f, largest weight sum error %.2e\n", mis.stats.configurations, maxError,
+            mis.stats.maxWeightSumError);
+        printf("MIS checks: %s\n", passed ? "passed" : "FAILED");
+        return passed ? 0 : 1;
+    }
+    if (mode == "restir")
+    {
+        // The unbiased estimate must stay within four standard errors of the reference at every pixel, and the M
+        // normalised variant must not, or the check could not tell the two apart
+        ReSTIRReference restir;
+        float standardErrors = restir.verify();
+        bool passed = standardErrors < 4.0f && restir.stats.maxBiasedStandardErrors > 4.0f;
+        printf("ReSTIR over %d pixels, mean M %.1f: 1/Z weights %.2f standard errors (%.1f%%), M normalised %.2f standard errors (%.1f%%)\n",
+            restir.stats.pixels, restir.stats.meanM, standardErrors, restir.stats.maxRelativeError * 100.0f, restir.stats.maxBiasedStandardErrors,
+            restir.stats.maxBiasedRelativeError * 100.0f);
+        printf("ReSTIR checks: %s\n", passed ? "passed" : "FAILED");
+        return passed ? 0 : 1;
+    }
+    if (mode == "restirgi")
+    {
+        // As for ReSTIR, and both the variant reusing neighbours without the Jacobian and the M normalised one must be
+        // detectably biased
+        ReSTIRGIReference restirGI;
+        float standardErrors = restirGI.verify();
+        bool passed = standardErrors < 4.0f && restirGI.stats.maxNoJacobianStandardErrors > 4.0f && restirGI.stats.maxBiasedStandardErrors > 4.0f;
+        printf("ReSTIR GI over %d pixels, mean M %.1f: 1/Z weights %.2f standard errors (%.1f%%), no Jacobian %.2f standard errors, M normalised %.2f standard errors\n",
+            restirGI.stats.pixels, restirGI.stats.meanM, standardErrors, restirGI.stats.maxRelativeError * 100.0f,
+            restirGI.stats.maxNoJacobianStandardErrors, restirGI.stats.maxBiasedStandardErrors);
+        printf("ReSTIR GI checks: %s\n", passed ? "passed" : "FAILED");
+        return passed ? 0 : 1;
+    }
+    if (mode == "hashgrid")
+    {
+        HashGrid grid;
+        int failures = grid.verify();
+        printf("Hash grid checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        HashGridBenchmark benchmark = grid.benchmark();
+        printf("Hash grid of %u slots over %d cells: insert %.1f, lookup %.1f, miss %.1f, deposit %.1f Mop/s\n", HASH_GRID_CAPACITY, benchmark.operations,
+            benchmark.insertsPerSecond / 1e6, benchmark.lookupsPerSecond / 1e6, benchmark.missesPerSecond / 1e6, benchmark.depositsPerSecond / 1e6);
+        printf("Load factor %.3f, inserts finding their bucket full %.4f%%\n", benchmark.loadFactor, benchmark.failedInsertFraction * 100.0f);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "probes")
+    {
+        ProbeVolume probes;
+        int failures = probes.verify();
+        printf("Probe volume checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "lightcache")
+    {
+        LightCache cache;
+        int failures = cache.verify();
+        printf("Light cache checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "guiding")
+    {
+        PathGuiding guiding;
+        int failures = guiding.verify();
+        printf("Path guiding checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        PathGuidingBenchmark benchmark = guiding.benchmark();
+        printf("Path guiding training over %d records: splat %.1f Mrecords/s, refine %.2f ms to %d S-tree leaves and %d D-tree nodes\n", benchmark.records,
+            benchmark.recordsPerSecond / 1e6, benchmark.refineSeconds * 1000.0, benchmark.leaves, benchmark.directionalNodes);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "photons")
+    {
+        PhotonMap photons;
+        int failures = photons.verify();
+        printf("Photon map checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        PhotonMapBenchmark benchmark = photons.benchmark();
+        printf("Photon map of %d photons: build %.1f Mphotons/s, gather %.2f Mqueries/s, %d nearest %.2f Mqueries/s\n", benchmark.photons,
+            benchmark.buildPhotonsPerSecond / 1e6, benchmark.gathersPerSecond / 1e6, PHOTON_RADIUS_NEIGHBOURS, benchmark.nearestPerSecond / 1e6);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "lightsampling")
+    {
+        std::vector<std::string> sceneNames(argv + std::min(argc, 2), argv + argc);
+        int failures = compareLightSamplingSetups(sceneNames);
+        printf("Light sampling comparison: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "lightbvh")
+    {
+        std::vector<std::string> sceneNames(argv + std::min(argc, 2), argv + argc);
+        int failures = verifyLightBVHs(sceneNames);
+        printf("Light BVH checks: %s (%d failed)\n", failures == 0 ? "passed" : "FAILED", failures);
+        return failures == 0 ? 0 : 1;
+    }
+    if (mode == "reorder")
+    {
+        std::vector<std::string> sceneNames(argv + std::min(argc, 2), argv + argc);
+        return reportReorder(sceneNames);
+    }
+    if (mode == "denoise")
+    {
+        std::string sceneName = argc > 2 ? argv[2] : "cornell-box";
+        int passes = argc > 3 ? std::max(atoi(argv[3]), 1) : 16;
+        int divisor = argc > 4 ? std::max(atoi(argv[4]), 1) : 4;
+        int referencePasses = argc > 5 ? std::max(atoi(argv[5]), 1) : 256;
+        return compareDenoiser(sceneName, passes, divisor, referencePasses);
+    }
+    double seconds = argc > 2 ? atof(argv[2]) : 60.0;
+    int divisor = argc > 3 ? std::max(atoi(argv[3]), 1) : 4;
+    return compareIntegrators(mode, seconds, divisor);
+}
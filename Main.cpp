@@ -94,12 +94,73 @@ int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int n
     shaders.updateConstant(shaderName, "CBuffer", "nLights", &nLights);
     unsigned int useEnv = scene.envLum > 0 ? 1 : 0;
     shaders.updateConstant(shaderName, "CBuffer", "useEnvironmentMap", &useEnv);
+    unsigned int useLightBVH = 1; // Select lights with the light BVH, press L to switch to the power based alias table
+    shaders.updateConstant(shaderName, "CBuffer", "useLightBVH", &useLightBVH);
+    unsigned int useReSTIR = 0; // Press R to resample direct lighting at the primary surfaces with ReSTIR
+    shaders.updateConstant(shaderName, "CBuffer", "useReSTIR", &useReSTIR);
+    unsigned int useReSTIRGI = 0; // Press G to resample indirect lighting at the primary surfaces with ReSTIR GI
+    shaders.updateConstant(shaderName, "CBuffer", "useReSTIRGI", &useReSTIRGI);
+    unsigned int useRadianceCache = 0; // Press C to end most paths early at cells of the world space radiance cache
+    shaders.updateConstant(shaderName, "CBuffer", "useRadianceCache", &useRadianceCache);
+    unsigned int useProbeVolume = 0; // Press P for the probe volume preview, lighting diffuse surfaces from irradiance probes
+    shaders.updateConstant(shaderName, "CBuffer", "useProbeVolume", &useProbeVolume);
+    shaders.updateConstant(shaderName, "CBuffer", "probeOrigin", &scene.probeVolume.origin);
+    shaders.updateConstant(shaderName, "CBuffer", "probeSpacing", &scene.probeVolume.spacing);
+    shaders.updateConstant(shaderName, "CBuffer", "probeCounts", &scene.probeVolume.counts[0]);
+    unsigned int useLightCache = 0; // Press K to select lights from what world space cells have learned about their contributions
+    shaders.updateConstant(shaderName, "CBuffer", "useLightCache", &useLightCache);
+    unsigned int guidingMode = 0; // Press T to guide path directions with the SD-tree, training it over the first frames
+    shaders.updateConstant(shaderName, "CBuffer", "guidingMode", &guidingMode);
+    shaders.updateConstant(shaderName, "CBuffer", "guidingMin", &scene.pathGuiding.boundsMin);
+    shaders.updateConstant(shaderName, "CBuffer", "guidingMax", &scene.pathGuiding.boundsMax);
+    // Record about as many guided directions per frame as the record buffer holds, assuming a few bounces per path
+    float guidingRecordFraction = std::min((float)(GUIDING_MAX_RECORDS - 1) / (float)(core.width * core.height * 4), 1.0f);
+    shaders.updateConstant(shaderName, "CBuffer", "guidingRecordFraction", &guidingRecordFraction);
+    unsigned int usePhotonCaustics = 0; // Press M to gather caustics from a progressive photon map
+    shaders.updateConstant(shaderName, "CBuffer", "usePhotonCaustics", &usePhotonCaustics);
+    unsigned int samplerType = SAMPLER_PCG; // Press N to cycle through the samplers of the camera paths
+    shaders.updateConstant(shaderName, "CBuffer", "samplerType", &samplerType);
+    unsigned int useAdaptiveSampling = 0; // Press V to sample only the pixels that are still noisy
+    shaders.updateConstant(shaderName, "CBuffer", "useAdaptiveSampling", &useAdaptiveSampling);
+    float exposure = 0; // Press E and Q to raise and lower the exposure of the image in stops
+    shaders.updateConstant(shaderName, "CBuffer", "exposure", &exposure);
+    unsigned int useDenoiser = 0; // Press F to denoise the displayed image
+    shaders.updateConstant(shaderName, "CBuffer", "useDenoiser", &useDenoiser);
+    unsigned int temporalReproject = 0; // Set in the first frame after the camera moves, press H to restart accumulation instead
+    shaders.updateConstant(shaderName, "CBuffer", "temporalReproject", &temporalReproject);
+    unsigned int useTiledDispatch = 0; // Press B to sample the screen a few tiles a frame, as many as keep the frame within its time budget
+    shaders.updateConstant(shaderName, "CBuffer", "useTiledDispatch", &useTiledDispatch);
+    shaders.updateConstant(shaderName, "CBuffer", "tileColumns", &scene.tileScheduler.columns);
+    unsigned int useDynamicResolution = 0; // Press U to render at a lower resolution, upsampled to the screen, while the camera moves
+    shaders.updateConstant(shaderName, "CBuffer", "useDynamicResolution", &useDynamicResolution);
+    bool lowResolution = false; // Whether the last frame was rendered at a lower resolution
 
     // Set up timer and initialize control variables
     Timer timer;
     bool running = true;
     float t = 0;         // Total elapsed time
     unsigned int SPP = 0; // Samples per pixel counter
+    bool lightKeyDown = false;
+    bool restirKeyDown = false;
+    bool restirGIKeyDown = false;
+    bool cacheKeyDown = false;
+    bool probeKeyDown = false;
+    bool lightCacheKeyDown = false;
+    bool guidingKeyDown = false;
+    bool photonKeyDown = false;
+    bool samplerKeyDown = false;
+    bool adaptiveKeyDown = false;
+    bool exposureKeyDown = false;
+    bool denoiserKeyDown = false;
+    bool temporalKeyDown = false;
+    bool wavefrontKeyDown = false;
+    bool tiledKeyDown = false;
+    bool resolutionKeyDown = false;
+    unsigned int frameIndex = 0; // Frames since ReSTIR was enabled, selects the per frame ReSTIR buffers
+    unsigned int probeFrame = 0; // Probe updates since the preview was enabled, seeds the probe rays and their blending
+    Matrix previousViewProjection = camera.viewProjection().transpose();
+    Matrix previousInverseView = camera.inverseView;
+    Matrix previousInverseProjection = camera.inverseProjection;
 
     // Main loop
     while (running)
@@ -109,25 +170,26 @@ int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int n
         float dt = timer.dt();  // Delta time for this frame
 
         // Camera movement controls
+        bool cameraMoved = false;
         if (win.keyPressed('W'))
         {
             camera.moveForward();
-            SPP = 0;
+            cameraMoved = true;
         }
         if (win.keyPressed('S'))
         {
             camera.moveBackward();
-            SPP = 0;
+            cameraMoved = true;
         }
         if (win.keyPressed('A'))
         {
             camera.moveLeft();
-            SPP = 0;
+            cameraMoved = true;
         }
         if (win.keyPressed('D'))
         {
             camera.moveRight();
-            SPP = 0;
+            cameraMoved = true;
         }
         // Camera orientation control using mouse input
         if (win.mouseButtons[0] == true)
@@ -135,13 +197,164 @@ int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int n
             float dx = (float)win.mousedx;
             float dy = (float)win.mousedy;
             camera.updateLookDirection(dx, dy, 0.001f);
+            cameraMoved = true;
+        }
+        // Toggle between light BVH and alias table light selection
+        if (win.keyPressed('L') && lightKeyDown == false)
+        {
+            useLightBVH = 1 - useLightBVH;
+            shaders.updateConstant(shaderName, "CBuffer", "useLightBVH", &useLightBVH);
+            SPP = 0;
+        }
+        lightKeyDown = win.keyPressed('L');
+        // Toggle ReSTIR direct illumination, starting without history
+        if (win.keyPressed('R') && restirKeyDown == false)
+        {
+            useReSTIR = 1 - useReSTIR;
+            shaders.updateConstant(shaderName, "CBuffer", "useReSTIR", &useReSTIR);
+            scene.useReSTIR = useReSTIR == 1;
+            frameIndex = 0;
+            SPP = 0;
+        }
+        restirKeyDown = win.keyPressed('R');
+        // Toggle ReSTIR GI, starting without history
+        if (win.keyPressed('G') && restirGIKeyDown == false)
+        {
+            useReSTIRGI = 1 - useReSTIRGI;
+            shaders.updateConstant(shaderName, "CBuffer", "useReSTIRGI", &useReSTIRGI);
+            scene.useReSTIRGI = useReSTIRGI == 1;
+            frameIndex = 0;
             SPP = 0;
         }
+        restirGIKeyDown = win.keyPressed('G');
+        // Toggle the radiance cache
+        if (win.keyPressed('C') && cacheKeyDown == false)
+        {
+            useRadianceCache = 1 - useRadianceCache;
+            shaders.updateConstant(shaderName, "CBuffer", "useRadianceCache", &useRadianceCache);
+            scene.useRadianceCache = useRadianceCache == 1;
+            SPP = 0;
+        }
+        cacheKeyDown = win.keyPressed('C');
+        // Toggle the probe volume preview, rebuilding the probes from scratch
+        if (win.keyPressed('P') && probeKeyDown == false)
+        {
+            useProbeVolume = 1 - useProbeVolume;
+            shaders.updateConstant(shaderName, "CBuffer", "useProbeVolume", &useProbeVolume);
+            scene.useProbeVolume = useProbeVolume == 1;
+            probeFrame = 0;
+            SPP = 0;
+        }
+        probeKeyDown = win.keyPressed('P');
+        // Toggle the learned light selection
+        if (win.keyPressed('K') && lightCacheKeyDown == false)
+        {
+            useLightCache = 1 - useLightCache;
+            shaders.updateConstant(shaderName, "CBuffer", "useLightCache", &useLightCache);
+            scene.useLightCache = useLightCache == 1;
+            SPP = 0;
+        }
+        lightCacheKeyDown = win.keyPressed('K');
+        // Toggle path guiding, which carries on training from the tree it has learned so far
+        if (win.keyPressed('T') && guidingKeyDown == false)
+        {
+            scene.usePathGuiding = !scene.usePathGuiding;
+            SPP = 0;
+        }
+        guidingKeyDown = win.keyPressed('T');
+        // Toggle photon caustics, which measure their first radius again from the photons of the first pass
+        if (win.keyPressed('M') && photonKeyDown == false)
+        {
+            scene.usePhotonCaustics = !scene.usePhotonCaustics;
+            SPP = 0;
+        }
+        photonKeyDown = win.keyPressed('M');
+        // Cycle the camera paths' sampler between PCG, Owen scrambled Sobol and blue noise dithered Sobol
+        if (win.keyPressed('N') && samplerKeyDown == false)
+        {
+            samplerType = (samplerType + 1) % SAMPLER_TYPES;
+            shaders.updateConstant(shaderName, "CBuffer", "samplerType", &samplerType);
+            SPP = 0;
+        }
+        samplerKeyDown = win.keyPressed('N');
+        // Toggle adaptive sampling, which starts again from every pixel
+        if (win.keyPressed('V') && adaptiveKeyDown == false)
+        {
+            scene.useAdaptiveSampling = !scene.useAdaptiveSampling;
+            SPP = 0;
+        }
+        adaptiveKeyDown = win.keyPressed('V');
+        // Change the exposure, which only the tonemap pass applies, so the accumulated samples are kept
+        if ((win.keyPressed('E') || win.keyPressed('Q')) && exposureKeyDown == false)
+        {
+            exposure += win.keyPressed('E') ? ACCUMULATION_EXPOSURE_STEP : -ACCUMULATION_EXPOSURE_STEP;
+            shaders.updateConstant(shaderName, "CBuffer", "exposure", &exposure);
+        }
+        exposureKeyDown = win.keyPressed('E') || win.keyPressed('Q');
+        // Toggle the denoiser, which filters the accumulated image for display only, so the samples are kept
+        if (win.keyPressed('F') && denoiserKeyDown == false)
+        {
+            scene.useDenoiser = !scene.useDenoiser;
+            useDenoiser = scene.useDenoiser ? 1 : 0;
+            shaders.updateConstant(shaderName, "CBuffer", "useDenoiser", &useDenoiser);
+        }
+        denoiserKeyDown = win.keyPressed('F');
+        // Toggle temporal reprojection, which only changes what happens the next time the camera moves
+        if (win.keyPressed('H') && temporalKeyDown == false)
+        {
+            scene.useTemporalReprojection = !scene.useTemporalReprojection;
+        }
+        temporalKeyDown = win.keyPressed('H');
+        // Toggle wavefront path tracing, which traces the same paths as the path tracing pass, so the samples are kept
+        if (win.keyPressed('J') && wavefrontKeyDown == false)
+        {
+            scene.useWavefront = !scene.useWavefront;
+        }
+        wavefrontKeyDown = win.keyPressed('J');
+        // Toggle tiled dispatch, starting accumulation again from the first tile
+        if (win.keyPressed('B') && tiledKeyDown == false)
+        {
+            scene.useTiledDispatch = !scene.useTiledDispatch;
+            SPP = 0;
+        }
+        tiledKeyDown = win.keyPressed('B');
+        // Toggle dynamic resolution while the camera moves
+        if (win.keyPressed('U') && resolutionKeyDown == false)
+        {
+            scene.useDynamicResolution = !scene.useDynamicResolution;
+        }
+        resolutionKeyDown = win.keyPressed('U');
         if (win.keyPressed(VK_ESCAPE))
         {
             break;
         }
 
+        // With dynamic resolution a moving camera's frames are rendered at the resolution the time the GPU took over
+        // the last frame allows
+        scene.scheduleResolution(cameraMoved, core.frameMilliseconds, (int)frameIndex);
+
+        // A moving camera reprojects the samples accumulated so far into the new view, unless reprojection is off,
+        // adaptive sampling, which counts each pixel's samples itself, is on, tiled dispatch, which would reproject
+        // only the frame's tiles, is on, or the frame is rendered at a lower resolution, when accumulation starts again.
+        // It also starts again at the full resolution once the camera stops
+        if (cameraMoved && (scene.useTemporalReprojection == false || scene.adaptiveSamplingActive() || scene.tiledDispatchActive() ||
+            scene.dynamicResolutionActive()))
+        {
+            SPP = 0;
+        }
+        if (lowResolution && scene.dynamicResolutionActive() == false)
+        {
+            SPP = 0;
+        }
+        lowResolution = scene.dynamicResolutionActive();
+        scene.temporalReproject = cameraMoved && SPP > 0;
+        temporalReproject = scene.temporalReproject ? 1 : 0;
+
+        // Build the photon map from the photons traced last frame, at the radius of the pass this frame adds
+        scene.buildPhotonMap(&core, SPP + 1);
+        // Choose the pixels this frame samples adaptively from the statistics of the frames so far
+        scene.scheduleAdaptiveSampling(&core, SPP);
+
         // Begin a new frame
         core.beginFrame();
 
@@ -152,11 +365,41 @@ int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int n
         shaders.updateConstant(shaderName, "CBuffer", "inverseView", &camera.inverseView);
         shaders.updateConstant(shaderName, "CBuffer", "inverseProjection", &camera.inverseProjection);
 
-        // Update samples per pixel counter and pass it to the shader
-        SPP++;
+        // Update samples per pixel counter and pass it to the shader. With tiled dispatch it counts passes over the
+        // screen, each frame sampling the next tiles the time the GPU took over the last frame allows
+        if (scene.scheduleTiles(SPP == 0, core.frameMilliseconds))
+        {
+            SPP++;
+        }
+        useTiledDispatch = scene.tiledDispatchActive() ? 1 : 0;
+        shaders.updateConstant(shaderName, "CBuffer", "useTiledDispatch", &useTiledDispatch);
+        shaders.updateConstant(shaderName, "CBuffer", "tileFirst", &scene.tileFrame.first);
+        useDynamicResolution = lowResolution ? 1 : 0;
+        shaders.updateConstant(shaderName, "CBuffer", "useDynamicResolution", &useDynamicResolution);
+        shaders.updateConstant(shaderName, "CBuffer", "renderSize", &scene.dynamicResolution.renderWidth);
+        shaders.updateConstant(shaderName, "CBuffer", "resolutionJitter", scene.resolutionJitter);
         float SPPf = static_cast<float>(SPP);
         shaders.updateConstant(shaderName, "CBuffer", "SPP", &SPPf);
 
+        // Pass last frame's camera and the frame counter used for temporal reuse
+        shaders.updateConstant(shaderName, "CBuffer", "previousViewProjection", &previousViewProjection);
+        shaders.updateConstant(shaderName, "CBuffer", "previousInverseView", &previousInverseView);
+        shaders.updateConstant(shaderName, "CBuffer", "previousInverseProjection", &previousInverseProjection);
+        shaders.updateConstant(shaderName, "CBuffer", "temporalReproject", &temporalReproject);
+        shaders.updateConstant(shaderName, "CBuffer", "frameIndex", &frameIndex);
+        shaders.updateConstant(shaderName, "CBuffer", "probeFrame", &probeFrame);
+        guidingMode = scene.usePathGuiding ? scene.pathGuiding.mode() : 0;
+        shaders.updateConstant(shaderName, "CBuffer", "guidingMode", &guidingMode);
+        // Caustics are gathered once there is a map to gather from
+        usePhotonCaustics = scene.usePhotonCaustics && scene.photonCount > 0 ? 1 : 0;
+        shaders.updateConstant(shaderName, "CBuffer", "usePhotonCaustics", &usePhotonCaustics);
+        shaders.updateConstant(shaderName, "CBuffer", "photonPass", &scene.photonPass);
+        shaders.updateConstant(shaderName, "CBuffer", "photonRadius", &scene.photonRadius);
+        shaders.updateConstant(shaderName, "CBuffer", "photonCount", &scene.photonCount);
+        // ReSTIR turns adaptive sampling off
+        useAdaptiveSampling = scene.adaptiveSamplingActive() ? 1 : 0;
+        shaders.updateConstant(shaderName, "CBuffer", "useAdaptiveSampling", &useAdaptiveSampling);
+
         // Apply shader changes and bind resources for the render target
         shaders.apply(&core, shaderName);
         core.bindRTUAV();
@@ -167,6 +410,16 @@ int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int n
 
         // Finish and present the frame
         core.finishFrame();
+        // Accumulation restarts whenever path guiding moves on to a better trained tree
+        if (scene.trainPathGuiding(&core))
+        {
+            SPP = 0;
+        }
+        previousViewProjection = camera.viewProjection().transpose();
+        previousInverseView = camera.inverseView;
+        previousInverseProjection = camera.inverseProjection;
+        frameIndex++;
+        probeFrame = useProbeVolume == 1 ? probeFrame + 1 : 0;
     }
     core.flushGraphicsQueue();
 
@@ -23,8 +23,11 @@ SOFTWARE.
 */
 
 // Structure that holds the payload data for each ray
-// This includes the current recursion depth, flags for state, a random seed
-// the accumulated colour, and the current path throughput
+// This includes the current bounce depth, flags for state, a random seed
+// the accumulated colour, the current path throughput, and the position, normal
+// and BSDF pdf of the previous vertex used to weight emission found by BSDF sampling. Probe rays return their hit
+// distance in lastPdf instead, and photons carry their power in colour and return their next ray in lastPosition and
+// lastNormal, with a lastPdf of zero once they stop
 struct Payload
 {
     uint depth;
@@ -32,10 +35,20 @@ struct Payload
     uint rndState;
     float3 colour;
     float3 pathThroughput;
+    float3 lastPosition;
+    float3 lastNormal;
+    float lastPdf;
 };
 
 // Constant buffer holding camera matrices, number of area lights, Samples Per Pixel (SPP)
-// and a flag for whether to use an environment map
+// a flag for whether to use an environment map, a flag selecting the light BVH over the alias table,
+// last frame's view projection matrix, a flag enabling ReSTIR direct illumination, a frame counter, a flag enabling ReSTIR GI,
+// a flag enabling the radiance cache, the probe volume's grid, a flag enabling its preview mode and its update counter,
+// a flag enabling the light cache, and the bounds of the path guiding tree, whether it samples and records (guidingMode),
+// the fraction of the guided directions recorded, a flag enabling photon caustics, the photon pass, the gather radius,
+// the number of photons in the map, the sampler camera paths take their random numbers from, a flag enabling
+// adaptive sampling, the exposure of the image in stops, a flag enabling the denoiser, last frame's inverse camera
+// matrices and a flag set in the first frame after the camera moves, which reprojects the accumulated samples
 cbuffer CBuffer : register(b0)
 {
     float4x4 inverseView;
@@ -43,6 +56,39 @@ cbuffer CBuffer : register(b0)
     uint nLights;
     float SPP;
     uint useEnvironmentMap;
+    uint useLightBVH;
+    float4x4 previousViewProjection;
+    uint useReSTIR;
+    uint frameIndex;
+    uint useReSTIRGI;
+    uint useRadianceCache;
+    float3 probeOrigin;
+    uint useProbeVolume;
+    float3 probeSpacing;
+    uint probeFrame;
+    uint3 probeCounts;
+    uint useLightCache;
+    float3 guidingMin;
+    uint guidingMode;
+    float3 guidingMax;
+    float guidingRecordFraction;
+    uint usePhotonCaustics;
+    uint photonPass;
+    float photonRadius;
+    uint photonCount;
+    uint samplerType;
+    uint useAdaptiveSampling;
+    float exposure;
+    uint useDenoiser;
+    float4x4 previousInverseView;
+    float4x4 previousInverseProjection;
+    uint temporalReproject;
+    uint useTiledDispatch;
+    uint tileFirst;
+    uint tileColumns;
+    uint useDynamicResolution;
+    uint2 renderSize;
+    float2 resolutionJitter;
 };
 
 // Acceleration structure for raytracing the scene
@@ -51,6 +97,34 @@ RaytracingAccelerationStructure scene : register(t0);
 // UAV for storing the final rendered image (output texture)
 RWTexture2D<float4> uav : register(u0);
 
+// Running mean of a pixel's samples in linear radiance and the low order bits rounded away from it, laid out as
+// AccumulationPixel in Accumulation.h. The Tonemap pass encodes the means into uav
+struct AccumulationPixel
+{
+    float4 mean;
+    float4 compensation;
+};
+RWStructuredBuffer<AccumulationPixel> accumulation : register(u16);
+
+// AOVs and the buffers of the passes reading them, nine sections of a float4 per pixel: the albedo and distance of the
+// first hit of the pixel's camera paths, their normal facing the camera and the emission they see there, each a
+// running mean over the pixel's samples, then the two ping-pong buffers of the denoiser's filter passes holding the
+// irradiance and its variance (see Denoiser.h), then the history temporal reprojection reads, last frame's
+// accumulated colour and sample count followed by its first three sections (see TemporalReprojection.h)
+RWStructuredBuffer<float4> aovBuffer : register(u17);
+#define DENOISER_ITERATIONS 5
+#define DENOISER_SIGMA_LUMINANCE 4.0
+#define DENOISER_SIGMA_NORMAL 128.0
+#define DENOISER_SIGMA_DEPTH 0.05
+#define DENOISER_ALBEDO_EPSILON 0.01
+#define DENOISER_EPSILON 1e-4
+#define DENOISER_MISS_DEPTH 1000.0
+#define TEMPORAL_HISTORY_SECTION 5
+#define TEMPORAL_MAX_HISTORY 32.0
+#define TEMPORAL_NORMAL_THRESHOLD 0.9
+#define TEMPORAL_PLANE_TOLERANCE 0.05
+#define TEMPORAL_MIN_WEIGHT 0.01
+
 // Array of textures and sampler state for texture sampling
 Texture2D<float4> textures[] : register(t0, space1);
 SamplerState samplerState : register(s0);
@@ -67,17 +141,19 @@ struct Vertex
 };
 
 // Structure holding instance-specific data including index offsets
-// BSDF/albedo texture ID, and additional material parameters
+// BSDF/albedo texture ID, additional material parameters, and for emitters the index of the area light
+// created from the instance's first triangle
 struct InstanceData
 {
     uint startIndex;
     unsigned int bsdfAlbedoID;
     float bsdfData[7];
     float coatingData[6];
+    uint lightOffset;
 };
 
 // Structure for area light information including three vertices (defining a triangle)
-// the light's normal, and its emitted radiance
+// the light's normal, its emitted radiance, and its precomputed area and power
 struct AreaLightData
 {
     float3 v1;
@@ -85,6 +161,17 @@ struct AreaLightData
     float3 v3;
     float3 normal;
     float3 Le;
+    float area;
+    float power;
+};
+
+// Entry of the Walker alias table used to select lights proportionally to their power
+struct LightAliasEntry
+{
+    float threshold;
+    uint alias;
+    float pmf;
+    float aliasPmf;
 };
 
 // Buffers for vertex data, index data, instance data, and area light data
@@ -96,6 +183,265 @@ StructuredBuffer<AreaLightData> areaLightData : register(t4);
 // Environment map texture for background lighting
 Texture2D<float4> environmentMap : register(t5);
 
+// Per-instance normal matrix (inverse transpose of the object to world rotation), precomputed on the CPU
+struct InstanceNormalMatrix
+{
+    float3 row0;
+    float3 row1;
+    float3 row2;
+};
+
+// Compact per-triangle shading record: snorm16 normals and uvs for the three corners in a single 48 byte fetch
+struct TriangleShadingRecord
+{
+    uint2 normals[3];
+    float2 uvs[3];
+};
+
+StructuredBuffer<InstanceNormalMatrix> instanceNormalMatrices : register(t6);
+StructuredBuffer<TriangleShadingRecord> shadingRecords : register(t7);
+StructuredBuffer<LightAliasEntry> lightAliasTable : register(t8);
+
+// Node of the light BVH. Nodes are stored depth first, so an interior node's first child is the next node
+// info holds LIGHT_BVH_LEAF | light index for leaves and the index of the second child for interior nodes
+struct LightBVHNode
+{
+    float3 boundsMin;
+    float power;
+    float3 boundsMax;
+    float cosThetaO;
+    float3 axis;
+    uint info;
+};
+
+#define LIGHT_BVH_LEAF 0x80000000
+
+StructuredBuffer<LightBVHNode> lightBVHNodes : register(t9);
+StructuredBuffer<uint> lightBVHTrails : register(t10);
+
+// Environment map importance sampling distribution: one conditional CDF of (width + 1) values per row of the
+// environment map, followed by the marginal CDF of (height + 1) values over the rows
+StructuredBuffer<float> environmentCDFs : register(t11);
+
+// Reservoir holding one light sample for ReSTIR direct illumination, matching Reservoir in Reservoir.h
+// Area light samples are points on the light, environment map samples are directions
+struct ReSTIRReservoir
+{
+    float3 samplePoint;
+    uint lightIndex;
+    float weightSum;
+    float M;
+    float W;
+    float targetPdf;
+};
+
+// Primary surface seen through a pixel and the radiance gathered for it apart from resampled lighting, matching ReSTIRSurface in Reservoir.h
+struct ReSTIRSurface
+{
+    float3 pos;
+    float depth;
+    float3 normal;
+    uint bsdf;
+    float3 albedo;
+    uint valid;
+    float3 radiance;
+    float pad;
+};
+
+// Reservoir holding one secondary path vertex for ReSTIR GI, matching GIReservoir in Reservoir.h
+struct GIReservoir
+{
+    float3 samplePos;
+    float weightSum;
+    float3 sampleNormal;
+    float M;
+    float3 radiance;
+    float W;
+    float targetPdf;
+    float3 pad;
+};
+
+// Light index marking a reservoir sample as an environment map direction
+#define RESERVOIR_ENVIRONMENT 0xFFFFFFFE
+// Light candidates streamed through each pixel's reservoir
+#define RESTIR_INITIAL_CANDIDATES 8
+// Largest multiple of the pixel's candidate count that last frame's reservoir may carry into temporal reuse
+#define RESTIR_TEMPORAL_MAX_M 20.0
+// Neighbouring reservoirs combined in the spatial pass, and the radius in pixels they are chosen from
+#define RESTIR_SPATIAL_NEIGHBOURS 4
+#define RESTIR_SPATIAL_RADIUS 30.0
+
+// Per pixel reservoirs: the temporal pass result for every pixel, followed by the spatial pass result which the next frame reuses
+RWStructuredBuffer<ReSTIRReservoir> restirReservoirs : register(u1);
+// Per pixel primary surfaces for two frames; frameIndex selects the half written this frame
+RWStructuredBuffer<ReSTIRSurface> restirSurfaces : register(u2);
+// Per pixel ReSTIR GI reservoirs: the temporal pass result for every pixel, followed by the temporal pass results of two
+// frames which the next frame reuses, with frameIndex selecting the half written this frame. Unlike restirReservoirs the
+// spatial result is not reused, as feeding the neighbours' reservoirs back into a pixel's own biases the reconnections.
+// While a pixel's path is traced, its temporal entry first holds the vertex found by the primary surface's bounce ray
+RWStructuredBuffer<GIReservoir> restirGIReservoirs : register(u3);
+
+// Data of one slot of the radiance cache's hash grid, matching HashGridEntry in HashGrid.h
+struct HashGridEntry
+{
+    uint3 accumulated;
+    uint accumulatedCount;
+    float3 radiance;
+    uint sampleCount;
+    uint age;
+};
+
+// Hash grid parameters, matching the constants in HashGrid.h
+#define HASH_GRID_CAPACITY (1u << 20)
+#define HASH_GRID_BUCKET_SIZE 8
+#define HASH_GRID_INVALID 0xFFFFFFFF
+#define HASH_GRID_MIN_CELL_SIZE (1.0 / 256.0)
+#define HASH_GRID_CELL_SCALE 0.02
+#define HASH_GRID_MAX_LEVEL 20
+#define HASH_GRID_RADIANCE_SCALE 1000.0
+#define HASH_GRID_MAX_RADIANCE 1000.0
+#define HASH_GRID_MAX_SAMPLES 256
+#define HASH_GRID_MIN_SAMPLES 4
+#define HASH_GRID_MAX_AGE 32
+// Fraction of paths that update the radiance cache with full length paths instead of ending at cached cells
+#define HASH_GRID_UPDATE_FRACTION (1.0 / 16.0)
+
+// Radiance cache: the checksum of the cell in each slot (zero while empty) and the slots' data
+RWStructuredBuffer<uint> hashGridChecksums : register(u4);
+RWStructuredBuffer<HashGridEntry> hashGridEntries : register(u5);
+
+// Probe volume parameters, matching the constants in ProbeVolume.h
+#define PROBE_IRRADIANCE_TEXELS 8
+#define PROBE_DISTANCE_TEXELS 16
+#define PROBE_RAYS 64
+// Fraction of a probe's previous irradiance and distances kept by each update once it has settled
+#define PROBE_HYSTERESIS 0.97
+// Exponent sharpening the cosine lobe that each distance texel averages the probe's rays over
+#define PROBE_DISTANCE_SHARPNESS 50.0
+// Hit distances of rays reaching the back of a surface are shortened by this factor, so that probes inside geometry
+// look occluded to the points around them
+#define PROBE_BACKFACE_DISTANCE_SCALE 0.2
+// Offsets of shaded points along the normal and towards the viewer, relative to the smallest probe spacing, before
+// the probes are sampled; they keep the visibility test from self shadowing on the surface
+#define PROBE_NORMAL_BIAS 0.1
+#define PROBE_VIEW_BIAS 0.3
+
+// Probe volume: each probe's octahedral tile of irradiance texels (the w component is unused), each probe's tile of
+// distance moments (mean and mean squared distance), and the radiance (xyz) and hit distance (w) of every probe ray
+// traced this frame, with the tiles and rays of consecutive probes stored one after another
+RWStructuredBuffer<float4> probeIrradiance : register(u6);
+RWStructuredBuffer<float2> probeDistance : register(u7);
+RWStructuredBuffer<float4> probeRays : register(u8);
+
+// Light cache parameters, matching the constants in LightCache.h
+#define LIGHT_CACHE_CAPACITY (1u << 16)
+#define LIGHT_CACHE_BUCKET_SIZE 4
+#define LIGHT_CACHE_SLOTS 8
+#define LIGHT_CACHE_INVALID 0xFFFFFFFF
+#define LIGHT_CACHE_CELL_FACTOR 4.0
+#define LIGHT_CACHE_CONTRIBUTION_SCALE 1000.0
+#define LIGHT_CACHE_MAX_CONTRIBUTION 100.0
+#define LIGHT_CACHE_DECAY 0.9
+#define LIGHT_CACHE_MAX_SAMPLES 256.0
+#define LIGHT_CACHE_MIN_SAMPLES 0.5
+#define LIGHT_CACHE_EVICT_SAMPLES 16.0
+#define LIGHT_CACHE_EVICT_FRACTION 0.01
+#define LIGHT_CACHE_MAX_MIX 0.75
+#define LIGHT_CACHE_CONFIDENT_SAMPLES 64.0
+
+// What a light cache cell has learned about one light, matching LightCacheSlot in LightCache.h
+struct LightCacheSlot
+{
+    uint lightPlusOne;
+    uint accumulated;
+    uint accumulatedCount;
+    float mean;
+    float samples;
+};
+
+// A cell of the light cache, matching LightCacheCell in LightCache.h
+struct LightCacheCell
+{
+    uint checksum;
+    LightCacheSlot slots[LIGHT_CACHE_SLOTS];
+};
+
+// Light cache: world space cells learning which lights contribute to the points inside them
+RWStructuredBuffer<LightCacheCell> lightCacheCells : register(u9);
+
+// Path guiding parameters, matching the constants in PathGuiding.h
+#define GUIDING_FRACTION 0.5
+#define GUIDING_MAX_RECORDS (1 << 20)
+#define GUIDING_LEAF 0
+#define GUIDING_SAMPLE 1
+#define GUIDING_RECORD 2
+
+// A node of the path guiding SD-tree, matching GuidingNode in PathGuiding.h. D-tree nodes hold the energy of their
+// quadrants and each quadrant's node; S-tree nodes use children as (first child, second child, axis, D-tree root)
+struct GuidingNode
+{
+    float4 sums;
+    uint4 children;
+};
+
+// Radiance gathered by one guided direction, matching GuidingRecord in PathGuiding.h
+struct GuidingRecord
+{
+    float3 position;
+    float value;
+    float2 direction;
+    uint count;
+    uint pad;
+};
+
+// Path guiding: the S-tree followed by the D-trees the directions are sampled from, and the records written for
+// training, after a first record whose count counts them
+RWStructuredBuffer<GuidingNode> guidingNodes : register(u10);
+RWStructuredBuffer<GuidingRecord> guidingRecords : register(u11);
+
+// Photon map parameters, matching the constants in PhotonMap.h
+#define PHOTON_MAX (1 << 18)
+#define PHOTON_GRID_CELLS (1 << 18)
+#define PHOTON_MAX_BOUNCES 8
+
+// A photon stored after a specular chain, matching Photon in PhotonMap.h; direction points back where it came from
+struct Photon
+{
+    float3 position;
+    uint count;
+    float3 power;
+    uint pad0;
+    float3 direction;
+    uint pad1;
+};
+
+// Caustic photons: PhotonTrace writes them after a first photon whose count counts them, and the CPU replaces them with
+// the map sorted by grid bucket, whose photons each bucket holds are given by (start, count) in photonCells
+RWStructuredBuffer<Photon> photons : register(u12);
+RWStructuredBuffer<uint2> photonCells : register(u13);
+
+// Samplers rnd can draw from; mirror Sampler.h. Camera paths use the one samplerType selects, every other ray the PCG
+// generator. The blue noise mask is BLUE_NOISE_SIZE squared values, each rank once
+#define SAMPLER_PCG 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+#define BLUE_NOISE_SIZE 64
+#define BLUE_NOISE_SEED 0x2C1B3C6Du
+StructuredBuffer<float> blueNoiseMask : register(t12);
+
+// Running statistics of a pixel's samples, laid out as AdaptivePixel in AdaptiveSampling.h, and the pixels adaptive
+// sampling still samples, packed with x in the low 16 bits. The adaptive dispatch runs RayGeneration along the list
+struct AdaptivePixel
+{
+    float3 mean;
+    uint count;
+    float luminanceMean;
+    float luminanceM2;    // Sum of the squared deviations of the luminance from its mean
+    uint2 pad;
+};
+RWStructuredBuffer<AdaptivePixel> adaptivePixels : register(u14);
+RWStructuredBuffer<uint> adaptiveWorkList : register(u15);
+
 // Structure holding hit data computed at a ray intersection
 struct HitData
 {
@@ -106,34 +452,32 @@ struct HitData
     uint bsdf;        // BSDF type identifier
     float3 albedo;    // Surface albedo colour
     InstanceData instance; // Instance data for the hit geometry
+    float3 direction; // Direction of the ray that found the hit
+    float t;          // Distance of the hit along the ray
+    uint primitive;   // Index of the hit triangle in its instance
 };
 
-// Function to compute the inverse of a 3x3 matrix
-float3x3 inverse(float3x3 m)
+// Unpacks a signed 16-bit normalised value stored in the low 16 bits of v
+float unpackSnorm16(uint v)
 {
-    float a = m[0][0], b = m[0][1], c = m[0][2];
-    float d = m[1][0], e = m[1][1], f = m[1][2];
-    float g = m[2][0], h = m[2][1], i = m[2][2];
-
-    float det = a * (e * i - f * h)
-        - b * (d * i - f * g)
-        + c * (d * h - e * g);
-    float invDet = 1.0f / det;
-
-    float3x3 inv;
-    inv[0][0] = (e * i - f * h) * invDet;
-    inv[0][1] = (c * h - b * i) * invDet;
-    inv[0][2] = (b * f - c * e) * invDet;
-
-    inv[1][0] = (f * g - d * i) * invDet;
-    inv[1][1] = (a * i - c * g) * invDet;
-    inv[1][2] = (c * d - a * f) * invDet;
+    return max((float)(((int)(v << 16)) >> 16) / 32767.0, -1.0);
+}
 
-    inv[2][0] = (d * h - e * g) * invDet;
-    inv[2][1] = (b * g - a * h) * invDet;
-    inv[2][2] = (a * e - b * d) * invDet;
+// Unpacks a normal stored as three snorm16 values (xy in the first word, z in the second)
+float3 decodeNormal(uint2 p)
+{
+    return float3(unpackSnorm16(p.x & 0xFFFF), unpackSnorm16(p.x >> 16), unpackSnorm16(p.y & 0xFFFF));
+}
 
-    return inv;
+// Builds an orthonormal basis around a unit normal without branching (Duff et al. 2017)
+float3x3 buildTBN(float3 n)
+{
+    float s = n.z >= 0.0 ? 1.0 : -1.0;
+    float a = -1.0 / (s + n.z);
+    float b = n.x * n.y * a;
+    float3 tangent = float3(1.0 + s * n.x * n.x * a, s * b, -s * n.x);
+    float3 binormal = float3(b, s + n.y * n.y * a, -n.y);
+    return float3x3(tangent, binormal, n);
 }
 
 // Function to determine if the BSDF is two-sided; returns false for specific BSDF types (4 and 6), otherwise true
@@ -165,7 +509,7 @@ uint encodeIsSpecular(uint flags)
 // Clear the specular flag
 uint clearSpecular(uint flags)
 {
-    return flags & 0xFD;
+    return flags & ~2;
 }
 
 // Decodes and checks if the specular flag is set
@@ -186,39 +530,127 @@ bool decodeIsShadow(uint flags)
     return ((flags & 4) > 0);
 }
 
-// Computes hit data at the intersection point by interpolating vertex attributes and applying necessary transforms; uses built-in triangle intersection attributes
-HitData calculateHitData(BuiltInTriangleIntersectionAttributes attrib)
+// Encodes the flag marking that direct lighting at the previous vertex came from a ReSTIR reservoir
+uint encodeIsReservoirLit(uint flags)
+{
+    return flags | 8;
+}
+
+// Clear the reservoir lit flag
+uint clearReservoirLit(uint flags)
+{
+    return flags & ~8;
+}
+
+// Decodes and checks if the reservoir lit flag is set
+bool decodeIsReservoirLit(uint flags)
+{
+    return ((flags & 8) > 0);
+}
+
+// Encodes the flag marking a ray leaving a primary surface whose first hit becomes the pixel's ReSTIR GI candidate
+uint encodeIsGIVertex(uint flags)
+{
+    return flags | 16;
+}
+
+// Clear the GI vertex flag
+uint clearGIVertex(uint flags)
+{
+    return flags & ~16;
+}
+
+// Decodes and checks if the GI vertex flag is set
+bool decodeIsGIVertex(uint flags)
+{
+    return ((flags & 16) > 0);
+}
+
+// Encodes the flag marking a path that deposits into the radiance cache instead of ending at cached cells
+uint encodeIsCacheUpdate(uint flags)
+{
+    return flags | 32;
+}
+
+// Decodes and checks if the cache update flag is set
+bool decodeIsCacheUpdate(uint flags)
+{
+    return ((flags & 32) > 0);
+}
+
+// Encodes the flag marking a ray traced from a probe of the probe volume
+uint encodeIsProbeRay(uint flags)
+{
+    return flags | 64;
+}
+
+// Decodes and checks if the probe ray flag is set
+bool decodeIsProbeRay(uint flags)
+{
+    return ((flags & 64) > 0);
+}
+
+// Encodes the flag marking a photon traced from a light
+uint encodeIsPhoton(uint flags)
+{
+    return flags | 128;
+}
+
+// Decodes and checks if the photon flag is set
+bool decodeIsPhoton(uint flags)
+{
+    return ((flags & 128) > 0);
+}
+
+// Encodes the flag marking a ray that left a diffuse vertex and has only been reflected specularly since, whose light
+// the photon map holds
+uint encodeIsCausticChain(uint flags)
+{
+    return flags | 256;
+}
+
+// Clear the caustic chain flag
+uint clearCausticChain(uint flags)
+{
+    return flags & ~256;
+}
+
+// Decodes and checks if the caustic chain flag is set
+bool decodeIsCausticChain(uint flags)
+{
+    return ((flags & 256) > 0);
+}
+
+// Computes hit data at a point found along a ray by interpolating the precomputed shading record of the hit triangle and applying the instance normal matrix
+HitData surfaceHitData(uint instanceIndex, uint primitive, float2 barycentrics, float3 origin, float3 direction, float t)
 {
     HitData hitData;
     // Retrieve instance data for the current hit
-    hitData.instance = instanceData[InstanceID()];
-    uint startIndex = hitData.instance.startIndex + (PrimitiveIndex() * 3);
+    hitData.instance = instanceData[instanceIndex];
+    hitData.direction = direction;
+    hitData.t = t;
+    hitData.primitive = primitive;
 
-    // Fetch the three vertices of the hit triangle
-    Vertex vertex[3];
-    vertex[0] = vertices[indices[startIndex]];
-    vertex[1] = vertices[indices[startIndex + 1]];
-    vertex[2] = vertices[indices[startIndex + 2]];
+    // Fetch the shading record of the hit triangle (startIndex is always a multiple of 3)
+    TriangleShadingRecord record = shadingRecords[(hitData.instance.startIndex / 3) + primitive];
 
     // Barycentric coordinates for interpolation
-    float u = attrib.barycentrics.x;
-    float v = attrib.barycentrics.y;
-    float w = 1.0 - attrib.barycentrics.x - attrib.barycentrics.y;
+    float u = barycentrics.x;
+    float v = barycentrics.y;
+    float w = 1.0 - barycentrics.x - barycentrics.y;
 
     // Compute hit position along the ray
-    hitData.pos = WorldRayOrigin() + (WorldRayDirection() * RayTCurrent());
+    hitData.pos = origin + (direction * t);
 
-    // Interpolate the surface normal from the vertex normals
-    hitData.normal = normalize((w * vertex[0].normal) + (u * vertex[1].normal) + (v * vertex[2].normal));
+    // Interpolate the surface normal from the packed vertex normals
+    float3 normal = (w * decodeNormal(record.normals[0])) + (u * decodeNormal(record.normals[1])) + (v * decodeNormal(record.normals[2]));
 
     // Interpolate the texture coordinates
-    hitData.uv = (w * vertex[0].uv) + (u * vertex[1].uv) + (v * vertex[2].uv);
+    hitData.uv = (w * record.uvs[0]) + (u * record.uvs[1]) + (v * record.uvs[2]);
 
-    // Transform the normal to world space using the instance's object-to-world matrix
-    float3x4 instanceToWorld = ObjectToWorld3x4();
-    float3x3 rotation = (float3x3)instanceToWorld;
-    float3x3 transform = transpose(inverse(rotation));
-    hitData.normal = normalize(mul(transform, hitData.normal));
+    // Transform the normal to world space using the precomputed normal matrix
+    InstanceNormalMatrix normalMatrix = instanceNormalMatrices[instanceIndex];
+    hitData.normal = normalize(float3(dot(normalMatrix.row0, normal), dot(normalMatrix.row1, normal), dot(normalMatrix.row2, normal)));
 
     // Retrieve BSDF type from instance data
     hitData.bsdf = hitData.instance.bsdfAlbedoID >> 16;
@@ -226,25 +658,14 @@ HitData calculateHitData(BuiltInTriangleIntersectionAttributes attrib)
     // If the material is two-sided, flip the normal if necessary
     if (isBSDFTwoSided(hitData.bsdf))
     {
-        if (dot(hitData.normal, WorldRayDirection()) > 0)
+        if (dot(hitData.normal, direction) > 0)
         {
             hitData.normal = -hitData.normal;
         }
     }
 
-    // Calculate tangent and binormal to form the TBN matrix
-    float3 tangent;
-    if (abs(hitData.normal.x) > abs(hitData.normal.y))
-    {
-        float l = 1.0f / sqrt(hitData.normal.x * hitData.normal.x + hitData.normal.z * hitData.normal.z);
-        tangent = float3(hitData.normal.z * l, 0.0f, -hitData.normal.x * l);
-    } else
-    {
-        float l = 1.0f / sqrt(hitData.normal.y * hitData.normal.y + hitData.normal.z * hitData.normal.z);
-        tangent = float3(0, hitData.normal.z * l, -hitData.normal.y * l);
-    }
-    float3 binormal = normalize(cross(hitData.normal, tangent));
-    hitData.tbn = float3x3(tangent, binormal, hitData.normal);
+    // Form the TBN matrix around the shading normal
+    hitData.tbn = buildTBN(hitData.normal);
 
     // Retrieve texture ID and sample the albedo texture
     uint albedoTexID = hitData.instance.bsdfAlbedoID & 0xFFFF;
@@ -253,9 +674,155 @@ HitData calculateHitData(BuiltInTriangleIntersectionAttributes attrib)
     return hitData;
 }
 
-// Pseudo-random number generator using bitwise operations; it updates the rndState and returns a random float in [0, 1)
+// Hit data of the hit a closest hit shader is running for
+HitData calculateHitData(BuiltInTriangleIntersectionAttributes attrib)
+{
+    return surfaceHitData(InstanceID(), PrimitiveIndex(), attrib.barycentrics, WorldRayOrigin(), WorldRayDirection(), RayTCurrent());
+}
+
+// PCG output permutation used as an independent second hash; mirrors hashPCG in HashGrid.h
+uint hashPCG(uint v)
+{
+    uint state = (v * 747796405u) + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Laine and Karras' permutation, in which every bit depends on the bits below it only; mirrors Sampler.h
+uint laineKarrasPermutation(uint x, uint seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling of a 32 bit fraction: every bit is flipped by a hash of the bits above it
+uint nestedUniformScramble(uint x, uint seed)
+{
+    return reversebits(laineKarrasPermutation(reversebits(x), seed));
+}
+
+// The first two Sobol dimensions as 32 bit fractions; mirrors sobol in Sampler.h
+uint sobol(uint index, uint dimension)
+{
+    if (dimension == 0)
+    {
+        return reversebits(index);
+    }
+    uint x = 0;
+    uint v = 0x80000000u;
+    for (; index != 0; index >>= 1)
+    {
+        if (index & 1)
+        {
+            x ^= v;
+        }
+        v ^= v >> 1;
+    }
+    return x;
+}
+
+uint samplerHashCombine(uint seed, uint v)
+{
+    return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+// A dimension of a sample of the Owen scrambled Sobol sequence seeded by seed, taken in pairs with each pair's samples
+// shuffled; mirrors PixelSampler::sobolSample in Sampler.h
+float sobolSample(uint index, uint dimension, uint seed)
+{
+    uint shuffled = nestedUniformScramble(index, hashPCG(samplerHashCombine(seed, dimension >> 1)));
+    uint value = nestedUniformScramble(sobol(shuffled, dimension & 1), hashPCG(samplerHashCombine(seed ^ 0x5bd1e995u, dimension)));
+    return (float)(value >> 8) / 16777216.0;
+}
+
+// A dimension of the sequence every pixel shares, rotated by the blue noise mask read at an offset along the R2
+// sequence for each dimension; mirrors PixelSampler::blueNoiseSample in Sampler.h
+float blueNoiseSample(uint2 pixel, uint index, uint dimension)
+{
+    uint2 offset = uint2((dimension * 3242174889u) >> 26, (dimension * 2447445414u) >> 26);
+    uint2 texel = (pixel + offset) & (BLUE_NOISE_SIZE - 1);
+    float value = sobolSample(index, dimension, BLUE_NOISE_SEED) + blueNoiseMask[(texel.y * BLUE_NOISE_SIZE) + texel.x];
+    return value >= 1.0 ? value - 1.0 : value;
+}
+
+// Whether the invocation is shading a path of the wavefront passes, and that path's pixel. The wavefront passes run
+// over queues rather than pixels, so the path's pixel stands in for the dispatch's
+static bool wavefrontShading = false;
+static uint2 wavefrontPixel = uint2(0, 0);
+
+// Side of the tiles of the tiled dispatch, which runs a TILE_SIZE square of invocations for each of a frame's tiles
+// along its depth, tiles numbered in scanline order from tileFirst. Mirrors TileScheduler in TiledDispatch.h
+#define TILE_SIZE 64
+
+// Pixel the current camera path belongs to, which the adaptive dispatch reads from the work list and the tiled dispatch
+// finds from its tile
+uint2 dispatchPixel()
+{
+    if (wavefrontShading)
+    {
+        return wavefrontPixel;
+    }
+    if (useTiledDispatch == 1)
+    {
+        uint tile = tileFirst + DispatchRaysIndex().z;
+        return (uint2(tile % tileColumns, tile / tileColumns) * TILE_SIZE) + DispatchRaysIndex().xy;
+    }
+    if (useAdaptiveSampling == 1)
+    {
+        uint packed = adaptiveWorkList[DispatchRaysIndex().x];
+        return uint2(packed & 0xFFFF, packed >> 16);
+    }
+    return DispatchRaysIndex().xy;
+}
+
+// Index of the current camera path among its pixel's samples: the SPP'th, or with adaptive sampling the pixel's own
+// count, which starts again along with accumulation
+uint dispatchSampleIndex(uint2 pixel)
+{
+    if (useAdaptiveSampling == 1)
+    {
+        uint width;
+        uint height;
+        uav.GetDimensions(width, height);
+        return SPP <= 1.0 ? 0 : adaptivePixels[(pixel.y * width) + pixel.x].count;
+    }
+    return (uint)max(SPP, 1.0) - 1;
+}
+
+// Sampler the current shader invocation's rnd calls draw from, set by the shaders tracing camera paths, and for the
+// low discrepancy samplers the pixel and sample of the camera path the invocation belongs to
+static uint activeSampler = SAMPLER_PCG;
+static uint2 activePixel = uint2(0, 0);
+static uint activeSampleIndex = 0;
+
+void setActiveSampler(uint sampler)
+{
+    activeSampler = sampler;
+    if (sampler != SAMPLER_PCG)
+    {
+        activePixel = dispatchPixel();
+        activeSampleIndex = dispatchSampleIndex(activePixel);
+    }
+}
+
+// Returns the next random number in [0, 1). The PCG generator updates rndState with bitwise operations; the low
+// discrepancy samplers take rndState as the next dimension of the active sample of the active pixel
 float rnd(inout uint rndState)
 {
+    if (activeSampler != SAMPLER_PCG)
+    {
+        uint dimension = rndState;
+        rndState++;
+        if (activeSampler == SAMPLER_BLUE_NOISE)
+        {
+            return blueNoiseSample(activePixel, activeSampleIndex, dimension);
+        }
+        return sobolSample(activeSampleIndex, dimension, hashPCG((activePixel.y << 16) ^ activePixel.x));
+    }
     rndState = rndState * 747796405u + 2891336453u;
     uint word = ((rndState >> ((rndState >> 28u) + 4u)) ^ rndState) * 277803737u;
     return (float)((word >> 22u) ^ word) / 4294967296.0;
@@ -273,62 +840,187 @@ float3 itmo(float3 p)
     return pow(p, 2.2);
 }
 
-// Ray generation shader that computes primary rays, traces them, and accumulates results
-[shader("raygeneration")]
-void RayGeneration()
+// Returns the luminance of a linear RGB colour
+float luminance(float3 c)
 {
-    // Get the pixel index and dimensions of the dispatch
-    uint2 idx = DispatchRaysIndex().xy;
-    float2 size = DispatchRaysDimensions().xy;
+    return dot(c, float3(0.2126, 0.7152, 0.0722));
+}
 
-    // Initialize the payload with default values
-    Payload payload;
-    payload.colour = float3(0.0, 0.0, 0.0);
-    payload.pathThroughput = float3(1.0, 1.0, 1.0);
-    payload.depth = 0;
-    payload.flags = 0;
-    payload.rndState = DispatchRaysIndex().x ^ (DispatchRaysIndex().y * 0x9e3779b9u) ^ (asuint(SPP) * 0x85ebca6bu);
+// Number of samples in a pixel's running mean, none on the first frame after accumulation restarts
+uint accumulationCount(uint pixel)
+{
+    return SPP <= 1.0 ? 0 : (uint)accumulation[pixel].mean.w;
+}
 
-    // Generate jittered UV coordinates for anti-aliasing
-    float2 uv = (idx + float2(rnd(payload.rndState), rnd(payload.rndState))) / size;
-    uv.y = 1.0 - uv.y;
-    uv = (uv * 2.0) - 1.0;
+// Adds the n'th sample of a pixel, counting from 1, to its running mean with compensated summation; the first replaces
+// the mean. The fourth channel keeps n. Mirrors AccumulationPixel::add
+void accumulate(uint2 pixel, uint width, float3 colour, uint n)
+{
+    uint index = (pixel.y * width) + pixel.x;
+    if (all(isfinite(colour)) == false)
+    {
+        colour = float3(0, 0, 0);
+    }
+    AccumulationPixel a;
+    if (n <= 1)
+    {
+        a.mean = float4(colour, 1.0);
+        a.compensation = float4(0, 0, 0, 0);
+    }
+    else
+    {
+        a = accumulation[index];
+        precise float4 y = ((float4(colour, 1.0) - a.mean) / (float)n) - a.compensation;
+        precise float4 t = a.mean + y;
+        precise float4 c = (t - a.mean) - y;
+        a.compensation = c;
+        a.mean = t;
+    }
+    a.mean.w = (float)n;
+    a.compensation.w = 0;
+    accumulation[index] = a;
+}
 
-    // Compute the camera position and the ray direction using inverse matrices
-    float3 cameraPosition = mul(inverseView, float4(0, 0, 0, 1)).xyz;
-    float4 p = mul(inverseProjection, float4(uv, 0.0, 1.0));
-    p.xyz = normalize(p.xyz / p.w);
-    float3 rayDirection = mul(inverseView, float4(p.xyz, 0)).xyz;
+// Adds a sample to the pixel's statistics with Welford's update, starting them again on the first sample after
+// accumulation restarts, and returns the pixel's sample count; mirrors AdaptivePixel::add
+uint adaptiveAccumulate(uint2 pixel, uint width, float3 colour)
+{
+    uint index = (pixel.y * width) + pixel.x;
+    AdaptivePixel stats = SPP <= 1.0 ? (AdaptivePixel)0 : adaptivePixels[index];
+    if (all(isfinite(colour)) == false)
+    {
+        colour = float3(0, 0, 0);
+    }
+    stats.count++;
+    float weight = 1.0 / (float)stats.count;
+    stats.mean += (colour - stats.mean) * weight;
+    float l = luminance(colour);
+    float delta = l - stats.luminanceMean;
+    stats.luminanceMean += delta * weight;
+    stats.luminanceM2 += delta * (l - stats.luminanceMean);
+    adaptivePixels[index] = stats;
+    return stats.count;
+}
 
-    // Set up the ray description
-    RayDesc ray;
-    ray.Origin = cameraPosition;
-    ray.Direction = rayDirection;
-    ray.TMin = 0.001;
-    ray.TMax = 1000;
+// Adds the first hit of the camera path being traced to its pixel's denoiser AOVs, counting the sample as the pixel's
+// colour does
+void denoiserRecord(float3 albedo, float3 normal, float depth, float3 emission)
+{
+    uint2 idx = dispatchPixel();
+    uint width;
+    uint height;
+    uav.GetDimensions(width, height);
+    uint pixel = (idx.y * width) + idx.x;
+    uint n = accumulationCount(pixel) + 1;
+    float4 albedoDepth = float4(albedo, depth);
+    float4 facing = float4(normal, 0.0);
+    float4 emitted = float4(emission, 0.0);
+    uint pixels = width * height;
+    if (n > 1)
+    {
+        float weight = 1.0 / (float)n;
+        albedoDepth = aovBuffer[pixel] + ((albedoDepth - aovBuffer[pixel]) * weight);
+        facing = aovBuffer[pixels + pixel] + ((facing - aovBuffer[pixels + pixel]) * weight);
+        emitted = aovBuffer[(2 * pixels) + pixel] + ((emitted - aovBuffer[(2 * pixels) + pixel]) * weight);
+    }
+    aovBuffer[pixel] = albedoDepth;
+    aovBuffer[pixels + pixel] = facing;
+    aovBuffer[(2 * pixels) + pixel] = emitted;
+}
 
-    // Trace the primary ray
-    TraceRay(scene, RAY_FLAG_NONE, 0xFF, 0, 0, 0, ray, payload);
+// Direction of last frame's camera ray through the centre of a pixel, as RayGeneration computed it
+float3 temporalDirection(uint2 pixel, float2 size)
+{
+    float2 uv = ((float2)pixel + 0.5) / size;
+    uv.y = 1.0 - uv.y;
+    uv = (uv * 2.0) - 1.0;
+    float4 p = mul(previousInverseProjection, float4(uv, 0.0, 1.0));
+    p.xyz = normalize(p.xyz / p.w);
+    return mul(previousInverseView, float4(p.xyz, 0)).xyz;
+}
 
-    uav[idx] = float4(tmo(payload.colour), 1.0);
+// Whether a history pixel shows the surface of a first hit at pos with the given normal, zero for lights and rays
+// leaving the scene, found at depth along the camera ray: last frame's ray through the pixel, taken out to the pixel's
+// mean distance, ends on the plane of the hit and the pixel's mean normal is close to the hit's, or without normals
+// both are the same distance from last frame's camera. Mirrors TemporalReprojection::similar
+bool temporalSimilar(uint2 historyIdx, float2 size, float3 pos, float3 normal, float depth)
+{
+    uint pixels = (uint)(size.x * size.y);
+    uint pixel = (historyIdx.y * (uint)size.x) + historyIdx.x;
+    if (aovBuffer[(TEMPORAL_HISTORY_SECTION * pixels) + pixel].w <= 0)
+    {
+        return false;
+    }
+    float historyDepth = aovBuffer[((TEMPORAL_HISTORY_SECTION + 1) * pixels) + pixel].w;
+    float3 historyNormal = aovBuffer[((TEMPORAL_HISTORY_SECTION + 2) * pixels) + pixel].xyz;
+    float historyLengthSq = dot(historyNormal, historyNormal);
+    float lengthSq = dot(normal, normal);
+    float3 origin = mul(previousInverseView, float4(0, 0, 0, 1)).xyz;
+    if (historyLengthSq < 0.25 || lengthSq < 0.25)
+    {
+        return historyLengthSq < 0.25 && lengthSq < 0.25 && abs(length(pos - origin) - historyDepth) < TEMPORAL_PLANE_TOLERANCE * depth;
+    }
+    float3 n = normal * rsqrt(lengthSq);
+    float3 p = origin + (temporalDirection(historyIdx, size) * historyDepth);
+    return dot(historyNormal, n) > TEMPORAL_NORMAL_THRESHOLD * sqrt(historyLengthSq) && abs(dot(n, pos - p)) < TEMPORAL_PLANE_TOLERANCE * depth;
 }
 
-// Miss shader: executed when a ray misses all geometry
-[shader("miss")]
-void Miss(inout Payload payload)
+// Carries the samples of the pixel the first hit of the camera path being traced was seen in last frame over into its
+// pixel's accumulation and AOVs, resampled bilinearly from the history pixels showing the same surface with the
+// sample count capped, or starts the pixel again if none do. Called before the first hit is recorded, in the first
+// frame after the camera moves. Mirrors TemporalReprojection::reproject
+void temporalReprojectPixel(float3 pos, float3 normal, float depth)
 {
-    // Only add environment contribution if not a shadow ray
-    if (decodeIsShadow(payload.flags) == 0)
+    uint2 idx = dispatchPixel();
+    uint width;
+    uint height;
+    uav.GetDimensions(width, height);
+    float2 size = float2(width, height);
+    uint pixels = width * height;
+    uint pixel = (idx.y * width) + idx.x;
+    float4 colour = float4(0, 0, 0, 0);
+    float4 albedoDepth = float4(0, 0, 0, 0);
+    float4 facing = float4(0, 0, 0, 0);
+    float4 emitted = float4(0, 0, 0, 0);
+    float sumWeight = 0;
+    float4 clip = mul(previousViewProjection, float4(pos, 1.0));
+    if (clip.w > 0)
     {
-        if (payload.depth == 0 || decodeIsSpecular(payload.flags))
+        float2 ndc = clip.xy / clip.w;
+        float2 f = (float2((ndc.x * 0.5) + 0.5, (-ndc.y * 0.5) + 0.5) * size) - 0.5;
+        int2 base = (int2)floor(f);
+        float2 t = f - (float2)base;
+        for (uint i = 0; i < 4; i++)
         {
-            payload.colour = payload.colour + (payload.pathThroughput * evaluateEnvironmentMap(WorldRayDirection()));
+            int2 historyIdx = base + int2(i & 1, i >> 1);
+            float w = ((i & 1) != 0 ? t.x : 1.0 - t.x) * ((i >> 1) != 0 ? t.y : 1.0 - t.y);
+            if (any(historyIdx < 0) || any(historyIdx >= (int2)size) || w <= 0 || temporalSimilar((uint2)historyIdx, size, pos, normal, depth) == false)
+            {
+                continue;
+            }
+            uint history = ((uint)historyIdx.y * width) + (uint)historyIdx.x;
+            colour += aovBuffer[(TEMPORAL_HISTORY_SECTION * pixels) + history] * w;
+            albedoDepth += aovBuffer[((TEMPORAL_HISTORY_SECTION + 1) * pixels) + history] * w;
+            facing += aovBuffer[((TEMPORAL_HISTORY_SECTION + 2) * pixels) + history] * w;
+            emitted += aovBuffer[((TEMPORAL_HISTORY_SECTION + 3) * pixels) + history] * w;
+            sumWeight += w;
         }
-    } else
+    }
+    AccumulationPixel a;
+    a.compensation = float4(0, 0, 0, 0);
+    if (sumWeight < TEMPORAL_MIN_WEIGHT)
     {
-        // If it's a shadow ray, set the throughput to 1 in the red channel
-        payload.pathThroughput.r = 1.0f;
+        // The surface was hidden or outside the image, and the pixel starts again from this sample
+        a.mean = float4(0, 0, 0, 0);
+        accumulation[pixel] = a;
+        return;
     }
+    float weight = 1.0 / sumWeight;
+    a.mean = float4(colour.rgb * weight, min(colour.w * weight, TEMPORAL_MAX_HISTORY));
+    accumulation[pixel] = a;
+    aovBuffer[pixel] = albedoDepth * weight;
+    aovBuffer[pixels + pixel] = facing * weight;
+    aovBuffer[(2 * pixels) + pixel] = emitted * weight;
 }
 
 // Converts spherical coordinates (theta, phi) to a 3D world-space direction
@@ -389,36 +1081,650 @@ void uniformSampleTriangle(float r1, float r2, out float alpha, out float beta,
     gamma = 1.0f - (alpha + beta);
 }
 
-// Randomly selects an area light from the available lights; returns the selected light data and sets the probability mass function (pmf)
-AreaLightData sampleLight(inout uint rndState, out float pmf)
+// Selects a light index proportionally to its power in O(1) using the alias table; sets the probability mass function (pmf)
+uint sampleLightIndex(inout uint rndState, out float pmf)
 {
-    uint lightIndex = rnd(rndState) * nLights;
-    pmf = 1.0 / (float)nLights;
-    return areaLightData[lightIndex];
+    uint i = min((uint)(rnd(rndState) * nLights), nLights - 1);
+    LightAliasEntry entry = lightAliasTable[i];
+    if (rnd(rndState) < entry.threshold)
+    {
+        pmf = entry.pmf;
+        return i;
+    }
+    pmf = entry.aliasPmf;
+    return entry.alias;
 }
 
-// Samples a point on an area light's triangle and calculates the PDF for that sample
-float3 sampleAreaLight(AreaLightData lightData, inout uint rndState, out float pdf)
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
 {
-    float u;
-    float v;
-    float w;
-    uniformSampleTriangle(rnd(rndState), rnd(rndState), u, v, w);
-    float3 p = lightData.v1 * u + lightData.v2 * v + lightData.v3 * w;
-    pdf = 1.0 / (length(cross(lightData.v3 - lightData.v2, lightData.v1 - lightData.v3)) * 0.5f);
-    return p;
+    return cosA > cosB ? 1.0 : (cosA * cosB) + (sinA * sinB);
 }
 
-// Samples a new direction based on the material's BSDF; it returns the new world-space direction along with the reflected colour, PDF value, and a flag indicating if the reflection is specular
-float3 sampleBSDF(HitData hitData, inout uint rndState, out float3 reflectedColour, out float pdf, out bool isSpecular)
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
 {
-    // Convert the outgoing ray direction to local space
-    float3 woLocal = mul(-WorldRayDirection(), transpose(hitData.tbn));
-    float3 wiLocal;
-    isSpecular = false;
+    return cosA > cosB ? 0.0 : (sinA * cosB) - (cosA * sinB);
+}
 
-    // Different sampling based on the BSDF type
-    if (hitData.bsdf == 0) // Diffuse
+// Estimates the contribution of all lights below a BVH node to a shading point, using the node's power, distance
+// and conservative bounds on the emitter and receiver cosines. Returns zero only if no light below can contribute
+float lightBVHImportance(LightBVHNode node, float3 p, float3 n)
+{
+    if (node.power <= 0)
+    {
+        return 0;
+    }
+    float3 centre = (node.boundsMin + node.boundsMax) * 0.5;
+    float radiusSq = dot(node.boundsMax - centre, node.boundsMax - centre);
+    float3 d = p - centre;
+    float distanceSq = dot(d, d);
+    // Inside the bounding sphere every direction is possible
+    if (distanceSq <= radiusSq)
+    {
+        return node.power / max(radiusSq, 1e-8);
+    }
+    float3 wi = d / sqrt(distanceSq);
+    // Half angle subtended by the bounding sphere
+    float sinThetaBSq = radiusSq / distanceSq;
+    float sinThetaB = sqrt(sinThetaBSq);
+    float cosThetaB = sqrt(1.0 - sinThetaBSq);
+    // Smallest angle between the direction to the point and any emitter normal in the node
+    float cosThetaW = clamp(dot(node.axis, wi), -1.0, 1.0);
+    float sinThetaW = sqrt(max(1.0 - (cosThetaW * cosThetaW), 0.0));
+    float sinThetaO = sqrt(max(1.0 - (node.cosThetaO * node.cosThetaO), 0.0));
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= 0)
+    {
+        return 0;
+    }
+    // Smallest angle between the shading normal and any direction towards the node
+    float cosThetaI = clamp(-dot(n, wi), -1.0, 1.0);
+    float sinThetaI = sqrt(max(1.0 - (cosThetaI * cosThetaI), 0.0));
+    float cosThetaIP = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    if (cosThetaIP <= 0)
+    {
+        return 0;
+    }
+    return node.power * cosThetaP * cosThetaIP / distanceSq;
+}
+
+// Walks the light BVH from the root, choosing each child with probability proportional to its importance
+// A single random number is rescaled at every level. Sets pmf to zero if no light can contribute
+uint sampleLightBVH(float3 p, float3 n, inout uint rndState, out float pmf)
+{
+    pmf = 0;
+    uint node = 0;
+    LightBVHNode current = lightBVHNodes[0];
+    if ((current.info & LIGHT_BVH_LEAF) == 0 && lightBVHImportance(current, p, n) <= 0)
+    {
+        return 0;
+    }
+    float u = rnd(rndState);
+    float prob = 1.0;
+    [loop]
+    while ((current.info & LIGHT_BVH_LEAF) == 0)
+    {
+        uint first = node + 1;
+        uint second = current.info;
+        LightBVHNode firstNode = lightBVHNodes[first];
+        LightBVHNode secondNode = lightBVHNodes[second];
+        float i0 = lightBVHImportance(firstNode, p, n);
+        float i1 = lightBVHImportance(secondNode, p, n);
+        if ((i0 + i1) <= 0)
+        {
+            return 0;
+        }
+        float p0 = i0 / (i0 + i1);
+        if (u < p0)
+        {
+            node = first;
+            current = firstNode;
+            prob = prob * p0;
+            u = min(u / p0, 0.99999994);
+        } else
+        {
+            node = second;
+            current = secondNode;
+            prob = prob * (1.0 - p0);
+            u = min((u - p0) / (1.0 - p0), 0.99999994);
+        }
+    }
+    pmf = prob;
+    return current.info & ~LIGHT_BVH_LEAF;
+}
+
+// Returns the probability that sampleLightBVH picks a given light, following the light's path through the tree
+float lightBVHPmf(float3 p, float3 n, uint lightIndex)
+{
+    uint node = 0;
+    LightBVHNode current = lightBVHNodes[0];
+    if ((current.info & LIGHT_BVH_LEAF) == 0 && lightBVHImportance(current, p, n) <= 0)
+    {
+        return 0;
+    }
+    uint trail = lightBVHTrails[lightIndex];
+    float prob = 1.0;
+    [loop]
+    while ((current.info & LIGHT_BVH_LEAF) == 0)
+    {
+        uint first = node + 1;
+        uint second = current.info;
+        LightBVHNode firstNode = lightBVHNodes[first];
+        LightBVHNode secondNode = lightBVHNodes[second];
+        float i0 = lightBVHImportance(firstNode, p, n);
+        float i1 = lightBVHImportance(secondNode, p, n);
+        if ((i0 + i1) <= 0)
+        {
+            return 0;
+        }
+        float p0 = i0 / (i0 + i1);
+        if ((trail & 1) == 0)
+        {
+            node = first;
+            current = firstNode;
+            prob = prob * p0;
+        } else
+        {
+            node = second;
+            current = secondNode;
+            prob = prob * (1.0 - p0);
+        }
+        trail = trail >> 1;
+    }
+    return prob;
+}
+
+// Selects an area light for a shading point, either with the light BVH or proportionally to power with the alias table
+// Returns the index of the selected light and sets the probability mass function (pmf), which is zero if no light can contribute
+uint selectDefaultLight(float3 p, float3 n, inout uint rndState, out float pmf)
+{
+    if (useLightBVH == 1)
+    {
+        return sampleLightBVH(p, n, rndState, pmf);
+    }
+    return sampleLightIndex(rndState, pmf);
+}
+
+// Returns the probability of selectDefaultLight picking a given light at a shading point
+float defaultLightPmf(float3 p, float3 n, uint lightIndex)
+{
+    if (useLightBVH == 1)
+    {
+        return lightBVHPmf(p, n, lightIndex);
+    }
+    return lightAliasTable[lightIndex].pmf;
+}
+
+// Bob Jenkins' 32 bit integer hash; mirrors hashJenkins in HashGrid.h
+uint hashJenkins(uint a)
+{
+    a = (a + 0x7ed55d16) + (a << 12);
+    a = (a ^ 0xc761c23c) ^ (a >> 19);
+    a = (a + 0x165667b1) + (a << 5);
+    a = (a + 0xd3a2646c) ^ (a << 9);
+    a = (a + 0xfd7046c5) + (a << 3);
+    a = (a ^ 0xb55a4f09) ^ (a >> 16);
+    return a;
+}
+
+// Grid level for a point at the given distance from the camera; mirrors hashGridLevel in HashGrid.h
+uint hashGridLevel(float distance)
+{
+    float cells = max(distance * HASH_GRID_CELL_SCALE / HASH_GRID_MIN_CELL_SIZE, 1.0);
+    return min((uint)floor(log2(cells)), HASH_GRID_MAX_LEVEL);
+}
+
+// Returns the hash (x) and checksum (y) of the cell holding a point; mirrors hashGridKey in HashGrid.h
+uint2 hashGridKey(float3 pos, float3 normal, float distance)
+{
+    uint level = hashGridLevel(distance);
+    float cellSize = HASH_GRID_MIN_CELL_SIZE * (float)(1u << level);
+    uint x = asuint((int)floor(pos.x / cellSize));
+    uint y = asuint((int)floor(pos.y / cellSize));
+    uint z = asuint((int)floor(pos.z / cellSize));
+    uint normalBits = (normal.x >= 0 ? 1u : 0u) | (normal.y >= 0 ? 2u : 0u) | (normal.z >= 0 ? 4u : 0u);
+    uint extra = level | (normalBits << 8);
+    uint2 key;
+    key.x = hashJenkins(hashJenkins(hashJenkins(hashJenkins(x) ^ y) ^ z) ^ extra);
+    key.y = hashPCG(hashPCG(hashPCG(hashPCG(x) ^ y) ^ z) ^ extra);
+    key.y = key.y == 0 ? 1 : key.y;
+    return key;
+}
+
+// Distance from the camera, which sets the size of the cache cells around a point
+float hashGridCameraDistance(float3 pos)
+{
+    return length(pos - mul(inverseView, float4(0, 0, 0, 1)).xyz);
+}
+
+// Returns the hash (x) and checksum (y) of the light cache cell holding a point; mirrors lightCacheKey in LightCache.h
+uint2 lightCacheKey(float3 pos, float3 normal, float distance)
+{
+    return hashGridKey(pos, normal, distance * LIGHT_CACHE_CELL_FACTOR);
+}
+
+// Returns the cell a key is stored in, or LIGHT_CACHE_INVALID; mirrors LightCache::find
+uint lightCacheFind(uint2 key)
+{
+    uint base = (key.x % (LIGHT_CACHE_CAPACITY / LIGHT_CACHE_BUCKET_SIZE)) * LIGHT_CACHE_BUCKET_SIZE;
+    for (uint i = 0; i < LIGHT_CACHE_BUCKET_SIZE; i++)
+    {
+        if (lightCacheCells[base + i].checksum == key.y)
+        {
+            return base + i;
+        }
+    }
+    return LIGHT_CACHE_INVALID;
+}
+
+// Returns the cell a key is stored in, claiming an empty cell of its bucket if needed; mirrors LightCache::insert
+uint lightCacheInsert(uint2 key)
+{
+    uint cell = lightCacheFind(key);
+    if (cell != LIGHT_CACHE_INVALID)
+    {
+        return cell;
+    }
+    uint base = (key.x % (LIGHT_CACHE_CAPACITY / LIGHT_CACHE_BUCKET_SIZE)) * LIGHT_CACHE_BUCKET_SIZE;
+    for (uint i = 0; i < LIGHT_CACHE_BUCKET_SIZE; i++)
+    {
+        uint previous;
+        InterlockedCompareExchange(lightCacheCells[base + i].checksum, 0, key.y, previous);
+        if (previous == 0 || previous == key.y)
+        {
+            return base + i;
+        }
+    }
+    return LIGHT_CACHE_INVALID;
+}
+
+// Adds the luminance of one light sample's contribution to a shading point to the light's slot in the point's cell,
+// claiming an empty slot if the light has none; mirrors LightCache::deposit
+void lightCacheDeposit(float3 pos, float3 normal, uint lightIndex, float contribution)
+{
+    uint cell = lightCacheInsert(lightCacheKey(pos, normal, hashGridCameraDistance(pos)));
+    if (cell == LIGHT_CACHE_INVALID)
+    {
+        return;
+    }
+    for (uint i = 0; i < LIGHT_CACHE_SLOTS; i++)
+    {
+        uint previous;
+        InterlockedCompareExchange(lightCacheCells[cell].slots[i].lightPlusOne, 0, lightIndex + 1, previous);
+        if (previous == 0 || previous == lightIndex + 1)
+        {
+            InterlockedAdd(lightCacheCells[cell].slots[i].accumulated, (uint)((clamp(contribution, 0.0, LIGHT_CACHE_MAX_CONTRIBUTION) * LIGHT_CACHE_CONTRIBUTION_SCALE) + 0.5));
+            InterlockedAdd(lightCacheCells[cell].slots[i].accumulatedCount, 1);
+            return;
+        }
+    }
+}
+
+// Fraction of the selections at a cell drawn from its learned distribution, and the sum of its lights' means; mirrors LightCache::mix
+float lightCacheMix(uint cell, out float total)
+{
+    total = 0;
+    float samples = 0;
+    for (uint i = 0; i < LIGHT_CACHE_SLOTS; i++)
+    {
+        total += lightCacheCells[cell].slots[i].mean;
+        samples += lightCacheCells[cell].slots[i].samples;
+    }
+    return total > 0 ? LIGHT_CACHE_MAX_MIX * saturate(samples / LIGHT_CACHE_CONFIDENT_SAMPLES) : 0.0;
+}
+
+// Picks a light from a cell in proportion to the means; mirrors LightCache::sample
+uint lightCacheSample(uint cell, float total, float u)
+{
+    float target = u * total;
+    uint last = LIGHT_CACHE_INVALID;
+    for (uint i = 0; i < LIGHT_CACHE_SLOTS; i++)
+    {
+        LightCacheSlot slot = lightCacheCells[cell].slots[i];
+        if (slot.mean > 0)
+        {
+            last = slot.lightPlusOne - 1;
+            target -= slot.mean;
+            if (target < 0)
+            {
+                return last;
+            }
+        }
+    }
+    return last;
+}
+
+// Probability of lightCacheSample picking a light; mirrors LightCache::pmf
+float lightCachePmf(uint cell, float total, uint lightIndex)
+{
+    for (uint i = 0; i < LIGHT_CACHE_SLOTS; i++)
+    {
+        if (lightCacheCells[cell].slots[i].lightPlusOne == lightIndex + 1)
+        {
+            return lightCacheCells[cell].slots[i].mean / total;
+        }
+    }
+    return 0.0;
+}
+
+// Returns the light cache cell and its mix fraction for a shading point, or a zero fraction if the cache has nothing to offer
+float lightCacheCellMix(float3 p, float3 n, out uint cell, out float total)
+{
+    total = 0;
+    cell = useLightCache == 1 ? lightCacheFind(lightCacheKey(p, n, hashGridCameraDistance(p))) : LIGHT_CACHE_INVALID;
+    return cell != LIGHT_CACHE_INVALID ? lightCacheMix(cell, total) : 0.0;
+}
+
+// Selects an area light for a shading point with selectDefaultLight. With the light cache enabled, a share of the
+// selections that grows with what the point's cell has learned is drawn from the cell's distribution instead, and the
+// pmf is that of the mixture. Returns the index of the selected light and sets the pmf, which is zero if no light can contribute
+uint selectLight(float3 p, float3 n, inout uint rndState, out float pmf)
+{
+    uint cell;
+    float total;
+    float mix = lightCacheCellMix(p, n, cell, total);
+    if (mix <= 0)
+    {
+        return selectDefaultLight(p, n, rndState, pmf);
+    }
+    uint lightIndex;
+    if (rnd(rndState) < mix)
+    {
+        lightIndex = lightCacheSample(cell, total, rnd(rndState));
+        pmf = defaultLightPmf(p, n, lightIndex);
+    } else
+    {
+        lightIndex = selectDefaultLight(p, n, rndState, pmf);
+        if (pmf <= 0)
+        {
+            return lightIndex;
+        }
+    }
+    pmf = (mix * lightCachePmf(cell, total, lightIndex)) + ((1.0 - mix) * pmf);
+    return lightIndex;
+}
+
+// Solid angle limits outside which area lights are sampled by area rather than by solid angle
+#define SPHERICAL_SAMPLE_MIN_SOLID_ANGLE 3e-4
+#define SPHERICAL_SAMPLE_MAX_SOLID_ANGLE 6.22
+
+// Angle between two unit vectors, accurate for nearly parallel and nearly opposite vectors
+float angleBetween(float3 a, float3 b)
+{
+    if (dot(a, b) < 0)
+    {
+        return PI - (2.0 * asin(min(length(a + b) * 0.5, 1.0)));
+    }
+    return 2.0 * asin(min(length(b - a) * 0.5, 1.0));
+}
+
+// Returns the component of v perpendicular to the unit vector w, normalised
+float3 orthogonalise(float3 v, float3 w)
+{
+    return normalize(v - (w * dot(v, w)));
+}
+
+// Computes the unit directions from p to the triangle's vertices and the interior angles of the spherical triangle
+// Returns false if the triangle is degenerate as seen from p
+bool sphericalTriangleAngles(float3 v1, float3 v2, float3 v3, float3 p, out float3 a, out float3 b, out float3 c, out float alpha, out float beta, out float gamma)
+{
+    a = normalize(v1 - p);
+    b = normalize(v2 - p);
+    c = normalize(v3 - p);
+    alpha = 0;
+    beta = 0;
+    gamma = 0;
+    float3 nab = cross(a, b);
+    float3 nbc = cross(b, c);
+    float3 nca = cross(c, a);
+    if (dot(nab, nab) <= 0 || dot(nbc, nbc) <= 0 || dot(nca, nca) <= 0)
+    {
+        return false;
+    }
+    nab = normalize(nab);
+    nbc = normalize(nbc);
+    nca = normalize(nca);
+    alpha = angleBetween(nab, -nca);
+    beta = angleBetween(nbc, -nab);
+    gamma = angleBetween(nca, -nbc);
+    return true;
+}
+
+// Solid angle subtended by a triangle from p, zero if degenerate
+float sphericalTriangleSolidAngle(float3 v1, float3 v2, float3 v3, float3 p)
+{
+    float3 a;
+    float3 b;
+    float3 c;
+    float alpha;
+    float beta;
+    float gamma;
+    if (sphericalTriangleAngles(v1, v2, v3, p, a, b, c, alpha, beta, gamma) == false)
+    {
+        return 0;
+    }
+    return max((alpha + beta + gamma) - PI, 0.0);
+}
+
+// Samples a direction uniformly within the solid angle of a triangle as seen from p (Arvo 1995)
+// Returns false if the triangle is degenerate, otherwise sets the direction and its pdf (one over the solid angle)
+bool sampleSphericalTriangle(float3 v1, float3 v2, float3 v3, float3 p, float u1, float u2, out float3 wi, out float pdf)
+{
+    float3 a;
+    float3 b;
+    float3 c;
+    float alpha;
+    float beta;
+    float gamma;
+    wi = float3(0, 0, 0);
+    pdf = 0;
+    if (sphericalTriangleAngles(v1, v2, v3, p, a, b, c, alpha, beta, gamma) == false)
+    {
+        return false;
+    }
+    float areaPi = alpha + beta + gamma;
+    float area = areaPi - PI;
+    if (area <= 0)
+    {
+        return false;
+    }
+    pdf = 1.0 / area;
+    // Pick the sub-triangle area with u1 and find the vertex c' that produces it
+    float areaPiSampled = PI + (u1 * area);
+    float cosAlpha = cos(alpha);
+    float sinAlpha = sin(alpha);
+    float sinPhi = (sin(areaPiSampled) * cosAlpha) - (cos(areaPiSampled) * sinAlpha);
+    float cosPhi = (cos(areaPiSampled) * cosAlpha) + (sin(areaPiSampled) * sinAlpha);
+    float k1 = cosPhi + cosAlpha;
+    float k2 = sinPhi - (sinAlpha * dot(a, b));
+    float cosBp = (k2 + (((k2 * cosPhi) - (k1 * sinPhi)) * cosAlpha)) / (((k2 * sinPhi) + (k1 * cosPhi)) * sinAlpha);
+    cosBp = clamp(cosBp, -1.0, 1.0);
+    float sinBp = sqrt(max(1.0 - (cosBp * cosBp), 0.0));
+    float3 cp = (a * cosBp) + (orthogonalise(c, a) * sinBp);
+    // Pick a point along the arc from b to c' with u2
+    float cosTheta = 1.0 - (u2 * (1.0 - dot(cp, b)));
+    float sinTheta = sqrt(max(1.0 - (cosTheta * cosTheta), 0.0));
+    wi = normalize((b * cosTheta) + (orthogonalise(cp, b) * sinTheta));
+    return true;
+}
+
+// Samples a direction towards an area light from p, by solid angle when the subtended solid angle is in the well
+// conditioned range and by area otherwise. Sets the direction, the point on the light and the solid angle pdf
+// Returns false if the sample carries no emission (degenerate triangle or back facing point)
+bool sampleTriangleLight(AreaLightData light, float3 p, inout uint rndState, out float3 wi, out float3 lightPoint, out float pdf)
+{
+    float u1 = rnd(rndState);
+    float u2 = rnd(rndState);
+    lightPoint = float3(0, 0, 0);
+    float solidAngle = sphericalTriangleSolidAngle(light.v1, light.v2, light.v3, p);
+    if (solidAngle >= SPHERICAL_SAMPLE_MIN_SOLID_ANGLE && solidAngle <= SPHERICAL_SAMPLE_MAX_SOLID_ANGLE)
+    {
+        if (sampleSphericalTriangle(light.v1, light.v2, light.v3, p, u1, u2, wi, pdf) == false)
+        {
+            return false;
+        }
+        // Intersect the sampled direction with the light's plane to find the point for visibility
+        float denom = dot(wi, light.normal);
+        if (denom >= 0)
+        {
+            return false;
+        }
+        lightPoint = p + (wi * (dot(light.v1 - p, light.normal) / denom));
+        return true;
+    }
+    // Uniform area sampling, converted to solid angle
+    float alpha;
+    float beta;
+    float gamma;
+    uniformSampleTriangle(u1, u2, alpha, beta, gamma);
+    lightPoint = (light.v1 * alpha) + (light.v2 * beta) + (light.v3 * gamma);
+    wi = lightPoint - p;
+    float distanceSq = dot(wi, wi);
+    pdf = 0;
+    if (distanceSq <= 0 || light.area <= 0)
+    {
+        return false;
+    }
+    wi = wi / sqrt(distanceSq);
+    float cosLight = -dot(wi, light.normal);
+    if (cosLight <= 0)
+    {
+        return false;
+    }
+    pdf = distanceSq / (cosLight * light.area);
+    return true;
+}
+
+// Returns the solid angle pdf of sampleTriangleLight producing the direction wi that reaches the light at lightPoint
+float triangleLightPdf(AreaLightData light, float3 p, float3 wi, float3 lightPoint)
+{
+    float cosLight = -dot(wi, light.normal);
+    if (cosLight <= 0)
+    {
+        return 0;
+    }
+    float solidAngle = sphericalTriangleSolidAngle(light.v1, light.v2, light.v3, p);
+    if (solidAngle >= SPHERICAL_SAMPLE_MIN_SOLID_ANGLE && solidAngle <= SPHERICAL_SAMPLE_MAX_SOLID_ANGLE)
+    {
+        return 1.0 / solidAngle;
+    }
+    if (light.area <= 0)
+    {
+        return 0;
+    }
+    float3 d = lightPoint - p;
+    return dot(d, d) / (cosLight * light.area);
+}
+
+// Returns the index i with cdf[offset + i] <= u < cdf[offset + i + 1] in a CDF of n + 1 values
+uint findEnvironmentInterval(uint offset, uint n, float u)
+{
+    uint first = 0;
+    uint last = n;
+    [loop]
+    while (last - first > 1)
+    {
+        uint mid = (first + last) / 2;
+        if (environmentCDFs[offset + mid] <= u)
+        {
+            first = mid;
+        } else
+        {
+            last = mid;
+        }
+    }
+    return first;
+}
+
+// Converts a pdf with respect to the environment map texture coordinates to a solid angle pdf
+float environmentUVToSolidAngle(float pdf, float v)
+{
+    float sinTheta = sin(v * PI);
+    return sinTheta > 0 ? pdf / (2.0 * PI * PI * sinTheta) : 0.0;
+}
+
+// Returns the coordinate at offset t into cell i of n cells, nudged by a few ulps where rounding would otherwise put it in
+// a neighbouring cell, so the pdf is looked up in the cell that was sampled
+float environmentCellCoordinate(uint i, float t, uint n)
+{
+    float c = ((float)i + t) / (float)n;
+    while (c > 0.0 && (uint)(c * (float)n) > i)
+    {
+        c = asfloat(asuint(c) - 1);
+    }
+    while ((uint)(c * (float)n) < i)
+    {
+        c = asfloat(asuint(c) + 1);
+    }
+    return c;
+}
+
+// Samples a direction proportionally to the environment map's luminance by inverting the marginal and conditional CDFs
+// Returns the world-space direction and sets the solid angle pdf
+float3 sampleEnvironment(inout uint rndState, out float pdf)
+{
+    uint width;
+    uint height;
+    environmentMap.GetDimensions(width, height);
+    uint marginal = height * (width + 1);
+    float r1 = rnd(rndState);
+    float r2 = rnd(rndState);
+    uint y = findEnvironmentInterval(marginal, height, r1);
+    float cdfY = environmentCDFs[marginal + y];
+    float dv = environmentCDFs[marginal + y + 1] - cdfY;
+    uint row = y * (width + 1);
+    uint x = findEnvironmentInterval(row, width, r2);
+    float cdfX = environmentCDFs[row + x];
+    float du = environmentCDFs[row + x + 1] - cdfX;
+    float v = environmentCellCoordinate(y, dv > 0 ? (r1 - cdfY) / dv : 0.5, height);
+    float u = environmentCellCoordinate(x, du > 0 ? (r2 - cdfX) / du : 0.5, width);
+    pdf = environmentUVToSolidAngle(dv * du * (float)width * (float)height, v);
+    // Inverse of the mapping in evaluateEnvironmentMap
+    float phi = u * 2.0 * PI;
+    float theta = v * PI;
+    return float3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+}
+
+// Returns the solid angle pdf of sampleEnvironment generating the given direction
+float environmentPdf(float3 wi)
+{
+    uint width;
+    uint height;
+    environmentMap.GetDimensions(width, height);
+    float u = atan2(wi.z, wi.x);
+    u = (u < 0.0f) ? u + (2.0f * PI) : u;
+    u = u / (2.0f * PI);
+    float v = acos(clamp(wi.y, -1.0, 1.0)) / PI;
+    uint x = min((uint)(u * width), width - 1);
+    uint y = min((uint)(v * height), height - 1);
+    uint marginal = height * (width + 1);
+    uint row = y * (width + 1);
+    float pdfUV = (environmentCDFs[marginal + y + 1] - environmentCDFs[marginal + y]) * (environmentCDFs[row + x + 1] - environmentCDFs[row + x]) * (float)width * (float)height;
+    return environmentUVToSolidAngle(pdfUV, v);
+}
+
+// Probability of sampling the environment map rather than an area light in calculateDirect
+float environmentSelectProbability()
+{
+    if (useEnvironmentMap == 0)
+    {
+        return 0.0;
+    }
+    return nLights == 0 ? 1.0 : 0.5;
+}
+
+// Samples a new direction based on the material's BSDF; it returns the new world-space direction along with the reflected colour, PDF value, and a flag indicating if the reflection is specular
+float3 sampleBSDF(HitData hitData, inout uint rndState, out float3 reflectedColour, out float pdf, out bool isSpecular)
+{
+    // Convert the outgoing ray direction to local space
+    float3 woLocal = mul(-hitData.direction, transpose(hitData.tbn));
+    float3 wiLocal;
+    isSpecular = false;
+
+    // Different sampling based on the BSDF type
+    if (hitData.bsdf == 0) // Diffuse
     {
         wiLocal = cosineSampleHemisphere(rnd(rndState), rnd(rndState));
         reflectedColour = hitData.albedo / PI;
@@ -471,11 +1777,9 @@ float3 sampleBSDF(HitData hitData, inout uint rndState, out float3 reflectedColo
     return normalize(mul(wiLocal, hitData.tbn));
 }
 
-// Evaluates the BSDF function for the given hit and incoming light direction
+// Evaluates the BSDF function for the given hit and incoming light direction; it does not read the ray, so ray generation passes can call it
 float3 evaluateBSDF(HitData hitData, float3 wi)
 {
-    float3 woLocal = mul(WorldRayDirection(), hitData.tbn);
-    float3 wiLocal = mul(wi, hitData.tbn);
     if (hitData.bsdf == 0) // Diffuse
     {
         return hitData.albedo / PI;
@@ -541,115 +1845,2411 @@ bool visible(float3 p1, float3 p2)
     return shadowPayload.pathThroughput.r > 0;
 }
 
-// Calculates the direct lighting contribution at a hit point
-float3 calculateDirect(HitData hitData, inout uint rndState)
+// Returns the pdf of sampleBSDF generating the direction wi, zero for specular and emissive surfaces
+float pdfBSDF(HitData hitData, float3 wi)
 {
-    // If using an environment map and either randomly sampling the environment or if no lights exist
-    if (useEnvironmentMap == 1 && (rnd(rndState) < (float)nLights + 1 || nLights == 0))
-    {
-        // Sample a point on the sphere (environment)
-        float pmf = (1.0f / (float)(nLights + 1));
-        float3 wi = uniformSampleSphere(rnd(rndState), rnd(rndState));
-        float pdf = uniformSpherePDF();
-        if (dot(hitData.normal, wi) > 0)
-        {
-            if (visible(hitData.pos + (wi * 1000), hitData.pos))
-            {
-                return evaluateEnvironmentMap(wi) * evaluateBSDF(hitData, wi) * dot(hitData.normal, wi) / (pmf * pdf);
-            }
-        }
-    } else
+    if (hitData.bsdf == 1 || hitData.bsdf == 3)
     {
-        // Otherwise, sample an area light
-        float pmf;
-        AreaLightData light = sampleLight(rndState, pmf);
-        pmf = (1.0f / (float)(nLights + 1));
-        // Sample a point on the light's surface
-        float pdf;
-        float3 p = sampleAreaLight(light, rndState, pdf);
-        // Compute the geometry term
-        float3 wi = p - hitData.pos;
-        float l = length(wi);
-        wi = normalize(wi);
-        float GTerm = max(dot(hitData.normal, wi), 0.0) * max(dot(light.normal, -wi), 0.0) / (l * l);
-        if (GTerm > 0)
-        {
-            // Check if the light is visible from the hit point
-            if (visible(p, hitData.pos))
-            {
-                return light.Le * evaluateBSDF(hitData, wi) * GTerm / (pmf * pdf);
-            }
-        }
+        return 0.0;
     }
-    // Return zero contribution if no valid light sample was found
-    return float3(0, 0, 0);
+    float3 wiLocal = mul(wi, hitData.tbn);
+    return max(cosineHemispherePDF(wiLocal), 0.0);
 }
 
-// Closest hit shader executed when a ray hits geometry
-[shader("closesthit")]
-void ClosestHit(inout Payload payload, BuiltInTriangleIntersectionAttributes attrib)
+// Returns true if calculateDirect can produce a contribution for the BSDF, so emission found by BSDF sampling must be MIS weighted
+bool bsdfUsesLightSampling(uint bsdf)
 {
-    // Compute hit data using the intersection attributes
-    HitData hitData = calculateHitData(attrib);
+    return bsdf != 1 && bsdf != 3 && bsdf != 4;
+}
 
-    // If the hit object is a light and it's the first bounce, return its emitted light
-    if (isLight(hitData) && (payload.depth == 0 || decodeIsSpecular(payload.flags)))
-    {
-        payload.colour = float3(hitData.instance.bsdfData[0], hitData.instance.bsdfData[1], hitData.instance.bsdfData[2]);
-        return;
-    }
+// Maps a direction to the unit square by its cosine around z and its azimuth, which preserves area; mirrors
+// guidingDirectionToSquare in PathGuiding.h
+float2 guidingDirectionToSquare(float3 d)
+{
+    float phi = atan2(d.y, d.x) / (2.0 * PI);
+    return float2(saturate((d.z * 0.5) + 0.5), phi < 0 ? phi + 1.0 : phi);
+}
 
-    // Accumulate direct lighting contribution
-    payload.colour = payload.colour + (payload.pathThroughput * calculateDirect(hitData, payload.rndState));
+// Inverse of guidingDirectionToSquare; mirrors guidingSquareToDirection in PathGuiding.h
+float3 guidingSquareToDirection(float2 s)
+{
+    float cosTheta = (2.0 * s.x) - 1.0;
+    float sinTheta = sqrt(max(1.0 - (cosTheta * cosTheta), 0.0));
+    float phi = 2.0 * PI * s.y;
+    return float3(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+}
 
-    // Terminate recursion if maximum depth reached
-    if (payload.depth == 6)
-    {
-        return;
-    }
+// Returns the quadrant of a D-tree node holding a point of its square and rescales the point to the quadrant's square;
+// mirrors DTree::quadrant
+uint guidingQuadrant(inout float2 s)
+{
+    uint qx = s.x >= 0.5 ? 1 : 0;
+    uint qy = s.y >= 0.5 ? 1 : 0;
+    s = (s * 2.0) - float2((float)qx, (float)qy);
+    return qx + (2 * qy);
+}
 
-    // Apply Russian Roulette termination for deeper bounces
-    if (payload.depth > 3)
+// Returns the root of the D-tree guiding the directions at a point, found by halving the S-tree's cell along each
+// node's axis; mirrors PathGuiding::leaf
+uint guidingTree(float3 p)
+{
+    float3 lo = guidingMin;
+    float3 hi = guidingMax;
+    uint node = 0;
+    [loop]
+    while (true)
     {
-        float q = min(dot(payload.pathThroughput, float3(0.2126, 0.7152, 0.0722)), 0.7);
-        if (rnd(payload.rndState) < q || payload.depth == 7)
+        GuidingNode current = guidingNodes[node];
+        if (current.children.x == GUIDING_LEAF)
         {
-            return;
+            return current.children.w;
+        }
+        uint axis = current.children.z;
+        float mid = (lo[axis] + hi[axis]) * 0.5;
+        if (p[axis] < mid)
+        {
+            hi[axis] = mid;
+            node = current.children.x;
+        } else
+        {
+            lo[axis] = mid;
+            node = current.children.y;
+        }
+    }
+    return 0;
+}
+
+// Density over solid angle of the directions guidingSample draws from a D-tree; mirrors DTree::pdf
+float guidingPdf(uint root, float3 wi)
+{
+    float2 s = guidingDirectionToSquare(wi);
+    float p = 1.0;
+    uint node = root;
+    [loop]
+    while (true)
+    {
+        GuidingNode current = guidingNodes[node];
+        float t = dot(current.sums, float4(1, 1, 1, 1));
+        if (t <= 0)
+        {
+            break;
+        }
+        uint q = guidingQuadrant(s);
+        p = p * 4.0 * current.sums[q] / t;
+        if (current.children[q] == GUIDING_LEAF)
+        {
+            break;
+        }
+        node = current.children[q];
+    }
+    return p / (4.0 * PI);
+}
+
+// Draws a direction from a D-tree proportionally to the radiance it recorded; mirrors DTree::sample
+float3 guidingSample(uint root, inout uint rndState)
+{
+    float r1 = rnd(rndState);
+    float r2 = rnd(rndState);
+    float2 origin = float2(0, 0);
+    float size = 1.0;
+    uint node = root;
+    [loop]
+    while (true)
+    {
+        GuidingNode current = guidingNodes[node];
+        float t = dot(current.sums, float4(1, 1, 1, 1));
+        if (t <= 0)
+        {
+            break;
+        }
+        float left = (current.sums[0] + current.sums[2]) / t;
+        uint qx = r1 < left ? 0 : 1;
+        r1 = qx == 0 ? r1 / left : (r1 - left) / (1.0 - left);
+        float bottom = current.sums[qx] / (current.sums[qx] + current.sums[qx + 2]);
+        uint qy = r2 < bottom ? 0 : 1;
+        r2 = qy == 0 ? r2 / bottom : (r2 - bottom) / (1.0 - bottom);
+        r1 = min(r1, 0.99999994);
+        r2 = min(r2, 0.99999994);
+        size = size * 0.5;
+        origin = origin + (float2((float)qx, (float)qy) * size);
+        uint q = qx + (2 * qy);
+        if (current.children[q] == GUIDING_LEAF)
+        {
+            break;
+        }
+        node = current.children[q];
+    }
+    return guidingSquareToDirection(origin + (float2(r1, r2) * size));
+}
+
+// Returns true if the scattering directions at a hit are drawn from the mixture of its BSDF and the guiding
+// distribution around it. Only BSDFs sampled by their cosine lobe, whose pdf pdfBSDF returns, are guided
+bool guidingSamples(HitData hitData)
+{
+    return (guidingMode & GUIDING_SAMPLE) != 0 && bsdfUsesLightSampling(hitData.bsdf);
+}
+
+// Pdf of a direction drawn from the mixture of a hit's BSDF and the D-tree guiding it
+float guidingMixturePdf(HitData hitData, uint root, float3 wi)
+{
+    return ((1.0 - GUIDING_FRACTION) * pdfBSDF(hitData, wi)) + (GUIDING_FRACTION * guidingPdf(root, wi));
+}
+
+// Pdf of the scattering directions shadeHit draws at a hit, which light sampling is weighted against
+float scatterPdf(HitData hitData, float3 wi)
+{
+    return guidingSamples(hitData) ? guidingMixturePdf(hitData, guidingTree(hitData.pos), wi) : pdfBSDF(hitData, wi);
+}
+
+// Appends a record of the radiance arriving at a point from a direction, divided by the direction's pdf, for training
+void guidingRecord(float3 pos, float3 wi, float value)
+{
+    uint index;
+    InterlockedAdd(guidingRecords[0].count, 1, index);
+    if (index + 1 < GUIDING_MAX_RECORDS)
+    {
+        GuidingRecord r;
+        r.position = pos;
+        r.value = value;
+        r.direction = guidingDirectionToSquare(wi);
+        r.count = 0;
+        r.pad = 0;
+        guidingRecords[index + 1] = r;
+    }
+}
+
+// Power heuristic (beta = 2) weight for a sample drawn with pdf a, combined with a strategy with pdf b
+float powerHeuristic(float a, float b)
+{
+    float a2 = a * a;
+    float b2 = b * b;
+    return (a2 + b2) > 0 ? a2 / (a2 + b2) : 0.0;
+}
+
+// Returns the probability of calculateDirect selecting a given area light at a shading point
+float lightSelectPmf(float3 p, float3 n, uint lightIndex)
+{
+    uint cell;
+    float total;
+    float mix = lightCacheCellMix(p, n, cell, total);
+    float pmf = defaultLightPmf(p, n, lightIndex);
+    return mix > 0 ? (mix * lightCachePmf(cell, total, lightIndex)) + ((1.0 - mix) * pmf) : pmf;
+}
+
+// A light sample taken by sampleDirect, with the shadow ray that decides it: the contribution it makes if the segment
+// from "from" to "to" is unoccluded, already weighted and divided by its selection probability, and for area lights
+// the light and the luminance of its unweighted contribution, which the light cache learns from
+struct DirectSample
+{
+    bool traced;              // Whether the sample needs its shadow ray; without one it contributes nothing
+    float3 from;
+    float3 to;
+    float3 radiance;
+    uint lightIndex;          // DIRECT_NO_LIGHT for the environment, or when no area light could be selected
+    float deposit;
+};
+#define DIRECT_NO_LIGHT 0xFFFFFFFF
+
+// Samples the direct lighting at a hit point, up to the shadow ray, which calculateDirect traces and the wavefront
+// passes queue. Samples are weighted with the power heuristic against BSDF sampling, which picks up the remaining
+// weight in shadeHit and shadeMiss when a BSDF sampled ray reaches an emitter. Vertices that end the path take no
+// BSDF sample, so they pass misWeighted = false and take the full light sample
+DirectSample sampleDirect(HitData hitData, bool misWeighted, inout uint rndState)
+{
+    DirectSample direct;
+    direct.traced = false;
+    direct.from = float3(0, 0, 0);
+    direct.to = hitData.pos;
+    direct.radiance = float3(0, 0, 0);
+    direct.lightIndex = DIRECT_NO_LIGHT;
+    direct.deposit = 0;
+    // Nothing to sample if there are no emitters
+    float envProb = environmentSelectProbability();
+    if (useEnvironmentMap == 0 && nLights == 0)
+    {
+        return direct;
+    }
+    // Choose between the environment map and the area lights
+    if (rnd(rndState) < envProb)
+    {
+        // Sample a direction proportionally to the environment map's luminance
+        float pmf = envProb;
+        float pdf;
+        float3 wi = sampleEnvironment(rndState, pdf);
+        if (pdf > 0 && dot(hitData.normal, wi) > 0)
+        {
+            float weight = misWeighted ? powerHeuristic(pmf * pdf, scatterPdf(hitData, wi)) : 1.0;
+            direct.traced = true;
+            direct.from = hitData.pos + (wi * 1000);
+            direct.radiance = evaluateEnvironmentMap(wi) * evaluateBSDF(hitData, wi) * dot(hitData.normal, wi) * weight / (pmf * pdf);
+        }
+    } else
+    {
+        // Otherwise, sample an area light proportionally to its power
+        float pmf;
+        uint lightIndex = selectLight(hitData.pos, hitData.normal, rndState, pmf);
+        if (pmf <= 0)
+        {
+            return direct;
+        }
+        direct.lightIndex = lightIndex;
+        AreaLightData light = areaLightData[lightIndex];
+        pmf = pmf * (1.0f - envProb);
+        // Sample a direction towards the light, by solid angle where possible
+        float pdf;
+        float3 wi;
+        float3 p;
+        if (sampleTriangleLight(light, hitData.pos, rndState, wi, p, pdf) && pdf > 0)
+        {
+            float cosTheta = dot(hitData.normal, wi);
+            if (cosTheta > 0)
+            {
+                float3 contribution = light.Le * evaluateBSDF(hitData, wi) * cosTheta / pdf;
+                float weight = misWeighted && any(contribution > 0) ? powerHeuristic(pmf * pdf, scatterPdf(hitData, wi)) : 1.0;
+                direct.traced = true;
+                direct.from = p;
+                direct.radiance = contribution * weight / pmf;
+                direct.deposit = luminance(contribution);
+            }
+        }
+    }
+    return direct;
+}
+
+// Teaches the light cache what a light sample contributed at a hit point, including nothing when it was occluded
+void directDeposit(DirectSample direct, float3 normal, bool lit)
+{
+    if (useLightCache == 1 && direct.lightIndex != DIRECT_NO_LIGHT)
+    {
+        lightCacheDeposit(direct.to, normal, direct.lightIndex, lit ? direct.deposit : 0.0);
+    }
+}
+
+// The light sample the invocation's last calculateDirect took, when the wavefront passes shade, which return no
+// lighting from it and leave its shadow ray for WavefrontShadow
+static DirectSample wavefrontDirect;
+
+// Calculates the direct lighting contribution at a hit point, tracing the shadow ray of a sample from sampleDirect
+float3 calculateDirect(HitData hitData, bool misWeighted, inout uint rndState)
+{
+    DirectSample direct = sampleDirect(hitData, misWeighted, rndState);
+    if (wavefrontShading)
+    {
+        wavefrontDirect = direct;
+        return float3(0, 0, 0);
+    }
+    // Check if the light is visible from the hit point
+    bool lit = direct.traced && visible(direct.from, direct.to);
+    directDeposit(direct, hitData.normal, lit);
+    return lit ? direct.radiance : float3(0, 0, 0);
+}
+
+// Returns the emission reaching the previous path vertex from the light hit by a BSDF sampled ray, weighted against light sampling
+float3 weightedEmission(HitData hitData, Payload payload)
+{
+    uint lightIndex = hitData.instance.lightOffset + hitData.primitive;
+    AreaLightData light = areaLightData[lightIndex];
+    float3 wi = hitData.direction;
+    // Lights only emit from their front face
+    if (dot(light.normal, -wi) <= 0)
+    {
+        return float3(0, 0, 0);
+    }
+    float lightPdf = lightSelectPmf(payload.lastPosition, payload.lastNormal, lightIndex) * (1.0 - environmentSelectProbability());
+    lightPdf = lightPdf * triangleLightPdf(light, payload.lastPosition, wi, hitData.pos);
+    return light.Le * powerHeuristic(payload.lastPdf, lightPdf);
+}
+
+// Streams one candidate into a reservoir with resampling weight target / sourcePdf; mirrors Reservoir::update in Reservoir.h
+bool reservoirUpdate(inout ReSTIRReservoir r, uint lightIndex, float3 samplePoint, float weight, float target, float u)
+{
+    r.weightSum = r.weightSum + weight;
+    r.M = r.M + 1.0;
+    if (weight > 0 && (u * r.weightSum) < weight)
+    {
+        r.samplePoint = samplePoint;
+        r.lightIndex = lightIndex;
+        r.targetPdf = target;
+        return true;
+    }
+    return false;
+}
+
+// Streams another reservoir into r, where target is the target function of its sample at r's surface; mirrors Reservoir::merge
+bool reservoirMerge(inout ReSTIRReservoir r, ReSTIRReservoir other, float target, float u)
+{
+    float weight = target * other.W * other.M;
+    r.weightSum = r.weightSum + weight;
+    r.M = r.M + other.M;
+    if (weight > 0 && (u * r.weightSum) < weight)
+    {
+        r.samplePoint = other.samplePoint;
+        r.lightIndex = other.lightIndex;
+        r.targetPdf = target;
+        return true;
+    }
+    return false;
+}
+
+// Computes the contribution weight, where Z counts the candidates from surfaces at which the selected sample has a non-zero target; mirrors Reservoir::finalise
+void reservoirFinalise(inout ReSTIRReservoir r, float Z)
+{
+    r.W = (r.targetPdf > 0 && Z > 0) ? r.weightSum / (Z * r.targetPdf) : 0.0;
+}
+
+// Returns an empty reservoir
+ReSTIRReservoir emptyReservoir()
+{
+    ReSTIRReservoir r;
+    r.samplePoint = float3(0, 0, 0);
+    r.lightIndex = 0;
+    r.weightSum = 0;
+    r.M = 0;
+    r.W = 0;
+    r.targetPdf = 0;
+    return r;
+}
+
+// Rebuilds the hit data the BSDF functions need from a stored primary surface
+HitData restirHitData(ReSTIRSurface surface)
+{
+    HitData hitData = (HitData)0;
+    hitData.pos = surface.pos;
+    hitData.normal = surface.normal;
+    hitData.tbn = buildTBN(surface.normal);
+    hitData.bsdf = surface.bsdf;
+    hitData.albedo = surface.albedo;
+    return hitData;
+}
+
+// Returns true if two primary surfaces are close enough in orientation and position to share reservoirs
+bool restirSimilar(ReSTIRSurface a, ReSTIRSurface b)
+{
+    return b.valid == 1 && dot(a.normal, b.normal) > 0.9 && abs(dot(b.normal, a.pos - b.pos)) < (0.05 * a.depth);
+}
+
+// Unshadowed contribution of a reservoir sample to a surface. Light samples are measured per unit light area so that
+// every surface shares the same domain, environment map samples per unit solid angle
+float3 restirContribution(ReSTIRSurface surface, uint lightIndex, float3 samplePoint)
+{
+    HitData hitData = restirHitData(surface);
+    if (lightIndex == RESERVOIR_ENVIRONMENT)
+    {
+        float cosTheta = dot(surface.normal, samplePoint);
+        if (useEnvironmentMap == 0 || cosTheta <= 0)
+        {
+            return float3(0, 0, 0);
+        }
+        return evaluateEnvironmentMap(samplePoint) * evaluateBSDF(hitData, samplePoint) * cosTheta;
+    }
+    if (lightIndex >= nLights)
+    {
+        return float3(0, 0, 0);
+    }
+    AreaLightData light = areaLightData[lightIndex];
+    float3 d = samplePoint - surface.pos;
+    float distanceSq = dot(d, d);
+    if (distanceSq <= 0)
+    {
+        return float3(0, 0, 0);
+    }
+    float3 wi = d / sqrt(distanceSq);
+    float cosTheta = dot(surface.normal, wi);
+    float cosLight = -dot(light.normal, wi);
+    if (cosTheta <= 0 || cosLight <= 0)
+    {
+        return float3(0, 0, 0);
+    }
+    return light.Le * evaluateBSDF(hitData, wi) * cosTheta * cosLight / distanceSq;
+}
+
+// Target function used for resampling: the luminance of the unshadowed contribution
+float restirTarget(ReSTIRSurface surface, uint lightIndex, float3 samplePoint)
+{
+    return luminance(restirContribution(surface, lightIndex, samplePoint));
+}
+
+// Streams light candidates, drawn as in calculateDirect, through a new reservoir for the surface
+ReSTIRReservoir restirInitialCandidates(ReSTIRSurface surface, inout uint rndState)
+{
+    ReSTIRReservoir r = emptyReservoir();
+    if (useEnvironmentMap == 0 && nLights == 0)
+    {
+        return r;
+    }
+    float envProb = environmentSelectProbability();
+    for (uint i = 0; i < RESTIR_INITIAL_CANDIDATES; i++)
+    {
+        uint lightIndex = RESERVOIR_ENVIRONMENT;
+        float3 samplePoint = float3(0, 0, 0);
+        float sourcePdf = 0;
+        if (rnd(rndState) < envProb)
+        {
+            float pdf;
+            samplePoint = sampleEnvironment(rndState, pdf);
+            sourcePdf = envProb * pdf;
+        } else
+        {
+            float pmf;
+            lightIndex = selectLight(surface.pos, surface.normal, rndState, pmf);
+            float pdf;
+            float3 wi;
+            if (pmf > 0 && sampleTriangleLight(areaLightData[lightIndex], surface.pos, rndState, wi, samplePoint, pdf) && pdf > 0)
+            {
+                // Convert the solid angle pdf to the area measure the reservoirs share
+                float3 d = samplePoint - surface.pos;
+                sourcePdf = pmf * (1.0 - envProb) * pdf * -dot(wi, areaLightData[lightIndex].normal) / dot(d, d);
+            }
+        }
+        float target = sourcePdf > 0 ? restirTarget(surface, lightIndex, samplePoint) : 0.0;
+        reservoirUpdate(r, lightIndex, samplePoint, sourcePdf > 0 ? target / sourcePdf : 0.0, target, rnd(rndState));
+    }
+    reservoirFinalise(r, r.M);
+    return r;
+}
+
+// Records the primary surface of the current pixel for the ReSTIR passes and returns it
+ReSTIRSurface restirRecordSurface(HitData hitData)
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint2 size = DispatchRaysDimensions().xy;
+    uint pixel = (idx.y * size.x) + idx.x;
+    uint current = (frameIndex & 1) * size.x * size.y;
+
+    ReSTIRSurface surface;
+    surface.pos = hitData.pos;
+    surface.depth = hitData.t;
+    surface.normal = hitData.normal;
+    surface.bsdf = hitData.bsdf;
+    surface.albedo = hitData.albedo;
+    surface.valid = 1;
+    surface.radiance = float3(0, 0, 0);
+    surface.pad = 0;
+    restirSurfaces[current + pixel] = surface;
+    return surface;
+}
+
+// Finds the pixel that saw a surface last frame by reprojecting it, and returns true if the surface recorded there is
+// similar enough for its reservoirs to be reused
+bool restirPreviousPixel(ReSTIRSurface surface, out uint previousPixel, out ReSTIRSurface previousSurface)
+{
+    previousPixel = 0;
+    previousSurface = (ReSTIRSurface)0;
+    if (frameIndex == 0)
+    {
+        return false;
+    }
+    uint2 size = DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    uint previous = pixels - ((frameIndex & 1) * pixels);
+    float4 clip = mul(previousViewProjection, float4(surface.pos, 1.0));
+    if (clip.w <= 0)
+    {
+        return false;
+    }
+    float2 ndc = clip.xy / clip.w;
+    int2 previousIdx = int2(floor(((ndc.x * 0.5) + 0.5) * size.x), floor(((-ndc.y * 0.5) + 0.5) * size.y));
+    if (any(previousIdx < 0) || any(previousIdx >= (int2)size))
+    {
+        return false;
+    }
+    previousPixel = (previousIdx.y * size.x) + previousIdx.x;
+    previousSurface = restirSurfaces[previous + previousPixel];
+    return restirSimilar(surface, previousSurface);
+}
+
+// Resamples light candidates for the pixel's primary surface and reuses last frame's reservoir at the reprojected pixel.
+// The result is read by the spatial pass, which also shades it
+void restirPrimarySurface(ReSTIRSurface surface, inout uint rndState)
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint2 size = DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    uint pixel = (idx.y * size.x) + idx.x;
+
+    ReSTIRReservoir initial = restirInitialCandidates(surface, rndState);
+    ReSTIRReservoir r = emptyReservoir();
+    reservoirMerge(r, initial, initial.targetPdf, rnd(rndState));
+    float Z = initial.M;
+
+    // Temporal reuse of the final reservoir of the pixel that saw this point last frame
+    uint previousPixel;
+    ReSTIRSurface previousSurface;
+    if (restirPreviousPixel(surface, previousPixel, previousSurface))
+    {
+        ReSTIRReservoir temporal = restirReservoirs[pixels + previousPixel];
+        temporal.M = min(temporal.M, RESTIR_TEMPORAL_MAX_M * max(initial.M, 1.0));
+        reservoirMerge(r, temporal, restirTarget(surface, temporal.lightIndex, temporal.samplePoint), rnd(rndState));
+        // Last frame's candidates only count if its surface could have produced the selected sample
+        if (restirTarget(previousSurface, r.lightIndex, r.samplePoint) > 0)
+        {
+            Z = Z + temporal.M;
+        }
+    }
+    reservoirFinalise(r, Z);
+    restirReservoirs[pixel] = r;
+}
+
+// Traces the final shadow ray for a reservoir's sample and returns its contribution to the surface
+float3 restirShade(ReSTIRSurface surface, ReSTIRReservoir r)
+{
+    if (r.W <= 0)
+    {
+        return float3(0, 0, 0);
+    }
+    float3 lightPoint = r.lightIndex == RESERVOIR_ENVIRONMENT ? surface.pos + (r.samplePoint * 1000) : r.samplePoint;
+    if (visible(lightPoint, surface.pos) == false)
+    {
+        return float3(0, 0, 0);
+    }
+    return restirContribution(surface, r.lightIndex, r.samplePoint) * r.W;
+}
+
+// Ratio of the solid angles that the area around a secondary vertex subtends at the surfaces at 'to' and 'from', by
+// which a GI reservoir's contribution weight is scaled when another surface reconnects to its vertex. Zero if the
+// vertex faces away from either surface; mirrors reconnectionJacobian in Reservoir.h
+float reconnectionJacobian(float3 from, float3 to, float3 samplePos, float3 sampleNormal)
+{
+    float3 dFrom = from - samplePos;
+    float3 dTo = to - samplePos;
+    float distanceFromSq = dot(dFrom, dFrom);
+    float distanceToSq = dot(dTo, dTo);
+    if (distanceFromSq <= 0 || distanceToSq <= 0)
+    {
+        return 0.0;
+    }
+    float cosFrom = dot(sampleNormal, dFrom) / sqrt(distanceFromSq);
+    float cosTo = dot(sampleNormal, dTo) / sqrt(distanceToSq);
+    if (cosFrom <= 0 || cosTo <= 0)
+    {
+        return 0.0;
+    }
+    return (cosTo / cosFrom) * (distanceFromSq / distanceToSq);
+}
+
+// Streams one candidate vertex into a GI reservoir with resampling weight target / sourcePdf; mirrors GIReservoir::update in Reservoir.h
+bool giReservoirUpdate(inout GIReservoir r, float3 samplePos, float3 sampleNormal, float3 radiance, float weight, float target, float u)
+{
+    r.weightSum = r.weightSum + weight;
+    r.M = r.M + 1.0;
+    if (weight > 0 && (u * r.weightSum) < weight)
+    {
+        r.samplePos = samplePos;
+        r.sampleNormal = sampleNormal;
+        r.radiance = radiance;
+        r.targetPdf = target;
+        return true;
+    }
+    return false;
+}
+
+// Streams another surface's GI reservoir into r, where target is the target function of its vertex at r's surface and
+// jacobian the reconnectionJacobian from the other surface to r's; mirrors GIReservoir::merge
+bool giReservoirMerge(inout GIReservoir r, GIReservoir other, float target, float jacobian, float u)
+{
+    float weight = target * jacobian * other.W * other.M;
+    r.weightSum = r.weightSum + weight;
+    r.M = r.M + other.M;
+    if (weight > 0 && (u * r.weightSum) < weight)
+    {
+        r.samplePos = other.samplePos;
+        r.sampleNormal = other.sampleNormal;
+        r.radiance = other.radiance;
+        r.targetPdf = target;
+        return true;
+    }
+    return false;
+}
+
+// Computes the contribution weight as reservoirFinalise does; mirrors GIReservoir::finalise
+void giReservoirFinalise(inout GIReservoir r, float Z)
+{
+    r.W = (r.targetPdf > 0 && Z > 0) ? r.weightSum / (Z * r.targetPdf) : 0.0;
+}
+
+// Returns an empty GI reservoir
+GIReservoir emptyGIReservoir()
+{
+    return (GIReservoir)0;
+}
+
+// Unshadowed contribution of a reservoir's vertex to a surface with respect to solid angle at the surface. The vertex's
+// radiance was measured towards the surface that found it, which is exact for diffuse vertices
+float3 restirGIContribution(ReSTIRSurface surface, GIReservoir r)
+{
+    float3 d = r.samplePos - surface.pos;
+    float distanceSq = dot(d, d);
+    if (distanceSq <= 0)
+    {
+        return float3(0, 0, 0);
+    }
+    float3 wi = d / sqrt(distanceSq);
+    float cosTheta = dot(surface.normal, wi);
+    float cosVertex = -dot(r.sampleNormal, wi);
+    if (cosTheta <= 0 || cosVertex <= 0)
+    {
+        return float3(0, 0, 0);
+    }
+    return r.radiance * evaluateBSDF(restirHitData(surface), wi) * cosTheta;
+}
+
+// Target function used for resampling GI reservoirs: the luminance of the unshadowed contribution
+float restirGITarget(ReSTIRSurface surface, GIReservoir r)
+{
+    return luminance(restirGIContribution(surface, r));
+}
+
+// Target function including visibility. Reconnecting to another surface's vertex uses it, so every GI reservoir only
+// holds vertices its own surface sees and is shaded without a further ray
+float restirGIVisibleTarget(ReSTIRSurface surface, GIReservoir r)
+{
+    float target = restirGITarget(surface, r);
+    if (target > 0 && visible(r.samplePos, surface.pos) == false)
+    {
+        return 0.0;
+    }
+    return target;
+}
+
+// Records the first hit of a ray leaving a primary surface, with the emission it sends back, in the pixel's temporal GI
+// reservoir entry. The normal is flipped to face the ray, which travels along direction. Vertices whose radiance depends
+// on where they are seen from are recorded without a normal, which makes them unusable for reuse
+void restirGIRecordVertex(float3 pos, float3 normal, float3 direction, float3 emission, bool reusable)
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint pixel = (idx.y * DispatchRaysDimensions().x) + idx.x;
+    GIReservoir vertex = emptyGIReservoir();
+    vertex.samplePos = pos;
+    vertex.sampleNormal = reusable ? (dot(normal, direction) > 0 ? -normal : normal) : float3(0, 0, 0);
+    vertex.radiance = emission;
+    restirGIReservoirs[pixel] = vertex;
+}
+
+// Builds the pixel's GI reservoir from the vertex found by its primary surface's BSDF sampled ray, carrying the radiance
+// the rest of the path gathered, and reuses last frame's reservoir at the reprojected pixel. The spatial pass shades the result
+void restirGIPrimarySurface(ReSTIRSurface surface, GIReservoir vertex, float sourcePdf, inout uint rndState)
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint2 size = DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    uint pixel = (idx.y * size.x) + idx.x;
+
+    GIReservoir initial = emptyGIReservoir();
+    float target = sourcePdf > 0 ? restirGITarget(surface, vertex) : 0.0;
+    giReservoirUpdate(initial, vertex.samplePos, vertex.sampleNormal, vertex.radiance, sourcePdf > 0 ? target / sourcePdf : 0.0, target, rnd(rndState));
+    giReservoirFinalise(initial, initial.M);
+    GIReservoir r = emptyGIReservoir();
+    giReservoirMerge(r, initial, initial.targetPdf, 1.0, rnd(rndState));
+    float Z = initial.M;
+    uint history = pixels + ((frameIndex & 1) * pixels);
+    uint previousHistory = (2 * pixels) - ((frameIndex & 1) * pixels);
+
+    // Temporal reuse, reconnecting to the vertex of the pixel that saw this point last frame
+    uint previousPixel;
+    ReSTIRSurface previousSurface;
+    if (restirPreviousPixel(surface, previousPixel, previousSurface))
+    {
+        GIReservoir temporal = restirGIReservoirs[previousHistory + previousPixel];
+        temporal.M = min(temporal.M, RESTIR_TEMPORAL_MAX_M * max(initial.M, 1.0));
+        float jacobian = reconnectionJacobian(previousSurface.pos, surface.pos, temporal.samplePos, temporal.sampleNormal);
+        bool selected = giReservoirMerge(r, temporal, restirGIVisibleTarget(surface, temporal), jacobian, rnd(rndState));
+        // Last frame's candidates only count if its surface could hold the selected vertex, which it does if it provided it
+        if (selected || restirGIVisibleTarget(previousSurface, r) > 0)
+        {
+            Z = Z + temporal.M;
+        }
+    }
+    giReservoirFinalise(r, Z);
+    restirGIReservoirs[pixel] = r;
+    restirGIReservoirs[history + pixel] = r;
+}
+
+// Spatial reuse of GI reservoirs. Combines the pixel's reservoir with those of a few similar neighbours by reconnecting
+// to their vertices and returns the shaded indirect lighting
+float3 restirGISpatial(ReSTIRSurface surface, inout uint rndState)
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint2 size = DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    uint pixel = (idx.y * size.x) + idx.x;
+    uint current = (frameIndex & 1) * pixels;
+
+    GIReservoir own = restirGIReservoirs[pixel];
+    GIReservoir r = emptyGIReservoir();
+    giReservoirMerge(r, own, own.targetPdf, 1.0, rnd(rndState));
+    uint neighbours[RESTIR_SPATIAL_NEIGHBOURS];
+    uint count = 0;
+    int selected = -1;
+    for (uint i = 0; i < RESTIR_SPATIAL_NEIGHBOURS; i++)
+    {
+        float2 offset = (float2(rnd(rndState), rnd(rndState)) * 2.0 - 1.0) * RESTIR_SPATIAL_RADIUS;
+        int2 neighbourIdx = (int2)idx + (int2)round(offset);
+        if (any(neighbourIdx < 0) || any(neighbourIdx >= (int2)size) || all(neighbourIdx == (int2)idx))
+        {
+            continue;
+        }
+        uint neighbour = (neighbourIdx.y * size.x) + neighbourIdx.x;
+        ReSTIRSurface neighbourSurface = restirSurfaces[current + neighbour];
+        if (restirSimilar(surface, neighbourSurface) == false)
+        {
+            continue;
+        }
+        GIReservoir other = restirGIReservoirs[neighbour];
+        float jacobian = reconnectionJacobian(neighbourSurface.pos, surface.pos, other.samplePos, other.sampleNormal);
+        if (giReservoirMerge(r, other, restirGIVisibleTarget(surface, other), jacobian, rnd(rndState)))
+        {
+            selected = (int)count;
+        }
+        neighbours[count] = neighbour;
+        count = count + 1;
+    }
+    // Count the candidates of every combined reservoir whose surface could hold the selected vertex
+    float Z = own.M;
+    for (uint j = 0; j < count; j++)
+    {
+        if ((int)j == selected || restirGIVisibleTarget(restirSurfaces[current + neighbours[j]], r) > 0)
+        {
+            Z = Z + restirGIReservoirs[neighbours[j]].M;
+        }
+    }
+    giReservoirFinalise(r, Z);
+    return restirGIContribution(surface, r) * r.W;
+}
+
+// Returns the slot holding a cell, or HASH_GRID_INVALID; mirrors HashGrid::find
+uint hashGridFind(uint2 key)
+{
+    uint base = (key.x % (HASH_GRID_CAPACITY / HASH_GRID_BUCKET_SIZE)) * HASH_GRID_BUCKET_SIZE;
+    for (uint i = 0; i < HASH_GRID_BUCKET_SIZE; i++)
+    {
+        if (hashGridChecksums[base + i] == key.y)
+        {
+            return base + i;
+        }
+    }
+    return HASH_GRID_INVALID;
+}
+
+// Returns the slot holding a cell, claiming the first empty slot of its bucket if needed; mirrors HashGrid::insert
+uint hashGridInsert(uint2 key)
+{
+    uint slot = hashGridFind(key);
+    if (slot != HASH_GRID_INVALID)
+    {
+        return slot;
+    }
+    uint base = (key.x % (HASH_GRID_CAPACITY / HASH_GRID_BUCKET_SIZE)) * HASH_GRID_BUCKET_SIZE;
+    for (uint i = 0; i < HASH_GRID_BUCKET_SIZE; i++)
+    {
+        uint previous;
+        InterlockedCompareExchange(hashGridChecksums[base + i], 0, key.y, previous);
+        if (previous == 0 || previous == key.y)
+        {
+            return base + i;
+        }
+    }
+    return HASH_GRID_INVALID;
+}
+
+// Adds one radiance sample leaving a point to its cell; mirrors HashGrid::deposit
+void hashGridDeposit(float3 pos, float3 normal, float distance, float3 radiance)
+{
+    uint slot = hashGridInsert(hashGridKey(pos, normal, distance));
+    if (slot == HASH_GRID_INVALID)
+    {
+        return;
+    }
+    uint3 value = (uint3)((clamp(radiance, 0.0, HASH_GRID_MAX_RADIANCE) * HASH_GRID_RADIANCE_SCALE) + 0.5);
+    InterlockedAdd(hashGridEntries[slot].accumulated.x, value.x);
+    InterlockedAdd(hashGridEntries[slot].accumulated.y, value.y);
+    InterlockedAdd(hashGridEntries[slot].accumulated.z, value.z);
+    InterlockedAdd(hashGridEntries[slot].accumulatedCount, 1);
+}
+
+// Returns true and the cached radiance leaving a point if its cell has enough samples; mirrors HashGrid::lookup
+bool hashGridLookup(float3 pos, float3 normal, float distance, out float3 radiance)
+{
+    radiance = float3(0, 0, 0);
+    uint slot = hashGridFind(hashGridKey(pos, normal, distance));
+    if (slot == HASH_GRID_INVALID || hashGridEntries[slot].sampleCount < HASH_GRID_MIN_SAMPLES)
+    {
+        return false;
+    }
+    radiance = hashGridEntries[slot].radiance;
+    return true;
+}
+
+// Normal of a hit facing the ray that found it, so that cells are keyed by the side of the surface they are seen from
+float3 hashGridFacingNormal(HitData hitData)
+{
+    return dot(hitData.normal, hitData.direction) > 0 ? -hitData.normal : hitData.normal;
+}
+
+// Deposits the radiance a cache update path gathered from a vertex onwards, divided by the throughput that reached the
+// vertex so that it is the radiance leaving the vertex
+void hashGridDepositVertex(float3 pos, float3 facingNormal, float3 gathered, float3 throughput)
+{
+    float3 radiance;
+    radiance.r = throughput.r > 0 ? gathered.r / throughput.r : 0.0;
+    radiance.g = throughput.g > 0 ? gathered.g / throughput.g : 0.0;
+    radiance.b = throughput.b > 0 ? gathered.b / throughput.b : 0.0;
+    hashGridDeposit(pos, facingNormal, hashGridCameraDistance(pos), radiance);
+}
+
+// Maps a unit direction to the octahedral square [-1, 1]^2, folding the lower hemisphere into the corners; mirrors probeOctEncode in ProbeVolume.h
+float2 probeOctEncode(float3 d)
+{
+    float2 e = d.xy / (abs(d.x) + abs(d.y) + abs(d.z));
+    if (d.z < 0)
+    {
+        e = (1.0 - abs(e.yx)) * float2(e.x >= 0 ? 1.0 : -1.0, e.y >= 0 ? 1.0 : -1.0);
+    }
+    return e;
+}
+
+// Maps a point of the octahedral square back to a unit direction; mirrors probeOctDecode in ProbeVolume.h
+float3 probeOctDecode(float2 e)
+{
+    float3 d = float3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (d.z < 0)
+    {
+        d.xy = (1.0 - abs(e.yx)) * float2(e.x >= 0 ? 1.0 : -1.0, e.y >= 0 ? 1.0 : -1.0);
+    }
+    return normalize(d);
+}
+
+// Direction through the centre of a texel of a tile with the given number of texels along each side
+float3 probeTexelDirection(uint2 texel, uint texels)
+{
+    return probeOctDecode(((((float2)texel + 0.5) / (float)texels) * 2.0) - 1.0);
+}
+
+// Maps a texel one step outside a tile to the texel inside it covering the same directions; mirrors probeWrapTexel in ProbeVolume.h
+int2 probeWrapTexel(int2 texel, int texels)
+{
+    if (texel.x < 0 || texel.x >= texels)
+    {
+        texel.x = clamp(texel.x, 0, texels - 1);
+        texel.y = texels - 1 - texel.y;
+    }
+    if (texel.y < 0 || texel.y >= texels)
+    {
+        texel.y = clamp(texel.y, 0, texels - 1);
+        texel.x = texels - 1 - texel.x;
+    }
+    return texel;
+}
+
+// Bilinear weights and wrapped texel indices of the four texels around direction d in a probe's tile; mirrors probeSampleTile in ProbeVolume.h
+void probeBilinear(uint probe, float3 d, int texels, out uint4 indices, out float4 weights)
+{
+    float2 t = (((probeOctEncode(d) + 1.0) * 0.5) * (float)texels) - 0.5;
+    int2 t0 = (int2)floor(t);
+    float2 f = t - (float2)t0;
+    uint base = probe * texels * texels;
+    for (uint i = 0; i < 4; i++)
+    {
+        int2 texel = probeWrapTexel(t0 + int2(i & 1, i >> 1), texels);
+        indices[i] = base + (texel.y * texels) + texel.x;
+        weights[i] = ((i & 1) ? f.x : 1.0 - f.x) * ((i >> 1) ? f.y : 1.0 - f.y);
+    }
+}
+
+// Irradiance a probe holds for a surface facing direction d
+float3 probeSampleIrradiance(uint probe, float3 d)
+{
+    uint4 indices;
+    float4 weights;
+    probeBilinear(probe, d, PROBE_IRRADIANCE_TEXELS, indices, weights);
+    float3 irradiance = float3(0, 0, 0);
+    for (uint i = 0; i < 4; i++)
+    {
+        irradiance = irradiance + (probeIrradiance[indices[i]].xyz * weights[i]);
+    }
+    return irradiance;
+}
+
+// Mean and mean squared distance a probe sees around direction d
+float2 probeSampleDistance(uint probe, float3 d)
+{
+    uint4 indices;
+    float4 weights;
+    probeBilinear(probe, d, PROBE_DISTANCE_TEXELS, indices, weights);
+    float2 moments = float2(0, 0);
+    for (uint i = 0; i < 4; i++)
+    {
+        moments = moments + (probeDistance[indices[i]] * weights[i]);
+    }
+    return moments;
+}
+
+// Direction of the i-th of n points on a spherical Fibonacci spiral; mirrors sphericalFibonacci in ProbeVolume.h
+float3 sphericalFibonacci(uint i, uint n)
+{
+    float phi = 2.0 * PI * frac((float)i * 0.6180339887);
+    float cosTheta = 1.0 - ((2.0 * (float)i) + 1.0) / (float)n;
+    float sinTheta = sqrt(max(1.0 - (cosTheta * cosTheta), 0.0));
+    return float3(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+}
+
+// Random rotation shared by every probe's rays this frame, so that successive updates cover different directions.
+// Built from a uniformly distributed unit quaternion
+float3x3 probeRayRotation()
+{
+    uint rndState = hashPCG(probeFrame);
+    float u1 = rnd(rndState);
+    float u2 = 2.0 * PI * rnd(rndState);
+    float u3 = 2.0 * PI * rnd(rndState);
+    float4 q = float4(sqrt(1.0 - u1) * sin(u2), sqrt(1.0 - u1) * cos(u2), sqrt(u1) * sin(u3), sqrt(u1) * cos(u3));
+    return float3x3(
+        1.0 - (2.0 * ((q.y * q.y) + (q.z * q.z))), 2.0 * ((q.x * q.y) - (q.z * q.w)), 2.0 * ((q.x * q.z) + (q.y * q.w)),
+        2.0 * ((q.x * q.y) + (q.z * q.w)), 1.0 - (2.0 * ((q.x * q.x) + (q.z * q.z))), 2.0 * ((q.y * q.z) - (q.x * q.w)),
+        2.0 * ((q.x * q.z) - (q.y * q.w)), 2.0 * ((q.y * q.z) + (q.x * q.w)), 1.0 - (2.0 * ((q.x * q.x) + (q.y * q.y))));
+}
+
+// Index of the probe at grid coordinates g; mirrors ProbeVolume::probeIndex
+uint probeIndex(int3 g)
+{
+    return g.x + (probeCounts.x * (g.y + (probeCounts.y * g.z)));
+}
+
+// Position of a probe; mirrors ProbeVolume::probePosition
+float3 probePosition(uint probe)
+{
+    uint3 g = uint3(probe % probeCounts.x, (probe / probeCounts.x) % probeCounts.y, probe / (probeCounts.x * probeCounts.y));
+    return probeOrigin + (probeSpacing * (float3)g);
+}
+
+// Irradiance at a surface point interpolated from the cage of eight probes around it. Each probe is weighted by its
+// trilinear weight, by how far it lies in front of the surface and by a Chebyshev test of the point's distance against
+// the distances the probe saw towards it, which stops light leaking through walls
+float3 probeVolumeIrradiance(float3 pos, float3 normal, float3 viewDirection)
+{
+    float minSpacing = min(probeSpacing.x, min(probeSpacing.y, probeSpacing.z));
+    float3 biasedPos = pos + (((normal * PROBE_NORMAL_BIAS) + (viewDirection * PROBE_VIEW_BIAS)) * minSpacing);
+    int3 maxCoordinates = (int3)probeCounts - 1;
+    float3 g = clamp((biasedPos - probeOrigin) / probeSpacing, float3(0, 0, 0), (float3)maxCoordinates);
+    int3 base = min((int3)floor(g), max(maxCoordinates - 1, int3(0, 0, 0)));
+    float3 alpha = saturate(g - (float3)base);
+    float3 irradiance = float3(0, 0, 0);
+    float weightSum = 0;
+    for (uint i = 0; i < 8; i++)
+    {
+        int3 offset = int3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+        uint probe = probeIndex(min(base + offset, maxCoordinates));
+        float3 probePos = probePosition(probe);
+        float3 trilinear = lerp(1.0 - alpha, alpha, (float3)offset);
+        // Probes behind the surface see little of what lights it
+        float3 toProbe = normalize(probePos - pos);
+        float facing = (dot(toProbe, normal) + 1.0) * 0.5;
+        float weight = (facing * facing) + 0.2;
+        // Probes that cannot see the point are mostly ignored
+        float3 probeToPoint = biasedPos - probePos;
+        float pointDistance = length(probeToPoint);
+        float2 moments = probeSampleDistance(probe, probeToPoint / max(pointDistance, 1e-6));
+        if (pointDistance > moments.x)
+        {
+            float variance = abs(moments.y - (moments.x * moments.x));
+            float d = pointDistance - moments.x;
+            float chebyshev = variance / (variance + (d * d));
+            weight = weight * max(chebyshev * chebyshev * chebyshev, 0.0);
+        }
+        // Crush small weights so that a probe behind a wall fades out completely
+        weight = max(weight, 1e-6);
+        if (weight < 0.2)
+        {
+            weight = weight * weight * weight / (0.2 * 0.2);
+        }
+        weight = weight * trilinear.x * trilinear.y * trilinear.z;
+        irradiance = irradiance + (probeSampleIrradiance(probe, normal) * weight);
+        weightSum = weightSum + weight;
+    }
+    return weightSum > 0 ? irradiance / weightSum : float3(0, 0, 0);
+}
+
+// Grid bucket of a photon map cell; mirrors PhotonMap::cellHash
+uint photonCellHash(int3 c)
+{
+    return (((uint)c.x * 73856093u) ^ ((uint)c.y * 19349663u) ^ ((uint)c.z * 83492791u)) % PHOTON_GRID_CELLS;
+}
+
+// Caustic radiance reflected towards the ray at a diffuse hit, from the photons within photonRadius arriving on the side
+// the ray comes from. The grid's cells are twice the radius wide, so the photons in reach lie in the 2x2x2 cells
+// around the point; photons of other cells sharing a bucket are skipped. Mirrors PhotonMap::gather
+float3 photonGather(HitData hitData)
+{
+    if (photonCount == 0)
+    {
+        return float3(0, 0, 0);
+    }
+    float cellSize = 2.0 * photonRadius;
+    float r2 = photonRadius * photonRadius;
+    float3 n = dot(hitData.normal, hitData.direction) < 0 ? hitData.normal : -hitData.normal;
+    int3 base = (int3)floor((hitData.pos / cellSize) - 0.5);
+    float3 power = float3(0, 0, 0);
+    for (uint i = 0; i < 8; i++)
+    {
+        int3 c = base + int3(i & 1, (i >> 1) & 1, i >> 2);
+        uint2 bucket = photonCells[photonCellHash(c)];
+        for (uint j = 0; j < bucket.y; j++)
+        {
+            Photon photon = photons[1 + bucket.x + j];
+            float3 d = photon.position - hitData.pos;
+            if (dot(d, d) <= r2 && dot(photon.direction, n) > 0 && all((int3)floor(photon.position / cellSize) == c))
+            {
+                power = power + photon.power;
+            }
+        }
+    }
+    return evaluateBSDF(hitData, n) * power / (PI * r2);
+}
+
+// Stores a photon after the photon heading the buffer, dropping it once the buffer is full
+void photonStore(float3 pos, float3 power, float3 direction)
+{
+    uint index;
+    InterlockedAdd(photons[0].count, 1, index);
+    if (index + 1 < PHOTON_MAX)
+    {
+        Photon photon = (Photon)0;
+        photon.position = pos;
+        photon.power = power;
+        photon.direction = direction;
+        photons[1 + index] = photon;
+    }
+}
+
+// A photon's hit: lights and surfaces light sampling cannot reach end it, specular surfaces reflect it, and the first
+// surface light sampling shades past a specular bounce stores it, as direct lighting covers photons arriving straight
+// from the lights
+void photonHit(HitData hitData, inout Payload payload)
+{
+    payload.lastPdf = 0;
+    if (isLight(hitData))
+    {
+        return;
+    }
+    if (bsdfUsesLightSampling(hitData.bsdf))
+    {
+        if (payload.depth > 0)
+        {
+            photonStore(hitData.pos, payload.colour, -hitData.direction);
+        }
+        return;
+    }
+    float3 reflectedColour;
+    float pdf;
+    bool isSpecular;
+    float3 wi = sampleBSDF(hitData, payload.rndState, reflectedColour, pdf, isSpecular);
+    float cosTheta = dot(wi, hitData.normal);
+    if (isSpecular == false || pdf <= 0 || cosTheta <= 0)
+    {
+        return;
+    }
+    payload.colour = payload.colour * reflectedColour * cosTheta / pdf;
+    payload.depth = payload.depth + 1;
+    payload.lastPosition = hitData.pos + (hitData.normal * 0.001);
+    payload.lastNormal = wi;
+    payload.lastPdf = pdf;
+}
+
+// Shades a camera path's or probe ray's ray from origin along direction leaving the scene, which sees the environment
+void shadeMiss(inout Payload payload, float3 origin, float3 direction)
+{
+    // Camera rays leaving the scene see the environment, which the denoiser leaves as it is, and are reprojected from
+    // a point far along them
+    if (payload.depth == 0 && decodeIsProbeRay(payload.flags) == false)
+    {
+        if (temporalReproject == 1)
+        {
+            temporalReprojectPixel(origin + (direction * DENOISER_MISS_DEPTH), float3(0, 0, 0), DENOISER_MISS_DEPTH);
+        }
+        denoiserRecord(float3(0, 0, 0), float3(0, 0, 0), DENOISER_MISS_DEPTH, evaluateEnvironmentMap(direction));
+    }
+
+    // Directions found by BSDF sampling are weighted against environment sampling in calculateDirect
+    // Directions leaving a surface lit from a ReSTIR reservoir add nothing, the reservoir accounts for the environment,
+    // and neither do probe rays, as the points shaded with the probes light themselves from the environment
+    float weight = 1.0;
+    if (payload.depth > 0 && decodeIsSpecular(payload.flags) == false)
+    {
+        float lightPdf = useEnvironmentMap == 1 ? environmentSelectProbability() * environmentPdf(direction) : 0.0;
+        weight = powerHeuristic(payload.lastPdf, lightPdf);
+    }
+    if ((decodeIsReservoirLit(payload.flags) || decodeIsProbeRay(payload.flags)) && useEnvironmentMap == 1)
+    {
+        weight = 0.0;
+    }
+    float3 emission = evaluateEnvironmentMap(direction) * weight;
+    payload.colour = payload.colour + (payload.pathThroughput * emission);
+    // A ray leaving a ReSTIR GI surface that escapes is recorded as a vertex far along the ray that only emits
+    if (decodeIsGIVertex(payload.flags))
+    {
+        restirGIRecordVertex(origin + (direction * 1000), -direction, direction, emission, true);
+    }
+}
+
+// Miss shader for shadow rays, probe rays and photons; camera paths miss in PathMiss
+[shader("miss")]
+void Miss(inout Payload payload)
+{
+    // Photons leaving the scene are lost
+    if (decodeIsPhoton(payload.flags))
+    {
+        payload.lastPdf = 0;
+        return;
+    }
+
+    // Only add environment contribution if not a shadow ray
+    if (decodeIsShadow(payload.flags) == 0)
+    {
+        shadeMiss(payload, WorldRayOrigin(), WorldRayDirection());
+    } else
+    {
+        // If it's a shadow ray, set the throughput to 1 in the red channel
+        payload.pathThroughput.r = 1.0f;
+    }
+}
+
+// Spatial reuse of direct illumination reservoirs. Combines the pixel's reservoir with those of a few similar neighbours,
+// keeps the result for next frame's temporal reuse and returns the direct lighting after tracing the final shadow ray
+float3 restirDirectSpatial(ReSTIRSurface surface, inout uint rndState)
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint2 size = DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    uint pixel = (idx.y * size.x) + idx.x;
+    uint current = (frameIndex & 1) * pixels;
+
+    ReSTIRReservoir own = restirReservoirs[pixel];
+    ReSTIRReservoir r = emptyReservoir();
+    reservoirMerge(r, own, own.targetPdf, rnd(rndState));
+    uint neighbours[RESTIR_SPATIAL_NEIGHBOURS];
+    uint count = 0;
+    for (uint i = 0; i < RESTIR_SPATIAL_NEIGHBOURS; i++)
+    {
+        float2 offset = (float2(rnd(rndState), rnd(rndState)) * 2.0 - 1.0) * RESTIR_SPATIAL_RADIUS;
+        int2 neighbourIdx = (int2)idx + (int2)round(offset);
+        if (any(neighbourIdx < 0) || any(neighbourIdx >= (int2)size) || all(neighbourIdx == (int2)idx))
+        {
+            continue;
+        }
+        uint neighbour = (neighbourIdx.y * size.x) + neighbourIdx.x;
+        if (restirSimilar(surface, restirSurfaces[current + neighbour]) == false)
+        {
+            continue;
+        }
+        ReSTIRReservoir other = restirReservoirs[neighbour];
+        reservoirMerge(r, other, restirTarget(surface, other.lightIndex, other.samplePoint), rnd(rndState));
+        neighbours[count] = neighbour;
+        count = count + 1;
+    }
+    // Count the candidates of every combined reservoir whose surface could have produced the selected sample
+    float Z = own.M;
+    for (uint j = 0; j < count; j++)
+    {
+        if (restirTarget(restirSurfaces[current + neighbours[j]], r.lightIndex, r.samplePoint) > 0)
+        {
+            Z = Z + restirReservoirs[neighbours[j]].M;
+        }
+    }
+    reservoirFinalise(r, Z);
+    restirReservoirs[pixels + pixel] = r;
+    return restirShade(surface, r);
+}
+
+// Spatial reuse pass for ReSTIR direct illumination and ReSTIR GI, dispatched after the path tracing pass. Adds the
+// resampled lighting of whichever is enabled to the radiance the path tracing pass gathered and accumulates the pixel
+[shader("raygeneration")]
+void ReSTIRSpatial()
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint2 size = DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    uint pixel = (idx.y * size.x) + idx.x;
+    uint current = (frameIndex & 1) * pixels;
+    ReSTIRSurface surface = restirSurfaces[current + pixel];
+    float3 colour = surface.radiance;
+    if (surface.valid == 1)
+    {
+        uint rndState = (idx.x * 0x27d4eb2du) ^ (idx.y * 0x165667b1u) ^ (asuint(SPP) * 0x9e3779b9u);
+        if (useReSTIR == 1)
+        {
+            colour = colour + restirDirectSpatial(surface, rndState);
+        }
+        if (useReSTIRGI == 1)
+        {
+            colour = colour + restirGISpatial(surface, rndState);
+        }
+    } else
+    {
+        restirReservoirs[pixels + pixel] = emptyReservoir();
+        restirGIReservoirs[pixels + ((frameIndex & 1) * pixels) + pixel] = emptyGIReservoir();
+    }
+    accumulate(idx, size.x, colour, accumulationCount(pixel) + 1);
+}
+
+// Tonemap pass, dispatched over the screen after every pass adding samples. Scales each pixel's running mean, or with
+// the denoiser the filtered irradiance multiplied by the albedo again plus the emission, by the exposure and encodes
+// it into the render target; mirrors tonemap in Accumulation.h
+[shader("raygeneration")]
+void Tonemap()
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint pixels = DispatchRaysDimensions().x * DispatchRaysDimensions().y;
+    uint pixel = (idx.y * DispatchRaysDimensions().x) + idx.x;
+    float3 colour = accumulation[pixel].mean.rgb;
+    if (useDenoiser == 1)
+    {
+        float3 irradiance = aovBuffer[((3 + (DENOISER_ITERATIONS & 1)) * pixels) + pixel].rgb;
+        colour = (irradiance * max(aovBuffer[pixel].rgb, DENOISER_ALBEDO_EPSILON)) + aovBuffer[(2 * pixels) + pixel].rgb;
+    }
+    colour = max(colour * exp2(exposure), float3(0, 0, 0));
+    uav[idx] = float4(saturate(tmo(colour)), 1.0);
+}
+
+// Upsampling pass, dispatched over the screen in place of the tonemap pass after the path tracing pass rendered the
+// frame at a lower resolution, into the top left renderSize pixels of the accumulation and AOVs. A pixel weights the
+// four samples around its centre bilinearly by where they were taken, through their pixels' points offset by
+// resolutionJitter, keeping only those whose first hit is as far away and faces as the nearest sample's, so that
+// edges stay sharp, and encodes the result as the tonemap pass does. Mirrors DynamicResolution::upsample
+#define RESOLUTION_DEPTH_TOLERANCE 0.05
+#define RESOLUTION_NORMAL_THRESHOLD 0.9
+
+// Accumulation index of the sample at (x, y) of the lower resolution frame, clamped to the samples taken
+uint resolutionSample(int2 xy, uint width)
+{
+    uint2 clamped = (uint2)clamp(xy, int2(0, 0), (int2)renderSize - 1);
+    return (clamped.y * width) + clamped.x;
+}
+
+[shader("raygeneration")]
+void Upsample()
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint2 size = DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    float2 position = (((float2)idx + 0.5) * (float2)renderSize / (float2)size) - resolutionJitter;
+    int2 base = (int2)floor(position);
+    float2 f = position - (float2)base;
+    uint nearest = resolutionSample(base + int2(f.x >= 0.5 ? 1 : 0, f.y >= 0.5 ? 1 : 0), size.x);
+    float nearestDepth = aovBuffer[nearest].w;
+    float3 nearestNormal = aovBuffer[pixels + nearest].xyz;
+    float nearestLength = dot(nearestNormal, nearestNormal);
+    float3 colour = float3(0, 0, 0);
+    float total = 0;
+    for (uint i = 0; i < 4; i++)
+    {
+        int2 offset = int2(i & 1, i >> 1);
+        uint sample = resolutionSample(base + offset, size.x);
+        float w = (offset.x == 1 ? f.x : 1.0 - f.x) * (offset.y == 1 ? f.y : 1.0 - f.y);
+
+        // Lights and rays leaving the scene have no normal and match only each other
+        float3 normal = aovBuffer[pixels + sample].xyz;
+        float normalLength = dot(normal, normal);
+        bool similar = abs(aovBuffer[sample].w - nearestDepth) <= RESOLUTION_DEPTH_TOLERANCE * nearestDepth;
+        if (normalLength <= 0 || nearestLength <= 0)
+        {
+            similar = similar && normalLength <= 0 && nearestLength <= 0;
+        }
+        else
+        {
+            similar = similar && dot(normal, nearestNormal) >= RESOLUTION_NORMAL_THRESHOLD * sqrt(normalLength * nearestLength);
+        }
+        w = similar ? w : 0.0;
+        colour += accumulation[sample].mean.rgb * w;
+        total += w;
+    }
+    colour = max((colour / total) * exp2(exposure), float3(0, 0, 0));
+    uav[idx] = float4(saturate(tmo(colour)), 1.0);
+}
+
+// Temporal reprojection pass, dispatched over the screen before the path tracing pass in the first frame after the
+// camera moves. Copies each pixel's accumulated colour and sample count and its first-hit AOVs into the history the
+// path tracing pass reprojects from, as it overwrites them
+[shader("raygeneration")]
+void TemporalHistory()
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint pixels = DispatchRaysDimensions().x * DispatchRaysDimensions().y;
+    uint pixel = (idx.y * DispatchRaysDimensions().x) + idx.x;
+    aovBuffer[(TEMPORAL_HISTORY_SECTION * pixels) + pixel] = accumulation[pixel].mean;
+    for (uint i = 0; i < 3; i++)
+    {
+        aovBuffer[((TEMPORAL_HISTORY_SECTION + 1 + i) * pixels) + pixel] = aovBuffer[(i * pixels) + pixel];
+    }
+}
+
+// The accumulated colour of a pixel less the emission seen, divided by its albedo
+float3 denoiserDemodulate(uint pixel, uint pixels)
+{
+    return (accumulation[pixel].mean.rgb - aovBuffer[(2 * pixels) + pixel].rgb) / max(aovBuffer[pixel].rgb, DENOISER_ALBEDO_EPSILON);
+}
+
+// The unit normal of a pixel, or zero where its samples' normals cancel out
+float3 denoiserNormal(uint pixel, uint pixels)
+{
+    float3 n = aovBuffer[pixels + pixel].xyz;
+    float length2 = dot(n, n);
+    return length2 > 0 ? n * rsqrt(length2) : float3(0, 0, 0);
+}
+
+// First denoiser pass, dispatched over the screen once the image is accumulated. Writes each pixel's irradiance, its
+// colour less the emission divided by its albedo, and the variance of the irradiance's luminance over the 3x3 pixels around it into the
+// first ping-pong buffer; mirrors Denoiser::prepare
+[shader("raygeneration")]
+void DenoisePrepare()
+{
+    int2 idx = (int2)DispatchRaysIndex().xy;
+    int2 size = (int2)DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    uint pixel = (idx.y * size.x) + idx.x;
+    float sum = 0;
+    float sumSq = 0;
+    float count = 0;
+    for (int qy = max(idx.y - 1, 0); qy <= min(idx.y + 1, size.y - 1); qy++)
+    {
+        for (int qx = max(idx.x - 1, 0); qx <= min(idx.x + 1, size.x - 1); qx++)
+        {
+            float l = luminance(denoiserDemodulate((qy * size.x) + qx, pixels));
+            sum += l;
+            sumSq += l * l;
+            count += 1.0;
+        }
+    }
+    float mean = sum / count;
+    aovBuffer[(3 * pixels) + pixel] = float4(denoiserDemodulate(pixel, pixels), max((sumSq / count) - (mean * mean), 0.0));
+}
+
+// One a-trous pass of the denoiser from one ping-pong buffer to the other, with the 5x5 kernel's taps 2^iteration pixels
+// apart weighted by the edge-stopping functions; mirrors Denoiser::filterPixel
+void denoiseAtrous(uint iteration)
+{
+    int2 idx = (int2)DispatchRaysIndex().xy;
+    int2 size = (int2)DispatchRaysDimensions().xy;
+    uint pixels = size.x * size.y;
+    uint pixel = (idx.y * size.x) + idx.x;
+    int step = 1 << iteration;
+    uint src = (3 + (iteration & 1)) * pixels;
+    uint dst = (4 - (iteration & 1)) * pixels;
+    const float kernel[5] = { 1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };
+
+    float4 centre = aovBuffer[src + pixel];
+    float lp = luminance(centre.rgb);
+    float3 np = denoiserNormal(pixel, pixels);
+    float zp = aovBuffer[pixel].w;
+    float luminanceScale = -1.0 / ((DENOISER_SIGMA_LUMINANCE * sqrt(centre.w)) + DENOISER_EPSILON);
+    float depthScale = -1.0 / (DENOISER_SIGMA_DEPTH * max(zp, DENOISER_EPSILON) * (float)step);
+    float3 sum = float3(0, 0, 0);
+    float sumVariance = 0;
+    float sumWeight = 0;
+    for (int j = -2; j <= 2; j++)
+    {
+        for (int i = -2; i <= 2; i++)
+        {
+            int2 q = idx + (int2(i, j) * step);
+            if (any(q < 0) || any(q >= size))
+            {
+                continue;
+            }
+            uint qp = (q.y * size.x) + q.x;
+            float4 tap = aovBuffer[src + qp];
+            float w = kernel[i + 2] * kernel[j + 2];
+            if (i != 0 || j != 0)
+            {
+                float normalWeight = pow(max(dot(np, denoiserNormal(qp, pixels)), 0.0), DENOISER_SIGMA_NORMAL);
+                float exponent = (abs(luminance(tap.rgb) - lp) * luminanceScale) + (abs(aovBuffer[qp].w - zp) * depthScale / length(float2(i, j)));
+                w *= normalWeight * exp(exponent);
+            }
+            sum += w * tap.rgb;
+            sumVariance += w * w * tap.w;
+            sumWeight += w;
+        }
+    }
+    aovBuffer[dst + pixel] = float4(sum / sumWeight, sumVariance / (sumWeight * sumWeight));
+}
+
+// The denoiser's a-trous passes, dispatched over the screen in turn after DenoisePrepare
+[shader("raygeneration")]
+void DenoiseStep0()
+{
+    denoiseAtrous(0);
+}
+
+[shader("raygeneration")]
+void DenoiseStep1()
+{
+    denoiseAtrous(1);
+}
+
+[shader("raygeneration")]
+void DenoiseStep2()
+{
+    denoiseAtrous(2);
+}
+
+[shader("raygeneration")]
+void DenoiseStep3()
+{
+    denoiseAtrous(3);
+}
+
+[shader("raygeneration")]
+void DenoiseStep4()
+{
+    denoiseAtrous(4);
+}
+
+// Radiance cache resolve pass, dispatched over the table's slots after the path tracing pass. Folds the radiance deposited
+// this frame into each cell's mean, and ages and evicts cells that received none; mirrors HashGrid::resolveSlot
+[shader("raygeneration")]
+void HashGridResolve()
+{
+    uint slot = (DispatchRaysIndex().y * DispatchRaysDimensions().x) + DispatchRaysIndex().x;
+    if (slot >= HASH_GRID_CAPACITY || hashGridChecksums[slot] == 0)
+    {
+        return;
+    }
+    HashGridEntry entry = hashGridEntries[slot];
+    if (entry.accumulatedCount == 0)
+    {
+        entry.age = entry.age + 1;
+        if (entry.age > HASH_GRID_MAX_AGE)
+        {
+            hashGridChecksums[slot] = 0;
+            entry = (HashGridEntry)0;
+        }
+        hashGridEntries[slot] = entry;
+        return;
+    }
+    uint history = entry.accumulatedCount >= HASH_GRID_MAX_SAMPLES ? 0 : min(entry.sampleCount, HASH_GRID_MAX_SAMPLES - entry.accumulatedCount);
+    float total = (float)(history + entry.accumulatedCount);
+    entry.radiance = ((entry.radiance * (float)history) + ((float3)entry.accumulated / HASH_GRID_RADIANCE_SCALE)) / total;
+    entry.accumulated = uint3(0, 0, 0);
+    entry.sampleCount = history + entry.accumulatedCount;
+    entry.accumulatedCount = 0;
+    entry.age = 0;
+    hashGridEntries[slot] = entry;
+}
+
+// Probe update pass, dispatched over the probe volume's rays (x) and probes (y) before the path tracing pass. Traces
+// each probe's rays in this frame's rotation of the spherical Fibonacci directions and keeps their radiance and hit
+// distance for ProbeBlend. Their hits are lit by the probes as they were last frame, which adds a bounce every frame
+[shader("raygeneration")]
+void ProbeTrace()
+{
+    uint rayIndex = DispatchRaysIndex().x;
+    uint probe = DispatchRaysIndex().y;
+    if (probe >= probeCounts.x * probeCounts.y * probeCounts.z)
+    {
+        return;
+    }
+    Payload payload;
+    payload.colour = float3(0.0, 0.0, 0.0);
+    payload.pathThroughput = float3(1.0, 1.0, 1.0);
+    payload.depth = 0;
+    payload.flags = encodeIsProbeRay(0);
+    payload.lastPosition = float3(0.0, 0.0, 0.0);
+    payload.lastNormal = float3(0.0, 0.0, 0.0);
+    payload.lastPdf = 1000;
+    payload.rndState = (rayIndex * 0x27d4eb2du) ^ (probe * 0x165667b1u) ^ (probeFrame * 0x9e3779b9u);
+
+    RayDesc ray;
+    ray.Origin = probePosition(probe);
+    ray.Direction = mul(probeRayRotation(), sphericalFibonacci(rayIndex, PROBE_RAYS));
+    ray.TMin = 0.001;
+    ray.TMax = 1000;
+    TraceRay(scene, RAY_FLAG_NONE, 0xFF, 0, 0, 0, ray, payload);
+    probeRays[(probe * PROBE_RAYS) + rayIndex] = float4(payload.colour, payload.lastPdf);
+}
+
+// Probe blend pass, dispatched over the texels of a distance tile (x) and the probes (y) after ProbeTrace. Each texel
+// averages this frame's rays around its direction, cosine weighted for irradiance and with a sharper lobe for the
+// distance moments, and blends the result into the atlases. A new volume takes each frame in full until the
+// hysteresis takes over
+[shader("raygeneration")]
+void ProbeBlend()
+{
+    uint texel = DispatchRaysIndex().x;
+    uint probe = DispatchRaysIndex().y;
+    if (probe >= probeCounts.x * probeCounts.y * probeCounts.z)
+    {
+        return;
+    }
+    bool irradianceTexel = texel < PROBE_IRRADIANCE_TEXELS * PROBE_IRRADIANCE_TEXELS;
+    float3 irradianceDirection = probeTexelDirection(uint2(texel % PROBE_IRRADIANCE_TEXELS, texel / PROBE_IRRADIANCE_TEXELS), PROBE_IRRADIANCE_TEXELS);
+    float3 distanceDirection = probeTexelDirection(uint2(texel % PROBE_DISTANCE_TEXELS, texel / PROBE_DISTANCE_TEXELS), PROBE_DISTANCE_TEXELS);
+    float maxDistance = length(probeSpacing) * 1.5;
+    float3x3 rotation = probeRayRotation();
+    float3 irradiance = float3(0, 0, 0);
+    float irradianceWeight = 0;
+    float2 moments = float2(0, 0);
+    float distanceWeight = 0;
+    for (uint i = 0; i < PROBE_RAYS; i++)
+    {
+        float4 rayData = probeRays[(probe * PROBE_RAYS) + i];
+        float3 direction = mul(rotation, sphericalFibonacci(i, PROBE_RAYS));
+        float weight = saturate(dot(irradianceDirection, direction));
+        irradiance = irradiance + (rayData.xyz * weight);
+        irradianceWeight = irradianceWeight + weight;
+        float hitDistance = min(rayData.w < 0 ? -rayData.w * PROBE_BACKFACE_DISTANCE_SCALE : rayData.w, maxDistance);
+        weight = pow(saturate(dot(distanceDirection, direction)), PROBE_DISTANCE_SHARPNESS);
+        moments = moments + (float2(hitDistance, hitDistance * hitDistance) * weight);
+        distanceWeight = distanceWeight + weight;
+    }
+    float blend = max(1.0 - PROBE_HYSTERESIS, 1.0 / (float)(probeFrame + 1));
+    if (irradianceTexel && irradianceWeight > 0)
+    {
+        uint index = (probe * PROBE_IRRADIANCE_TEXELS * PROBE_IRRADIANCE_TEXELS) + texel;
+        float3 previous = probeIrradiance[index].xyz;
+        probeIrradiance[index] = float4(lerp(previous, irradiance * (PI / irradianceWeight), blend), 1.0);
+    }
+    if (distanceWeight > 0)
+    {
+        uint index = (probe * PROBE_DISTANCE_TEXELS * PROBE_DISTANCE_TEXELS) + texel;
+        probeDistance[index] = lerp(probeDistance[index], moments / distanceWeight, blend);
+    }
+}
+
+// Light cache resolve pass, dispatched over the cells after the path tracing pass. Folds the contributions deposited
+// this frame into each slot's decaying mean, evicts stale and useless slots, and frees cells left without any;
+// mirrors LightCache::resolveCell
+[shader("raygeneration")]
+void LightCacheResolve()
+{
+    uint cell = (DispatchRaysIndex().y * DispatchRaysDimensions().x) + DispatchRaysIndex().x;
+    if (cell >= LIGHT_CACHE_CAPACITY || lightCacheCells[cell].checksum == 0)
+    {
+        return;
+    }
+    LightCacheCell c = lightCacheCells[cell];
+    float total = 0;
+    for (uint i = 0; i < LIGHT_CACHE_SLOTS; i++)
+    {
+        if (c.slots[i].lightPlusOne == 0)
+        {
+            continue;
+        }
+        c.slots[i].samples = c.slots[i].samples * LIGHT_CACHE_DECAY;
+        if (c.slots[i].accumulatedCount > 0)
+        {
+            float sum = (float)c.slots[i].accumulated / LIGHT_CACHE_CONTRIBUTION_SCALE;
+            c.slots[i].mean = ((c.slots[i].mean * c.slots[i].samples) + sum) / (c.slots[i].samples + (float)c.slots[i].accumulatedCount);
+            c.slots[i].samples = min(c.slots[i].samples + (float)c.slots[i].accumulatedCount, LIGHT_CACHE_MAX_SAMPLES);
+        }
+        c.slots[i].accumulated = 0;
+        c.slots[i].accumulatedCount = 0;
+        total += c.slots[i].mean;
+    }
+    bool empty = true;
+    for (uint j = 0; j < LIGHT_CACHE_SLOTS; j++)
+    {
+        if (c.slots[j].lightPlusOne == 0)
+        {
+            continue;
+        }
+        if (c.slots[j].samples < LIGHT_CACHE_MIN_SAMPLES || (c.slots[j].samples >= LIGHT_CACHE_EVICT_SAMPLES && c.slots[j].mean <= LIGHT_CACHE_EVICT_FRACTION * total))
+        {
+            c.slots[j] = (LightCacheSlot)0;
+            continue;
+        }
+        empty = false;
+    }
+    if (empty)
+    {
+        c.checksum = 0;
+    }
+    lightCacheCells[cell] = c;
+}
+
+// Photon pass for photon caustics, dispatched over PHOTON_PASS_WIDTH squared threads after the other passes. Each
+// thread emits a photon from a light chosen by power, at a uniform point of the triangle and in a cosine distributed
+// direction, and follows it through specular bounces; the CPU builds the map the next frame gathers from
+[shader("raygeneration")]
+void PhotonTrace()
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint2 size = DispatchRaysDimensions().xy;
+    if (nLights == 0)
+    {
+        return;
+    }
+    Payload payload;
+    payload.rndState = hashPCG((idx.y * size.x) + idx.x) ^ (photonPass * 0x9e3779b9u);
+    float pmf;
+    uint lightIndex = sampleLightIndex(payload.rndState, pmf);
+    if (pmf <= 0)
+    {
+        return;
+    }
+    AreaLightData light = areaLightData[lightIndex];
+    float alpha;
+    float beta;
+    float gamma;
+    uniformSampleTriangle(rnd(payload.rndState), rnd(payload.rndState), alpha, beta, gamma);
+    float3 wi = mul(cosineSampleHemisphere(rnd(payload.rndState), rnd(payload.rndState)), buildTBN(light.normal));
+    // Power over the pdfs of the light, the point and the direction, shared between the pass's photons
+    payload.colour = light.Le * light.area * PI / (pmf * (float)(size.x * size.y));
+    payload.pathThroughput = float3(1.0, 1.0, 1.0);
+    payload.depth = 0;
+    payload.flags = encodeIsPhoton(0);
+    payload.lastPosition = (alpha * light.v1) + (beta * light.v2) + (gamma * light.v3) + (light.normal * 0.001);
+    payload.lastNormal = wi;
+    payload.lastPdf = 1.0;
+    for (uint bounce = 0; bounce < PHOTON_MAX_BOUNCES && payload.lastPdf > 0; bounce++)
+    {
+        RayDesc ray;
+        ray.Origin = payload.lastPosition;
+        ray.Direction = payload.lastNormal;
+        ray.TMin = 0.001;
+        ray.TMax = 1000;
+        TraceRay(scene, RAY_FLAG_NONE, 0xFF, 0, 0, 0, ray, payload);
+    }
+}
+
+// Hit of a camera path's ray, all that PathClosestHit returns: the instance and triangle hit, the barycentrics of the
+// hit and its distance along the ray, which is negative if the ray left the scene. tracePath shades it
+struct PathHit
+{
+    uint instance;
+    uint primitive;
+    float2 barycentrics;
+    float t;
+};
+// Offsets of PathClosestHit's hit group and PathMiss in the shader table, after those of Payload rays
+#define PATH_HIT_GROUP 1
+#define PATH_MISS_SHADER 1
+
+// State a camera path keeps at a vertex it bounced from, for the work that needs the radiance the rest of the path
+// gathers: recording the direction for path guiding, depositing into the radiance cache and splitting the primary
+// bounce for ReSTIR GI. tracePath finishes the vertices once the path ends, from the last back, which is the order a
+// recursive trace would finish them in
+struct PathVertex
+{
+    float3 pos;
+    float3 facingNormal;
+    float3 wi;
+    float pdf;
+    float3 throughput;        // Throughput of the bounce ray
+    float3 colour;            // Colour the path had gathered when the bounce ray was traced
+    float3 colourBefore;      // Colour and throughput the path reached the vertex with
+    float3 throughputBefore;
+    uint flags;
+};
+#define PATH_MAX_VERTICES 6
+#define PATH_VERTEX_GUIDING_RECORD 1
+#define PATH_VERTEX_GI 2
+#define PATH_VERTEX_CACHE_DEPOSIT 4
+
+// Shades the hit of a camera path or probe ray, adding what it sees there to the payload. Returns true with the
+// next ray of the path in ray and the vertex to finish once the path ends, or false if the path ends here. surface
+// holds the primary surface ReSTIR records
+bool shadeHit(HitData hitData, inout Payload payload, inout ReSTIRSurface surface, out PathVertex vertex, out RayDesc ray)
+{
+    vertex = (PathVertex)0;
+    ray = (RayDesc)0;
+    float3 facing = hashGridFacingNormal(hitData);
+
+    // The first hit of a camera ray gives the denoiser its AOVs, once the pixel's samples have been reprojected to it
+    // after the camera moved. Lights reflect nothing and the denoiser leaves the emission seen there as it is
+    if (payload.depth == 0 && decodeIsProbeRay(payload.flags) == false)
+    {
+        if (temporalReproject == 1)
+        {
+            temporalReprojectPixel(hitData.pos, isLight(hitData) ? float3(0, 0, 0) : facing, hitData.t);
+        }
+        if (isLight(hitData))
+        {
+            denoiserRecord(float3(0, 0, 0), float3(0, 0, 0), hitData.t, float3(hitData.instance.bsdfData[0], hitData.instance.bsdfData[1], hitData.instance.bsdfData[2]));
+        } else
+        {
+            denoiserRecord(hitData.albedo, facing, hitData.t, float3(0, 0, 0));
+        }
+    }
+
+    // If the hit object is a light, add its emission. Camera rays and rays leaving surfaces that cannot be light sampled
+    // take the full emission, other BSDF sampled rays are weighted against light sampling at the previous vertex,
+    // and rays leaving a surface lit from a ReSTIR reservoir add nothing as the reservoir already covers the light.
+    // Probe rays add nothing either, as the points shaded with the probes sample the lights themselves, and with photon
+    // caustics neither do specular chains from a diffuse vertex, whose light that vertex gathered from the photon map
+    if (isLight(hitData))
+    {
+        float3 emission = float3(0, 0, 0);
+        bool photonMapped = usePhotonCaustics == 1 && decodeIsCausticChain(payload.flags);
+        if (decodeIsReservoirLit(payload.flags) == false && decodeIsProbeRay(payload.flags) == false && photonMapped == false)
+        {
+            if (payload.depth == 0 || decodeIsSpecular(payload.flags))
+            {
+                emission = float3(hitData.instance.bsdfData[0], hitData.instance.bsdfData[1], hitData.instance.bsdfData[2]);
+            } else
+            {
+                emission = weightedEmission(hitData, payload);
+            }
+        }
+        payload.colour = payload.colour + (payload.pathThroughput * emission);
+        if (decodeIsGIVertex(payload.flags))
+        {
+            restirGIRecordVertex(hitData.pos, hitData.normal, hitData.direction, emission, true);
+        }
+        return false;
+    }
+
+    // The first hit of a ray leaving a ReSTIR GI surface becomes the pixel's candidate vertex. Only vertices that
+    // reflect the same radiance in every direction can be reused by other surfaces
+    if (decodeIsGIVertex(payload.flags))
+    {
+        restirGIRecordVertex(hitData.pos, hitData.normal, hitData.direction, float3(0, 0, 0), bsdfUsesLightSampling(hitData.bsdf));
+        payload.flags = clearGIVertex(payload.flags);
+    }
+
+    // Probe rays, and in the probe volume preview every diffuse vertex, end the path with the full direct lighting plus
+    // the indirect lighting interpolated from the probes, which stands in for the rest of the path
+    if (decodeIsProbeRay(payload.flags) || (useProbeVolume == 1 && bsdfUsesLightSampling(hitData.bsdf)))
+    {
+        float3 irradiance = probeVolumeIrradiance(hitData.pos, hitData.normal, -hitData.direction);
+        float3 shading = calculateDirect(hitData, false, payload.rndState) + (evaluateBSDF(hitData, hitData.normal) * irradiance);
+        payload.colour = payload.colour + (payload.pathThroughput * shading);
+        return false;
+    }
+
+    // With the radiance cache, paths that are not updating it end at the first diffuse vertex past the primary surface
+    // whose cell has enough samples, taking the cached radiance leaving it in place of the rest of the path
+    if (useRadianceCache == 1 && payload.depth > 0 && decodeIsCacheUpdate(payload.flags) == false && bsdfUsesLightSampling(hitData.bsdf))
+    {
+        float3 cached;
+        if (hashGridLookup(hitData.pos, facing, hashGridCameraDistance(hitData.pos), cached))
+        {
+            payload.colour = payload.colour + (payload.pathThroughput * cached);
+            return false;
+        }
+    }
+
+    // Accumulate direct lighting contribution. With ReSTIR, direct lighting at the primary surface is resampled
+    // into the pixel's reservoir here and shaded by the spatial pass
+    bool restirSurface = (useReSTIR == 1 || useReSTIRGI == 1) && payload.depth == 0 && bsdfUsesLightSampling(hitData.bsdf);
+    if (restirSurface)
+    {
+        surface = restirRecordSurface(hitData);
+    }
+    bool reservoirLit = restirSurface && useReSTIR == 1;
+    // Paths updating the radiance cache deposit what they gather from every diffuse vertex ReSTIR does not handle
+    bool cacheDeposit = decodeIsCacheUpdate(payload.flags) && bsdfUsesLightSampling(hitData.bsdf) && restirSurface == false;
+    float3 colourBefore = payload.colour;
+    float3 throughputBefore = payload.pathThroughput;
+    // The vertex at the maximum depth traces no BSDF sample to pick up the rest of the MIS weight, so its light sample
+    // takes the full weight
+    if (reservoirLit)
+    {
+        restirPrimarySurface(surface, payload.rndState);
+    } else
+    {
+        payload.colour = payload.colour + (payload.pathThroughput * calculateDirect(hitData, payload.depth < 6, payload.rndState));
+    }
+    // Caustics at diffuse vertices come from the photon map
+    if (usePhotonCaustics == 1 && bsdfUsesLightSampling(hitData.bsdf))
+    {
+        payload.colour = payload.colour + (payload.pathThroughput * photonGather(hitData));
+    }
+
+    // End the path if maximum depth reached
+    if (payload.depth == 6)
+    {
+        if (cacheDeposit)
+        {
+            hashGridDepositVertex(hitData.pos, facing, payload.colour - colourBefore, throughputBefore);
+        }
+        return false;
+    }
+
+    // Apply Russian Roulette termination for deeper bounces
+    if (payload.depth > 3)
+    {
+        float q = min(dot(payload.pathThroughput, float3(0.2126, 0.7152, 0.0722)), 0.7);
+        if (rnd(payload.rndState) < q || payload.depth == 7)
+        {
+            if (cacheDeposit)
+            {
+                hashGridDepositVertex(hitData.pos, facing, payload.colour - colourBefore, throughputBefore);
+            }
+            return false;
         }
         payload.pathThroughput = payload.pathThroughput / (1.0f - q);
     }
 
-    // Sample indirect illumination from the BSDF
+    // Sample indirect illumination from the BSDF. With path guiding, a share of the directions is drawn from the D-tree
+    // around the hit instead, and the pdf is that of the mixture. Guided directions below the surface end the path
     float3 wi;
     float pdf;
     float3 indirect;
     bool isSpecular;
-    wi = sampleBSDF(hitData, payload.rndState, indirect, pdf, isSpecular);
+    bool guided = guidingSamples(hitData);
+    uint guidingRoot = guided || (guidingMode & GUIDING_RECORD) != 0 ? guidingTree(hitData.pos) : 0;
+    if (guided && rnd(payload.rndState) < GUIDING_FRACTION)
+    {
+        wi = guidingSample(guidingRoot, payload.rndState);
+        indirect = evaluateBSDF(hitData, wi);
+        isSpecular = false;
+        pdf = dot(wi, hitData.normal) > 0 ? guidingMixturePdf(hitData, guidingRoot, wi) : 0.0;
+    } else
+    {
+        wi = sampleBSDF(hitData, payload.rndState, indirect, pdf, isSpecular);
+        if (guided)
+        {
+            pdf = guidingMixturePdf(hitData, guidingRoot, wi);
+        }
+    }
+
+    // With ReSTIR GI the primary surface's bounce ray is traced with unit throughput, so that the radiance it gathers
+    // is the radiance leaving its first hit, which becomes the pixel's candidate vertex
+    bool giVertex = restirSurface && useReSTIRGI == 1;
 
     // Check if pdf is valid
     if (pdf <= 0)
     {
-        return;
+        if (giVertex)
+        {
+            restirGIPrimarySurface(surface, emptyGIReservoir(), 0.0, payload.rndState);
+        }
+        if (cacheDeposit)
+        {
+            hashGridDepositVertex(hitData.pos, facing, payload.colour - colourBefore, throughputBefore);
+        }
+        return false;
     }
 
+    // A specular bounce continues a chain from the last diffuse vertex, or starts one if that vertex was this ray's origin
+    bool causticChain = isSpecular && (decodeIsCausticChain(payload.flags) || (payload.depth > 0 && decodeIsSpecular(payload.flags) == false));
+
     // Update the path throughput
-    payload.pathThroughput = payload.pathThroughput * indirect * abs(dot(wi, hitData.normal)) / pdf;
+    float3 throughput = payload.pathThroughput * indirect * abs(dot(wi, hitData.normal)) / pdf;
+    payload.pathThroughput = giVertex ? float3(1.0, 1.0, 1.0) : throughput;
     payload.depth = payload.depth + 1;
-    if (isSpecular)
+    payload.lastPosition = hitData.pos;
+    payload.lastNormal = hitData.normal;
+    payload.lastPdf = pdf;
+    // Emission reached from specular surfaces, or surfaces calculateDirect cannot light, is not MIS weighted
+    if (isSpecular || bsdfUsesLightSampling(hitData.bsdf) == false)
     {
         payload.flags = encodeIsSpecular(payload.flags);
     } else
     {
         payload.flags = clearSpecular(payload.flags);
     }
+    if (reservoirLit && isSpecular == false)
+    {
+        payload.flags = encodeIsReservoirLit(payload.flags);
+    } else
+    {
+        payload.flags = clearReservoirLit(payload.flags);
+    }
+    if (giVertex)
+    {
+        payload.flags = encodeIsGIVertex(payload.flags);
+    } else
+    {
+        payload.flags = clearGIVertex(payload.flags);
+    }
+    if (causticChain)
+    {
+        payload.flags = encodeIsCausticChain(payload.flags);
+    } else
+    {
+        payload.flags = clearCausticChain(payload.flags);
+    }
 
     // Set up the ray for the indirect bounce
-    RayDesc ray;
     ray.Origin = hitData.pos + (dot(wi, hitData.normal) > 0 ? hitData.normal : -hitData.normal) * 0.001;
     ray.Direction = wi;
     ray.TMin = 0.001;
     ray.TMax = 1000;
 
-    // Trace the indirect ray
-    TraceRay(scene, RAY_FLAG_NONE, 0xFF, 0, 0, 0, ray, payload);
+    // Keep what finishing the vertex needs. While path guiding trains, a share of the directions leaving surfaces it
+    // can guide record the radiance they gather
+    bool guidingRecorded = (guidingMode & GUIDING_RECORD) != 0 && bsdfUsesLightSampling(hitData.bsdf) && giVertex == false && rnd(payload.rndState) < guidingRecordFraction;
+    vertex.pos = hitData.pos;
+    vertex.facingNormal = facing;
+    vertex.wi = wi;
+    vertex.pdf = pdf;
+    vertex.throughput = throughput;
+    vertex.colour = payload.colour;
+    vertex.colourBefore = colourBefore;
+    vertex.throughputBefore = throughputBefore;
+    vertex.flags = (guidingRecorded ? PATH_VERTEX_GUIDING_RECORD : 0) | (giVertex ? PATH_VERTEX_GI : 0) | (cacheDeposit ? PATH_VERTEX_CACHE_DEPOSIT : 0);
+    return true;
+}
+
+// Finishes a vertex of a camera path once the rest of the path has been traced and payload holds all it gathered
+void finishVertex(PathVertex vertex, ReSTIRSurface surface, inout Payload payload)
+{
+    if ((vertex.flags & PATH_VERTEX_GUIDING_RECORD) != 0)
+    {
+        float3 radiance;
+        radiance.r = vertex.throughput.r > 0 ? (payload.colour.r - vertex.colour.r) / vertex.throughput.r : 0.0;
+        radiance.g = vertex.throughput.g > 0 ? (payload.colour.g - vertex.colour.g) / vertex.throughput.g : 0.0;
+        radiance.b = vertex.throughput.b > 0 ? (payload.colour.b - vertex.colour.b) / vertex.throughput.b : 0.0;
+        guidingRecord(vertex.pos, vertex.wi, luminance(radiance) / vertex.pdf);
+    }
+
+    // The vertex's own emission is direct lighting and stays with this pixel. The radiance it reflects is resampled
+    // and shaded by the spatial pass, unless the vertex cannot be reused
+    if ((vertex.flags & PATH_VERTEX_GI) != 0)
+    {
+        uint pixel = (DispatchRaysIndex().y * DispatchRaysDimensions().x) + DispatchRaysIndex().x;
+        GIReservoir gi = restirGIReservoirs[pixel];
+        float3 emission = gi.radiance;
+        gi.radiance = max(payload.colour - vertex.colour - emission, float3(0, 0, 0));
+        payload.colour = vertex.colour + (vertex.throughput * emission);
+        if (dot(gi.sampleNormal, gi.sampleNormal) <= 0)
+        {
+            payload.colour = payload.colour + (vertex.throughput * gi.radiance);
+        }
+        restirGIPrimarySurface(surface, gi, vertex.pdf, payload.rndState);
+    }
+    if ((vertex.flags & PATH_VERTEX_CACHE_DEPOSIT) != 0)
+    {
+        hashGridDepositVertex(vertex.pos, vertex.facingNormal, payload.colour - vertex.colourBefore, vertex.throughputBefore);
+    }
+}
+
+// Closest hit shader for photons and probe rays; camera paths are shaded in tracePath
+[shader("closesthit")]
+void ClosestHit(inout Payload payload, BuiltInTriangleIntersectionAttributes attrib)
+{
+    // Compute hit data using the intersection attributes
+    HitData hitData = calculateHitData(attrib);
+
+    // Photons and probe rays take their random numbers from PCG
+    setActiveSampler(SAMPLER_PCG);
+
+    // Photons follow specular bounces and are stored at the surfaces gathering them
+    if (decodeIsPhoton(payload.flags))
+    {
+        photonHit(hitData, payload);
+        return;
+    }
+
+    // Probe rays report their hit distance. Those reaching the back of a surface are inside geometry, return no light
+    // and report a negative distance
+    payload.lastPdf = RayTCurrent();
+    if (dot(hitData.normal, WorldRayDirection()) > 0)
+    {
+        payload.lastPdf = -RayTCurrent();
+        return;
+    }
+    ReSTIRSurface surface = (ReSTIRSurface)0;
+    PathVertex vertex;
+    RayDesc ray;
+    shadeHit(hitData, payload, surface, vertex, ray);
+}
+
+// Closest hit shader of camera paths, which returns where the ray hit for tracePath to shade
+[shader("closesthit")]
+void PathClosestHit(inout PathHit hit, BuiltInTriangleIntersectionAttributes attrib)
+{
+    hit.instance = InstanceID();
+    hit.primitive = PrimitiveIndex();
+    hit.barycentrics = attrib.barycentrics;
+    hit.t = RayTCurrent();
+}
+
+// Miss shader of camera paths
+[shader("miss")]
+void PathMiss(inout PathHit hit)
+{
+    hit.t = -1.0;
+}
+
+// Traces a camera path from ray, bounce by bounce. Each hit comes back from PathClosestHit and is shaded here, so
+// closest hit shaders never trace rays of their own and the pipeline's recursion stays shallow. The vertices with
+// work left for when the path ends are finished then, from the last back. Mirrored by PathLoop.h
+void tracePath(RayDesc ray, inout Payload payload)
+{
+    PathVertex vertices[PATH_MAX_VERTICES];
+    uint count = 0;
+    ReSTIRSurface surface = (ReSTIRSurface)0;
+    for (uint bounce = 0; bounce <= PATH_MAX_VERTICES; bounce++)
+    {
+        PathHit hit;
+        hit.instance = 0;
+        hit.primitive = 0;
+        hit.barycentrics = float2(0, 0);
+        hit.t = -1.0;
+        TraceRay(scene, RAY_FLAG_NONE, 0xFF, PATH_HIT_GROUP, 0, PATH_MISS_SHADER, ray, hit);
+        if (hit.t < 0)
+        {
+            shadeMiss(payload, ray.Origin, ray.Direction);
+            break;
+        }
+        HitData hitData = surfaceHitData(hit.instance, hit.primitive, hit.barycentrics, ray.Origin, ray.Direction, hit.t);
+        PathVertex vertex;
+        if (shadeHit(hitData, payload, surface, vertex, ray) == false)
+        {
+            break;
+        }
+        if (vertex.flags != 0 && count < PATH_MAX_VERTICES)
+        {
+            vertices[count] = vertex;
+            count++;
+        }
+    }
+    for (uint i = count; i > 0; i--)
+    {
+        finishVertex(vertices[i - 1], surface, payload);
+    }
+}
+
+// Starts the camera path of a pixel's sample: activates the sampler camera paths draw from, fills in the payload and
+// sets up a ray through a jittered point of the pixel
+Payload cameraPath(uint2 idx, uint sampleIndex, float2 size, out RayDesc ray)
+{
+    // Initialize the payload with default values
+    Payload payload;
+    payload.colour = float3(0.0, 0.0, 0.0);
+    payload.pathThroughput = float3(1.0, 1.0, 1.0);
+    payload.depth = 0;
+    payload.flags = 0;
+    payload.lastPosition = float3(0.0, 0.0, 0.0);
+    payload.lastNormal = float3(0.0, 0.0, 0.0);
+    payload.lastPdf = 0;
+    setActiveSampler(samplerType);
+    payload.rndState = samplerType == SAMPLER_PCG ? idx.x ^ (idx.y * 0x9e3779b9u) ^ (asuint((float)(sampleIndex + 1)) * 0x85ebca6bu) : 0;
+
+    // Generate jittered UV coordinates for anti-aliasing, from the first two dimensions. At a lower resolution every
+    // pixel takes the frame's jitter instead, which the Upsample pass places the samples by
+    float2 jitter = float2(rnd(payload.rndState), rnd(payload.rndState));
+    if (useDynamicResolution == 1)
+    {
+        jitter = resolutionJitter;
+    }
+    float2 uv = (idx + jitter) / size;
+    if (useRadianceCache == 1 && rnd(payload.rndState) < HASH_GRID_UPDATE_FRACTION)
+    {
+        payload.flags = encodeIsCacheUpdate(payload.flags);
+    }
+    uv.y = 1.0 - uv.y;
+    uv = (uv * 2.0) - 1.0;
+
+    // Compute the camera position and the ray direction using inverse matrices
+    float3 cameraPosition = mul(inverseView, float4(0, 0, 0, 1)).xyz;
+    float4 p = mul(inverseProjection, float4(uv, 0.0, 1.0));
+    p.xyz = normalize(p.xyz / p.w);
+    float3 rayDirection = mul(inverseView, float4(p.xyz, 0)).xyz;
+
+    // Set up the ray description
+    ray.Origin = cameraPosition;
+    ray.Direction = rayDirection;
+    ray.TMin = 0.001;
+    ray.TMax = 1000;
+    return payload;
+}
+
+// Ray generation shader that computes primary rays, traces them, and accumulates results
+[shader("raygeneration")]
+void RayGeneration()
+{
+    // Get the pixel, which the adaptive dispatch looks up in its work list, and the dimensions of the image. The tiles
+    // of the tiled dispatch along the right and bottom edges reach past it
+    uint2 idx = dispatchPixel();
+    uint width;
+    uint height;
+    uav.GetDimensions(width, height);
+    if (idx.x >= width || idx.y >= height)
+    {
+        return;
+    }
+    uint sampleIndex = dispatchSampleIndex(idx);
+
+    // At a lower resolution the camera rays span the screen from the pixels of its top left corner
+    float2 size = useDynamicResolution == 1 ? (float2)renderSize : float2(width, height);
+    RayDesc ray;
+    Payload payload = cameraPath(idx, sampleIndex, size, ray);
+
+    // With ReSTIR the pixel's surface record starts out invalid, and tracePath fills it in if lighting is resampled
+    uint pixel = (idx.y * width) + idx.x;
+    uint surfaceIndex = ((frameIndex & 1) * width * height) + pixel;
+    if (useReSTIR == 1 || useReSTIRGI == 1)
+    {
+        restirSurfaces[surfaceIndex] = (ReSTIRSurface)0;
+    }
+
+    // Trace the camera path
+    tracePath(ray, payload);
+
+    // The spatial pass adds the resampled lighting and accumulates the pixel
+    if (useReSTIR == 1 || useReSTIRGI == 1)
+    {
+        restirSurfaces[surfaceIndex].radiance = payload.colour;
+        return;
+    }
+    // Adaptive sampling counts the pixel's samples itself
+    uint n = useAdaptiveSampling == 1 ? adaptiveAccumulate(idx, width, payload.colour) : accumulationCount(pixel) + 1;
+    accumulate(idx, width, payload.colour, n);
+}
+
+// Wavefront path tracing traces every pixel's camera path a bounce at a time across separate passes, rather than each
+// path in one invocation. WavefrontGenerate writes the camera rays into an extension ray queue, WavefrontTrace traces
+// the queue into hit records and counts them into a bin per BSDF type and one for rays leaving the scene, WavefrontSort
+// scatters them into bin order from a prefix sum over the counts, and WavefrontShade shades them in that order with
+// shadeHit and shadeMiss, so that the invocations of a wave run the same branches of sampleBSDF and evaluateBSDF. It
+// appends the paths that go on to the other extension queue and their light samples to the shadow ray queue, which
+// WavefrontShadow traces before the next bounce, and WavefrontAccumulate adds the finished paths to the image. The
+// queue logic is mirrored by WavefrontQueues in Wavefront.h. Every pass runs over the screen, the longest any queue
+// can be, and invocations past the end of their queue return
+#define WAVEFRONT_BSDFS 8
+#define WAVEFRONT_MISS_BIN 8
+#define WAVEFRONT_BINS 9
+// Layout of wavefrontCounters: the extension queue being traced, the lengths of the two extension queues and of the
+// shadow ray queue, and each bin's count and cursor
+#define WAVEFRONT_COUNTER_QUEUE 0
+#define WAVEFRONT_COUNTER_RAYS 1
+#define WAVEFRONT_COUNTER_SHADOW_RAYS 3
+#define WAVEFRONT_COUNTER_BIN_COUNTS 4
+#define WAVEFRONT_COUNTER_BIN_CURSORS 13
+#define WAVEFRONT_COUNTERS 22
+
+// A ray of an extension queue and the path, which is its pixel's, it continues
+struct WavefrontRay
+{
+    float3 origin;
+    uint path;
+    float3 direction;
+    uint pad;
+};
+
+// A light sample of the shadow ray queue: the segment its shadow ray tests, the radiance it adds to the path if that is
+// unoccluded, times the path's throughput, and what the light cache learns from it at the shading point, as in
+// DirectSample
+struct WavefrontShadowRay
+{
+    float3 from;
+    uint path;
+    float3 to;
+    uint lightIndex;
+    float3 radiance;
+    float deposit;
+    float3 normal;
+    uint pad;
+};
+
+// The queues, behind a descriptor table of their own like the other feature buffers: the paths' payloads
+// by pixel, the two extension queues of a ray per pixel each, the hit records of the queue being traced, their order
+// by bin, the shadow ray queue and the counters
+RWStructuredBuffer<Payload> wavefrontPaths : register(u18);
+RWStructuredBuffer<WavefrontRay> wavefrontRays : register(u19);
+RWStructuredBuffer<PathHit> wavefrontHits : register(u20);
+RWStructuredBuffer<uint> wavefrontSorted : register(u21);
+RWStructuredBuffer<WavefrontShadowRay> wavefrontShadowRays : register(u22);
+RWStructuredBuffer<uint> wavefrontCounters : register(u23);
+
+// Index of the invocation among the entries of a wavefront pass's queue
+uint wavefrontIndex()
+{
+    return (DispatchRaysIndex().y * DispatchRaysDimensions().x) + DispatchRaysIndex().x;
+}
+
+// Bin of a hit record: the BSDF type of the instance hit, or WAVEFRONT_MISS_BIN for a ray leaving the scene
+uint wavefrontBin(PathHit hit)
+{
+    return hit.t < 0 ? WAVEFRONT_MISS_BIN : min(instanceData[hit.instance].bsdfAlbedoID >> 16, WAVEFRONT_BSDFS - 1);
+}
+
+// Starts every pixel's camera path, queueing its ray in the first extension queue. The other queues and the bins start
+// out empty
+[shader("raygeneration")]
+void WavefrontGenerate()
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint width;
+    uint height;
+    uav.GetDimensions(width, height);
+    uint pixel = (idx.y * width) + idx.x;
+    RayDesc ray;
+    wavefrontPaths[pixel] = cameraPath(idx, dispatchSampleIndex(idx), float2(width, height), ray);
+    WavefrontRay queued;
+    queued.origin = ray.Origin;
+    queued.path = pixel;
+    queued.direction = ray.Direction;
+    queued.pad = 0;
+    wavefrontRays[pixel] = queued;
+    if (pixel == 0)
+    {
+        for (uint i = 0; i < WAVEFRONT_COUNTERS; i++)
+        {
+            wavefrontCounters[i] = 0;
+        }
+        wavefrontCounters[WAVEFRONT_COUNTER_RAYS] = width * height;
+    }
+}
+
+// Traces the extension queue into hit records, counting each into its bin
+[shader("raygeneration")]
+void WavefrontTrace()
+{
+    uint i = wavefrontIndex();
+    uint width;
+    uint height;
+    uav.GetDimensions(width, height);
+    uint queue = wavefrontCounters[WAVEFRONT_COUNTER_QUEUE];
+    // The shade pass appends to the other extension queue and the shadow ray queue, which the last bounce emptied
+    if (i == 0)
+    {
+        wavefrontCounters[WAVEFRONT_COUNTER_RAYS + (queue ^ 1)] = 0;
+        wavefrontCounters[WAVEFRONT_COUNTER_SHADOW_RAYS] = 0;
+    }
+    if (i >= wavefrontCounters[WAVEFRONT_COUNTER_RAYS + queue])
+    {
+        return;
+    }
+    WavefrontRay queued = wavefrontRays[(queue * width * height) + i];
+    RayDesc ray;
+    ray.Origin = queued.origin;
+    ray.Direction = queued.direction;
+    ray.TMin = 0.001;
+    ray.TMax = 1000;
+    PathHit hit;
+    hit.instance = 0;
+    hit.primitive = 0;
+    hit.barycentrics = float2(0, 0);
+    hit.t = -1.0;
+    TraceRay(scene, RAY_FLAG_NONE, 0xFF, PATH_HIT_GROUP, 0, PATH_MISS_SHADER, ray, hit);
+    wavefrontHits[i] = hit;
+    uint slot;
+    InterlockedAdd(wavefrontCounters[WAVEFRONT_COUNTER_BIN_COUNTS + wavefrontBin(hit)], 1, slot);
+}
+
+// Scatters the hit records into bin order: each bin starts after the records of the bins before it, and each record
+// takes the next position in its bin. Mirrors WavefrontQueues::binAtomic
+[shader("raygeneration")]
+void WavefrontSort()
+{
+    uint i = wavefrontIndex();
+    uint queue = wavefrontCounters[WAVEFRONT_COUNTER_QUEUE];
+    if (i >= wavefrontCounters[WAVEFRONT_COUNTER_RAYS + queue])
+    {
+        return;
+    }
+    uint bin = wavefrontBin(wavefrontHits[i]);
+    uint start = 0;
+    for (uint b = 0; b < bin; b++)
+    {
+        start += wavefrontCounters[WAVEFRONT_COUNTER_BIN_COUNTS + b];
+    }
+    uint slot;
+    InterlockedAdd(wavefrontCounters[WAVEFRONT_COUNTER_BIN_CURSORS + bin], 1, slot);
+    wavefrontSorted[start + slot] = i;
+}
+
+// Shades the hit records in bin order, appending the paths that go on to the other extension queue and their light
+// samples to the shadow ray queue
+[shader("raygeneration")]
+void WavefrontShade()
+{
+    uint i = wavefrontIndex();
+    uint width;
+    uint height;
+    uav.GetDimensions(width, height);
+    uint pixels = width * height;
+    uint queue = wavefrontCounters[WAVEFRONT_COUNTER_QUEUE];
+    // The trace pass of the next bounce counts into empty bins
+    if (i == 0)
+    {
+        for (uint b = 0; b < WAVEFRONT_BINS; b++)
+        {
+            wavefrontCounters[WAVEFRONT_COUNTER_BIN_COUNTS + b] = 0;
+            wavefrontCounters[WAVEFRONT_COUNTER_BIN_CURSORS + b] = 0;
+        }
+    }
+    if (i >= wavefrontCounters[WAVEFRONT_COUNTER_RAYS + queue])
+    {
+        return;
+    }
+    uint entry = wavefrontSorted[i];
+    WavefrontRay queued = wavefrontRays[(queue * pixels) + entry];
+    PathHit hit = wavefrontHits[entry];
+    Payload payload = wavefrontPaths[queued.path];
+    wavefrontShading = true;
+    wavefrontPixel = uint2(queued.path % width, queued.path / width);
+    setActiveSampler(samplerType);
+    if (hit.t < 0)
+    {
+        shadeMiss(payload, queued.origin, queued.direction);
+    } else
+    {
+        HitData hitData = surfaceHitData(hit.instance, hit.primitive, hit.barycentrics, queued.origin, queued.direction, hit.t);
+        // calculateDirect leaves its light sample here, to be lit by the throughput the path reached the hit with
+        float3 throughput = payload.pathThroughput;
+        wavefrontDirect = (DirectSample)0;
+        wavefrontDirect.lightIndex = DIRECT_NO_LIGHT;
+        ReSTIRSurface surface = (ReSTIRSurface)0;
+        PathVertex vertex;
+        RayDesc ray;
+        uint slot;
+        if (shadeHit(hitData, payload, surface, vertex, ray))
+        {
+            WavefrontRay next;
+            next.origin = ray.Origin;
+            next.path = queued.path;
+            next.direction = ray.Direction;
+            next.pad = 0;
+            InterlockedAdd(wavefrontCounters[WAVEFRONT_COUNTER_RAYS + (queue ^ 1)], 1, slot);
+            wavefrontRays[((queue ^ 1) * pixels) + slot] = next;
+        }
+        if (wavefrontDirect.traced)
+        {
+            WavefrontShadowRay shadow;
+            shadow.from = wavefrontDirect.from;
+            shadow.path = queued.path;
+            shadow.to = wavefrontDirect.to;
+            shadow.lightIndex = wavefrontDirect.lightIndex;
+            shadow.radiance = throughput * wavefrontDirect.radiance;
+            shadow.deposit = wavefrontDirect.deposit;
+            shadow.normal = hitData.normal;
+            shadow.pad = 0;
+            InterlockedAdd(wavefrontCounters[WAVEFRONT_COUNTER_SHADOW_RAYS], 1, slot);
+            wavefrontShadowRays[slot] = shadow;
+        } else
+        {
+            // Samples without a shadow ray still teach the light cache that the light contributes nothing here
+            directDeposit(wavefrontDirect, hitData.normal, false);
+        }
+    }
+    wavefrontPaths[queued.path] = payload;
+}
+
+// Traces the shadow ray queue, adding the light samples that are unoccluded to their paths, and switches the next
+// bounce to the extension queue the shade pass appended to
+[shader("raygeneration")]
+void WavefrontShadow()
+{
+    uint i = wavefrontIndex();
+    if (i == 0)
+    {
+        wavefrontCounters[WAVEFRONT_COUNTER_QUEUE] = wavefrontCounters[WAVEFRONT_COUNTER_QUEUE] ^ 1;
+    }
+    if (i >= wavefrontCounters[WAVEFRONT_COUNTER_SHADOW_RAYS])
+    {
+        return;
+    }
+    WavefrontShadowRay shadow = wavefrontShadowRays[i];
+    bool lit = visible(shadow.from, shadow.to);
+    if (useLightCache == 1 && shadow.lightIndex != DIRECT_NO_LIGHT)
+    {
+        lightCacheDeposit(shadow.to, shadow.normal, shadow.lightIndex, lit ? shadow.deposit : 0.0);
+    }
+    if (lit)
+    {
+        wavefrontPaths[shadow.path].colour += shadow.radiance;
+    }
+}
+
+// Adds every pixel's finished path to its running mean
+[shader("raygeneration")]
+void WavefrontAccumulate()
+{
+    uint2 idx = DispatchRaysIndex().xy;
+    uint width;
+    uint height;
+    uav.GetDimensions(width, height);
+    uint pixel = (idx.y * width) + idx.x;
+    accumulate(idx, width, wavefrontPaths[pixel].colour, accumulationCount(pixel) + 1);
 }